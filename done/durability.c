@@ -0,0 +1,303 @@
+/* ** NOTE: undocumented in Doxygen
+ * @file durability.c
+ * @brief When the imgFS server makes updates durable
+ */
+
+#include "durability.h"
+#include "journal.h"
+
+#include <inttypes.h> // for PRIu64
+#include <string.h>
+#include <time.h>
+
+static const char* const durability_names[NB_DURABILITY_MODES] = {
+    "none", "periodic", "request"
+};
+
+/*******************************************************************
+ * Monotonic time, in microseconds
+ */
+static uint64_t now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000u + (uint64_t) now.tv_nsec / 1000u;
+}
+
+/*******************************************************************
+ * Histograms
+ */
+void histogram_add(struct histogram* histogram, uint64_t value)
+{
+    size_t bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && value >> bucket != 0) ++bucket;
+
+    ++histogram->buckets[bucket];
+    ++histogram->count;
+    histogram->sum += value;
+    if (value > histogram->max) histogram->max = value;
+}
+
+void histogram_print(FILE* out, const char* name, const struct histogram* histogram)
+{
+    fprintf(out, "%s: count %" PRIu64 ", mean %" PRIu64 ", max %" PRIu64 "\n", name,
+            histogram->count, histogram->count == 0 ? 0 : histogram->sum / histogram->count,
+            histogram->max);
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        if (histogram->buckets[i] == 0) continue;
+        const uint64_t low = i == 0 ? 0 : (uint64_t) 1 << (i - 1);
+        fprintf(out, "  [%" PRIu64 ", %" PRIu64 "): %" PRIu64 "\n",
+                low, (uint64_t) 1 << i, histogram->buckets[i]);
+    }
+}
+
+/*******************************************************************
+ * Modes
+ */
+const char* durability_name(enum durability_mode mode)
+{
+    return mode < NB_DURABILITY_MODES ? durability_names[mode] : "unknown";
+}
+
+int durability_parse(const char* name)
+{
+    if (name == NULL) return -1;
+
+    for (int mode = 0; mode < NB_DURABILITY_MODES; ++mode) {
+        if (strcmp(name, durability_names[mode]) == 0) return mode;
+    }
+    return -1;
+}
+
+/*******************************************************************
+ * Commits whatever is pending, with mutex held and committing set (so
+ * by one thread at a time). The mutex is released while syncing: the
+ * updates go on meanwhile, for the next commit
+ */
+static int commit(struct durability* durability)
+{
+    struct imgfs_journal* journal = durability->imgfs_file->journal;
+    const uint64_t target = durability->logged;
+    if (durability->failed != ERR_NONE) return durability->failed;
+
+    // (lazy resizes are logged too, without counting as updates)
+    if (journal == NULL || journal->pending_count == 0) {
+        durability->durable = target;
+        return ERR_NONE;
+    }
+
+    const uint64_t start = now_us();
+    struct journal_group group;
+    journal_group_begin(journal, &group);
+
+    // 1. the content the updates refer to
+    int fds[IMGFS_MAX_SYNC_FDS];
+    size_t nb_fds = 0;
+    int err = imgfs_dup_sync_fds(durability->imgfs_file, fds, &nb_fds);
+    if (err == ERR_NONE) {
+        pthread_mutex_unlock(durability->mutex);
+        err = imgfs_sync_fds(fds, nb_fds);
+        pthread_mutex_lock(durability->mutex);
+    }
+
+    // 2. the updates, as one batch
+    if (err == ERR_NONE) err = journal_group_write(journal, &group);
+    if (err == ERR_NONE) {
+        pthread_mutex_unlock(durability->mutex);
+        err = journal_group_sync(journal);
+        pthread_mutex_lock(durability->mutex);
+    }
+
+    // 3. in place
+    err = journal_group_end(durability->imgfs_file, &group, err);
+    histogram_add(&durability->commit_us, now_us() - start);
+    histogram_add(&durability->batch, target - durability->durable);
+
+    if (err != ERR_NONE) {
+        // neither these updates nor any later one are durable
+        fprintf(stderr, "commit failed: %s\n", ERR_MSG(err));
+        durability->failed = err;
+    } else {
+        durability->durable = target;
+    }
+    pthread_cond_broadcast(&durability->committed);
+    return err;
+}
+
+/*******************************************************************
+ * Commits once no other thread is committing, with mutex held
+ */
+static int commit_alone(struct durability* durability)
+{
+    while (durability->committing) {
+        pthread_cond_wait(&durability->committed, durability->mutex);
+    }
+
+    durability->committing = 1;
+    const int err = commit(durability);
+    durability->committing = 0;
+    pthread_cond_broadcast(&durability->committed);
+    return err;
+}
+
+/*******************************************************************
+ * DURABILITY_PERIODIC: commits every interval until stopped
+ */
+static void* periodic_committer(void* arg)
+{
+    struct durability* durability = arg;
+
+    pthread_mutex_lock(durability->mutex);
+    while (durability->running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) durability->interval_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        pthread_cond_timedwait(&durability->stop, durability->mutex, &deadline);
+        commit_alone(durability);
+    }
+    pthread_mutex_unlock(durability->mutex);
+    return NULL;
+}
+
+/*******************************************************************
+ * Startup
+ */
+int durability_start(struct durability* durability, enum durability_mode mode,
+                     unsigned interval_ms, struct imgfs_file* imgfs_file,
+                     pthread_mutex_t* mutex)
+{
+    M_REQUIRE_NON_NULL(durability);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(mutex);
+    if (mode >= NB_DURABILITY_MODES) return ERR_INVALID_ARGUMENT;
+
+    memset(durability, 0, sizeof(*durability));
+    durability->mode = mode;
+    durability->interval_ms = interval_ms;
+    durability->imgfs_file = imgfs_file;
+    durability->mutex = mutex;
+
+    if (mode == DURABILITY_NONE) {
+        // updates then go in place, flushed but not synced
+        journal_close(imgfs_file);
+    } else if (imgfs_file->journal == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    } else {
+        imgfs_file->journal->autocommit = 0;
+    }
+
+    if (pthread_cond_init(&durability->committed, NULL) != 0) return ERR_RUNTIME;
+    if (pthread_cond_init(&durability->stop, NULL) != 0) {
+        pthread_cond_destroy(&durability->committed);
+        return ERR_RUNTIME;
+    }
+
+    if (mode == DURABILITY_PERIODIC) {
+        durability->running = 1;
+        if (pthread_create(&durability->committer, NULL, periodic_committer, durability) != 0) {
+            durability->running = 0;
+            pthread_cond_destroy(&durability->stop);
+            pthread_cond_destroy(&durability->committed);
+            return ERR_RUNTIME;
+        }
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Group commit
+ */
+void durability_update_begin(struct durability* durability)
+{
+    if (durability != NULL) __atomic_add_fetch(&durability->arriving, 1, __ATOMIC_RELAXED);
+}
+
+void durability_update_cancel(struct durability* durability)
+{
+    if (durability != NULL) __atomic_sub_fetch(&durability->arriving, 1, __ATOMIC_RELAXED);
+}
+
+int durability_update_done(struct durability* durability)
+{
+    M_REQUIRE_NON_NULL(durability);
+
+    __atomic_sub_fetch(&durability->arriving, 1, __ATOMIC_RELAXED);
+    if (durability->failed != ERR_NONE) return durability->failed;
+
+    const uint64_t mine = ++durability->logged;
+    if (durability->mode != DURABILITY_REQUEST) return ERR_NONE;
+
+    const uint64_t start = now_us();
+    while (durability->durable < mine && durability->failed == ERR_NONE) {
+        if (durability->committing) {
+            // a leader is on it
+            pthread_cond_wait(&durability->committed, durability->mutex);
+            continue;
+        }
+
+        durability->committing = 1;
+        if (durability->interval_ms > 0
+            && __atomic_load_n(&durability->arriving, __ATOMIC_RELAXED) > 0) {
+            // let the concurrent updates join the group
+            const struct timespec window = {
+                (time_t) (durability->interval_ms / 1000),
+                (long) (durability->interval_ms % 1000) * 1000000L
+            };
+            pthread_mutex_unlock(durability->mutex);
+            nanosleep(&window, NULL);
+            pthread_mutex_lock(durability->mutex);
+        }
+        commit(durability);
+        durability->committing = 0;
+        pthread_cond_broadcast(&durability->committed);
+    }
+    histogram_add(&durability->wait_us, now_us() - start);
+
+    return durability->failed;
+}
+
+/*******************************************************************
+ * Shutdown
+ */
+void durability_stop(struct durability* durability)
+{
+    if (durability == NULL || durability->imgfs_file == NULL) return;
+
+    pthread_mutex_lock(durability->mutex);
+    const int running = durability->running;
+    durability->running = 0;
+    pthread_cond_signal(&durability->stop);
+    pthread_mutex_unlock(durability->mutex);
+
+    if (running) pthread_join(durability->committer, NULL);
+
+    pthread_mutex_lock(durability->mutex);
+    commit_alone(durability);
+    pthread_mutex_unlock(durability->mutex);
+
+    pthread_cond_destroy(&durability->stop);
+    pthread_cond_destroy(&durability->committed);
+    durability->imgfs_file = NULL;
+}
+
+/*******************************************************************
+ * Statistics
+ */
+void durability_print_stats(FILE* out, const struct durability* durability)
+{
+    if (out == NULL || durability == NULL) return;
+
+    fprintf(out, "durability: %s, interval %u ms, %" PRIu64 " updates\n",
+            durability_name(durability->mode), durability->interval_ms, durability->logged);
+    if (durability->mode == DURABILITY_NONE) return;
+
+    histogram_print(out, "commit batch size (updates)", &durability->batch);
+    histogram_print(out, "commit duration (us)", &durability->commit_us);
+    if (durability->mode == DURABILITY_REQUEST) {
+        histogram_print(out, "update wait (us)", &durability->wait_us);
+    }
+}
@@ -0,0 +1,134 @@
+/**
+ * @file durability.h
+ * @brief When the imgFS server makes updates durable.
+ *
+ * DURABILITY_NONE leaves it to the operating system: updates are written
+ * in place without journal and without fdatasync(). DURABILITY_PERIODIC
+ * replies right away and commits the journal every interval.
+ * DURABILITY_REQUEST replies only once the update is durable: concurrent
+ * updates wait for the same group commit, which its first waiter (the
+ * leader) starts after letting the others join for one interval; a lone
+ * update, with no other one under way, does not wait that interval.
+ *
+ * Once a commit fails, the updates it held are not durable and later
+ * ones cannot be either: every update then fails with its error.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <pthread.h>
+#include <stdint.h> // for uint64_t
+#include <stdio.h>  // for FILE
+
+#define DEFAULT_DURABILITY_INTERVAL_MS 2
+#define HISTOGRAM_BUCKETS 32 // bucket i counts values in [2^(i-1), 2^i)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum durability_mode {
+    DURABILITY_NONE,
+    DURABILITY_PERIODIC,
+    DURABILITY_REQUEST,
+    NB_DURABILITY_MODES
+};
+
+struct histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+struct durability {
+    enum durability_mode mode;
+    unsigned interval_ms;
+    struct imgfs_file* imgfs_file;
+    pthread_mutex_t* mutex;      // the one protecting imgfs_file
+
+    pthread_cond_t committed;    // signaled at the end of each commit
+    pthread_cond_t stop;         // wakes the periodic committer up
+    pthread_t committer;         // DURABILITY_PERIODIC only
+    int running;
+
+    int arriving;                // updates begun, not logged yet (atomic)
+    uint64_t logged;             // number of updates so far
+    uint64_t durable;            // number of them known to be durable
+    int committing;              // a leader is gathering a group
+    int failed;                  // error of the commit that failed, if any
+
+    struct histogram wait_us;    // DURABILITY_REQUEST: update to reply
+    struct histogram commit_us;  // duration of each commit
+    struct histogram batch;      // updates per commit
+};
+
+/**
+ * @brief Adds a value to a histogram.
+ */
+void histogram_add(struct histogram* histogram, uint64_t value);
+
+/**
+ * @brief Prints the non-empty buckets of a histogram.
+ */
+void histogram_print(FILE* out, const char* name, const struct histogram* histogram);
+
+/**
+ * @brief Name of a durability mode ("none", "periodic", "request").
+ */
+const char* durability_name(enum durability_mode mode);
+
+/**
+ * @brief Reads a durability mode from its name.
+ *
+ * @return the mode, -1 if unknown.
+ */
+int durability_parse(const char* name);
+
+/**
+ * @brief Sets the durability of an imgFS opened for writing, with mutex
+ *        not held. Starts the periodic committer if needed.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int durability_start(struct durability* durability, enum durability_mode mode,
+                     unsigned interval_ms, struct imgfs_file* imgfs_file,
+                     pthread_mutex_t* mutex);
+
+/**
+ * @brief To be called before each update, with mutex not held (before
+ *        taking it): a leader gathers a group only while updates are
+ *        under way.
+ */
+void durability_update_begin(struct durability* durability);
+
+/**
+ * @brief To be called after each successful update, with mutex held: in
+ *        DURABILITY_REQUEST, returns once the update is durable.
+ *
+ * @return Some error code (of the commit). 0 if no error.
+ */
+int durability_update_done(struct durability* durability);
+
+/**
+ * @brief To be called instead of durability_update_done() after an update
+ *        that failed (or was not made), with or without mutex held.
+ */
+void durability_update_cancel(struct durability* durability);
+
+/**
+ * @brief Commits what is pending and stops the periodic committer,
+ *        with mutex not held.
+ */
+void durability_stop(struct durability* durability);
+
+/**
+ * @brief Prints the histograms.
+ */
+void durability_print_stats(FILE* out, const struct durability* durability);
+
+#ifdef __cplusplus
+}
+#endif
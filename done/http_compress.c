@@ -0,0 +1,174 @@
+/*
+ * @file http_compress.c
+ * @brief HTTP content codings (gzip, deflate) on top of zlib.
+ */
+
+#include <stdint.h> // UINT32_MAX
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "http_compress.h"
+
+#define GZIP_WINDOW_BITS (MAX_WBITS + 16) // asks zlib for a gzip wrapper
+
+/*******************************************************************
+ * Coding names
+ */
+const char* http_encoding_name(enum http_encoding encoding)
+{
+    switch (encoding) {
+    case HTTP_ENCODING_GZIP:
+        return "gzip";
+    case HTTP_ENCODING_DEFLATE:
+        return "deflate";
+    default:
+        return NULL;
+    }
+}
+
+/*******************************************************************
+ * Streaming compression
+ */
+int http_compressor_init(struct http_compressor* compressor, enum http_encoding encoding,
+                         http_compress_sink sink, void* sink_arg)
+{
+    M_REQUIRE_NON_NULL(compressor);
+    M_REQUIRE_NON_NULL(sink);
+
+    if (encoding != HTTP_ENCODING_GZIP && encoding != HTTP_ENCODING_DEFLATE) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    memset(&compressor->stream, 0, sizeof(compressor->stream));
+    compressor->sink = sink;
+    compressor->sink_arg = sink_arg;
+    if (deflateInit2(&compressor->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     encoding == HTTP_ENCODING_GZIP ? GZIP_WINDOW_BITS : MAX_WBITS,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return ERR_RUNTIME;
+    }
+    compressor->stream.next_out = (Bytef*) compressor->out;
+    compressor->stream.avail_out = COMPRESS_CHUNK;
+    return ERR_NONE;
+}
+
+// hands the full output buffer (or what is in it) to the sink
+static int drain(struct http_compressor* compressor)
+{
+    const size_t len = COMPRESS_CHUNK - compressor->stream.avail_out;
+    compressor->stream.next_out = (Bytef*) compressor->out;
+    compressor->stream.avail_out = COMPRESS_CHUNK;
+    return len > 0 ? compressor->sink(compressor->sink_arg, compressor->out, len) : ERR_NONE;
+}
+
+/*
+ * Deflates the pending input with the given flush mode, until zlib
+ * needs more input (or, with Z_FINISH, until the end of the stream).
+ */
+static int run(struct http_compressor* compressor, int flush)
+{
+    for (;;) {
+        const int ret = deflate(&compressor->stream, flush);
+        if (ret == Z_STREAM_ERROR) return ERR_RUNTIME;
+
+        const int full = compressor->stream.avail_out == 0;
+        if (full || ret == Z_STREAM_END) {
+            const int err = drain(compressor);
+            if (err != ERR_NONE) return err;
+        }
+        if (ret == Z_STREAM_END) return ERR_NONE;
+        // all the input is taken and nothing more is coming out
+        if (flush != Z_FINISH && !full && compressor->stream.avail_in == 0) return ERR_NONE;
+    }
+}
+
+int http_compressor_write(struct http_compressor* compressor, const char* data, size_t len)
+{
+    M_REQUIRE_NON_NULL(compressor);
+    M_REQUIRE_NON_NULL(data);
+
+    while (len > 0) {
+        // avail_in is 32 bits wide
+        const uInt piece = len > UINT32_MAX ? UINT32_MAX : (uInt) len;
+        compressor->stream.next_in = (const Bytef*) data;
+        compressor->stream.avail_in = piece;
+        const int err = run(compressor, Z_NO_FLUSH);
+        if (err != ERR_NONE) return err;
+        data += piece;
+        len -= piece;
+    }
+    return ERR_NONE;
+}
+
+int http_compressor_finish(struct http_compressor* compressor)
+{
+    M_REQUIRE_NON_NULL(compressor);
+
+    compressor->stream.next_in = NULL;
+    compressor->stream.avail_in = 0;
+    const int err = run(compressor, Z_FINISH);
+    deflateEnd(&compressor->stream);
+    return err;
+}
+
+void http_compressor_end(struct http_compressor* compressor)
+{
+    if (compressor != NULL) deflateEnd(&compressor->stream);
+}
+
+/*******************************************************************
+ * Compression into memory
+ */
+struct buffer {
+    char* data;
+    size_t len;
+    size_t capacity;
+};
+
+static int append(void* arg, const char* data, size_t len)
+{
+    struct buffer* buffer = arg;
+    if (buffer->len + len > buffer->capacity) {
+        size_t capacity = buffer->capacity == 0 ? COMPRESS_CHUNK : buffer->capacity;
+        while (capacity < buffer->len + len) capacity *= 2;
+        char* const grown = realloc(buffer->data, capacity);
+        if (grown == NULL) return ERR_OUT_OF_MEMORY;
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return ERR_NONE;
+}
+
+int http_compress(enum http_encoding encoding, const char* in, size_t in_len,
+                  char** out, size_t* out_len)
+{
+    M_REQUIRE_NON_NULL(in);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(out_len);
+
+    struct buffer buffer = { NULL, 0, 0 };
+    struct http_compressor* compressor = malloc(sizeof(struct http_compressor));
+    if (compressor == NULL) return ERR_OUT_OF_MEMORY;
+
+    int err = http_compressor_init(compressor, encoding, append, &buffer);
+    if (err == ERR_NONE) {
+        err = http_compressor_write(compressor, in, in_len);
+        if (err == ERR_NONE) {
+            err = http_compressor_finish(compressor);
+        } else {
+            http_compressor_end(compressor);
+        }
+    }
+    free(compressor);
+
+    if (err != ERR_NONE) {
+        free(buffer.data);
+        return err;
+    }
+    *out = buffer.data;
+    *out_len = buffer.len;
+    return ERR_NONE;
+}
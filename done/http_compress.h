@@ -0,0 +1,89 @@
+/**
+ * @file http_compress.h
+ * @brief HTTP content codings (gzip, deflate) on top of zlib.
+ *
+ * A compressor takes the data piece by piece and hands the compressed
+ * bytes to a sink as they come out, COMPRESS_CHUNK at a time, so that
+ * neither the data nor its compressed form needs to be held in memory.
+ */
+
+#pragma once
+
+#include <stddef.h>     // size_t
+#ifndef ZLIB_CONST
+#define ZLIB_CONST      // zlib does not modify its input: next_in is const
+#endif
+#include <zlib.h>       // z_stream
+#include "http_prot.h"  // enum http_encoding
+
+#define COMPRESS_CHUNK 16384 // compressed bytes handed to the sink at a time
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Consumer of the compressed data, e.g. a socket.
+ *        Returns some error code, 0 if no error.
+ */
+typedef int (*http_compress_sink)(void* arg, const char* data, size_t len);
+
+struct http_compressor {
+    z_stream stream;
+    http_compress_sink sink;
+    void* sink_arg;
+    char out[COMPRESS_CHUNK];
+};
+
+/**
+ * @brief Name of the coding, as used in the Content-Encoding header
+ *        (NULL for HTTP_ENCODING_IDENTITY).
+ */
+const char* http_encoding_name(enum http_encoding encoding);
+
+/**
+ * @brief Starts a compressor for the given content coding
+ *        (HTTP_ENCODING_GZIP or HTTP_ENCODING_DEFLATE).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int http_compressor_init(struct http_compressor* compressor, enum http_encoding encoding,
+                         http_compress_sink sink, void* sink_arg);
+
+/**
+ * @brief Compresses the next len bytes of the data.
+ *
+ * @return Some error code, of zlib or of the sink. 0 if no error.
+ */
+int http_compressor_write(struct http_compressor* compressor, const char* data, size_t len);
+
+/**
+ * @brief Completes the compressed data, hands the rest of it to the sink
+ *        and releases the compressor.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int http_compressor_finish(struct http_compressor* compressor);
+
+/**
+ * @brief Releases a compressor without completing its data (e.g. after
+ *        an error).
+ */
+void http_compressor_end(struct http_compressor* compressor);
+
+/**
+ * @brief Compresses `in` with the given content coding, into memory.
+ *
+ * @param encoding HTTP_ENCODING_GZIP or HTTP_ENCODING_DEFLATE
+ * @param in The data to compress
+ * @param in_len Its length
+ * @param out Where to store the (dynamically allocated) compressed data
+ * @param out_len Where to store the length of the compressed data
+ * @return Some error code. 0 if no error.
+ */
+int http_compress(enum http_encoding encoding, const char* in, size_t in_len,
+                  char** out, size_t* out_len);
+
+#ifdef __cplusplus
+}
+#endif
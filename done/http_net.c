@@ -9,17 +9,26 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <string.h>
+#include <strings.h> // for strncasecmp
 #include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <limits.h> // IOV_MAX
+#include <sys/uio.h> // struct iovec
 
 #include "http_prot.h"
 #include "http_net.h"
 #include "socket_layer.h"
 #include "error.h"
 #include "http_prot.h"
+#include "metrics.h"
+#include "trace.h"
 #include <pthread.h>
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // buffers per gather write (Linux)
+#endif
+
 static int passive_socket = -1;
 static EventCallback cb;
 
@@ -43,12 +52,28 @@ MK_OUR_ERR(ERR_IO);
 /*******************************************************************
  * Handle connection
  */
-static void *handle_connection(void *arg)
+/*
+ * Messages are served one after the other on a connection (keep-alive),
+ * until the client closes it, asks to ("Connection: close") or an error
+ * occurs. buf holds len bytes received, followed by a '\0': the current
+ * message, possibly the start of the next ones.
+ */
+static int connection_close_requested(const struct http_message* msg)
+{
+    for (size_t i = 0; i < msg->num_headers; ++i) {
+        const struct http_string* key = &msg->headers[i].key;
+        const struct http_string* value = &msg->headers[i].value;
+        if (key->len == strlen("Connection") && strncasecmp(key->val, "Connection", key->len) == 0) {
+            return value->len == strlen("close") && strncasecmp(value->val, "close", value->len) == 0;
+        }
+    }
+    return 0;
+}
+
+static void *serve_connection(void *arg)
 {
     M_REQUIRE_NON_NULL(arg);
     sigset_t mask;
-    size_t total_read = 0;
-    ssize_t read = 0;
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
     sigaddset(&mask, SIGTERM);
@@ -61,7 +86,9 @@ static void *handle_connection(void *arg)
         return &our_ERR_INVALID_ARGUMENT;
     }
 
-    char *buf = calloc(MAX_HEADER_SIZE, sizeof(char));
+    size_t capacity = MAX_HEADER_SIZE;
+    size_t len = 0;
+    char *buf = calloc(capacity + 1, sizeof(char));
 
     if (buf == NULL) {
         perror("calloc() in handle_connection()");
@@ -70,108 +97,88 @@ static void *handle_connection(void *arg)
         return &our_ERR_OUT_OF_MEMORY;
     }
 
-    while(total_read < MAX_HEADER_SIZE && strstr(buf, HTTP_HDR_END_DELIM) == NULL) {
-        read = tcp_read(*active_socket, buf + total_read, MAX_HEADER_SIZE - total_read);
-        if (read < 0) {
-            perror("tcp_read() in handle_connection()");
-            close(*active_socket);
-            free(active_socket);
-            free(buf);
-            return &our_ERR_IO;
-        }
-
-        total_read += read;
-    }
-
-    if (read <= 0) {
-        perror("tcp_read1() in handle_connection()");
-        close(*active_socket);
-        free(active_socket);
-        free(buf);
-        return &our_ERR_IO;
-    }
-
-
-    while (strstr(buf, HTTP_HDR_END_DELIM) == NULL && read > 0) {
-
-        read = tcp_read(*active_socket, buf, MAX_HEADER_SIZE);
-
-        if (read <= 0) {
-            perror("tcp_read2() in handle_connection()");
-            close(*active_socket);
-            free(active_socket);
-            free(buf);
-            return &our_ERR_IO;
-        }
-
-        int err = ERR_NONE;
-
+    int* ret = &our_ERR_NONE;
+    int keep_alive = 1;
+    while (keep_alive) {
         struct http_message msg;
         int content_len = 0;
-
-        err = http_parse_message(buf, read, &msg, &content_len);
-
-        if (err < 0) {
-            free(buf);
-            close(*active_socket);
-            free(active_socket);
-            return &err;
-        }
-
-        if (read == 0 && content_len > 0 && msg.body.len < content_len) {
-            char* extended_buf = realloc(buf, MAX_HEADER_SIZE + content_len);
-            if (extended_buf == NULL) {
-                perror("realloc() in handle_connection()");
-                free(buf);
-                close(*active_socket);
-                free(active_socket);
-                return &our_ERR_OUT_OF_MEMORY;
+        int parsed = 0;
+
+        // receives a whole message
+        while ((parsed = http_parse_message(buf, len, &msg, &content_len)) == 0) {
+            const char* header_end = strstr(buf, HTTP_HDR_END_DELIM);
+            if (header_end != NULL && content_len > 0) {
+                const size_t needed = (size_t) (header_end - buf) + strlen(HTTP_HDR_END_DELIM)
+                                      + (size_t) content_len;
+                if (needed > MAX_REQUEST_SIZE) {
+                    parsed = ERR_INVALID_ARGUMENT;
+                    break;
+                }
+                if (needed > capacity) {
+                    char* extended_buf = realloc(buf, needed + 1);
+                    if (extended_buf == NULL) {
+                        perror("realloc() in handle_connection()");
+                        parsed = ERR_OUT_OF_MEMORY;
+                        break;
+                    }
+                    buf = extended_buf;
+                    capacity = needed;
+                }
             }
-
-            buf = extended_buf;
-            ssize_t extended_read = tcp_read(*active_socket, buf + read,
-                                             MAX_HEADER_SIZE + content_len - read);
-            if (extended_read == -1) {
-                perror("tcp_read3() in handle_connection()");
-                free(buf);
-                close(*active_socket);
-                free(active_socket);
-                return &our_ERR_IO;
+            if (len == capacity) {
+                // headers too long
+                parsed = ERR_INVALID_ARGUMENT;
+                break;
             }
 
-            read += extended_read;
-        }
-
-        if (read > 0) {
-            ssize_t remaining_read = tcp_read(*active_socket, buf + read,
-                                              MAX_HEADER_SIZE + content_len - read);
-            if (remaining_read > 0) {
-                read += remaining_read;
-                err = cb(&msg, *active_socket);
-                content_len = 0;
+            const ssize_t read = tcp_read(*active_socket, buf + len, capacity - len);
+            if (read <= 0) {
+                // closed between two messages: the normal end
+                if (read < 0 || len > 0) perror("tcp_read() in handle_connection()");
+                parsed = read < 0 || len > 0 ? ERR_IO : ERR_NONE;
+                break;
             }
+            len += (size_t) read;
+            buf[len] = '\0';
         }
 
-        if (err != ERR_NONE) {
-            free(buf);
-            close(*active_socket);
-            free(active_socket);
-            return &err;
+        if (parsed <= 0) {
+            if (parsed == ERR_INVALID_ARGUMENT) ret = &our_ERR_INVALID_ARGUMENT;
+            else if (parsed == ERR_OUT_OF_MEMORY) ret = &our_ERR_OUT_OF_MEMORY;
+            else if (parsed != ERR_NONE) ret = &our_ERR_IO;
+            break;
         }
 
-        if (read == 0) {
-            free(buf);
-            close(*active_socket);
-            free(active_socket);
-            return &our_ERR_NONE;
+        keep_alive = !connection_close_requested(&msg);
+
+        const uint64_t traced = trace_request_begin();
+        const int err = cb(&msg, *active_socket);
+        trace_request_end(traced);
+        if (err != ERR_NONE) {
+            ret = &our_ERR_IO;
+            break;
         }
 
+        // keeps what was received of the next messages
+        const size_t consumed = (size_t) (strstr(buf, HTTP_HDR_END_DELIM) - buf)
+                                + strlen(HTTP_HDR_END_DELIM) + (size_t) content_len;
+        memmove(buf, buf + consumed, len - consumed);
+        len -= consumed;
+        buf[len] = '\0';
     }
 
     close(*active_socket);
     free(active_socket);
     free(buf);
-    return &our_ERR_NONE;
+    return ret;
+}
+
+static void *handle_connection(void *arg)
+{
+    metrics_connection_begin();
+    void* const ret = serve_connection(arg);
+    metrics_connection_end();
+    return ret;
 }
 
 
@@ -290,6 +297,27 @@ int http_serve_file(int connection, const char* filename)
     return ret;
 }
 
+/*******************************************************************
+ * Send a whole buffer, looping over partial writes
+ */
+static int send_all(int connection, const char* buf, size_t len)
+{
+    const uint64_t span = trace_begin();
+    size_t sent = 0;
+    int err = ERR_NONE;
+    while (sent < len && err == ERR_NONE) {
+        const ssize_t ret = tcp_send(connection, buf + sent, len - sent);
+        if (ret <= 0) {
+            err = ERR_IO;
+        } else {
+            sent += (size_t) ret;
+            metrics_bytes_sent((size_t) ret);
+        }
+    }
+    trace_end("send", span);
+    return err;
+}
+
 /*******************************************************************
  * Create and send HTTP reply
  */
@@ -298,27 +326,149 @@ int http_reply(int connection, const char* status, const char* headers,
 {
     M_REQUIRE_NON_NULL(status);
     M_REQUIRE_NON_NULL(headers);
+    if (body_len > 0) M_REQUIRE_NON_NULL(body);
 
     size_t header_length = strlen(HTTP_PROTOCOL_ID) + strlen(status)
                            + strlen(HTTP_LINE_DELIM) + strlen(headers) + strlen("Content-Length: ")
-                           + snprintf(NULL, 0, "%zu", body_len) + strlen(HTTP_HDR_END_DELIM) + 1;
+                           + (size_t) snprintf(NULL, 0, "%zu", body_len) + strlen(HTTP_HDR_END_DELIM) + 1;
 
-    char* buf = calloc(header_length, sizeof(char));
+    // the body may be binary (e.g. images): copy it after the header, do not strcat() it
+    char* buf = calloc(header_length + body_len, sizeof(char));
 
     if (buf == NULL) return ERR_OUT_OF_MEMORY;
 
-    sprintf(buf, "%s%s%s%s%s%zu%s",
-            HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, "Content-Length: ",
-            body_len, HTTP_HDR_END_DELIM);
+    const int written = sprintf(buf, "%s%s%s%s%s%zu%s",
+                                HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, "Content-Length: ",
+                                body_len, HTTP_HDR_END_DELIM);
+    if (written < 0) {
+        free(buf);
+        return ERR_IO;
+    }
+
+    if (body_len > 0) memcpy(buf + written, body, body_len);
 
-    if (body_len > 0) {
-        M_REQUIRE_NON_NULL(body);
-        buf = realloc(buf, header_length + body_len);
-        if (buf == NULL) return ERR_OUT_OF_MEMORY;
-        strcat(buf, body);
+    const int err = send_all(connection, buf, (size_t) written + body_len);
+    free(buf);
+    return err;
+}
+
+/*******************************************************************
+ * Send whole buffers, looping over partial writes
+ */
+static int send_all_iov(int connection, struct iovec* iov, size_t count)
+{
+    size_t sent = 0; // of the first buffer
+    for (;;) {
+        // skip what was sent (and empty buffers)
+        while (count > 0 && sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count == 0) return ERR_NONE;
+        iov->iov_base = (char*) iov->iov_base + sent;
+        iov->iov_len -= sent;
+
+        const ssize_t ret = tcp_sendv(connection, iov, count > IOV_MAX ? IOV_MAX : count);
+        if (ret <= 0) return ERR_IO;
+        sent = (size_t) ret;
+        metrics_bytes_sent(sent);
     }
+}
 
-    if (tcp_send(connection, buf, strlen(buf)) == -1) return ERR_IO;
+/*******************************************************************
+ * Create and send HTTP reply, the body being made of several buffers
+ */
+int http_reply_iov(int connection, const char* status, const char* headers,
+                   const struct iovec* body, size_t count)
+{
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(headers);
+    if (count > 0) M_REQUIRE_NON_NULL(body);
+
+    size_t body_len = 0;
+    for (size_t i = 0; i < count; ++i) body_len += body[i].iov_len;
+
+    const int header_length = snprintf(NULL, 0, "%s%s%s%s%s%zu%s",
+                                       HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers,
+                                       "Content-Length: ", body_len, HTTP_HDR_END_DELIM);
+    if (header_length < 0) return ERR_IO;
+
+    char* header = calloc((size_t) header_length + 1, sizeof(char));
+    // the header goes first, the buffers of the body are sent where they are
+    struct iovec* iov = calloc(count + 1, sizeof(struct iovec));
+    if (header == NULL || iov == NULL) {
+        free(header);
+        free(iov);
+        return ERR_OUT_OF_MEMORY;
+    }
 
-    return ERR_NONE;
+    sprintf(header, "%s%s%s%s%s%zu%s", HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers,
+            "Content-Length: ", body_len, HTTP_HDR_END_DELIM);
+    iov[0].iov_base = header;
+    iov[0].iov_len = (size_t) header_length;
+    if (count > 0) memcpy(iov + 1, body, count * sizeof(struct iovec));
+
+    const uint64_t span = trace_begin();
+    const int err = send_all_iov(connection, iov, count + 1);
+    trace_end("send", span);
+    free(iov);
+    free(header);
+    return err;
+}
+
+/*******************************************************************
+ * Start a chunked HTTP reply: status line and headers only
+ */
+int http_reply_chunked_begin(int connection, const char* status, const char* headers)
+{
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(headers);
+
+    const int len = snprintf(NULL, 0, "%s%s%s%s%s%s", HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM,
+                             headers, "Transfer-Encoding: chunked", HTTP_HDR_END_DELIM);
+    if (len < 0) return ERR_IO;
+
+    char* buf = malloc((size_t) len + 1);
+    if (buf == NULL) return ERR_OUT_OF_MEMORY;
+
+    sprintf(buf, "%s%s%s%s%s%s", HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM,
+            headers, "Transfer-Encoding: chunked", HTTP_HDR_END_DELIM);
+
+    const int err = send_all(connection, buf, (size_t) len);
+    free(buf);
+    return err;
+}
+
+/*******************************************************************
+ * Send one chunk of a chunked reply
+ */
+int http_reply_chunk(int connection, const char* data, size_t len)
+{
+    if (len == 0) return ERR_NONE;
+    M_REQUIRE_NON_NULL(data);
+
+    // size line, data and trailing delimiter go out in a single send,
+    // so that the small pieces are not held back by Nagle's algorithm
+    char size_line[2 * sizeof(size_t) + sizeof(HTTP_LINE_DELIM)];
+    const int size_len = snprintf(size_line, sizeof(size_line), "%zx%s", len, HTTP_LINE_DELIM);
+    if (size_len < 0) return ERR_IO;
+    char delim[] = HTTP_LINE_DELIM;
+
+    // (writev() only reads the data)
+    struct iovec iov[3] = {
+        { size_line, (size_t) size_len },
+        { (void*) (uintptr_t) data, len },
+        { delim, sizeof(delim) - 1 }
+    };
+    return send_all_iov(connection, iov, 3);
+}
+
+/*******************************************************************
+ * Terminate a chunked reply (last chunk, no trailers)
+ */
+int http_reply_chunked_end(int connection)
+{
+    static const char last_chunk[] = "0" HTTP_HDR_END_DELIM;
+    return send_all(connection, last_chunk, strlen(last_chunk));
 }
@@ -9,6 +9,7 @@
 
 #include <stdint.h>
 #include "http_prot.h" // for structs
+#include <sys/uio.h> // for struct iovec
 
 #define MAX_REQUEST_SIZE 8388608 // 2^23 -> to handle images up to 8MB
 #define MAX_HEADER_SIZE    16384 // 2^14 -> to handle http headers
@@ -33,4 +34,28 @@ int http_serve_file(int connection, const char* filename);
 
 int http_reply(int connection, const char* status, const char* headers, const char* body, size_t body_len);
 
+/**
+ * @brief Same as http_reply(), the body being the concatenation of count
+ * buffers: they are sent as they are (gather write), without being copied
+ * into one.
+ */
+int http_reply_iov(int connection, const char* status, const char* headers,
+                   const struct iovec* body, size_t count);
+
+/**
+ * @brief Chunked replies (Transfer-Encoding: chunked), for bodies whose
+ * length is not known up front: send the status line and headers with
+ * http_reply_chunked_begin(), then the body piece by piece with
+ * http_reply_chunk(), and terminate with http_reply_chunked_end().
+ *
+ * headers, as for http_reply(), is a list of "\r\n"-terminated lines;
+ * it must not contain Content-Length. Empty chunks are not sent, since
+ * a zero-length chunk marks the end of the body.
+ */
+int http_reply_chunked_begin(int connection, const char* status, const char* headers);
+
+int http_reply_chunk(int connection, const char* data, size_t len);
+
+int http_reply_chunked_end(int connection);
+
 void http_close(void);
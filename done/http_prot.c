@@ -1,4 +1,5 @@
 #include <string.h>
+#include <strings.h> // strncasecmp
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -113,6 +114,7 @@ int http_parse_message(const char *stream, size_t bytes_received,
     M_REQUIRE_NON_NULL(out);
     M_REQUIRE_NON_NULL(content_len);
 
+    const char* const start = stream;
     const char* header_end = strstr(stream, HTTP_HDR_END_DELIM);
 
     if (header_end == NULL) return 0;
@@ -150,10 +152,207 @@ int http_parse_message(const char *stream, size_t bytes_received,
         out->body.val = NULL;
         out->body.len = 0;
         return 1;
+    }
+
+    // the body may hold any byte, '\0' included
+    const size_t header_len = (size_t) (stream - start);
+    const size_t received = bytes_received > header_len ? bytes_received - header_len : 0;
+    out->body.val = stream;
+    out->body.len = received < content_length ? received : content_length;
+
+    return (content_length == out->body.len) ? 1 : 0;
+}
+
+int http_get_header(const struct http_message* message, const char* name,
+                    struct http_string* value)
+{
+    M_REQUIRE_NON_NULL(message);
+    M_REQUIRE_NON_NULL(name);
+    M_REQUIRE_NON_NULL(value);
+
+    const size_t name_len = strlen(name);
+    for (size_t i = 0; i < message->num_headers; i++) {
+        const struct http_string* key = &message->headers[i].key;
+        if (key->len == name_len && strncasecmp(key->val, name, name_len) == 0) {
+            *value = message->headers[i].value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int http_match_etag(const struct http_string* header_value, const char* etag)
+{
+    M_REQUIRE_NON_NULL(header_value);
+    M_REQUIRE_NON_NULL(etag);
+
+    const size_t etag_len = strlen(etag);
+    size_t i = 0;
+    while (i < header_value->len) {
+        // skip list separators and optional whitespace
+        while (i < header_value->len
+               && (header_value->val[i] == ',' || header_value->val[i] == ' '
+                   || header_value->val[i] == '\t')) {
+            i++;
+        }
+        if (i == header_value->len) break;
+
+        if (header_value->val[i] == '*') return 1;
+
+        // weak validators are compared as strong ones for If-None-Match
+        if (header_value->len - i >= 2 && header_value->val[i] == 'W'
+            && header_value->val[i + 1] == '/') {
+            i += 2;
+        }
+
+        size_t tag_end = i;
+        while (tag_end < header_value->len && header_value->val[tag_end] != ',') {
+            tag_end++;
+        }
+        size_t tag_len = tag_end - i;
+        while (tag_len > 0 && (header_value->val[i + tag_len - 1] == ' '
+                               || header_value->val[i + tag_len - 1] == '\t')) {
+            tag_len--;
+        }
+
+        if (tag_len == etag_len && strncmp(header_value->val + i, etag, etag_len) == 0) {
+            return 1;
+        }
+        i = tag_end;
+    }
+    return 0;
+}
+
+/*
+ * Parses the decimal number starting at str[*pos] and advances *pos.
+ * Returns 1 if at least one digit was read, 0 otherwise (or on overflow).
+ */
+static int parse_uint64(const struct http_string* str, size_t* pos, uint64_t* value)
+{
+    const size_t start = *pos;
+    *value = 0;
+    while (*pos < str->len && str->val[*pos] >= '0' && str->val[*pos] <= '9') {
+        const uint64_t digit = (uint64_t) (str->val[*pos] - '0');
+        if (*value > (UINT64_MAX - digit) / 10) return 0;
+        *value = *value * 10 + digit;
+        (*pos)++;
+    }
+    return *pos > start;
+}
+
+int http_parse_range(const struct http_string* header_value, uint64_t total,
+                     uint64_t* first, uint64_t* last)
+{
+    M_REQUIRE_NON_NULL(header_value);
+    M_REQUIRE_NON_NULL(first);
+    M_REQUIRE_NON_NULL(last);
+
+    static const char unit[] = "bytes=";
+    const size_t unit_len = strlen(unit);
+
+    size_t pos = 0;
+    while (pos < header_value->len && header_value->val[pos] == ' ') pos++;
+
+    if (header_value->len - pos < unit_len
+        || strncasecmp(header_value->val + pos, unit, unit_len) != 0) {
+        return HTTP_RANGE_IGNORED;
+    }
+    pos += unit_len;
+
+    uint64_t start = 0;
+    uint64_t end = 0;
+    const int has_start = parse_uint64(header_value, &pos, &start);
+
+    if (pos >= header_value->len || header_value->val[pos] != '-') return HTTP_RANGE_IGNORED;
+    pos++;
+
+    const int has_end = parse_uint64(header_value, &pos, &end);
+
+    while (pos < header_value->len && header_value->val[pos] == ' ') pos++;
+    // multiple ranges (or trailing garbage): serve the whole representation
+    if (pos != header_value->len) return HTTP_RANGE_IGNORED;
+
+    if (has_start) {
+        if (has_end && end < start) return HTTP_RANGE_IGNORED;
+        if (start >= total) return HTTP_RANGE_UNSATISFIABLE;
+        *first = start;
+        *last = (has_end && end < total) ? end : total - 1;
     } else {
-        out->body.val = stream;
-        out->body.len = strlen(stream);
+        if (!has_end) return HTTP_RANGE_IGNORED;
+        // suffix range: the last `end` bytes
+        if (end == 0 || total == 0) return HTTP_RANGE_UNSATISFIABLE;
+        *first = (end < total) ? total - end : 0;
+        *last = total - 1;
+    }
+    return HTTP_RANGE_SATISFIABLE;
+}
+
+/*
+ * Parses the weight of an Accept-Encoding entry ("q=0.5") in thousandths.
+ * Anything unparsable counts as the default weight of 1.
+ */
+static unsigned parse_qvalue(const char* params, size_t len)
+{
+    size_t i = 0;
+    while (i < len && (params[i] == ';' || params[i] == ' ')) i++;
+    if (len - i < 2 || (params[i] != 'q' && params[i] != 'Q') || params[i + 1] != '=') return 1000;
+    i += 2;
+
+    if (i >= len || (params[i] != '0' && params[i] != '1')) return 1000;
+    unsigned q = (unsigned) (params[i] - '0') * 1000;
+    i++;
+    if (i < len && params[i] == '.') {
+        i++;
+        unsigned scale = 100;
+        while (i < len && scale > 0 && params[i] >= '0' && params[i] <= '9') {
+            q += (unsigned) (params[i] - '0') * scale;
+            scale /= 10;
+            i++;
+        }
+    }
+    return MIN(q, 1000u);
+}
+
+int http_negotiate_encoding(const struct http_message* message)
+{
+    M_REQUIRE_NON_NULL(message);
+
+    struct http_string accept;
+    if (http_get_header(message, "Accept-Encoding", &accept) != 1) return HTTP_ENCODING_IDENTITY;
+
+    unsigned gzip_q = 0;
+    unsigned deflate_q = 0;
+    unsigned any_q = 0;
+    // "*" only stands for the codings that are not named
+    int gzip_named = 0;
+    int deflate_named = 0;
+    size_t i = 0;
+    while (i < accept.len) {
+        while (i < accept.len && (accept.val[i] == ',' || accept.val[i] == ' ')) i++;
 
-        return (content_length == out->body.len) ? 1 : 0;
+        size_t end = i;
+        while (end < accept.len && accept.val[end] != ',') end++;
+
+        size_t name_end = i;
+        while (name_end < end && accept.val[name_end] != ';' && accept.val[name_end] != ' ') name_end++;
+
+        const unsigned q = parse_qvalue(accept.val + name_end, end - name_end);
+        const size_t name_len = name_end - i;
+        if (name_len == strlen("gzip") && strncasecmp(accept.val + i, "gzip", name_len) == 0) {
+            gzip_q = q;
+            gzip_named = 1;
+        } else if (name_len == strlen("deflate") && strncasecmp(accept.val + i, "deflate", name_len) == 0) {
+            deflate_q = q;
+            deflate_named = 1;
+        } else if (name_len == 1 && accept.val[i] == '*') {
+            any_q = q;
+        }
+        i = end;
     }
+    if (!gzip_named) gzip_q = any_q;
+    if (!deflate_named) deflate_q = any_q;
+
+    if (gzip_q > 0 && gzip_q >= deflate_q) return HTTP_ENCODING_GZIP;
+    if (deflate_q > 0) return HTTP_ENCODING_DEFLATE;
+    return HTTP_ENCODING_IDENTITY;
 }
@@ -14,9 +14,29 @@
 #define HTTP_HDR_END_DELIM HTTP_LINE_DELIM HTTP_LINE_DELIM
 #define HTTP_PROTOCOL_ID   "HTTP/1.1 "
 #define HTTP_OK            "200 OK"
+#define HTTP_PARTIAL_CONTENT "206 Partial Content"
+#define HTTP_NOT_MODIFIED  "304 Not Modified"
 #define HTTP_BAD_REQUEST   "400 Bad Request"
+#define HTTP_RANGE_NOT_SATISFIABLE "416 Range Not Satisfiable"
+#define HTTP_SERVICE_UNAVAILABLE "503 Service Unavailable"
+
+// Return values of http_parse_range()
+#define HTTP_RANGE_IGNORED       0
+#define HTTP_RANGE_SATISFIABLE   1
+#define HTTP_RANGE_UNSATISFIABLE 2
 
 #include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Content codings the server knows how to produce.
+ */
+enum http_encoding {
+    HTTP_ENCODING_IDENTITY,
+    HTTP_ENCODING_GZIP,
+    HTTP_ENCODING_DEFLATE,
+    NB_HTTP_ENCODINGS
+};
 
 struct http_string {
     const char *val; // Warning! This is *NOT* null-terminated (thus len field below)
@@ -72,3 +92,50 @@ int http_get_var(const struct http_string* url, const char* name, char* out, siz
  * @brief Compare method with verb and return 1 if they are equal, 0 otherwise
  */
 int http_match_verb(const struct http_string* method, const char* verb);
+
+/**
+ * @brief Looks up the first header named `name` (case-insensitive) in `message`.
+ *
+ * Returns: 1 and sets `value` if the header is present, 0 if it is not,
+ * a negative int if there was an error.
+ */
+int http_get_header(const struct http_message* message, const char* name,
+                    struct http_string* value);
+
+/**
+ * @brief Checks an If-None-Match header value against the entity tag `etag`.
+ *
+ * `etag` is the quoted opaque tag as sent in the ETag header. The header value
+ * may be "*" or a comma-separated list of (possibly weak, "W/") entity tags,
+ * which are compared with the weak comparison function of RFC 9110.
+ *
+ * Returns: 1 if one of the tags matches, 0 if none does,
+ * a negative int if there was an error.
+ */
+int http_match_etag(const struct http_string* header_value, const char* etag);
+
+/**
+ * @brief Parses the value of a Range header for a representation of `total` bytes.
+ *
+ * Only single byte ranges are supported ("bytes=first-last", "bytes=first-"
+ * and "bytes=-suffix"); `last` is clamped to the end of the representation.
+ *
+ * Returns:
+ *  HTTP_RANGE_SATISFIABLE and sets `first` and `last` (inclusive) for a valid range
+ *  HTTP_RANGE_UNSATISFIABLE if the range lies outside of the representation
+ *  HTTP_RANGE_IGNORED if the header is malformed or asks for several ranges,
+ *      in which case the full representation shall be sent
+ *  a negative int if there was an error
+ */
+int http_parse_range(const struct http_string* header_value, uint64_t total,
+                     uint64_t* first, uint64_t* last);
+
+/**
+ * @brief Chooses the content coding of the response from the Accept-Encoding
+ *        header of `message` (gzip is preferred over deflate on equal weights;
+ *        codings with q=0 are refused, "*" stands for the codings not named).
+ *
+ * Returns: the chosen enum http_encoding (HTTP_ENCODING_IDENTITY if the
+ * header is missing or names nothing we support), a negative int on error.
+ */
+int http_negotiate_encoding(const struct http_message* message);
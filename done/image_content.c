@@ -1,4 +1,8 @@
 #include "imgfs.h"
+#include "image_content.h"
+#include "metrics.h"
+#include "trace.h"
+#include <stdint.h> // uintptr_t
 #include <vips/vips.h>
 
 /*******************************************************************
@@ -33,22 +37,23 @@ int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index)
         return ERR_NONE;
     } else if (resolution == THUMB_RES || resolution == SMALL_RES) {
         if(image->offset[resolution] == 0) {
+            const uint64_t start = metrics_now_us();
             VipsImage* image_vips_in = NULL;
             void* buffer = calloc(1, image->size[ORIG_RES]);
 
             if (buffer == NULL) return ERR_OUT_OF_MEMORY;
 
-            if (fseek(imgfs_file->file, (long) image->offset[ORIG_RES], SEEK_SET) != 0) {
+            uint64_t span = trace_begin();
+            int err = imgfs_content_pread(imgfs_file, ORIG_RES, buffer, image->size[ORIG_RES],
+                                          image->offset[ORIG_RES]);
+            trace_end("read original", span);
+            if (err != ERR_NONE) {
                 free(buffer);
-                return ERR_IO;
-            }
-
-            if (fread(buffer, 1, image->size[ORIG_RES], imgfs_file->file)
-                != image->size[ORIG_RES]) {
-                free(buffer);
-                return ERR_IO;
+                return err;
             }
 
+            // (vips decodes lazily: most of the work is done by the save)
+            span = trace_begin();
             if(vips_jpegload_buffer(buffer, image->size[ORIG_RES],
                                     &image_vips_in, NULL) != 0) {
                 free_all(buffer, image_vips_in, NULL);
@@ -73,35 +78,29 @@ int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index)
                 free_all(buffer, image_vips_in, image_vips_resized);
                 return ERR_IMGLIB;
             }
+            trace_end("resize", span);
 
-            image->size[resolution] = (uint32_t) size;
-
-            if(fseek(imgfs_file->file, 0, SEEK_END) != 0) {
-                free_all(buffer, image_vips_in, image_vips_resized);
-                return ERR_IO;
-            }
-
-            image->offset[resolution] = (uint64_t) ftell(imgfs_file->file);
-
-            if(fwrite(buffer, 1, image->size[resolution], imgfs_file->file)
-               != image->size[resolution]) {
+            span = trace_begin();
+            uint64_t offset = 0;
+            err = imgfs_content_append(imgfs_file, resolution, buffer, size, &offset);
+            if (err != ERR_NONE) {
                 free_all(buffer, image_vips_in, image_vips_resized);
-                return ERR_IO;
+                return err;
             }
 
-            if(fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header) +
-                                               index * sizeof(struct img_metadata)),
-                     SEEK_SET) != 0) {
-                free_all(buffer, image_vips_in, image_vips_resized);
-                return ERR_IO;
-            }
+            image->size[resolution] = (uint32_t) size;
+            image->offset[resolution] = offset;
 
-            if(fwrite(image, sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
+            err = write_metadata(imgfs_file, (uint32_t) index, 0);
+            if (err == ERR_NONE) err = imgfs_end_update(imgfs_file);
+            trace_end("store resized", span);
+            if (err != ERR_NONE) {
                 free_all(buffer, image_vips_in, image_vips_resized);
-                return ERR_IO;
+                return err;
             }
 
             free_all(buffer, image_vips_in, image_vips_resized);
+            metrics_resize(metrics_now_us() - start);
         }
         return ERR_NONE;
     } else {
@@ -130,3 +129,63 @@ int get_resolution(uint32_t *height, uint32_t *width,
     g_object_unref(VIPS_OBJECT(original));
     return ERR_NONE;
 }
+
+/*******************************************************************
+ * Composes images into a sprite sheet.
+ */
+int make_sprite_sheet(const char* const* images, const size_t* sizes, size_t n,
+                      unsigned columns, uint32_t cell_width, uint32_t cell_height,
+                      char** sheet, size_t* sheet_size, struct sprite_cell* cells)
+{
+    M_REQUIRE_NON_NULL(images);
+    M_REQUIRE_NON_NULL(sizes);
+    M_REQUIRE_NON_NULL(sheet);
+    M_REQUIRE_NON_NULL(sheet_size);
+    M_REQUIRE_NON_NULL(cells);
+    if (n == 0 || columns == 0 || cell_width == 0 || cell_height == 0) return ERR_INVALID_ARGUMENT;
+
+    VipsImage** decoded = calloc(n, sizeof(VipsImage*));
+    if (decoded == NULL) return ERR_OUT_OF_MEMORY;
+
+    int err = ERR_NONE;
+    for (size_t i = 0; i < n && err == ERR_NONE; ++i) {
+        if (images[i] == NULL
+            || vips_jpegload_buffer((void*) (uintptr_t) images[i], sizes[i], &decoded[i], NULL) != 0) {
+            err = ERR_IMGLIB;
+            break;
+        }
+
+        const uint32_t width = (uint32_t) vips_image_get_width(decoded[i]);
+        const uint32_t height = (uint32_t) vips_image_get_height(decoded[i]);
+        if (width > cell_width || height > cell_height) {
+            err = ERR_INVALID_ARGUMENT;
+            break;
+        }
+        cells[i].x = (uint32_t) (i % columns) * cell_width;
+        cells[i].y = (uint32_t) (i / columns) * cell_height;
+        cells[i].width = width;
+        cells[i].height = height;
+    }
+
+    // one pass: images placed every cell_width (resp. cell_height) pixels, at the top left
+    VipsImage* joined = NULL;
+    if (err == ERR_NONE
+        && vips_arrayjoin(decoded, &joined, (int) n,
+                          "across", (int) (n < columns ? n : columns),
+                          "hspacing", (int) cell_width, "vspacing", (int) cell_height, NULL) != 0) {
+        err = ERR_IMGLIB;
+    }
+
+    void* buffer = NULL;
+    if (err == ERR_NONE && vips_jpegsave_buffer(joined, &buffer, sheet_size, NULL) != 0) {
+        err = ERR_IMGLIB;
+    }
+    if (err == ERR_NONE) *sheet = buffer;
+
+    if (joined != NULL) g_object_unref(joined);
+    for (size_t i = 0; i < n; ++i) {
+        if (decoded[i] != NULL) g_object_unref(decoded[i]);
+    }
+    free(decoded);
+    return err;
+}
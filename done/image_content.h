@@ -36,6 +36,35 @@ int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer,
  */
 int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index);
 
+/**
+ * @brief Where an image is in a sprite sheet, in pixels.
+ */
+struct sprite_cell {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+/**
+ * @brief Composes JPEG images (typically thumbnails) into a single JPEG,
+ *        a grid of columns cells of cell_width x cell_height pixels: image
+ *        i is at the top left of cell i (row i / columns, column i % columns).
+ *
+ * @param images The JPEG content of the images.
+ * @param sizes Their sizes.
+ * @param n Number of images (at least 1).
+ * @param columns Number of cells per row.
+ * @param cell_width, cell_height Size of the cells, at least that of the images.
+ * @param sheet Where to store the JPEG content of the sheet, to be freed by the caller.
+ * @param sheet_size Where to store its size.
+ * @param cells Where to store the position of each image (n of them).
+ * @return Some error code. 0 if no error.
+ */
+int make_sprite_sheet(const char* const* images, const size_t* sizes, size_t n,
+                      unsigned columns, uint32_t cell_width, uint32_t cell_height,
+                      char** sheet, size_t* sheet_size, struct sprite_cell* cells);
+
 #ifdef __cplusplus
 }
 #endif
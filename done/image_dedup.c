@@ -18,24 +18,32 @@ int do_name_and_content_dedup(struct imgfs_file* imgfs_file, uint32_t index)
 
     int has_duplicated_content = 0;
 
-    for(uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+    const uint32_t hash = img_id_hash(image->img_id);
+    uint64_t sha_prefix = 0;
+    memcpy(&sha_prefix, image->SHA, sizeof(sha_prefix));
+
+    // the view gives the candidates, the metadata has the last word
+    const struct metadata_view* view = &imgfs_file->view;
+    const uint32_t max_files = imgfs_file->header.max_files;
+    for(uint32_t i = metadata_view_next_valid(imgfs_file, 0); i < max_files;
+        i = metadata_view_next_valid(imgfs_file, i + 1)) {
         if(i != index) {
             struct img_metadata* other_image = &(imgfs_file->metadata[i]);
-            if(other_image->is_valid) {
-                if(strcmp(image->img_id, other_image->img_id) == 0) {
-                    return ERR_DUPLICATE_ID;
-                }
-                if(memcmp(image->SHA, other_image->SHA, SHA256_DIGEST_LENGTH) == 0) {
-                    image->size[ORIG_RES] = other_image->size[ORIG_RES];
-                    image->size[THUMB_RES] = other_image->size[THUMB_RES];
-                    image->size[SMALL_RES] = other_image->size[SMALL_RES];
-                    image->offset[ORIG_RES] = other_image->offset[ORIG_RES];
-                    image->offset[THUMB_RES] = other_image->offset[THUMB_RES];
-                    image->offset[SMALL_RES] = other_image->offset[SMALL_RES];
-                    has_duplicated_content = 1;
-                }
-            }
+            if(!other_image->is_valid) continue;
 
+            if(view->id_hash[i] == hash && strcmp(image->img_id, other_image->img_id) == 0) {
+                return ERR_DUPLICATE_ID;
+            }
+            if(view->sha_prefix[i] == sha_prefix
+               && memcmp(image->SHA, other_image->SHA, SHA256_DIGEST_LENGTH) == 0) {
+                image->size[ORIG_RES] = other_image->size[ORIG_RES];
+                image->size[THUMB_RES] = other_image->size[THUMB_RES];
+                image->size[SMALL_RES] = other_image->size[SMALL_RES];
+                image->offset[ORIG_RES] = other_image->offset[ORIG_RES];
+                image->offset[THUMB_RES] = other_image->offset[THUMB_RES];
+                image->offset[SMALL_RES] = other_image->offset[SMALL_RES];
+                has_duplicated_content = 1;
+            }
         }
     }
 
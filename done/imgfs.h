@@ -11,6 +11,23 @@
  * should be stored as raw bytes appended at the end of the imgFS
  * file and addressed by offsets in the metadata structure.
  *
+ * Format v2 (header name CAT_TXT_V2) replaces the metadata structures
+ * by 64-byte img_record's, one cache line each, holding only what scans
+ * need; the full SHA and the image ID of each record are stored in the
+ * data region, like image content, at record.id_offset. That entry is
+ * IMG_ID_ENTRY_SIZE bytes long whatever the ID, so that a new image in
+ * the slot reuses it. In memory, both formats are loaded into the same
+ * img_metadata array.
+ *
+ * With IMGFS_FLAG_EXTENT_FILES, the content of each resolution is not
+ * appended to the imgFS file but to its own extent file, named after
+ * it ("<imgFS>.thumb", ".small", ".orig"), and the offsets of that
+ * resolution are in that file. Each extent file starts with a copy of
+ * the header, so that no content is at offset 0.
+ *
+ * With IMGFS_FLAG_SEGMENTS, content goes to fixed-size segment files
+ * instead, see segment.h.
+ *
  * @author Mia Primorac
  */
 
@@ -25,10 +42,22 @@
 #include <stdio.h>         // for FILE
 
 #define CAT_TXT "EPFL ImgFS 2024"
+#define CAT_TXT_V2 "EPFL ImgFS 2024 v2"
+
+// On-disk formats, told apart by imgfs_header.name
+#define IMGFS_FORMAT_V1 1
+#define IMGFS_FORMAT_V2 2
 
 // Constraints
 #define MAX_IMGFS_NAME  31  // max. size of a ImgFS name
 #define MAX_IMG_ID     127  // max. size of an image id
+#define IMG_ID_ENTRY_SIZE (SHA256_DIGEST_LENGTH + MAX_IMG_ID) // SHA and ID of a v2 record
+
+// For flags in imgfs_header
+#define IMGFS_FLAG_DIRECT_ORIG  0x1 // originals aligned, read around the page cache
+#define IMGFS_FLAG_EXTENT_FILES 0x2 // content of each resolution in its own file
+#define IMGFS_FLAG_SEGMENTS     0x4 // content in segment files, see segment.h
+#define DIRECT_ALIGNMENT    4096
 
 // For is_valid in imgfs_metadata
 #define EMPTY     0
@@ -54,8 +83,8 @@ struct imgfs_header {
     uint32_t nb_files;
     uint32_t max_files;
     uint16_t resized_res[2*(NB_RES-1)];
-    uint32_t unused_32;
-    uint64_t unused_64;
+    uint32_t flags;     // IMGFS_FLAG_*
+    uint64_t segment_size; // IMGFS_FLAG_SEGMENTS: max. bytes per segment file
 };
 
 struct img_metadata {
@@ -68,10 +97,52 @@ struct img_metadata {
     uint16_t unused_16;
 };
 
+#define SHA_PREFIX_LENGTH 8
+
+/**
+ * @brief On-disk metadata record of format v2 (the "hot" part of img_metadata).
+ */
+struct img_record {
+    uint16_t is_valid;
+    uint16_t id_len;                  // length of the image ID, without '\0'
+    uint32_t orig_res[ORIG_RES];
+    uint32_t size[NB_RES];
+    uint64_t offset[NB_RES];
+    uint64_t id_offset;               // where the SHA, then the image ID, are stored
+    unsigned char sha_prefix[SHA_PREFIX_LENGTH];
+};
+
+_Static_assert(sizeof(struct img_record) == 64, "img_record must fill one cache line");
+
+/**
+ * @brief Structure-of-arrays view of the metadata, for full-table scans.
+ *
+ * Derived from imgfs_file.metadata when the imgFS is opened or created,
+ * and kept in sync by write_metadata(): slot i is valid iff bit (i % 64)
+ * of valid[i / 64] is set. Scans use it to pick candidate slots, then
+ * check them against the metadata. The arrays are allocated right after
+ * the metadata, in the same block, and released with it.
+ */
+struct metadata_view {
+    uint64_t* valid;            // validity bitmap
+    uint64_t* sha_prefix;       // first SHA_PREFIX_LENGTH bytes of each SHA
+    uint32_t* id_hash;          // hash of each image ID, see img_id_hash()
+};
+
+struct imgfs_journal; // see journal.h
+struct io_engine;     // see io_engine.h
+struct imgfs_segments; // see segment.h
+struct json_writer;    // see json_writer.h
+
 struct imgfs_file {
     FILE* file;
     struct imgfs_header header;
     struct img_metadata* metadata;
+    struct metadata_view view;
+    struct imgfs_journal* journal; // NULL unless opened for writing
+    int direct_fd;                 // O_DIRECT descriptor (IMGFS_FLAG_DIRECT_ORIG), -1 if none
+    int extent_fd[NB_RES];         // extent files (IMGFS_FLAG_EXTENT_FILES), -1 if none
+    struct imgfs_segments* segments; // IMGFS_FLAG_SEGMENTS, NULL otherwise
 } ;
 
 /**
@@ -88,9 +159,20 @@ void print_header(const struct imgfs_header* header);
  */
 void print_metadata(const struct img_metadata* metadata);
 
+/**
+ * @brief Writes the hexadecimal representation of a SHA.
+ *
+ * @param SHA The SHA256_DIGEST_LENGTH bytes to convert.
+ * @param sha_string Output buffer of at least 2 * SHA256_DIGEST_LENGTH + 1 chars.
+ */
+void sha_to_string(const unsigned char* SHA, char* sha_string);
+
 /**
  * @brief Open imgFS file, read the header and all the metadata.
  *
+ * Updates left in the journal by a crash are first replayed. In "rb+"
+ * mode, the journal is then (re)created for the updates to come.
+ *
  * @param imgfs_filename Path to the imgFS file
  * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
  * @param imgfs_file Structure for header, metadata and file pointer.
@@ -99,6 +181,200 @@ int do_open(const char* imgfs_filename,
             const char* open_mode,
             struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Tells the on-disk format of an imgFS from its header.
+ *
+ * @return IMGFS_FORMAT_V1 or IMGFS_FORMAT_V2.
+ */
+int imgfs_format(const struct imgfs_header* header);
+
+/**
+ * @brief Position in the imgFS file of the metadata of slot index, in the
+ *        format of the file; for index == max_files, the end of the table.
+ */
+long metadata_position(const struct imgfs_header* header, uint32_t index);
+
+/**
+ * @brief Positional I/O on the file of an imgFS. All its I/O goes through
+ *        these (pread()/pwrite() on its descriptor, short transfers
+ *        retried): nothing depends on a shared file position, so that
+ *        concurrent readers need no lock around it.
+ *
+ * @return some error code; ERR_IO also if the file ends before size bytes.
+ */
+int imgfs_pread(const struct imgfs_file* imgfs_file, void* data, size_t size, uint64_t offset);
+int imgfs_pwrite(const struct imgfs_file* imgfs_file, const void* data, size_t size, uint64_t offset);
+
+/**
+ * @brief Makes imgfs_pread() and imgfs_pwrite() go through an I/O engine
+ *        (see io_engine.h), for all imgFS; NULL to stop.
+ */
+void imgfs_set_io_engine(struct io_engine* engine);
+
+/**
+ * @brief Writes size bytes at the end of the file of an imgFS, and
+ *        gives where (if offset is not NULL).
+ *
+ * @return some error code.
+ */
+int imgfs_append(const struct imgfs_file* imgfs_file, const void* data, size_t size,
+                 uint64_t* offset);
+
+/**
+ * @brief Reads (resp. appends) image content of a resolution, where it
+ *        is stored: the imgFS file, the extent file of the resolution
+ *        (IMGFS_FLAG_EXTENT_FILES) or a segment (IMGFS_FLAG_SEGMENTS),
+ *        whose descriptors imgfs_file caches. With IMGFS_FLAG_DIRECT_ORIG
+ *        (never with segments), originals are appended at multiples of
+ *        DIRECT_ALIGNMENT, and read keeping the page cache for hotter
+ *        data: with O_DIRECT if possible, otherwise by dropping the pages
+ *        read (posix_fadvise()).
+ *
+ * @return some error code.
+ */
+int imgfs_content_pread(struct imgfs_file* imgfs_file, int resolution, void* data,
+                        size_t size, uint64_t offset);
+int imgfs_content_append(struct imgfs_file* imgfs_file, int resolution, const void* data,
+                         size_t size, uint64_t* offset);
+
+/**
+ * @brief One read of imgfs_content_preadv().
+ */
+struct content_read {
+    int resolution;
+    uint64_t offset;
+    void* data;
+    size_t size;
+    int err;         // set by imgfs_content_preadv()
+};
+
+/**
+ * @brief Performs several imgfs_content_pread() at once: with an I/O
+ *        engine, they are all submitted together. Each read gets its
+ *        own error code.
+ *
+ * @return some error code (if no read could be attempted).
+ */
+int imgfs_content_preadv(struct imgfs_file* imgfs_file, struct content_read* reads, size_t n);
+
+/**
+ * @brief Path of the extent file of a resolution, to be freed by the caller.
+ *
+ * @return the path, NULL if out of memory.
+ */
+char* imgfs_extent_path(const char* imgfs_filename, int resolution);
+
+/**
+ * @brief Opens the extent files of an imgFS whose header is loaded, if
+ *        it has some and no segments (done by do_open() and do_create());
+ *        "wb" creates them.
+ *
+ * @return some error code.
+ */
+int imgfs_open_extents(struct imgfs_file* imgfs_file, const char* imgfs_filename,
+                       const char* open_mode);
+
+/**
+ * @brief Makes all the writes to the files of an imgFS durable (fdatasync()).
+ *
+ * @return some error code.
+ */
+int imgfs_sync(const struct imgfs_file* imgfs_file);
+
+#define IMGFS_MAX_SYNC_FDS (1 + 2 * NB_RES) // the file, extent files, active segments
+
+/**
+ * @brief First half of imgfs_sync(), to be called with the imgFS locked:
+ *        flushes it and duplicates the descriptors to sync into fds, so
+ *        that imgfs_sync_fds() can sync them once the lock is released.
+ *
+ * @return some error code.
+ */
+int imgfs_dup_sync_fds(const struct imgfs_file* imgfs_file, int fds[IMGFS_MAX_SYNC_FDS],
+                       size_t* count);
+
+/**
+ * @brief Second half of imgfs_sync(): syncs the descriptors got from
+ *        imgfs_dup_sync_fds() and closes them.
+ *
+ * @return some error code.
+ */
+int imgfs_sync_fds(int* fds, size_t count);
+
+/**
+ * @brief Gets the size of the file of an imgFS.
+ *
+ * @return some error code.
+ */
+int imgfs_size(const struct imgfs_file* imgfs_file, uint64_t* size);
+
+/**
+ * @brief Updates size bytes of the header or metadata table at offset:
+ *        logged to the journal if there is one, written in place otherwise.
+ *
+ * @return some error code.
+ */
+int imgfs_write_at(struct imgfs_file* imgfs_file, uint64_t offset, const void* data, size_t size);
+
+/**
+ * @brief Ends an update (insert, delete, ...): commits it to the journal,
+ *        unless the journal groups updates (see journal.h).
+ *
+ * @return some error code.
+ */
+int imgfs_end_update(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Writes the in-memory header to the imgFS file.
+ */
+int write_header(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Writes the in-memory metadata of one image to the imgFS file,
+ *        in the format of the file.
+ *
+ * @param imgfs_file The opened imgFS.
+ * @param index Slot of the image.
+ * @param new_image Non-zero if the slot has just been filled: in format v2,
+ *      its SHA and ID are then appended to the file; otherwise only the
+ *      record is rewritten.
+ * @return some error code.
+ */
+int write_metadata(struct imgfs_file* imgfs_file, uint32_t index, int new_image);
+
+/**
+ * @brief Builds imgfs_file->view from the metadata (done by do_open() and do_create()).
+ *        The metadata block is reallocated to make room for the view.
+ *
+ * @return some error code.
+ */
+int metadata_view_build(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Refreshes slot index of imgfs_file->view from its metadata.
+ */
+void metadata_view_update(struct imgfs_file* imgfs_file, uint32_t index);
+
+/**
+ * @brief Tells whether slot index is valid according to the view.
+ */
+static inline int metadata_view_valid(const struct metadata_view* view, uint32_t index)
+{
+    return (int) ((view->valid[index / 64] >> (index % 64)) & 1);
+}
+
+/**
+ * @brief First slot, from index from on, that is valid (resp. free) according
+ *        to the view; header.max_files if there is none.
+ */
+uint32_t metadata_view_next_valid(const struct imgfs_file* imgfs_file, uint32_t from);
+uint32_t metadata_view_next_free(const struct imgfs_file* imgfs_file, uint32_t from);
+
+/**
+ * @brief Hash of an image ID, as stored in metadata_view.id_hash.
+ */
+uint32_t img_id_hash(const char* img_id);
+
 /**
  * @brief Do some clean-up for imgFS file handling.
  *
@@ -117,6 +393,23 @@ enum do_list_mode {
     NB_DO_LIST_MODES
 };
 
+/**
+ * @brief Optional per-image fields of a JSON listing (bitmask for struct list_query).
+ */
+#define LIST_FIELD_SIZE       0x1 // size of each resolution
+#define LIST_FIELD_RESOLUTION 0x2 // resolution of the original
+#define LIST_FIELD_SHA        0x4 // SHA of the original, in hexadecimal
+
+/**
+ * @brief Selection of a page of the JSON listing, see do_list_query().
+ */
+struct list_query {
+    uint32_t start;     // first metadata slot to scan: 0, or 1 + the "next" cursor of the previous page
+    uint32_t limit;     // max. number of images in the page; 0 for no limit
+    const char* prefix; // only list images whose ID starts with it; NULL for all
+    unsigned fields;    // LIST_FIELD_* to include; 0 lists bare image IDs
+};
+
 /**
  * @brief Displays (on stdout) imgFS metadata.
  *
@@ -129,12 +422,118 @@ enum do_list_mode {
 int do_list(const struct imgfs_file* imgfs_file,
             enum do_list_mode output_mode, char** json);
 
+/**
+ * @brief Lists a page of the imgFS content in JSON format.
+ *
+ * The scan starts at slot query->start and stops as soon as the page is
+ * full. Without a prefix, it thus visits about limit slots when the table
+ * is dense; with a prefix, or over many free slots, it may visit all the
+ * slots from the cursor up to max_files. When more matching images remain,
+ * a "next" member gives the cursor of the following page: the slot of the
+ * last listed image (the next scan starts right after it).
+ * Without fields, "Images" is an array of image IDs; with fields, of
+ * objects holding "img_id" and the selected fields.
+ *
+ * @param imgfs_file In memory structure with header and metadata.
+ * @param query The page and filters to apply.
+ * @param json A pointer to a string containing the list in JSON format.
+ *      It will be dynamically allocated by the function.
+ * @return some error code.
+ */
+int do_list_query(const struct imgfs_file* imgfs_file,
+                  const struct list_query* query, char** json);
+
+/**
+ * @brief Streams a page of the imgFS content in JSON format to writer.
+ *
+ * Same output as do_list_query(), but written as the metadata is scanned:
+ * with a json_writer sink, the listing never needs to be held in memory.
+ *
+ * @param imgfs_file In memory structure with header and metadata.
+ * @param query The page and filters to apply.
+ * @param writer Where to write the JSON text; not completed by this function.
+ * @return some error code.
+ */
+int do_list_json(const struct imgfs_file* imgfs_file,
+                 const struct list_query* query, struct json_writer* writer);
+
+/**
+ * @brief What do_list_images() listed.
+ */
+struct list_page {
+    uint32_t listed; // number of images listed
+    uint32_t last;   // slot of the last one
+    int has_next;    // more matching images remain after it
+};
+
+/**
+ * @brief Writes the images of a page of the listing, as elements of the
+ *        "Images" array already opened in writer: the building block of
+ *        do_list_json(), for listings merging several imgFS.
+ *
+ * @param imgfs_file In memory structure with header and metadata.
+ * @param query The page and filters to apply.
+ * @param writer Where to write them; NULL to only count them.
+ * @param slots If not NULL, where to store the slot of each image listed
+ *        (room for query->limit of them, which must then not be 0).
+ * @param page Where to store what was listed.
+ * @return some error code.
+ */
+int do_list_images(const struct imgfs_file* imgfs_file, const struct list_query* query,
+                   struct json_writer* writer, uint32_t* slots, struct list_page* page);
+
+/**
+ * @brief Converts, in place, an imgFS from format v1 to format v2.
+ *
+ * The SHA and ID of the valid images are appended to the file, the
+ * records are written over the v1 metadata table (the rest of which is
+ * left unused) and the header is updated last. Image content does not
+ * move. Does nothing on an imgFS already in format v2.
+ *
+ * @param imgfs_file The imgFS, opened in "rb+" mode.
+ * @return some error code.
+ */
+int do_upgrade(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Raises the capacity (max_files) of an imgFS, in place.
+ *
+ * The metadata table is extended over the start of the data region: the
+ * content stored there (image data, and v2 SHA and IDs) is first copied
+ * to the end of the file and its references updated, then the new slots
+ * are cleared and the header is written last. The cost depends on the
+ * number of added slots, not on the size of the imgFS.
+ *
+ * @param imgfs_file The imgFS, opened in "rb+" mode.
+ * @param new_max_files The new capacity, greater than the current one.
+ * @return some error code.
+ */
+int do_grow(struct imgfs_file* imgfs_file, uint32_t new_max_files);
+
+/**
+ * @brief Compacts the segments of an imgFS (IMGFS_FLAG_SEGMENTS).
+ *
+ * Each segment but the active ones whose referenced content is at most
+ * max_live_percent of its size has that content copied to the active
+ * segment; once the metadata refers to the copies (and is committed),
+ * the segment file is removed at once. Content shared by several images
+ * is copied once.
+ *
+ * @param imgfs_file The imgFS, opened in "rb+" mode.
+ * @param max_live_percent Threshold, from 0 (only drop unreferenced segments) to 100.
+ * @param dropped Where to store the number of segments removed, if not NULL.
+ * @return some error code.
+ */
+int do_compact(struct imgfs_file* imgfs_file, unsigned max_live_percent, uint32_t* dropped);
+
 /**
  * @brief Creates the imgFS called imgfs_filename. Writes the header and the
  *        preallocated empty metadata array to imgFS file.
  *
  * @param imgfs_filename Path to the imgFS file
  * @param imgfs_file In memory structure with header and metadata.
+ * @return Some error code: ERR_INVALID_ARGUMENT for IMGFS_FLAG_SEGMENTS
+ *         with IMGFS_FLAG_DIRECT_ORIG. 0 if no error.
  */
 int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file);
 
@@ -161,6 +560,17 @@ int do_delete(const char* img_id, struct imgfs_file* imgfs_file);
  */
 int resolution_atoi(const char* resolution);
 
+/**
+ * @brief Finds the metadata slot of a valid image.
+ *
+ * @param img_id The ID of the image to look for.
+ * @param imgfs_file The main in-memory data structure
+ * @param index Where to store the index of the image in the metadata array
+ * @return Some error code. 0 if no error, ERR_IMAGE_NOT_FOUND if no valid image has that ID.
+ */
+int find_image_index(const char* img_id, const struct imgfs_file* imgfs_file,
+                     uint32_t* index);
+
 /**
  * @brief Reads the content of an image from a imgFS.
  *
@@ -174,6 +584,49 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, int resolution, char** image_buffer,
             uint32_t* image_size, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Reads part of the content of an image from a imgFS.
+ *
+ * Only the requested bytes are read from disk: the slice starts at
+ * offset[resolution] + start and is at most length bytes long.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param start First byte to read, relative to the start of the image content.
+ * @param length Maximum number of bytes to read; the slice is cut at the end of the image.
+ * @param image_buffer Location of the location of the image content
+ * @param image_size Location of the size of the slice actually read
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error, ERR_INVALID_ARGUMENT if start is past the end.
+ */
+int do_read_range(const char* img_id, int resolution, uint32_t start, uint32_t length,
+                  char** image_buffer, uint32_t* image_size, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief One image of do_read_batch().
+ */
+struct batch_image {
+    const char* img_id;
+    char* data;      // to be freed by the caller, NULL on error
+    uint32_t size;
+    int err;         // e.g. ERR_IMAGE_NOT_FOUND
+};
+
+/**
+ * @brief Reads several images from a imgFS at the same resolution: the
+ *        missing resized versions are generated first, then all the
+ *        content is read at once (see imgfs_content_preadv()). An image
+ *        that cannot be read does not fail the others.
+ *
+ * @param images The IDs to read; their data, size and err are set.
+ * @param n Number of images.
+ * @param resolution The desired resolution for the images read.
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error (whatever the err of each image).
+ */
+int do_read_batch(struct batch_image* images, size_t n, int resolution,
+                  struct imgfs_file* imgfs_file);
+
 /**
  * @brief Insert image in the imgFS file
  *
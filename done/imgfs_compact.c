@@ -0,0 +1,191 @@
+#include "imgfs.h"
+#include "journal.h"
+#include "segment.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+// a piece of content of the series, and the slot that refers to it
+struct piece {
+    uint64_t* offset;     // in the metadata
+    uint32_t size;
+    uint32_t slot;
+    int resolution;
+};
+
+static int compare_offset(const void* a, const void* b)
+{
+    const uint64_t offset_a = *((const struct piece*) a)->offset;
+    const uint64_t offset_b = *((const struct piece*) b)->offset;
+    return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+static int compare_slot(const void* a, const void* b)
+{
+    const uint32_t slot_a = ((const struct piece*) a)->slot;
+    const uint32_t slot_b = ((const struct piece*) b)->slot;
+    return slot_a < slot_b ? -1 : slot_a > slot_b;
+}
+
+/*******************************************************************
+ * Copies a piece of content of a resolution to the active segment.
+ */
+static int move_content(struct imgfs_file* imgfs_file, const struct piece* piece,
+                        char** buffer, uint32_t* capacity, uint64_t* to)
+{
+    if (piece->size > *capacity) {
+        char* grown = realloc(*buffer, piece->size);
+        if (grown == NULL) return ERR_OUT_OF_MEMORY;
+        *buffer = grown;
+        *capacity = piece->size;
+    }
+
+    const int err = imgfs_content_pread(imgfs_file, piece->resolution, *buffer, piece->size,
+                                        *piece->offset);
+    return err != ERR_NONE ? err
+           : imgfs_content_append(imgfs_file, piece->resolution, *buffer, piece->size, to);
+}
+
+/*******************************************************************
+ * Moves out what is referenced in a segment, then drops it.
+ *
+ * The pieces of the segment come sorted by offset: the content shared
+ * by several images (deduplicated) is next to each other and copied
+ * once. Sorted by slot, they then tell which slots to rewrite, each once.
+ */
+static int compact_segment(struct imgfs_file* imgfs_file, int stream, uint32_t segment,
+                           struct piece* pieces, size_t count)
+{
+    char* buffer = NULL;
+    uint32_t capacity = 0;
+    uint64_t from = 0;
+    uint64_t to = 0;
+    int err = ERR_NONE;
+
+    for (size_t p = 0; p < count && err == ERR_NONE; ++p) {
+        if (p == 0 || *pieces[p].offset != from) {
+            from = *pieces[p].offset;
+            err = move_content(imgfs_file, &pieces[p], &buffer, &capacity, &to);
+        }
+        if (err == ERR_NONE) *pieces[p].offset = to;
+    }
+    free(buffer);
+
+    if (err == ERR_NONE && count > 0) qsort(pieces, count, sizeof(struct piece), compare_slot);
+    for (size_t p = 0; p < count && err == ERR_NONE; ++p) {
+        if (p > 0 && pieces[p - 1].slot == pieces[p].slot) continue;
+        err = write_metadata(imgfs_file, pieces[p].slot, 0);
+    }
+
+    // the copies and the metadata referring to them are durable before the segment goes
+    if (err == ERR_NONE) err = journal_commit(imgfs_file);
+    if (err == ERR_NONE) err = imgfs_sync(imgfs_file);
+    if (err == ERR_NONE) err = segments_drop(imgfs_file, stream, segment);
+    return err;
+}
+
+/*******************************************************************
+ * Collects, in one pass over the metadata, the pieces of a series in
+ * the segments before active, and what is live in each of them.
+ * (content shared by several images is counted for each of them)
+ */
+static int collect_pieces(struct imgfs_file* imgfs_file, int stream, uint32_t active,
+                          uint64_t* live, struct piece** pieces, size_t* count)
+{
+    size_t capacity = 0;
+    *pieces = NULL;
+    *count = 0;
+
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        struct img_metadata* image = &imgfs_file->metadata[i];
+        if (image->is_valid == EMPTY) continue;
+
+        for (int res = 0; res < NB_RES; ++res) {
+            const uint32_t segment = SEGMENT_OF(image->offset[res]);
+            if (image->offset[res] == 0 || segment >= active
+                || segment_stream(&imgfs_file->header, res) != stream) {
+                continue;
+            }
+            live[segment] += image->size[res];
+
+            if (*count == capacity) {
+                capacity = capacity == 0 ? 16 : 2 * capacity;
+                struct piece* grown = realloc(*pieces, capacity * sizeof(struct piece));
+                if (grown == NULL) return ERR_OUT_OF_MEMORY;
+                *pieces = grown;
+            }
+            (*pieces)[(*count)++] = (struct piece) { &image->offset[res], image->size[res], i, res };
+        }
+    }
+
+    // the segment is in the high bits: sorted by segment, then in file order
+    if (*count > 0) qsort(*pieces, *count, sizeof(struct piece), compare_offset);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Compacts the segments of one series.
+ */
+static int compact_stream(struct imgfs_file* imgfs_file, int stream, unsigned max_live_percent,
+                          uint32_t* dropped)
+{
+    // the segments filled by the copies are not compacted in the same pass
+    const uint32_t active = imgfs_file->segments->active[stream];
+    if (active == 0) return ERR_NONE;
+
+    uint64_t* live = calloc(active, sizeof(uint64_t));
+    if (live == NULL) return ERR_OUT_OF_MEMORY;
+
+    struct piece* pieces = NULL;
+    size_t count = 0;
+    int err = collect_pieces(imgfs_file, stream, active, live, &pieces, &count);
+
+    size_t first = 0; // of the pieces of the segment
+    for (uint32_t segment = 0; segment < active && err == ERR_NONE; ++segment) {
+        size_t last = first;
+        while (last < count && SEGMENT_OF(*pieces[last].offset) == segment) ++last;
+
+        char* path = segment_path(imgfs_file, stream, segment);
+        if (path == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+            break;
+        }
+        struct stat st;
+        const int exists = stat(path, &st) == 0;
+        free(path);
+
+        const uint64_t content = exists && (uint64_t) st.st_size > sizeof(struct imgfs_header)
+                                 ? (uint64_t) st.st_size - sizeof(struct imgfs_header) : 0;
+        // not already dropped, and mostly dead
+        if (exists && live[segment] * 100 <= (uint64_t) max_live_percent * content) {
+            err = compact_segment(imgfs_file, stream, segment, pieces + first, last - first);
+            if (err == ERR_NONE && dropped != NULL) ++*dropped;
+        }
+        first = last;
+    }
+
+    free(pieces);
+    free(live);
+    return err;
+}
+
+/*******************************************************************
+ * Compacts the segments of an imgFS.
+ */
+int do_compact(struct imgfs_file* imgfs_file, unsigned max_live_percent, uint32_t* dropped)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    if (imgfs_file->segments == NULL || max_live_percent > 100) return ERR_INVALID_ARGUMENT;
+    if (dropped != NULL) *dropped = 0;
+
+    int err = ERR_NONE;
+    for (int stream = 0; stream < imgfs_file->segments->nb_streams && err == ERR_NONE; ++stream) {
+        err = compact_stream(imgfs_file, stream, max_live_percent, dropped);
+    }
+    return err;
+}
@@ -1,4 +1,5 @@
 #include "imgfs.h"
+#include "segment.h"
 #include "util.h"
 #include <stdio.h>
 #include <string.h>
@@ -14,30 +15,47 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
     M_REQUIRE_NON_NULL(imgfs_filename);
     M_REQUIRE_NON_NULL(imgfs_file);
 
+    // segments are not opened with O_DIRECT
+    if ((imgfs_file->header.flags & IMGFS_FLAG_SEGMENTS)
+        && (imgfs_file->header.flags & IMGFS_FLAG_DIRECT_ORIG)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
     strncpy(imgfs_file->header.name, CAT_TXT, MAX_IMGFS_NAME);
     imgfs_file->header.version = 0;
     imgfs_file->header.nb_files = 0;
 
     size_t max_files = imgfs_file->header.max_files;
 
+    imgfs_file->journal = NULL;
+    imgfs_file->direct_fd = -1;
+    for (int res = 0; res < NB_RES; ++res) imgfs_file->extent_fd[res] = -1;
+    imgfs_file->segments = NULL;
     imgfs_file->metadata = calloc(max_files, sizeof(struct img_metadata));
 
     if (imgfs_file->metadata == NULL) return ERR_OUT_OF_MEMORY;
 
-    FILE* file = fopen(imgfs_filename, "wb");
+    int err = metadata_view_build(imgfs_file);
+    if (err != ERR_NONE) return err;
 
-    if (file == NULL) return ERR_IO;
+    imgfs_file->file = fopen(imgfs_filename, "wb");
 
-    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, file) != 1) {
-        return ERR_IO;
-    }
+    if (imgfs_file->file == NULL) return ERR_IO;
+    // all I/O is positional, on the descriptor
+    setvbuf(imgfs_file->file, NULL, _IONBF, 0);
 
-    if (fwrite(imgfs_file->metadata, sizeof(struct img_metadata), max_files, file)
-        != max_files) {
-        return ERR_IO;
-    }
+    err = imgfs_pwrite(imgfs_file, &imgfs_file->header, sizeof(struct imgfs_header), 0);
+    if (err != ERR_NONE) return err;
+
+    err = imgfs_pwrite(imgfs_file, imgfs_file->metadata, max_files * sizeof(struct img_metadata),
+                       sizeof(struct imgfs_header));
+    if (err != ERR_NONE) return err;
+
+    err = imgfs_open_extents(imgfs_file, imgfs_filename, "wb");
+    if (err != ERR_NONE) return err;
 
-    imgfs_file->file = file;
+    err = segments_open(imgfs_file, imgfs_filename, "wb");
+    if (err != ERR_NONE) return err;
 
     printf("%d item(s) written\n", imgfs_file->header.max_files + 1);
 
@@ -0,0 +1,237 @@
+#include "imgfs.h"
+#include "journal.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define COPY_CHUNK_SIZE 65536
+
+// a piece of content in the way of the new table, and what refers to it
+struct displaced {
+    uint64_t* offset;     // in the metadata or in a record
+    uint64_t size;
+    uint64_t alignment;
+    uint32_t slot;
+};
+
+struct relocations {
+    uint64_t append_at;   // where the next piece goes
+    char* buffer;         // COPY_CHUNK_SIZE bytes
+};
+
+/*******************************************************************
+ * Copies size bytes of the file from one offset to another.
+ */
+static int copy_content(const struct imgfs_file* imgfs_file, uint64_t from, uint64_t to,
+                        uint64_t size, char* buffer)
+{
+    int err = ERR_NONE;
+    for (uint64_t done = 0; done < size && err == ERR_NONE; ) {
+        const size_t n = (size_t) (size - done < COPY_CHUNK_SIZE ? size - done : COPY_CHUNK_SIZE);
+        err = imgfs_pread(imgfs_file, buffer, n, from + done);
+        if (err == ERR_NONE) err = imgfs_pwrite(imgfs_file, buffer, n, to + done);
+        done += n;
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Moves the content at offset to the end of the file (aligned).
+ */
+static int relocate(const struct imgfs_file* imgfs_file, struct relocations* relocations,
+                    uint64_t offset, uint64_t size, uint64_t alignment, uint64_t* to)
+{
+    *to = (relocations->append_at + alignment - 1) & ~(alignment - 1);
+    const int err = copy_content(imgfs_file, offset, *to, size, relocations->buffer);
+    if (err == ERR_NONE) relocations->append_at = *to + size;
+    return err;
+}
+
+static int compare_displaced(const void* a, const void* b)
+{
+    const uint64_t offset_a = *((const struct displaced*) a)->offset;
+    const uint64_t offset_b = *((const struct displaced*) b)->offset;
+    return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+static int compare_slot(const void* a, const void* b)
+{
+    const uint32_t slot_a = ((const struct displaced*) a)->slot;
+    const uint32_t slot_b = ((const struct displaced*) b)->slot;
+    return slot_a < slot_b ? -1 : slot_a > slot_b;
+}
+
+/*******************************************************************
+ * Moves out of [.., new_end) all the content referenced by the table,
+ * and rewrites the slots that reference it.
+ *
+ * One pass over the table collects the displaced pieces; sorted by
+ * offset, the pieces shared by several images (deduplicated) are next
+ * to each other and copied once, in file order. Sorted by slot, they
+ * then tell which slots to rewrite, each once.
+ */
+static int move_content(struct imgfs_file* imgfs_file, struct img_record* records,
+                        uint64_t new_end, struct relocations* relocations)
+{
+    const uint32_t max_files = imgfs_file->header.max_files;
+
+    // originals stay aligned, see IMGFS_FLAG_DIRECT_ORIG
+    const uint64_t orig_alignment = (imgfs_file->header.flags & IMGFS_FLAG_DIRECT_ORIG)
+                                    ? DIRECT_ALIGNMENT : 1;
+    // content in extent files or segments is not in the way
+    const int nb_res_here = (imgfs_file->header.flags
+                             & (IMGFS_FLAG_EXTENT_FILES | IMGFS_FLAG_SEGMENTS)) ? 0 : NB_RES;
+
+    struct displaced* pieces = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    int err = ERR_NONE;
+
+    for (uint32_t i = 0; i < max_files && err == ERR_NONE; ++i) {
+        struct img_metadata* image = &imgfs_file->metadata[i];
+        if (image->is_valid == EMPTY) continue;
+
+        for (int res = 0; res <= NB_RES; ++res) {
+            struct displaced piece = { NULL, 0, 1, i };
+            if (res < nb_res_here && image->offset[res] != 0 && image->offset[res] < new_end) {
+                piece.offset = &image->offset[res];
+                piece.size = image->size[res];
+                if (res == ORIG_RES) piece.alignment = orig_alignment;
+            } else if (res == NB_RES && records != NULL && records[i].id_offset < new_end) {
+                piece.offset = &records[i].id_offset;
+                piece.size = IMG_ID_ENTRY_SIZE;
+            } else {
+                continue;
+            }
+
+            if (count == capacity) {
+                capacity = capacity == 0 ? 16 : 2 * capacity;
+                struct displaced* grown = realloc(pieces, capacity * sizeof(struct displaced));
+                if (grown == NULL) {
+                    err = ERR_OUT_OF_MEMORY;
+                    break;
+                }
+                pieces = grown;
+            }
+            pieces[count++] = piece;
+        }
+    }
+
+    if (err == ERR_NONE && count > 0) qsort(pieces, count, sizeof(struct displaced), compare_displaced);
+
+    uint64_t from = 0;
+    uint64_t to = 0;
+    for (size_t p = 0; p < count && err == ERR_NONE; ++p) {
+        if (p == 0 || *pieces[p].offset != from) {
+            from = *pieces[p].offset;
+            err = relocate(imgfs_file, relocations, from, pieces[p].size, pieces[p].alignment, &to);
+        }
+        if (err == ERR_NONE) *pieces[p].offset = to;
+    }
+
+    // the copies are complete (and synced by the commit) before anything points to them
+    if (err == ERR_NONE && count > 0) qsort(pieces, count, sizeof(struct displaced), compare_slot);
+    for (size_t p = 0; p < count && err == ERR_NONE; ++p) {
+        const uint32_t i = pieces[p].slot;
+        if (p > 0 && pieces[p - 1].slot == i) continue;
+
+        if (records == NULL) {
+            err = write_metadata(imgfs_file, i, 0);
+        } else {
+            memcpy(records[i].offset, imgfs_file->metadata[i].offset, sizeof(records[i].offset));
+            err = imgfs_write_at(imgfs_file, (uint64_t) metadata_position(&imgfs_file->header, i),
+                                 &records[i], sizeof(struct img_record));
+        }
+    }
+    // the old copies are cleared next: nothing may refer to them anymore
+    if (err == ERR_NONE) err = journal_commit(imgfs_file);
+
+    free(pieces);
+    return err;
+}
+
+/*******************************************************************
+ * Clears the new slots, [old_end, new_end) of the file.
+ */
+static int clear_slots(const struct imgfs_file* imgfs_file, uint64_t old_end, uint64_t new_end,
+                       char* buffer)
+{
+    memset(buffer, 0, COPY_CHUNK_SIZE);
+
+    int err = ERR_NONE;
+    for (uint64_t at = old_end; at < new_end && err == ERR_NONE; ) {
+        const size_t n = (size_t) (new_end - at < COPY_CHUNK_SIZE ? new_end - at : COPY_CHUNK_SIZE);
+        err = imgfs_pwrite(imgfs_file, buffer, n, at);
+        at += n;
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Raises the capacity of an imgFS.
+ */
+int do_grow(struct imgfs_file* imgfs_file, uint32_t new_max_files)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    const uint32_t old_max_files = imgfs_file->header.max_files;
+    if (new_max_files <= old_max_files) return ERR_MAX_FILES;
+
+    const uint64_t old_end = (uint64_t) metadata_position(&imgfs_file->header, old_max_files);
+    const uint64_t new_end = (uint64_t) metadata_position(&imgfs_file->header, new_max_files);
+
+    // in memory first, so that nothing is written if it fails;
+    // the view, which followed the metadata, is rebuilt at the end
+    struct img_metadata* metadata = realloc(imgfs_file->metadata,
+                                            new_max_files * sizeof(struct img_metadata));
+    if (metadata == NULL) return ERR_OUT_OF_MEMORY;
+    memset(metadata + old_max_files, 0,
+           (new_max_files - old_max_files) * sizeof(struct img_metadata));
+    imgfs_file->metadata = metadata;
+    memset(&imgfs_file->view, 0, sizeof(imgfs_file->view));
+
+    struct relocations relocations = { 0, NULL };
+    struct img_record* records = NULL;
+    int err = ERR_NONE;
+
+    relocations.buffer = malloc(COPY_CHUNK_SIZE);
+    if (relocations.buffer == NULL) err = ERR_OUT_OF_MEMORY;
+
+    // in format v2, the records tell where the SHA and IDs are
+    if (err == ERR_NONE && imgfs_format(&imgfs_file->header) == IMGFS_FORMAT_V2) {
+        records = calloc(old_max_files, sizeof(struct img_record));
+        if (records == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else {
+            err = imgfs_pread(imgfs_file, records, old_max_files * sizeof(struct img_record),
+                              (uint64_t) metadata_position(&imgfs_file->header, 0));
+        }
+    }
+
+    // copies go after both the current content and the new table
+    if (err == ERR_NONE) {
+        uint64_t end = 0;
+        err = imgfs_size(imgfs_file, &end);
+        relocations.append_at = end > new_end ? end : new_end;
+    }
+
+    if (err == ERR_NONE) err = move_content(imgfs_file, records, new_end, &relocations);
+    if (err == ERR_NONE) err = clear_slots(imgfs_file, old_end, new_end, relocations.buffer);
+
+    // the header makes the new slots visible
+    if (err == ERR_NONE) {
+        imgfs_file->header.max_files = new_max_files;
+        err = write_header(imgfs_file);
+        if (err == ERR_NONE) err = journal_commit(imgfs_file);
+        if (err != ERR_NONE) imgfs_file->header.max_files = old_max_files;
+    }
+
+    free(records);
+    free(relocations.buffer);
+
+    const int view_err = metadata_view_build(imgfs_file);
+    return err != ERR_NONE ? err : view_err;
+}
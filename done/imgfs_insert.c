@@ -14,8 +14,11 @@ int do_insert(const char *image_buffer, size_t image_size,
 
     if (imgfs_file->header.nb_files >= imgfs_file->header.max_files) return ERR_IMGFS_FULL;
 
-    uint32_t i = 0;
-    while(imgfs_file->metadata[i].is_valid == NON_EMPTY) i++;
+    uint32_t i = metadata_view_next_free(imgfs_file, 0);
+    while (i < imgfs_file->header.max_files && imgfs_file->metadata[i].is_valid == NON_EMPTY) {
+        i = metadata_view_next_free(imgfs_file, i + 1);
+    }
+    if (i >= imgfs_file->header.max_files) return ERR_IMGFS_FULL;
 
 
     imgfs_file->metadata[i].offset[THUMB_RES] = 0;
@@ -46,36 +49,26 @@ int do_insert(const char *image_buffer, size_t image_size,
 
     err = do_name_and_content_dedup(imgfs_file, i);
 
-    if (err != ERR_NONE) return err;
+    if (err != ERR_NONE) {
+        // the slot stays free
+        imgfs_file->metadata[i].is_valid = EMPTY;
+        return err;
+    }
 
     if (imgfs_file->metadata[i].offset[ORIG_RES] == 0) {
-
-        if (fseek(imgfs_file->file, 0, SEEK_END) != 0) return ERR_IO;
-
-        imgfs_file->metadata[i].offset[ORIG_RES] = (uint64_t) ftell(imgfs_file->file);
-
-        if (fwrite(image_buffer, image_size, 1, imgfs_file->file) != 1) {
-            return ERR_IO;
-        }
+        err = imgfs_content_append(imgfs_file, ORIG_RES, image_buffer, image_size,
+                                   &imgfs_file->metadata[i].offset[ORIG_RES]);
+        if (err != ERR_NONE) return err;
     }
 
     imgfs_file->header.nb_files++;
     imgfs_file->header.version++;
 
-    if (fseek(imgfs_file->file, 0, SEEK_SET) != 0) return ERR_IO;
-
-    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
-    }
-
-    if (fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header) +
-                                        i * sizeof(struct img_metadata)), SEEK_SET) != ERR_NONE) {
-        return ERR_IO;
-    }
+    err = write_header(imgfs_file);
+    if (err != ERR_NONE) return err;
 
-    if (fwrite(&imgfs_file->metadata[i], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
-    }
+    err = write_metadata(imgfs_file, i, 1);
+    if (err != ERR_NONE) return err;
 
-    return ERR_NONE;
+    return imgfs_end_update(imgfs_file);
 }
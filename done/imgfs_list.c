@@ -1,9 +1,134 @@
 #include "imgfs.h"
+#include "json_writer.h"
 #include "util.h"
 #include <stdio.h>
-#include <json-c/json.h>
 #include <string.h>
 
+/*******************************************************************
+ * Writes the JSON description of one image for a listing.
+ */
+static int write_image(struct json_writer* writer, const struct img_metadata* image,
+                       unsigned fields)
+{
+    if (fields == 0) return json_string(writer, image->img_id);
+
+    json_begin_object(writer);
+    json_key(writer, "img_id");
+    json_string(writer, image->img_id);
+
+    if (fields & LIST_FIELD_SIZE) {
+        json_key(writer, "size");
+        json_begin_array(writer);
+        for (int res = 0; res < NB_RES; ++res) {
+            json_uint(writer, image->size[res]);
+        }
+        json_end_array(writer);
+    }
+    if (fields & LIST_FIELD_RESOLUTION) {
+        json_key(writer, "resolution");
+        json_begin_array(writer);
+        json_uint(writer, image->orig_res[0]);
+        json_uint(writer, image->orig_res[1]);
+        json_end_array(writer);
+    }
+    if (fields & LIST_FIELD_SHA) {
+        char sha_string[2 * SHA256_DIGEST_LENGTH + 1];
+        sha_to_string(image->SHA, sha_string);
+        json_key(writer, "SHA");
+        json_string(writer, sha_string);
+    }
+    return json_end_object(writer);
+}
+
+/*******************************************************************
+ * Writes the images of a page, inside an array opened by the caller.
+ */
+int do_list_images(const struct imgfs_file* imgfs_file, const struct list_query* query,
+                   struct json_writer* writer, uint32_t* slots, struct list_page* page)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(query);
+    M_REQUIRE_NON_NULL(page);
+
+    const size_t prefix_len = query->prefix == NULL ? 0 : strlen(query->prefix);
+    if (slots != NULL && query->limit == 0) return ERR_INVALID_ARGUMENT;
+    memset(page, 0, sizeof(*page));
+
+    if (imgfs_file->header.nb_files == 0 || imgfs_file->metadata == NULL) return ERR_NONE;
+
+    // from the first slot on, the scan can stop after the last valid image
+    const uint32_t to_see = query->start == 0 ? imgfs_file->header.nb_files : UINT32_MAX;
+    uint32_t seen = 0;
+    const uint32_t max_files = imgfs_file->header.max_files;
+    for (uint32_t i = metadata_view_next_valid(imgfs_file, query->start);
+         i < max_files && seen < to_see; i = metadata_view_next_valid(imgfs_file, i + 1)) {
+        const struct img_metadata* image = &imgfs_file->metadata[i];
+        if (image->is_valid) ++seen;
+        if (image->is_valid
+            && (prefix_len == 0 || strncmp(image->img_id, query->prefix, prefix_len) == 0)) {
+            if (query->limit > 0 && page->listed == query->limit) {
+                // there is at least one more image
+                page->has_next = 1;
+                break;
+            }
+            if (writer != NULL) {
+                const int err = write_image(writer, image, query->fields);
+                if (err != ERR_NONE) return err;
+            }
+            if (slots != NULL) slots[page->listed] = i;
+            page->last = i;
+            ++page->listed;
+        }
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Streams a page of the imgFS content in JSON format.
+ */
+int do_list_json(const struct imgfs_file* imgfs_file,
+                 const struct list_query* query, struct json_writer* writer)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(query);
+    M_REQUIRE_NON_NULL(writer);
+
+    json_begin_object(writer);
+    json_key(writer, "Images");
+    json_begin_array(writer);
+
+    struct list_page page;
+    const int err = do_list_images(imgfs_file, query, writer, NULL, &page);
+    if (err != ERR_NONE) return err;
+
+    json_end_array(writer);
+    if (page.has_next) {
+        // the next page starts after the last image listed
+        json_key(writer, "next");
+        json_uint(writer, page.last);
+    }
+    return json_end_object(writer);
+}
+
+/*******************************************************************
+ * Lists a page of the imgFS content in JSON format.
+ */
+int do_list_query(const struct imgfs_file* imgfs_file,
+                  const struct list_query* query, char** json)
+{
+    M_REQUIRE_NON_NULL(json);
+
+    struct json_writer writer;
+    json_writer_init(&writer, NULL, NULL);
+
+    const int err = do_list_json(imgfs_file, query, &writer);
+    if (err != ERR_NONE) {
+        json_writer_free(&writer);
+        return err;
+    }
+    return json_writer_finish(&writer, json, NULL);
+}
+
 /*******************************************************************
  * Displays (on stdout) imgFS metadata.
  */
@@ -32,30 +157,10 @@ int do_list(const struct imgfs_file* imgfs_file,
             printf("<< empty imgFS >>\n");
         }
         return ERR_NONE;
-    case JSON:
-        if (imgfs_file->header.nb_files > 0) {
-            json_object* jobj = json_object_new_object();
-            json_object* jarray = json_object_new_array();
-            size_t files_read = 0;
-            size_t i = 0;
-            while (i < imgfs_file->header.max_files
-                   && files_read < imgfs_file->header.nb_files) {
-                if (imgfs_file->metadata[i].is_valid) {
-                    json_object_array_add(jarray, json_object_new_string(imgfs_file->metadata[i].img_id));
-                    ++files_read;
-                }
-                ++i;
-            }
-            json_object_object_add(jobj, "Images", jarray);
-            *json = strdup(json_object_to_json_string(jobj));
-            json_object_put(jobj);
-        } else {
-            json_object* jobj = json_object_new_object();
-            json_object_object_add(jobj, "Images", json_object_new_array());
-            *json = strdup(json_object_to_json_string(jobj));
-            json_object_put(jobj);
-        }
-        return ERR_NONE;
+    case JSON: {
+        const struct list_query all = { 0, 0, NULL, 0 };
+        return do_list_query(imgfs_file, &all, json);
+    }
     default:
         return ERR_DEBUG;
     }
@@ -8,6 +8,13 @@
 
 int do_read(const char *img_id, int resolution, char **image_buffer,
             uint32_t *image_size, struct imgfs_file *imgfs_file)
+{
+    return do_read_range(img_id, resolution, 0, UINT32_MAX,
+                         image_buffer, image_size, imgfs_file);
+}
+
+int do_read_range(const char *img_id, int resolution, uint32_t start, uint32_t length,
+                  char **image_buffer, uint32_t *image_size, struct imgfs_file *imgfs_file)
 {
     M_REQUIRE_NON_NULL(img_id);
     M_REQUIRE_NON_NULL(image_buffer);
@@ -15,34 +22,102 @@ int do_read(const char *img_id, int resolution, char **image_buffer,
     M_REQUIRE_NON_NULL(imgfs_file);
 
     uint32_t i = 0;
-    while(i < imgfs_file->header.max_files
-          && strcmp(img_id, imgfs_file->metadata[i].img_id) != 0) i++;
-
-    if (imgfs_file->header.nb_files == 0
-        || i == imgfs_file->header.max_files
-        || imgfs_file->metadata[i].is_valid == EMPTY) return ERR_IMAGE_NOT_FOUND;
+    int err = find_image_index(img_id, imgfs_file, &i);
+    if (err != ERR_NONE) return err;
 
     if (resolution < THUMB_RES || resolution > ORIG_RES) return ERR_RESOLUTIONS;
 
     if ((resolution == THUMB_RES || resolution == SMALL_RES) &&
         (imgfs_file->metadata[i].offset[resolution] == 0)) {
-        int err = lazily_resize(resolution, imgfs_file, i);
+        err = lazily_resize(resolution, imgfs_file, i);
         if (err != ERR_NONE) return err;
     }
 
-    if (fseek(imgfs_file->file, (long) imgfs_file->metadata[i].offset[resolution], SEEK_SET) != 0) {
-        return ERR_IO;
-    }
+    const uint32_t size = imgfs_file->metadata[i].size[resolution];
+
+    if (start > 0 && start >= size) return ERR_INVALID_ARGUMENT;
+
+    const uint32_t to_read = MIN(length, size - start);
 
-    *image_buffer = calloc(1, imgfs_file->metadata[i].size[resolution]);
+    *image_buffer = calloc(1, to_read);
 
     if (*image_buffer == NULL) return ERR_OUT_OF_MEMORY;
 
-    if (fread(*image_buffer, imgfs_file->metadata[i].size[resolution], 1, imgfs_file->file) != 1) {
-        return ERR_IO;
+    err = imgfs_content_pread(imgfs_file, resolution, *image_buffer, to_read,
+                              imgfs_file->metadata[i].offset[resolution] + start);
+    if (err != ERR_NONE) {
+        free(*image_buffer);
+        *image_buffer = NULL;
+        return err;
     }
 
-    *image_size = imgfs_file->metadata[i].size[resolution];
+    *image_size = to_read;
+
+    return ERR_NONE;
+}
+
+int do_read_batch(struct batch_image* images, size_t n, int resolution,
+                  struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    if (n > 0) M_REQUIRE_NON_NULL(images);
+
+    if (resolution < THUMB_RES || resolution > ORIG_RES) return ERR_RESOLUTIONS;
+
+    struct content_read* reads = calloc(n, sizeof(struct content_read));
+    size_t* owners = calloc(n, sizeof(size_t));
+    if (n > 0 && (reads == NULL || owners == NULL)) {
+        free(reads);
+        free(owners);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // resolves all the IDs (and resizes) before reading anything
+    size_t nb_reads = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct batch_image* image = &images[i];
+        image->data = NULL;
+        image->size = 0;
+        image->err = ERR_INVALID_ARGUMENT;
+        if (image->img_id == NULL) continue;
+
+        uint32_t index = 0;
+        image->err = find_image_index(image->img_id, imgfs_file, &index);
+        if (image->err != ERR_NONE) continue;
+
+        if (resolution != ORIG_RES && imgfs_file->metadata[index].offset[resolution] == 0) {
+            image->err = lazily_resize(resolution, imgfs_file, index);
+            if (image->err != ERR_NONE) continue;
+        }
+
+        const struct img_metadata* metadata = &imgfs_file->metadata[index];
+        image->data = calloc(1, metadata->size[resolution]);
+        if (image->data == NULL) {
+            image->err = ERR_OUT_OF_MEMORY;
+            continue;
+        }
+        image->size = metadata->size[resolution];
+
+        struct content_read* read = &reads[nb_reads];
+        read->resolution = resolution;
+        read->offset = metadata->offset[resolution];
+        read->data = image->data;
+        read->size = image->size;
+        owners[nb_reads++] = i;
+    }
+
+    const int err = imgfs_content_preadv(imgfs_file, reads, nb_reads);
+    for (size_t j = 0; j < nb_reads; ++j) {
+        struct batch_image* image = &images[owners[j]];
+        image->err = err != ERR_NONE ? err : reads[j].err;
+        if (image->err != ERR_NONE) {
+            free(image->data);
+            image->data = NULL;
+            image->size = 0;
+        }
+    }
 
+    free(reads);
+    free(owners);
     return ERR_NONE;
 }
@@ -8,32 +8,316 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h> // isalnum
 #include <stdint.h> // uint16_t
+#include <inttypes.h> // PRIu32, PRIu64
 #include <pthread.h>
 #include <vips/vips.h>
 
 #include "error.h"
 #include "util.h" // atouint16
 #include "imgfs.h"
+#include "image_content.h"
 #include "http_net.h"
+#include "http_compress.h"
+#include "json_writer.h"
 #include "imgfs_server_service.h"
 #include "http_prot.h"
+#include "durability.h"
+#include "io_engine.h"
+#include "shard_ring.h"
+#include "metrics.h"
+#include "trace.h"
 
 
 #define MAX_CHARACTERE_RES 5
 
-// Main in-memory structure for imgFS
-static struct imgfs_file fs_file;
-static uint16_t server_port;
+// Validators for /imgfs/read: images may be revalidated (e.g. after an ID is reused)
+#define CACHE_CONTROL "public, no-cache"
+#define ETAG_SIZE (2 * SHA256_DIGEST_LENGTH + MAX_CHARACTERE_RES + 4)
+#define READ_HEADERS_SIZE (ETAG_SIZE + 256)
+
+// /imgfs/batch_read: parts of a multipart/mixed body
+#define MAX_BATCH_IDS 64
+#define BATCH_BOUNDARY "imgfs-batch-5f0c2a9e71d84b36"
+#define PART_HEADERS_SIZE (MAX_IMG_ID + 160)
+
+// /imgfs/list: pages (paged or filtered listings) are streamed
+#define MAX_LIST_LIMIT 1000 // images per page, and default page size
+#define LIST_BATCH_SIZE 256 // images listed per hold of a shard lock
+
+// /imgfs/sprite: sheets of thumbnails
+#define MAX_SPRITE_IMAGES 100
+#define DEFAULT_SPRITE_COLUMNS 10
+#define SPRITE_CACHE_SIZE 8
+
+#define STORE_SEPARATOR ";"
+#define SHARD_SEPARATOR ","
+#define MAX_STORE_NAME 32
+
+/*
+ * A store serves one imgFS per shard, each with its own lock, durability
+ * (group commits) and in-memory structure (metadata index, append point):
+ * requests to different shards never wait for each other. Image IDs are
+ * routed to shards by consistent hashing. In listings, the slots of the
+ * shards are numbered one after the other (those of a shard start at its
+ * first_slot), so that a cursor designates a shard and a slot in it.
+ */
+struct shard {
+    struct imgfs_file fs_file;
+    pthread_mutex_t mutex;       // protects fs_file
+    struct durability durability;
+    uint32_t first_slot;
+};
+
+/*
+ * Cache of the JSON listing (of all shards), one entry per content coding.
+ * An entry stays valid as long as the list_generation of its store (bumped
+ * by every insert and delete, on any shard) does not change. Protected by
+ * list_mutex, taken before the shard locks.
+ */
+struct list_cache_entry {
+    int valid;
+    uint64_t generation;
+    char* body;
+    size_t len;
+};
+
+/*
+ * Cache of the sprite sheets (and their maps) of a store, by query; an
+ * entry is valid for the list_generation it was built at. Protected by
+ * sprite_mutex, which is not held while building (nor with shard locks).
+ */
+struct sprite_cache_entry {
+    char* query;                 // NULL if the entry is free
+    uint64_t generation;
+    char* jpeg;                  // NULL if no image could be read
+    size_t jpeg_size;
+    char* map;
+    size_t map_len;
+};
+
+/*
+ * The stores of the server are mounted under URI_ROOT "/<name>" (the first
+ * one also right under URI_ROOT). They share the connection threads and the
+ * I/O engine; max_requests caps the requests a store serves at once, so that
+ * a busy store cannot hold all the threads on its locks.
+ */
+struct store {
+    char name[MAX_STORE_NAME + 1];
+    struct shard* shards;
+    uint32_t nb_shards;
+    uint32_t nb_started;         // shards whose durability is started
+    struct shard_ring ring;
+    unsigned max_requests;       // 0 for no limit
+    unsigned requests;           // being served (atomic)
+
+    struct list_cache_entry list_cache[NB_HTTP_ENCODINGS];
+    pthread_mutex_t list_mutex;
+    uint64_t list_generation;    // atomic
 
-// Global variables
-pthread_mutex_t mutex;
+    struct sprite_cache_entry sprite_cache[SPRITE_CACHE_SIZE];
+    size_t sprite_victim;        // round-robin replacement
+    pthread_mutex_t sprite_mutex;
+};
+
+static struct store* stores;
+static uint32_t nb_stores;
+static uint16_t server_port;
+static struct io_engine io_engine;
+static int with_io_engine;
 
 #define URI_ROOT "/imgfs"
 
+/********************************************************************//**
+ * Releases a store.
+ ********************************************************************** */
+static void close_store(struct store* store)
+{
+    for (uint32_t i = 0; i < store->nb_shards; ++i) {
+        if (i < store->nb_started) durability_stop(&store->shards[i].durability);
+        do_close(&store->shards[i].fs_file);
+        pthread_mutex_destroy(&store->shards[i].mutex);
+    }
+    free(store->shards);
+    store->shards = NULL;
+    store->nb_shards = 0;
+    store->nb_started = 0;
+    shard_ring_free(&store->ring);
+
+    for (size_t i = 0; i < NB_HTTP_ENCODINGS; ++i) {
+        free(store->list_cache[i].body);
+        store->list_cache[i].body = NULL;
+        store->list_cache[i].valid = 0;
+    }
+    pthread_mutex_destroy(&store->list_mutex);
+
+    for (size_t i = 0; i < SPRITE_CACHE_SIZE; ++i) {
+        free(store->sprite_cache[i].query);
+        free(store->sprite_cache[i].jpeg);
+        free(store->sprite_cache[i].map);
+    }
+    memset(store->sprite_cache, 0, sizeof(store->sprite_cache));
+    pthread_mutex_destroy(&store->sprite_mutex);
+}
+
+/********************************************************************//**
+ * Releases all the stores.
+ ********************************************************************** */
+static void close_stores(void)
+{
+    for (uint32_t i = 0; i < nb_stores; ++i) {
+        close_store(&stores[i]);
+    }
+    free(stores);
+    stores = NULL;
+    nb_stores = 0;
+}
+
+/********************************************************************//**
+ * Opens the imgFS of the shards of a store, given as a comma-separated
+ * list. The base names of the files place the shards on the ring.
+ ********************************************************************** */
+static int open_shards(struct store* store, char* filenames)
+{
+    uint32_t count = 1;
+    for (const char* c = filenames; *c != '\0'; ++c) {
+        if (*c == SHARD_SEPARATOR[0]) ++count;
+    }
+    if (count > MAX_SHARDS) return ERR_INVALID_ARGUMENT;
+
+    const char* paths[MAX_SHARDS];
+    const char* names[MAX_SHARDS];
+    uint32_t nb_names = 0;
+    char* saveptr = NULL;
+    for (char* filename = strtok_r(filenames, SHARD_SEPARATOR, &saveptr);
+         filename != NULL;
+         filename = strtok_r(NULL, SHARD_SEPARATOR, &saveptr)) {
+        const char* slash = strrchr(filename, '/');
+        paths[nb_names] = filename;
+        names[nb_names++] = slash != NULL ? slash + 1 : filename;
+    }
+    // empty names
+    if (nb_names != count) return ERR_INVALID_ARGUMENT;
+
+    int err = shard_ring_init(&store->ring, names, count);
+    if (err == ERR_NONE) {
+        store->shards = calloc(count, sizeof(struct shard));
+        if (store->shards == NULL) err = ERR_OUT_OF_MEMORY;
+    }
+
+    uint64_t slots = 0;
+    for (uint32_t i = 0; i < count && err == ERR_NONE; ++i) {
+        struct shard* shard = &store->shards[store->nb_shards];
+        if (pthread_mutex_init(&shard->mutex, NULL) != 0) {
+            err = ERR_RUNTIME;
+            break;
+        }
+        err = do_open(paths[i], "rb+", &shard->fs_file);
+        if (err != ERR_NONE) {
+            pthread_mutex_destroy(&shard->mutex);
+            break;
+        }
+        ++store->nb_shards;
+        print_header(&shard->fs_file.header);
+
+        shard->first_slot = (uint32_t) slots;
+        slots += shard->fs_file.header.max_files;
+        // listing cursors must fit
+        if (slots >= UINT32_MAX) err = ERR_INVALID_ARGUMENT;
+    }
+    return err;
+}
+
+/********************************************************************//**
+ * Reads the name and the limit of a store, "<name>[@<max_requests>]".
+ ********************************************************************** */
+static int parse_store_name(struct store* store, char* spec)
+{
+    char* at = strchr(spec, '@');
+    if (at != NULL) {
+        *at = '\0';
+        store->max_requests = atouint32(at + 1);
+        if (store->max_requests == 0) return ERR_INVALID_ARGUMENT;
+    }
+
+    const size_t len = strlen(spec);
+    if (len == 0 || len > MAX_STORE_NAME) return ERR_INVALID_ARGUMENT;
+    for (const char* c = spec; *c != '\0'; ++c) {
+        if (!isalnum((unsigned char) *c) && *c != '_' && *c != '-') return ERR_INVALID_ARGUMENT;
+    }
+    for (uint32_t i = 0; i < nb_stores; ++i) {
+        if (strcmp(stores[i].name, spec) == 0) return ERR_INVALID_ARGUMENT;
+    }
+    strcpy(store->name, spec);
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Opens the stores: either the shards of a single, unnamed store, or
+ * semicolon-separated "<name>[@<max_requests>]=<shards>".
+ ********************************************************************** */
+static int open_stores(const char* spec)
+{
+    char* list = strdup(spec);
+    if (list == NULL) return ERR_OUT_OF_MEMORY;
+
+    const int named = strchr(list, '=') != NULL;
+    uint32_t count = 1;
+    for (const char* c = list; named && *c != '\0'; ++c) {
+        if (*c == STORE_SEPARATOR[0]) ++count;
+    }
+
+    stores = calloc(count, sizeof(struct store));
+    if (stores == NULL) {
+        free(list);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int err = ERR_NONE;
+    char* saveptr = NULL;
+    for (char* store_spec = named ? strtok_r(list, STORE_SEPARATOR, &saveptr) : list;
+         store_spec != NULL && err == ERR_NONE;
+         store_spec = named ? strtok_r(NULL, STORE_SEPARATOR, &saveptr) : NULL) {
+        struct store* store = &stores[nb_stores];
+        char* filenames = store_spec;
+        if (named) {
+            filenames = strchr(store_spec, '=');
+            if (filenames == NULL) {
+                err = ERR_INVALID_ARGUMENT;
+                break;
+            }
+            *filenames++ = '\0';
+            err = parse_store_name(store, store_spec);
+            if (err != ERR_NONE) break;
+        }
+
+        if (pthread_mutex_init(&store->list_mutex, NULL) != 0) {
+            err = ERR_RUNTIME;
+            break;
+        }
+        if (pthread_mutex_init(&store->sprite_mutex, NULL) != 0) {
+            pthread_mutex_destroy(&store->list_mutex);
+            err = ERR_RUNTIME;
+            break;
+        }
+        ++nb_stores;
+        err = open_shards(store, filenames);
+    }
+    // empty specifications
+    if (err == ERR_NONE && nb_stores != count) err = ERR_INVALID_ARGUMENT;
+
+    free(list);
+    if (err != ERR_NONE) close_stores();
+    return err;
+}
+
 /********************************************************************//**
  * Startup function. Create imgFS file and load in-memory structure.
- * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2]
+ * Pass the imgFS file name as argv[1] (several, comma-separated, to serve
+ * one shard per file; or several stores, see open_stores()) and optionnaly
+ * port number as argv[2], durability mode as argv[3] and its interval
+ * (in ms) as argv[4]
  ********************************************************************** */
 int server_startup (int argc, char **argv)
 {
@@ -41,18 +325,12 @@ int server_startup (int argc, char **argv)
 
     if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
 
-    pthread_mutex_init(&mutex, NULL);
-
     M_REQUIRE_NON_NULL(argv[1]);
 
-    memset(&fs_file, 0, sizeof(struct imgfs_file));
-
-    int err = do_open(argv[1], "rb+", &fs_file);
+    int err = open_stores(argv[1]);
 
     if (err != ERR_NONE) return err;
 
-    print_header(&fs_file.header);
-
     if (argc > 2) {
         M_REQUIRE_NON_NULL(argv[2]);
         uint16_t potential_port = atouint16(argv[2]);
@@ -61,14 +339,65 @@ int server_startup (int argc, char **argv)
         server_port = DEFAULT_LISTENING_PORT;
     }
 
-    err = http_init(server_port, handle_http_message);
+    int mode = DURABILITY_REQUEST;
+    unsigned interval_ms = DEFAULT_DURABILITY_INTERVAL_MS;
+    if (argc > 3) {
+        mode = durability_parse(argv[3]);
+        if (mode < 0) {
+            close_stores();
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    if (argc > 4) {
+        M_REQUIRE_NON_NULL(argv[4]);
+        interval_ms = atouint32(argv[4]);
+        // (0 is also what atouint32() returns on garbage)
+        if (interval_ms == 0 && (strcmp(argv[4], "0") != 0 || mode == DURABILITY_PERIODIC)) {
+            close_stores();
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    unsigned trace_every = 0;
+    if (argc > 5) {
+        M_REQUIRE_NON_NULL(argv[5]);
+        trace_every = atouint32(argv[5]);
+    }
+    err = trace_init(trace_every);
+    if (err != ERR_NONE) {
+        close_stores();
+        return err;
+    }
 
-    fprintf(stderr, "ImgFS server started on http://localhost:%d\n", server_port);
+    for (uint32_t i = 0; i < nb_stores; ++i) {
+        struct store* store = &stores[i];
+        for (uint32_t j = 0; j < store->nb_shards; ++j) {
+            err = durability_start(&store->shards[j].durability, (enum durability_mode) mode,
+                                   interval_ms, &store->shards[j].fs_file, &store->shards[j].mutex);
+            if (err != ERR_NONE) {
+                close_stores();
+                trace_free();
+                return err;
+            }
+            ++store->nb_started;
+        }
+    }
 
-    if (pthread_mutex_init(&mutex, NULL) != 0) {
-        do_close(&fs_file);
-        return ERR_RUNTIME;
+    // content I/O through io_uring when available
+    with_io_engine = io_engine_init(&io_engine, IO_ENGINE_DEPTH) == ERR_NONE;
+    if (with_io_engine) imgfs_set_io_engine(&io_engine);
+
+    err = http_init(server_port, handle_http_message);
+
+    fprintf(stderr, "ImgFS server started on http://localhost:%d (durability: %s, %u ms; I/O: %s)\n",
+            server_port, durability_name((enum durability_mode) mode), interval_ms,
+            with_io_engine ? "io_uring" : "pread/pwrite");
+    for (uint32_t i = 0; i < nb_stores; ++i) {
+        fprintf(stderr, "  " URI_ROOT "%s%s: %u shard%s", stores[i].name[0] != '\0' ? "/" : "",
+                stores[i].name, stores[i].nb_shards, stores[i].nb_shards > 1 ? "s" : "");
+        if (stores[i].max_requests > 0) fprintf(stderr, ", at most %u requests", stores[i].max_requests);
+        fprintf(stderr, "\n");
     }
+    if (trace_every > 0) fprintf(stderr, "Tracing one request in %u (spans at /trace)\n", trace_every);
 
     return ERR_NONE;
 }
@@ -80,13 +409,64 @@ void server_shutdown (void)
 {
     fprintf(stderr, "Shutting down...\n");
     http_close();
-    do_close(&fs_file);
+    for (uint32_t i = 0; i < nb_stores; ++i) {
+        struct store* store = &stores[i];
+        for (uint32_t j = 0; j < store->nb_shards; ++j) {
+            if (nb_stores > 1 || store->nb_shards > 1) {
+                fprintf(stderr, "Store \"%s\", shard %u:\n", store->name, j);
+            }
+            durability_stop(&store->shards[j].durability);
+            durability_print_stats(stderr, &store->shards[j].durability);
+        }
+        store->nb_started = 0;
+    }
+    close_stores();
+
+    if (with_io_engine) {
+        imgfs_set_io_engine(NULL);
+        io_engine_free(&io_engine);
+        with_io_engine = 0;
+    }
+    trace_free();
 
     vips_shutdown();
+}
+
+/**********************************************************************
+ * Shard of the image whose ID is the given URI parameter. Without it,
+ * any shard: the handler reports the error.
+ ********************************************************************** */
+static struct shard* route(struct store* store, const struct http_message* msg, const char* name)
+{
+    char img_id[MAX_IMG_ID + 1] = {0};
+    if (http_get_var(&msg->uri, name, img_id, sizeof(img_id)) <= 0) return &store->shards[0];
+    return &store->shards[shard_ring_lookup(&store->ring, img_id)];
+}
 
-    if (pthread_mutex_destroy(&mutex) != 0) {
-        fprintf(stderr, "Error destroying mutex\n");
+/**********************************************************************
+ * To be called after each insert or delete, with the lock of its shard
+ * held: invalidates the cached listings of the store.
+ ********************************************************************** */
+static void update_done(struct store* store)
+{
+    __atomic_add_fetch(&store->list_generation, 1, __ATOMIC_RELEASE);
+}
+
+/**********************************************************************
+ * Takes a lock of the server, counting the time waited for it.
+ ********************************************************************** */
+static void lock(pthread_mutex_t* mutex, enum metrics_lock which)
+{
+    // not contended: no need to read the clock
+    if (pthread_mutex_trylock(mutex) == 0) {
+        metrics_lock_wait(which, 0);
+        return;
     }
+    const uint64_t start = metrics_now_us();
+    const uint64_t span = trace_begin();
+    pthread_mutex_lock(mutex);
+    trace_end("lock wait", span);
+    metrics_lock_wait(which, metrics_now_us() - start);
 }
 
 /**********************************************************************
@@ -118,22 +498,371 @@ static int reply_302_msg(int connection)
     return http_reply(connection, "302 Found", location, "", 0);
 }
 
-static int handle_list_call(int connection)
+/**********************************************************************
+ * Lists a page of the images of all shards, as do_list_images() for one
+ * imgFS: writes them to writer and/or copies their IDs to ids (room for
+ * query->limit of them), if not NULL.
+ *
+ * The shards are locked one at a time, and, with a writer, for at most
+ * LIST_BATCH_SIZE images: the writer only flushes (to its sink, e.g. the
+ * socket) between batches, with no lock held. A batch resumes after the
+ * last image of the previous one, as the next page would.
+ ********************************************************************** */
+static int list_shards(struct store* store, const struct list_query* query,
+                       struct json_writer* writer, char (*ids)[MAX_IMG_ID + 1],
+                       struct list_page* result)
+{
+    memset(result, 0, sizeof(*result));
+    uint32_t* slots = ids == NULL ? NULL : calloc(query->limit, sizeof(uint32_t));
+    if (ids != NULL && slots == NULL) return ERR_OUT_OF_MEMORY;
+
+    int err = ERR_NONE;
+    for (uint32_t i = 0; i < store->nb_shards && err == ERR_NONE && !result->has_next; ++i) {
+        struct shard* shard = &store->shards[i];
+        // max_files does not change while serving
+        if (query->start >= shard->first_slot + shard->fs_file.header.max_files) continue;
+
+        struct list_query local = *query;
+        local.start = query->start > shard->first_slot ? query->start - shard->first_slot : 0;
+        for (;;) {
+            // once the page is full, only looks for one more image
+            const int full = query->limit > 0 && result->listed == query->limit;
+            const uint32_t wanted = full ? 1 : (query->limit > 0 ? query->limit - result->listed : 0);
+            local.limit = wanted;
+            if (writer != NULL && !full && (wanted == 0 || wanted > LIST_BATCH_SIZE)) {
+                local.limit = LIST_BATCH_SIZE;
+            }
+
+            struct list_page page;
+            if (writer != NULL) json_writer_hold(writer, 1);
+            lock(&shard->mutex, METRICS_LOCK_SHARD);
+            err = do_list_images(&shard->fs_file, &local, full ? NULL : writer,
+                                 full ? NULL : slots, &page);
+            for (uint32_t k = 0; err == ERR_NONE && !full && ids != NULL && k < page.listed; ++k) {
+                strcpy(ids[result->listed + k], shard->fs_file.metadata[slots[k]].img_id);
+            }
+            pthread_mutex_unlock(&shard->mutex);
+            if (writer != NULL && err == ERR_NONE) err = json_writer_hold(writer, 0);
+            if (err != ERR_NONE) break;
+
+            if (full) {
+                result->has_next = page.listed > 0;
+                break;
+            }
+            if (page.listed > 0) result->last = shard->first_slot + page.last;
+            result->listed += page.listed;
+            // the rest of the page was asked for
+            if (local.limit == wanted) {
+                result->has_next = page.has_next;
+                break;
+            }
+            // a batch: on to the next one, if the shard has more
+            if (!page.has_next) break;
+            local.start = page.last + 1;
+        }
+    }
+    free(slots);
+    return err;
+}
+
+/**********************************************************************
+ * Writes a page of the listing of all shards, as do_list_json() for one
+ * imgFS.
+ ********************************************************************** */
+static int write_listing(struct store* store, const struct list_query* query,
+                         struct json_writer* writer)
+{
+    json_begin_object(writer);
+    json_key(writer, "Images");
+    json_begin_array(writer);
+
+    struct list_page page;
+    const int err = list_shards(store, query, writer, NULL, &page);
+    if (err != ERR_NONE) return err;
+
+    json_end_array(writer);
+    if (page.has_next) {
+        // the next page starts after the last image listed
+        json_key(writer, "next");
+        json_uint(writer, page.last);
+    }
+    return json_end_object(writer);
+}
+
+/**********************************************************************
+ * Gets a page of the listing of all shards in memory.
+ ********************************************************************** */
+static int build_listing(struct store* store, const struct list_query* query,
+                         char** json, size_t* len)
 {
-    char *json_body;
-    pthread_mutex_lock(&mutex);
-    int err = do_list(&fs_file, JSON, &json_body);
-    pthread_mutex_unlock(&mutex);
+    struct json_writer writer;
+    json_writer_init(&writer, NULL, NULL);
+
+    const int err = write_listing(store, query, &writer);
     if (err != ERR_NONE) {
+        json_writer_free(&writer);
         return err;
     }
-    return http_reply(connection, "200 OK", "Content-Type: application/json", json_body, strlen(json_body));
+    return json_writer_finish(&writer, json, len);
+}
+
+/**********************************************************************
+ * Gets the JSON listing in the given coding, (re)building the cache
+ * entry if the imgFS changed since it was computed. The body stays
+ * owned by the cache. Must be called with list_mutex held.
+ ********************************************************************** */
+static int get_cached_listing(struct store* store, enum http_encoding encoding,
+                              const char** body, size_t* len)
+{
+    struct list_cache_entry* const entry = &store->list_cache[encoding];
+    // read first: an update during the build makes the new entry stale
+    const uint64_t generation = __atomic_load_n(&store->list_generation, __ATOMIC_ACQUIRE);
+
+    if (!entry->valid || entry->generation != generation) {
+        char* new_body = NULL;
+        size_t new_len = 0;
+        int err = ERR_NONE;
+
+        if (encoding == HTTP_ENCODING_IDENTITY) {
+            const struct list_query all = { 0, 0, NULL, 0 };
+            err = build_listing(store, &all, &new_body, &new_len);
+        } else {
+            const char* plain = NULL;
+            size_t plain_len = 0;
+            err = get_cached_listing(store, HTTP_ENCODING_IDENTITY, &plain, &plain_len);
+            if (err == ERR_NONE) err = http_compress(encoding, plain, plain_len, &new_body, &new_len);
+        }
+
+        if (err != ERR_NONE) return err;
+
+        free(entry->body);
+        entry->body = new_body;
+        entry->len = new_len;
+        entry->generation = generation;
+        entry->valid = 1;
+    }
+
+    *body = entry->body;
+    *len = entry->len;
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Headers of a listing in the given coding.
+ ********************************************************************** */
+static void list_headers(enum http_encoding encoding, char* headers, size_t size)
+{
+    if (encoding == HTTP_ENCODING_IDENTITY) {
+        snprintf(headers, size,
+                 "Content-Type: application/json" HTTP_LINE_DELIM
+                 "Vary: Accept-Encoding" HTTP_LINE_DELIM);
+    } else {
+        snprintf(headers, size,
+                 "Content-Type: application/json" HTTP_LINE_DELIM
+                 "Vary: Accept-Encoding" HTTP_LINE_DELIM
+                 "Content-Encoding: %s" HTTP_LINE_DELIM,
+                 http_encoding_name(encoding));
+    }
+}
+
+// sinks of a streamed listing: the JSON text goes to the socket as
+// chunks, through the compressor if any
+static int chunk_sink(void* arg, const char* data, size_t len)
+{
+    return http_reply_chunk(*(const int*) arg, data, len);
+}
+
+static int compress_sink(void* arg, const char* data, size_t len)
+{
+    return http_compressor_write(arg, data, len);
+}
+
+/**********************************************************************
+ * Streams a listing page with a chunked reply, as it is generated: the
+ * JSON writer (and the compressor) hand it to the socket JSON_FLUSH_SIZE
+ * (COMPRESS_CHUNK) at a time, between the batches of list_shards(), so
+ * that neither the page nor a lock is held while sending.
+ ********************************************************************** */
+static int stream_list_page(struct store* store, int connection, const struct list_query* query,
+                            enum http_encoding encoding)
+{
+    char headers[ERR_MSG_SIZE];
+    list_headers(encoding, headers, sizeof(headers));
+    int err = http_reply_chunked_begin(connection, HTTP_OK, headers);
+    if (err != ERR_NONE) return err;
+
+    // once the headers are out, errors can no longer be reported to the
+    // client: they are returned so that the connection gets closed
+    struct json_writer writer;
+    struct http_compressor* compressor = NULL;
+    if (encoding == HTTP_ENCODING_IDENTITY) {
+        json_writer_init(&writer, chunk_sink, &connection);
+    } else {
+        compressor = malloc(sizeof(struct http_compressor));
+        err = compressor == NULL ? ERR_OUT_OF_MEMORY
+              : http_compressor_init(compressor, encoding, chunk_sink, &connection);
+        if (err != ERR_NONE) {
+            free(compressor);
+            return err;
+        }
+        json_writer_init(&writer, compress_sink, compressor);
+    }
+
+    err = write_listing(store, query, &writer);
+    if (err == ERR_NONE) {
+        char* unused = NULL;
+        err = json_writer_finish(&writer, &unused, NULL);
+    } else {
+        json_writer_free(&writer);
+    }
+
+    if (compressor != NULL) {
+        if (err == ERR_NONE) {
+            err = http_compressor_finish(compressor);
+        } else {
+            http_compressor_end(compressor);
+        }
+        free(compressor);
+    }
+    return err != ERR_NONE ? err : http_reply_chunked_end(connection);
+}
+
+/**********************************************************************
+ * Reads the optional paging and filtering parameters of /imgfs/list:
+ * limit, after (the "next" cursor of the previous page), prefix and
+ * fields (comma-separated among size, resolution and sha).
+ * Sets *has_query to 0 if none is given.
+ ********************************************************************** */
+static int parse_list_query(const struct http_message* msg, struct list_query* query,
+                            char* prefix, size_t prefix_size, int* has_query)
+{
+#define LIST_PARAM_SIZE 32
+    char param[LIST_PARAM_SIZE] = {0};
+    memset(query, 0, sizeof(*query));
+    *has_query = 0;
+
+    int len = http_get_var(&msg->uri, "limit", param, sizeof(param));
+    if (len < 0) return ERR_INVALID_ARGUMENT;
+    if (len > 0) {
+        query->limit = atouint32(param);
+        if (query->limit == 0) return ERR_INVALID_ARGUMENT;
+        *has_query = 1;
+    }
+
+    len = http_get_var(&msg->uri, "after", param, sizeof(param));
+    if (len < 0) return ERR_INVALID_ARGUMENT;
+    if (len > 0) {
+        const uint32_t after = atouint32(param);
+        if ((after == 0 && strcmp(param, "0") != 0) || after == UINT32_MAX) return ERR_INVALID_ARGUMENT;
+        query->start = after + 1;
+        *has_query = 1;
+    }
+
+    len = http_get_var(&msg->uri, "prefix", prefix, prefix_size);
+    if (len < 0) return ERR_INVALID_ARGUMENT;
+    if (len > 0) {
+        query->prefix = prefix;
+        *has_query = 1;
+    }
+
+    len = http_get_var(&msg->uri, "fields", param, sizeof(param));
+    if (len < 0) return ERR_INVALID_ARGUMENT;
+    if (len > 0) {
+        char* saveptr = NULL;
+        for (char* field = strtok_r(param, ",", &saveptr); field != NULL;
+             field = strtok_r(NULL, ",", &saveptr)) {
+            if (strcmp(field, "size") == 0) {
+                query->fields |= LIST_FIELD_SIZE;
+            } else if (strcmp(field, "resolution") == 0) {
+                query->fields |= LIST_FIELD_RESOLUTION;
+            } else if (strcmp(field, "sha") == 0) {
+                query->fields |= LIST_FIELD_SHA;
+            } else {
+                return ERR_INVALID_ARGUMENT;
+            }
+        }
+        *has_query = 1;
+    }
+    return ERR_NONE;
 }
 
-static int handle_read_call(int connection, struct http_message* msg)
+static int handle_list_call(struct store* store, int connection, const struct http_message* msg)
+{
+    int encoding = http_negotiate_encoding(msg);
+    if (encoding < 0) encoding = HTTP_ENCODING_IDENTITY;
+
+    struct list_query query;
+    char prefix[MAX_IMG_ID + 1] = {0};
+    int has_query = 0;
+    int err = parse_list_query(msg, &query, prefix, sizeof(prefix), &has_query);
+    if (err != ERR_NONE) {
+        return reply_error_msg(connection, err);
+    }
+
+    // pages (with any parameter) are bounded
+    if (has_query && (query.limit == 0 || query.limit > MAX_LIST_LIMIT)) query.limit = MAX_LIST_LIMIT;
+
+    if (has_query) {
+        // pages are not cached: they are streamed
+        return stream_list_page(store, connection, &query, (enum http_encoding) encoding);
+    }
+
+    // the full listing is cached: a snapshot of it is taken under
+    // list_mutex, and sent once it is released
+    const char* body = NULL;
+    size_t body_len = 0;
+    char* snapshot = NULL;
+    lock(&store->list_mutex, METRICS_LOCK_LIST);
+    err = get_cached_listing(store, (enum http_encoding) encoding, &body, &body_len);
+    if (err == ERR_NONE) {
+        snapshot = malloc(body_len > 0 ? body_len : 1);
+        if (snapshot == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else {
+            memcpy(snapshot, body, body_len);
+        }
+    }
+    pthread_mutex_unlock(&store->list_mutex);
+    if (err != ERR_NONE) {
+        return reply_error_msg(connection, err);
+    }
+
+    char headers[ERR_MSG_SIZE];
+    list_headers((enum http_encoding) encoding, headers, sizeof(headers));
+    err = http_reply(connection, HTTP_OK, headers, snapshot, body_len);
+    free(snapshot);
+    return err;
+}
+
+/**********************************************************************
+ * Builds the (strong) entity tag of an image at a given resolution.
+ * Content is identified by the SHA of the original; the resolution
+ * tells the variants apart.
+ ********************************************************************** */
+static void make_etag(const struct img_metadata* image, int resolution, char* etag)
+{
+    static const char* const res_names[NB_RES] = { "thumb", "small", "orig" };
+    char sha_string[2 * SHA256_DIGEST_LENGTH + 1];
+    sha_to_string(image->SHA, sha_string);
+    snprintf(etag, ETAG_SIZE, "\"%s-%s\"", sha_string, res_names[resolution]);
+}
+
+/**********************************************************************
+ * Tells whether a Range header applies: without If-Range it always
+ * does, otherwise only if If-Range is our (strong) entity tag.
+ ********************************************************************** */
+static int if_range_matches(const struct http_message* msg, const char* etag)
+{
+    struct http_string if_range;
+    if (http_get_header(msg, "If-Range", &if_range) != 1) return 1;
+
+    return if_range.len == strlen(etag) && strncmp(if_range.val, etag, if_range.len) == 0;
+}
+
+static int handle_read_call(struct shard* shard, int connection, struct http_message* msg)
 {
     char res[MAX_CHARACTERE_RES + 1] = {0};
-    char img_id[MAX_IMG_ID] = {0};
+    char img_id[MAX_IMG_ID + 1] = {0};
     //TODO: how can we know the size of the res in advance?
     int err = http_get_var(&msg->uri, "res", res, sizeof(res));
 
@@ -153,29 +882,471 @@ static int handle_read_call(int connection, struct http_message* msg)
         return reply_error_msg(connection, ERR_INVALID_COMMAND);
     }
 
-    char* image_data;
-    uint32_t image_size;
-    err = do_read(img_id, resolution, &image_data, &image_size, &fs_file);
+    uint32_t index = 0;
+    uint64_t span = trace_begin();
+    err = find_image_index(img_id, &shard->fs_file, &index);
+    trace_end("lookup", span);
+    if (err != ERR_NONE) {
+        return reply_error_msg(connection, err);
+    }
+
+    char etag[ETAG_SIZE];
+    make_etag(&shard->fs_file.metadata[index], resolution, etag);
+
+    char headers[READ_HEADERS_SIZE];
+    snprintf(headers, sizeof(headers),
+             "Content-Type: image/jpeg" HTTP_LINE_DELIM
+             "ETag: %s" HTTP_LINE_DELIM
+             "Cache-Control: " CACHE_CONTROL HTTP_LINE_DELIM
+             "Accept-Ranges: bytes" HTTP_LINE_DELIM, etag);
+
+    struct http_string if_none_match;
+    if (http_get_header(msg, "If-None-Match", &if_none_match) == 1
+        && http_match_etag(&if_none_match, etag) == 1) {
+        return http_reply(connection, HTTP_NOT_MODIFIED, headers, NULL, 0);
+    }
+
+    int range_status = HTTP_RANGE_IGNORED;
+    uint64_t first = 0;
+    uint64_t last = 0;
+    struct http_string range;
+    if (http_get_header(msg, "Range", &range) == 1 && if_range_matches(msg, etag)) {
+        // the size of a resized variant is only known once it has been generated
+        err = lazily_resize(resolution, &shard->fs_file, index);
+        if (err != ERR_NONE) {
+            return reply_error_msg(connection, err);
+        }
+        range_status = http_parse_range(&range, shard->fs_file.metadata[index].size[resolution],
+                                        &first, &last);
+    }
+
+    if (range_status == HTTP_RANGE_UNSATISFIABLE) {
+        char range_headers[READ_HEADERS_SIZE];
+        snprintf(range_headers, sizeof(range_headers),
+                 "Content-Range: bytes */%" PRIu32 HTTP_LINE_DELIM,
+                 shard->fs_file.metadata[index].size[resolution]);
+        return http_reply(connection, HTTP_RANGE_NOT_SATISFIABLE, range_headers, NULL, 0);
+    }
+
+    char* image_data = NULL;
+    uint32_t image_size = 0;
+
+    if (range_status == HTTP_RANGE_SATISFIABLE) {
+        span = trace_begin();
+        err = do_read_range(img_id, resolution, (uint32_t) first, (uint32_t) (last - first + 1),
+                            &image_data, &image_size, &shard->fs_file);
+        trace_end("do_read_range", span);
+        if (err != ERR_NONE) {
+            return reply_error_msg(connection, err);
+        }
+
+        const size_t headers_len = strlen(headers);
+        snprintf(headers + headers_len, sizeof(headers) - headers_len,
+                 "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu32 HTTP_LINE_DELIM,
+                 first, last, shard->fs_file.metadata[index].size[resolution]);
+
+        err = http_reply(connection, HTTP_PARTIAL_CONTENT, headers, image_data, image_size);
+        free(image_data);
+        return err;
+    }
+
+    span = trace_begin();
+    err = do_read(img_id, resolution, &image_data, &image_size, &shard->fs_file);
+    trace_end("do_read", span);
+    if (err != ERR_NONE) {
+        return reply_error_msg(connection, err);
+    }
+
+    err = http_reply(connection, HTTP_OK, headers, image_data, image_size);
+    free(image_data);
+    return err;
+}
+
+/**********************************************************************
+ * Reads images at one resolution with do_read_batch(), taking the lock
+ * of each shard once. On error, no image is left allocated.
+ ********************************************************************** */
+static int read_batch(struct store* store, struct batch_image* images, size_t n, int resolution)
+{
+    uint32_t* shard_of = calloc(n, sizeof(uint32_t));
+    struct batch_image* batch = calloc(n, sizeof(struct batch_image));
+    size_t* from = calloc(n, sizeof(size_t));
+    int err = n > 0 && (shard_of == NULL || batch == NULL || from == NULL)
+              ? ERR_OUT_OF_MEMORY : ERR_NONE;
+
+    for (size_t i = 0; i < n && err == ERR_NONE; ++i) {
+        shard_of[i] = shard_ring_lookup(&store->ring, images[i].img_id);
+    }
+
+    for (uint32_t s = 0; s < store->nb_shards && err == ERR_NONE; ++s) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (shard_of[i] == s) {
+                batch[m] = images[i];
+                from[m++] = i;
+            }
+        }
+        if (m == 0) continue;
+
+        lock(&store->shards[s].mutex, METRICS_LOCK_SHARD);
+        const uint64_t span = trace_begin();
+        err = do_read_batch(batch, m, resolution, &store->shards[s].fs_file);
+        trace_end("do_read_batch", span);
+        pthread_mutex_unlock(&store->shards[s].mutex);
+        for (size_t j = 0; j < m && err == ERR_NONE; ++j) images[from[j]] = batch[j];
+    }
+
+    if (err != ERR_NONE) {
+        for (size_t i = 0; i < n; ++i) {
+            free(images[i].data);
+            images[i].data = NULL;
+        }
+    }
+    free(shard_of);
+    free(batch);
+    free(from);
+    return err;
+}
+
+/**********************************************************************
+ * Reads several images (the comma-separated IDs of "ids") at one
+ * resolution, taking the lock of each shard once, and sends them as the
+ * parts of a multipart/mixed body, in the order of the IDs. An image that
+ * cannot be read gets a text/plain part with the error.
+ ********************************************************************** */
+static int handle_batch_read_call(struct store* store, int connection, const struct http_message* msg)
+{
+    char res[MAX_CHARACTERE_RES + 1] = {0};
+    char ids[MAX_BATCH_IDS * (MAX_IMG_ID + 1)] = {0};
+    if (http_get_var(&msg->uri, "res", res, sizeof(res)) <= 0
+        || http_get_var(&msg->uri, "ids", ids, sizeof(ids)) <= 0) {
+        return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    }
+    const int resolution = resolution_atoi(res);
+    if (resolution == -1) {
+        return reply_error_msg(connection, ERR_INVALID_COMMAND);
+    }
+
+    struct batch_image images[MAX_BATCH_IDS];
+    size_t n = 0;
+    char* saveptr = NULL;
+    for (char* img_id = strtok_r(ids, ",", &saveptr); img_id != NULL;
+         img_id = strtok_r(NULL, ",", &saveptr)) {
+        if (n == MAX_BATCH_IDS) return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+        memset(&images[n], 0, sizeof(images[n]));
+        images[n++].img_id = img_id;
+    }
+
+    int err = read_batch(store, images, n, resolution);
     if (err != ERR_NONE) {
         return reply_error_msg(connection, err);
     }
 
-    return http_reply(connection, "200 OK", "Content-Type: image/jpeg",
-                      image_data, image_size);
+    // per part: its headers, its content and the line ending it; then the closing delimiter
+    char* part_headers = calloc(n, PART_HEADERS_SIZE);
+    struct iovec* body = calloc(3 * n + 1, sizeof(struct iovec));
+    if (part_headers == NULL || body == NULL) {
+        err = ERR_OUT_OF_MEMORY;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < n && err == ERR_NONE; ++i) {
+        const struct batch_image* image = &images[i];
+        const char* content = image->err == ERR_NONE ? image->data : ERR_MSG(image->err);
+        const size_t content_len = image->err == ERR_NONE ? image->size : strlen(content);
+
+        char* headers = part_headers + i * PART_HEADERS_SIZE;
+        const int len = snprintf(headers, PART_HEADERS_SIZE,
+                                 "--" BATCH_BOUNDARY HTTP_LINE_DELIM
+                                 "Content-Type: %s" HTTP_LINE_DELIM
+                                 "Content-ID: <%s>" HTTP_LINE_DELIM
+                                 "Content-Length: %zu" HTTP_HDR_END_DELIM,
+                                 image->err == ERR_NONE ? "image/jpeg" : "text/plain",
+                                 image->img_id, content_len);
+        body[count].iov_base = headers;
+        body[count++].iov_len = (size_t) len;
+        body[count].iov_base = (void*) (uintptr_t) content;
+        body[count++].iov_len = content_len;
+        body[count].iov_base = (void*) (uintptr_t) HTTP_LINE_DELIM;
+        body[count++].iov_len = strlen(HTTP_LINE_DELIM);
+    }
+    if (err == ERR_NONE) {
+        body[count].iov_base = (void*) (uintptr_t) ("--" BATCH_BOUNDARY "--" HTTP_LINE_DELIM);
+        body[count++].iov_len = strlen("--" BATCH_BOUNDARY "--" HTTP_LINE_DELIM);
+
+        err = http_reply_iov(connection, HTTP_OK,
+                             "Content-Type: multipart/mixed; boundary=" BATCH_BOUNDARY HTTP_LINE_DELIM
+                             "Cache-Control: " CACHE_CONTROL HTTP_LINE_DELIM,
+                             body, count);
+    } else {
+        err = reply_error_msg(connection, err);
+    }
+
+    for (size_t i = 0; i < n; ++i) free(images[i].data);
+    free(part_headers);
+    free(body);
+    return err;
+}
+
+/**********************************************************************
+ * Builds a sprite sheet of the given thumbnails and its JSON map into a
+ * cache entry. has_next and next are those of the page, if any.
+ ********************************************************************** */
+static int build_sprite(struct store* store, const struct batch_image* images, size_t n,
+                        unsigned columns, int has_next, uint32_t next,
+                        struct sprite_cache_entry* entry)
+{
+    // the cells fit the thumbnails of every shard
+    uint32_t cell_width = 1;
+    uint32_t cell_height = 1;
+    for (uint32_t i = 0; i < store->nb_shards; ++i) {
+        const struct imgfs_header* header = &store->shards[i].fs_file.header;
+        if (header->resized_res[0] > cell_width) cell_width = header->resized_res[0];
+        if (header->resized_res[1] > cell_height) cell_height = header->resized_res[1];
+    }
+
+    // only the images that could be read
+    const char* contents[MAX_SPRITE_IMAGES];
+    size_t sizes[MAX_SPRITE_IMAGES];
+    const char* ids[MAX_SPRITE_IMAGES];
+    struct sprite_cell cells[MAX_SPRITE_IMAGES];
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (images[i].err != ERR_NONE) continue;
+        contents[count] = images[i].data;
+        sizes[count] = images[i].size;
+        ids[count++] = images[i].img_id;
+    }
+
+    int err = ERR_NONE;
+    if (count > 0) {
+        err = make_sprite_sheet(contents, sizes, count, columns, cell_width, cell_height,
+                                &entry->jpeg, &entry->jpeg_size, cells);
+        if (err != ERR_NONE) return err;
+    }
+
+    const size_t across = count < columns ? count : columns;
+    const size_t rows = (count + columns - 1) / columns;
+
+    struct json_writer writer;
+    json_writer_init(&writer, NULL, NULL);
+    json_begin_object(&writer);
+    json_key(&writer, "width");
+    json_uint(&writer, across * cell_width);
+    json_key(&writer, "height");
+    json_uint(&writer, rows * cell_height);
+    json_key(&writer, "Images");
+    json_begin_array(&writer);
+    for (size_t i = 0; i < count; ++i) {
+        json_begin_object(&writer);
+        json_key(&writer, "img_id");
+        json_string(&writer, ids[i]);
+        json_key(&writer, "x");
+        json_uint(&writer, cells[i].x);
+        json_key(&writer, "y");
+        json_uint(&writer, cells[i].y);
+        json_key(&writer, "width");
+        json_uint(&writer, cells[i].width);
+        json_key(&writer, "height");
+        json_uint(&writer, cells[i].height);
+        json_end_object(&writer);
+    }
+    json_end_array(&writer);
+    if (has_next) {
+        json_key(&writer, "next");
+        json_uint(&writer, next);
+    }
+    json_end_object(&writer);
+    return json_writer_finish(&writer, &entry->map, &entry->map_len);
+}
+
+/**********************************************************************
+ * Copies the sheet (NULL if none) or the map of a sprite, to be freed.
+ ********************************************************************** */
+static int copy_sprite(const struct sprite_cache_entry* sprite, int map, char** body, size_t* len)
+{
+    const char* data = map ? sprite->map : sprite->jpeg;
+    *len = map ? sprite->map_len : sprite->jpeg_size;
+    *body = NULL;
+    if (data == NULL) return ERR_NONE;
 
+    *body = malloc(*len);
+    if (*body == NULL) return ERR_OUT_OF_MEMORY;
+    memcpy(*body, data, *len);
+    return ERR_NONE;
 }
 
-static int handle_delete_call(int connection, struct http_message* msg)
+/**********************************************************************
+ * Gets (a copy of) the sprite sheet or the map of the images of a query,
+ * from the cache or built (and cached). sprite_mutex is only held to use
+ * the cache: concurrent misses of a query build it each, the last one
+ * is kept.
+ ********************************************************************** */
+static int get_sprite(struct store* store, const struct http_message* msg, const char* query_string,
+                      int map, char** body, size_t* body_len)
 {
-    char *img_id;
-    //TODO: how can we know the size of the img_id in advance?
+    // read first: an update during the build makes the new entry stale
+    const uint64_t generation = __atomic_load_n(&store->list_generation, __ATOMIC_ACQUIRE);
+    lock(&store->sprite_mutex, METRICS_LOCK_SPRITE);
+    for (size_t i = 0; i < SPRITE_CACHE_SIZE; ++i) {
+        const struct sprite_cache_entry* entry = &store->sprite_cache[i];
+        if (entry->query != NULL && entry->generation == generation
+            && strcmp(entry->query, query_string) == 0) {
+            const int err = copy_sprite(entry, map, body, body_len);
+            pthread_mutex_unlock(&store->sprite_mutex);
+            return err;
+        }
+    }
+    pthread_mutex_unlock(&store->sprite_mutex);
+
+    char param[LIST_PARAM_SIZE] = {0};
+    unsigned columns = DEFAULT_SPRITE_COLUMNS;
+    int len = http_get_var(&msg->uri, "columns", param, sizeof(param));
+    if (len < 0) return ERR_INVALID_ARGUMENT;
+    if (len > 0) {
+        columns = atouint32(param);
+        if (columns == 0 || columns > MAX_SPRITE_IMAGES) return ERR_INVALID_ARGUMENT;
+    }
+
+    // the images: either listed by ID, or a page of the listing
+    char (*ids)[MAX_IMG_ID + 1] = calloc(MAX_SPRITE_IMAGES, MAX_IMG_ID + 1);
+    char* id_list = calloc(MAX_SPRITE_IMAGES, MAX_IMG_ID + 1);
+    if (ids == NULL || id_list == NULL) {
+        free(ids);
+        free(id_list);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    struct list_page page = { 0, 0, 0 };
+    int err = ERR_NONE;
+    len = http_get_var(&msg->uri, "ids", id_list, MAX_SPRITE_IMAGES * (MAX_IMG_ID + 1));
+    if (len < 0) {
+        err = ERR_INVALID_ARGUMENT;
+    } else if (len > 0) {
+        char* saveptr = NULL;
+        for (char* img_id = strtok_r(id_list, ",", &saveptr); img_id != NULL && err == ERR_NONE;
+             img_id = strtok_r(NULL, ",", &saveptr)) {
+            if (page.listed == MAX_SPRITE_IMAGES || strlen(img_id) > MAX_IMG_ID) {
+                err = ERR_INVALID_ARGUMENT;
+            } else {
+                strcpy(ids[page.listed++], img_id);
+            }
+        }
+    } else {
+        struct list_query query;
+        char prefix[MAX_IMG_ID + 1] = {0};
+        int has_query = 0;
+        err = parse_list_query(msg, &query, prefix, sizeof(prefix), &has_query);
+        if (err == ERR_NONE && (query.limit == 0 || query.limit > MAX_SPRITE_IMAGES)) {
+            query.limit = MAX_SPRITE_IMAGES;
+        }
+        if (err == ERR_NONE) err = list_shards(store, &query, NULL, ids, &page);
+    }
+
+    struct batch_image images[MAX_SPRITE_IMAGES];
+    memset(images, 0, sizeof(images));
+    for (uint32_t i = 0; i < page.listed; ++i) images[i].img_id = ids[i];
+    if (err == ERR_NONE) err = read_batch(store, images, page.listed, THUMB_RES);
+
+    struct sprite_cache_entry built;
+    memset(&built, 0, sizeof(built));
+    if (err == ERR_NONE) {
+        err = build_sprite(store, images, page.listed, columns, page.has_next, page.last, &built);
+    }
+    for (uint32_t i = 0; i < page.listed; ++i) free(images[i].data);
+    free(ids);
+    free(id_list);
+
+    if (err == ERR_NONE) {
+        built.query = strdup(query_string);
+        if (built.query == NULL) err = ERR_OUT_OF_MEMORY;
+    }
+    if (err == ERR_NONE) err = copy_sprite(&built, map, body, body_len);
+    if (err != ERR_NONE) {
+        free(built.query);
+        free(built.jpeg);
+        free(built.map);
+        return err;
+    }
+    built.generation = generation;
+
+    // in place of the entry of the query if another build made one
+    lock(&store->sprite_mutex, METRICS_LOCK_SPRITE);
+    struct sprite_cache_entry* entry = NULL;
+    for (size_t i = 0; i < SPRITE_CACHE_SIZE && entry == NULL; ++i) {
+        if (store->sprite_cache[i].query != NULL
+            && strcmp(store->sprite_cache[i].query, query_string) == 0) {
+            entry = &store->sprite_cache[i];
+        }
+    }
+    if (entry == NULL) {
+        entry = &store->sprite_cache[store->sprite_victim];
+        store->sprite_victim = (store->sprite_victim + 1) % SPRITE_CACHE_SIZE;
+    }
+    free(entry->query);
+    free(entry->jpeg);
+    free(entry->map);
+    *entry = built;
+    pthread_mutex_unlock(&store->sprite_mutex);
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Sends the sprite sheet of the thumbnails of some images (as a single
+ * JPEG) or its map (JSON: where each image is in it). The images are
+ * either given by "ids" (comma-separated) or a page of the listing
+ * ("limit", "after", "prefix", as for /imgfs/list; at most
+ * MAX_SPRITE_IMAGES); "columns" sets the number of cells per row.
+ ********************************************************************** */
+static int handle_sprite_call(struct store* store, int connection, const struct http_message* msg,
+                              int map)
+{
+    const char* query_string = memchr(msg->uri.val, '?', msg->uri.len);
+    const size_t query_len = query_string == NULL ? 0
+                             : msg->uri.len - (size_t) (query_string - msg->uri.val);
+    char* key = calloc(1, query_len + 1);
+    if (key == NULL) return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    if (query_len > 0) memcpy(key, query_string, query_len);
+
+    char* body = NULL;
+    size_t len = 0;
+    int err = get_sprite(store, msg, key, map, &body, &len);
+    free(key);
+    if (err == ERR_NONE && body == NULL) err = ERR_IMAGE_NOT_FOUND;
+    if (err != ERR_NONE) {
+        return reply_error_msg(connection, err);
+    }
+
+    const char* headers = map
+                          ? "Content-Type: application/json" HTTP_LINE_DELIM
+                            "Cache-Control: " CACHE_CONTROL HTTP_LINE_DELIM
+                          : "Content-Type: image/jpeg" HTTP_LINE_DELIM
+                            "Cache-Control: " CACHE_CONTROL HTTP_LINE_DELIM;
+    err = http_reply(connection, HTTP_OK, headers, body, len);
+    free(body);
+    return err;
+}
+
+static int handle_delete_call(struct store* store, struct shard* shard, int connection, struct http_message* msg)
+{
+    char img_id[MAX_IMG_ID + 1] = {0};
     int err = http_get_var(&msg->uri, "img_id", img_id, sizeof(img_id));
 
     if (err <= 0) {
+        durability_update_cancel(&shard->durability);
         return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
     }
 
-    err = do_delete(img_id, &fs_file);
+    uint64_t span = trace_begin();
+    err = do_delete(img_id, &shard->fs_file);
+    trace_end("do_delete", span);
+    update_done(store);
+    if (err != ERR_NONE) {
+        durability_update_cancel(&shard->durability);
+        return reply_error_msg(connection, err);
+    }
+    span = trace_begin();
+    err = durability_update_done(&shard->durability);
+    trace_end("durability", span);
 
     if (err != ERR_NONE) {
         return reply_error_msg(connection, err);
@@ -190,23 +1361,27 @@ static int handle_delete_call(int connection, struct http_message* msg)
     return http_reply(connection, "302 Found", location, "", 0);
 }
 
-static int handle_insert_call(int connection, struct http_message* msg)
+static int handle_insert_call(struct store* store, struct shard* shard, int connection, struct http_message* msg)
 {
     char img_name[MAX_IMGFS_NAME] = {0};
-    char *img_data;
-    size_t img_size;
 
     int err = http_get_var(&msg->uri, "name", img_name, sizeof(img_name));
-    if (err <= 0) {
+    if (err <= 0 || msg->body.len == 0) {
+        durability_update_cancel(&shard->durability);
         return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
     }
 
-    //err = http_parse_message(msg->body, &img_data, &img_size); ?? AHHHHHHHHHHHHHHHHHHHHHHHHH
+    uint64_t span = trace_begin();
+    err = do_insert(msg->body.val, msg->body.len, img_name, &shard->fs_file);
+    trace_end("do_insert", span);
+    update_done(store);
     if (err != ERR_NONE) {
+        durability_update_cancel(&shard->durability);
         return reply_error_msg(connection, err);
     }
-
-    err = do_insert(img_data, img_size, img_name, &fs_file);
+    span = trace_begin();
+    err = durability_update_done(&shard->durability);
+    trace_end("durability", span);
     if (err != ERR_NONE) {
         return reply_error_msg(connection, err);
     }
@@ -215,38 +1390,183 @@ static int handle_insert_call(int connection, struct http_message* msg)
 }
 
 /**********************************************************************
- * Simple handling of http message. TO BE UPDATED WEEK 13
+ * Store a URI is for, and the operation (e.g. "/read?...") in it: after
+ * URI_ROOT "/<store>" for a named store, after URI_ROOT for the first one.
  ********************************************************************** */
-int handle_http_message(struct http_message* msg, int connection)
+static struct store* find_store(const struct http_message* msg, struct http_string* op)
 {
-    M_REQUIRE_NON_NULL(msg);
+    const size_t root_len = strlen(URI_ROOT);
+    if (msg->uri.len <= root_len || strncmp(msg->uri.val, URI_ROOT "/", root_len + 1) != 0) {
+        return NULL;
+    }
+
+    const char* name = msg->uri.val + root_len + 1;
+    const size_t left = msg->uri.len - root_len - 1;
+    size_t name_len = 0;
+    while (name_len < left && name[name_len] != '/' && name[name_len] != '?') ++name_len;
+
+    if (name_len < left && name[name_len] == '/') {
+        for (uint32_t i = 0; i < nb_stores; ++i) {
+            if (stores[i].name[0] != '\0' && strlen(stores[i].name) == name_len
+                && strncmp(stores[i].name, name, name_len) == 0) {
+                op->val = name + name_len;
+                op->len = left - name_len;
+                return &stores[i];
+            }
+        }
+    }
 
+    op->val = msg->uri.val + root_len;
+    op->len = msg->uri.len - root_len;
+    return &stores[0];
+}
+
+/**********************************************************************
+ * Tells whether an operation is the given one: its URI may only go on
+ * with parameters ("/read?..."), not with more of a name ("/readXYZ").
+ ********************************************************************** */
+static int match_op(const struct http_string* op, const char* name)
+{
+    const size_t len = strlen(name);
+    return op->len >= len && strncmp(op->val, name, len) == 0
+           && (op->len == len || op->val[len] == '?');
+}
+
+/**********************************************************************
+ * Counts a request of a store in, unless it is at its limit.
+ ********************************************************************** */
+static int store_enter(struct store* store)
+{
+    const unsigned requests = __atomic_add_fetch(&store->requests, 1, __ATOMIC_ACQ_REL);
+    if (store->max_requests > 0 && requests > store->max_requests) {
+        __atomic_sub_fetch(&store->requests, 1, __ATOMIC_ACQ_REL);
+        return 0;
+    }
+    return 1;
+}
+
+static void store_leave(struct store* store)
+{
+    __atomic_sub_fetch(&store->requests, 1, __ATOMIC_ACQ_REL);
+}
+
+/**********************************************************************
+ * Sends the counters of the server, in the Prometheus text format.
+ ********************************************************************** */
+static int handle_metrics_call(int connection)
+{
+    char* text = NULL;
+    size_t len = 0;
+    const int err = metrics_export(&text, &len);
+    if (err != ERR_NONE) {
+        return reply_error_msg(connection, err);
+    }
+
+    const int ret = http_reply(connection, HTTP_OK,
+                               "Content-Type: text/plain; version=0.0.4" HTTP_LINE_DELIM,
+                               text, len);
+    free(text);
+    return ret;
+}
+
+/**********************************************************************
+ * Sends the spans of the traced requests, in the Chrome trace format.
+ ********************************************************************** */
+static int handle_trace_call(int connection)
+{
+    char* json = NULL;
+    size_t len = 0;
+    const int err = trace_export(&json, &len);
+    if (err != ERR_NONE) {
+        return reply_error_msg(connection, err);
+    }
+
+    const int ret = http_reply(connection, HTTP_OK,
+                               "Content-Type: application/json" HTTP_LINE_DELIM,
+                               json, len);
+    free(json);
+    return ret;
+}
+
+/**********************************************************************
+ * Dispatches a request to its handler; tells which endpoint it was.
+ ********************************************************************** */
+static int dispatch(struct http_message* msg, int connection, enum metrics_endpoint* endpoint)
+{
+    *endpoint = METRICS_OTHER;
     if (http_match_verb(&msg->uri, "/") || http_match_uri(msg, "/index.html")) {
         return http_serve_file(connection, BASE_FILE);
     }
+    if (http_match_uri(msg, "/metrics")) {
+        *endpoint = METRICS_METRICS;
+        return handle_metrics_call(connection);
+    }
+    if (http_match_uri(msg, "/trace")) {
+        return handle_trace_call(connection);
+    }
 
     debug_printf("handle_http_message() on connection %d. URI: %.*s\n",
                  connection,
                  (int) msg->uri.len, msg->uri.val);
 
-    if (http_match_uri(msg, URI_ROOT "/list")) {
-        pthread_mutex_lock(&mutex);
-        handle_list_call(connection);
-        pthread_mutex_unlock(&mutex);
-    } else if (http_match_uri(msg, URI_ROOT "/read")) {
-        pthread_mutex_lock(&mutex);
-        handle_read_call(connection, msg);
-        pthread_mutex_unlock(&mutex);
-    } else if (http_match_uri(msg, URI_ROOT "/delete")) {
-        pthread_mutex_lock(&mutex);
-        handle_delete_call(connection, msg);
-        pthread_mutex_unlock(&mutex);
-    } else if (http_match_uri(msg, URI_ROOT "/insert")
+    struct http_string op;
+    struct store* store = find_store(msg, &op);
+    if (store == NULL) {
+        return reply_error_msg(connection, ERR_INVALID_COMMAND);
+    }
+    if (!store_enter(store)) {
+        return http_reply(connection, HTTP_SERVICE_UNAVAILABLE, "Retry-After: 1" HTTP_LINE_DELIM,
+                          NULL, 0);
+    }
+
+    int err = ERR_NONE;
+    if (match_op(&op, "/list")) {
+        *endpoint = METRICS_LIST;
+        err = handle_list_call(store, connection, msg);
+    } else if (match_op(&op, "/sprite") || match_op(&op, "/sprite.json")) {
+        *endpoint = METRICS_SPRITE;
+        err = handle_sprite_call(store, connection, msg, match_op(&op, "/sprite.json"));
+    } else if (match_op(&op, "/batch_read")) {
+        *endpoint = METRICS_BATCH_READ;
+        err = handle_batch_read_call(store, connection, msg);
+    } else if (match_op(&op, "/read")) {
+        *endpoint = METRICS_READ;
+        struct shard* shard = route(store, msg, "img_id");
+        lock(&shard->mutex, METRICS_LOCK_SHARD);
+        err = handle_read_call(shard, connection, msg);
+        pthread_mutex_unlock(&shard->mutex);
+    } else if (match_op(&op, "/delete")) {
+        *endpoint = METRICS_DELETE;
+        struct shard* shard = route(store, msg, "img_id");
+        durability_update_begin(&shard->durability);
+        lock(&shard->mutex, METRICS_LOCK_SHARD);
+        err = handle_delete_call(store, shard, connection, msg);
+        pthread_mutex_unlock(&shard->mutex);
+    } else if (match_op(&op, "/insert")
                && http_match_verb(&msg->method, "POST")) {
-        pthread_mutex_lock(&mutex);
-        handle_insert_call(connection, msg);
-        pthread_mutex_unlock(&mutex);
+        *endpoint = METRICS_INSERT;
+        struct shard* shard = route(store, msg, "name");
+        durability_update_begin(&shard->durability);
+        lock(&shard->mutex, METRICS_LOCK_SHARD);
+        err = handle_insert_call(store, shard, connection, msg);
+        pthread_mutex_unlock(&shard->mutex);
     } else {
-        return reply_error_msg(connection, ERR_INVALID_COMMAND);
+        err = reply_error_msg(connection, ERR_INVALID_COMMAND);
     }
+    store_leave(store);
+    return err;
+}
+
+/**********************************************************************
+ * Simple handling of http message. TO BE UPDATED WEEK 13
+ ********************************************************************** */
+int handle_http_message(struct http_message* msg, int connection)
+{
+    M_REQUIRE_NON_NULL(msg);
+
+    const uint64_t start = metrics_now_us();
+    enum metrics_endpoint endpoint = METRICS_OTHER;
+    const int err = dispatch(msg, connection, &endpoint);
+    metrics_request(endpoint, metrics_now_us() - start);
+    return err;
 }
@@ -5,20 +5,29 @@
  * @author Mia Primorac
  */
 
+#define _GNU_SOURCE        // for O_DIRECT
+
 #include "imgfs.h"
+#include "io_engine.h"
+#include "journal.h"
+#include "segment.h"
 #include "util.h"
 
+#include <errno.h>         // for EINVAL
+#include <fcntl.h>         // for open, posix_fadvise
 #include <inttypes.h>      // for PRIxN macros
 #include <openssl/sha.h>   // for SHA256_DIGEST_LENGTH
 #include <stdint.h>        // for uint8_t
 #include <stdio.h>         // for sprintf
 #include <stdlib.h>        // for calloc
 #include <string.h>        // for strcmp
+#include <sys/stat.h>      // for fstat
+#include <unistd.h>        // for pread, pwrite, fdatasync, dup
 
 /*******************************************************************
  * Human-readable SHA
  */
-static void sha_to_string(const unsigned char* SHA,
+void sha_to_string(const unsigned char* SHA,
                           char* sha_string)
 {
     if (SHA == NULL) return;
@@ -67,6 +76,554 @@ ORIGINAL: %" PRIu32 " x %" PRIu32 "\n",
     printf("*****************************************\n");
 }
 
+/*******************************************************************
+ * On-disk format
+ */
+int imgfs_format(const struct imgfs_header* header)
+{
+    if (header != NULL && strncmp(header->name, CAT_TXT_V2, MAX_IMGFS_NAME) == 0) {
+        return IMGFS_FORMAT_V2;
+    }
+    return IMGFS_FORMAT_V1;
+}
+
+/*******************************************************************
+ * Position of the on-disk metadata of a slot
+ */
+long metadata_position(const struct imgfs_header* header, uint32_t index)
+{
+    const size_t entry_size = imgfs_format(header) == IMGFS_FORMAT_V2
+                              ? sizeof(struct img_record) : sizeof(struct img_metadata);
+    return (long) (sizeof(struct imgfs_header) + index * entry_size);
+}
+
+/*******************************************************************
+ * Positional I/O
+ */
+static struct io_engine* io_engine = NULL;
+
+void imgfs_set_io_engine(struct io_engine* engine)
+{
+    io_engine = engine;
+}
+
+/*
+ * Through the I/O engine, if any (and not given up); returns how many
+ * bytes went through, the rest (e.g. after a short transfer) being left
+ * to pread()/pwrite().
+ */
+static size_t engine_transfer(enum io_op op, int fd, void* data, size_t size, uint64_t offset)
+{
+    if (io_engine_failed(io_engine) || size == 0) return 0;
+
+    struct io_request request = { op, fd, data, size, offset, 0, 0 };
+    if (io_engine_submit(io_engine, &request, 1) != ERR_NONE || request.result < 0) return 0;
+    return (size_t) request.result;
+}
+
+static int fd_pread(int fd, void* data, size_t size, uint64_t offset)
+{
+    for (size_t done = engine_transfer(IO_READ, fd, data, size, offset); done < size; ) {
+        const ssize_t n = pread(fd, (char*) data + done, size - done, (off_t) (offset + done));
+        if (n <= 0) return ERR_IO;
+        done += (size_t) n;
+    }
+    return ERR_NONE;
+}
+
+static int fd_pwrite(int fd, const void* data, size_t size, uint64_t offset)
+{
+    for (size_t done = engine_transfer(IO_WRITE, fd, (void*) (uintptr_t) data, size, offset);
+         done < size; ) {
+        const ssize_t n = pwrite(fd, (const char*) data + done, size - done, (off_t) (offset + done));
+        if (n <= 0) return ERR_IO;
+        done += (size_t) n;
+    }
+    return ERR_NONE;
+}
+
+/*
+ * Writes at the end of a file, first rounded up to alignment
+ * (a power of 2): the gap, if any, stays a hole.
+ */
+static int fd_append(int fd, const void* data, size_t size, uint64_t alignment, uint64_t* offset)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) return ERR_IO;
+
+    const uint64_t end = ((uint64_t) st.st_size + alignment - 1) & ~(alignment - 1);
+    const int err = fd_pwrite(fd, data, size, end);
+    if (err == ERR_NONE && offset != NULL) *offset = end;
+    return err;
+}
+
+int imgfs_pread(const struct imgfs_file* imgfs_file, void* data, size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(data);
+
+    return fd_pread(fileno(imgfs_file->file), data, size, offset);
+}
+
+int imgfs_pwrite(const struct imgfs_file* imgfs_file, const void* data, size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(data);
+
+    return fd_pwrite(fileno(imgfs_file->file), data, size, offset);
+}
+
+int imgfs_size(const struct imgfs_file* imgfs_file, uint64_t* size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(size);
+
+    struct stat st;
+    if (fstat(fileno(imgfs_file->file), &st) != 0) return ERR_IO;
+    *size = (uint64_t) st.st_size;
+    return ERR_NONE;
+}
+
+int imgfs_append(const struct imgfs_file* imgfs_file, const void* data, size_t size,
+                 uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(data);
+
+    return fd_append(fileno(imgfs_file->file), data, size, 1, offset);
+}
+
+int imgfs_sync(const struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    if (fflush(imgfs_file->file) != 0 || fdatasync(fileno(imgfs_file->file)) != 0) return ERR_IO;
+    for (int res = 0; res < NB_RES; ++res) {
+        if (imgfs_file->extent_fd[res] >= 0 && fdatasync(imgfs_file->extent_fd[res]) != 0) {
+            return ERR_IO;
+        }
+    }
+    return segments_sync(imgfs_file->segments);
+}
+
+int imgfs_dup_sync_fds(const struct imgfs_file* imgfs_file, int fds[IMGFS_MAX_SYNC_FDS],
+                       size_t* count)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(fds);
+    M_REQUIRE_NON_NULL(count);
+
+    *count = 0;
+    if (fflush(imgfs_file->file) != 0) return ERR_IO;
+
+    // duplicates: the originals may be closed meanwhile (segment rotation)
+    int originals[IMGFS_MAX_SYNC_FDS];
+    size_t nb_originals = 0;
+    originals[nb_originals++] = fileno(imgfs_file->file);
+    for (int res = 0; res < NB_RES; ++res) {
+        if (imgfs_file->extent_fd[res] >= 0) originals[nb_originals++] = imgfs_file->extent_fd[res];
+    }
+    const struct imgfs_segments* segments = imgfs_file->segments;
+    for (int stream = 0; segments != NULL && stream < segments->nb_streams; ++stream) {
+        if (segments->active_fd[stream] >= 0) originals[nb_originals++] = segments->active_fd[stream];
+    }
+
+    for (size_t i = 0; i < nb_originals; ++i) {
+        const int fd = dup(originals[i]);
+        if (fd < 0) {
+            while (*count > 0) close(fds[--*count]);
+            return ERR_IO;
+        }
+        fds[(*count)++] = fd;
+    }
+    return ERR_NONE;
+}
+
+int imgfs_sync_fds(int* fds, size_t count)
+{
+    if (count > 0) M_REQUIRE_NON_NULL(fds);
+
+    int err = ERR_NONE;
+    for (size_t i = 0; i < count; ++i) {
+        if (fdatasync(fds[i]) != 0) err = ERR_IO;
+        close(fds[i]);
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Extent files (IMGFS_FLAG_EXTENT_FILES)
+ */
+static const char* const extent_suffixes[NB_RES] = { ".thumb", ".small", ".orig" };
+
+char* imgfs_extent_path(const char* imgfs_filename, int resolution)
+{
+    const size_t len = strlen(imgfs_filename);
+    const size_t suffix_len = strlen(extent_suffixes[resolution]);
+    char* path = malloc(len + suffix_len + 1);
+    if (path == NULL) return NULL;
+
+    memcpy(path, imgfs_filename, len);
+    memcpy(path + len, extent_suffixes[resolution], suffix_len + 1);
+    return path;
+}
+
+int imgfs_open_extents(struct imgfs_file* imgfs_file, const char* imgfs_filename,
+                       const char* open_mode)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_filename);
+    M_REQUIRE_NON_NULL(open_mode);
+
+    for (int res = 0; res < NB_RES; ++res) imgfs_file->extent_fd[res] = -1;
+    // with segments, each resolution has its own series of them instead
+    if ((imgfs_file->header.flags & (IMGFS_FLAG_EXTENT_FILES | IMGFS_FLAG_SEGMENTS))
+        != IMGFS_FLAG_EXTENT_FILES) {
+        return ERR_NONE;
+    }
+
+    const int create = strcmp(open_mode, "wb") == 0;
+    const int flags = create ? O_WRONLY | O_CREAT | O_TRUNC
+                      : strcmp(open_mode, "rb+") == 0 ? O_RDWR : O_RDONLY;
+
+    int err = ERR_NONE;
+    for (int res = 0; res < NB_RES && err == ERR_NONE; ++res) {
+        char* path = imgfs_extent_path(imgfs_filename, res);
+        if (path == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+            break;
+        }
+        imgfs_file->extent_fd[res] = open(path, flags, 0666);
+        free(path);
+
+        if (imgfs_file->extent_fd[res] < 0) {
+            err = ERR_IO;
+        } else if (create) {
+            // offset 0 means "not stored": a copy of the header goes there
+            err = fd_pwrite(imgfs_file->extent_fd[res], &imgfs_file->header,
+                            sizeof(struct imgfs_header), 0);
+        }
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Image content
+ */
+
+/*
+ * Where the content of a resolution at offset is stored: file and
+ * position in it
+ */
+static int content_location(struct imgfs_file* imgfs_file, int resolution, uint64_t offset,
+                            int* fd, uint64_t* position)
+{
+    if (imgfs_file->segments != NULL) {
+        *position = SEGMENT_POSITION(offset);
+        return segments_fd(imgfs_file, segment_stream(&imgfs_file->header, resolution),
+                           SEGMENT_OF(offset), fd);
+    }
+
+    *fd = imgfs_file->extent_fd[resolution] >= 0
+          ? imgfs_file->extent_fd[resolution] : fileno(imgfs_file->file);
+    *position = offset;
+    return ERR_NONE;
+}
+
+/*
+ * With O_DIRECT: whole aligned blocks, into an aligned buffer.
+ * ERR_INVALID_ARGUMENT if the file system does not support it
+ */
+static int pread_direct(int fd, void* data, size_t size, uint64_t offset)
+{
+    const uint64_t start = offset & ~(uint64_t) (DIRECT_ALIGNMENT - 1);
+    const uint64_t end = (offset + size + DIRECT_ALIGNMENT - 1) & ~(uint64_t) (DIRECT_ALIGNMENT - 1);
+    const size_t needed = (size_t) (offset - start) + size;
+
+    char* buffer = NULL;
+    if (posix_memalign((void**) &buffer, DIRECT_ALIGNMENT, (size_t) (end - start)) != 0) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // the last block may be short, at the end of the file
+    size_t done = 0;
+    int unsupported = 0;
+    while (done < needed) {
+        const ssize_t n = pread(fd, buffer + done, (size_t) (end - start) - done, (off_t) (start + done));
+        if (n <= 0) {
+            unsupported = n < 0 && errno == EINVAL;
+            break;
+        }
+        done += (size_t) n;
+    }
+
+    if (done >= needed) memcpy(data, buffer + (offset - start), size);
+    free(buffer);
+    if (unsupported) return ERR_INVALID_ARGUMENT;
+    return done >= needed ? ERR_NONE : ERR_IO;
+}
+
+/*
+ * Reads keeping the page cache for hotter data: with O_DIRECT if
+ * possible, otherwise by dropping the pages read (posix_fadvise()).
+ */
+static int pread_uncached(struct imgfs_file* imgfs_file, int fd, void* data, size_t size,
+                          uint64_t offset)
+{
+    if (imgfs_file->direct_fd >= 0) {
+        const int err = pread_direct(imgfs_file->direct_fd, data, size, offset);
+        if (err == ERR_NONE) return ERR_NONE;
+        if (err == ERR_INVALID_ARGUMENT) {
+            // the file system does not support it: not worth trying again
+            close(imgfs_file->direct_fd);
+            imgfs_file->direct_fd = -1;
+        }
+    }
+
+    const int err = fd_pread(fd, data, size, offset);
+    if (err == ERR_NONE) posix_fadvise(fd, (off_t) offset, (off_t) size, POSIX_FADV_DONTNEED);
+    return err;
+}
+
+int imgfs_content_pread(struct imgfs_file* imgfs_file, int resolution, void* data,
+                        size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(data);
+    if (resolution < THUMB_RES || resolution > ORIG_RES) return ERR_RESOLUTIONS;
+
+    int fd = -1;
+    uint64_t position = 0;
+    const int err = content_location(imgfs_file, resolution, offset, &fd, &position);
+    if (err != ERR_NONE) return err;
+
+    // large originals, read once, should not evict the hot thumbnails
+    if (resolution == ORIG_RES && (imgfs_file->header.flags & IMGFS_FLAG_DIRECT_ORIG)) {
+        return pread_uncached(imgfs_file, fd, data, size, position);
+    }
+    return fd_pread(fd, data, size, position);
+}
+
+/*
+ * Completes a read the I/O engine did (done bytes of it), if any
+ */
+static int finish_read(int fd, struct content_read* read, size_t done, uint64_t position)
+{
+    if (done >= read->size) return ERR_NONE;
+    return fd_pread(fd, (char*) read->data + done, read->size - done, position + done);
+}
+
+int imgfs_content_preadv(struct imgfs_file* imgfs_file, struct content_read* reads, size_t n)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    if (n > 0) M_REQUIRE_NON_NULL(reads);
+
+    // without engine (or memory for it), one at a time
+    struct io_request* requests = io_engine_failed(io_engine) ? NULL
+                                  : calloc(n, sizeof(struct io_request));
+    size_t* owners = requests == NULL ? NULL : calloc(n, sizeof(size_t));
+    size_t nb_requests = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        struct content_read* read = &reads[i];
+        const int uncached = read->resolution == ORIG_RES
+                             && (imgfs_file->header.flags & IMGFS_FLAG_DIRECT_ORIG);
+        if (owners == NULL || uncached || read->size == 0 || read->data == NULL
+            || read->resolution < THUMB_RES || read->resolution > ORIG_RES) {
+            read->err = imgfs_content_pread(imgfs_file, read->resolution, read->data,
+                                            read->size, read->offset);
+            continue;
+        }
+
+        struct io_request* request = &requests[nb_requests];
+        uint64_t position = 0;
+        read->err = content_location(imgfs_file, read->resolution, read->offset,
+                                     &request->fd, &position);
+        if (read->err != ERR_NONE) continue;
+
+        request->op = IO_READ;
+        request->data = read->data;
+        request->size = read->size;
+        request->offset = position;
+        owners[nb_requests++] = i;
+    }
+
+    if (nb_requests > 0) {
+        // what did not go through (all, if the submission failed) is read again
+        const int submitted = io_engine_submit(io_engine, requests, nb_requests) == ERR_NONE;
+        for (size_t j = 0; j < nb_requests; ++j) {
+            const struct io_request* request = &requests[j];
+            const size_t done = submitted && request->result > 0 ? (size_t) request->result : 0;
+            reads[owners[j]].err = finish_read(request->fd, &reads[owners[j]], done, request->offset);
+        }
+    }
+
+    free(owners);
+    free(requests);
+    return ERR_NONE;
+}
+
+int imgfs_content_append(struct imgfs_file* imgfs_file, int resolution, const void* data,
+                         size_t size, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(data);
+    if (resolution < THUMB_RES || resolution > ORIG_RES) return ERR_RESOLUTIONS;
+
+    const uint64_t alignment = resolution == ORIG_RES
+                               && (imgfs_file->header.flags & IMGFS_FLAG_DIRECT_ORIG)
+                               ? DIRECT_ALIGNMENT : 1;
+
+    if (imgfs_file->segments == NULL) {
+        int fd = -1;
+        uint64_t position = 0;
+        const int err = content_location(imgfs_file, resolution, 0, &fd, &position);
+        return err != ERR_NONE ? err : fd_append(fd, data, size, alignment, offset);
+    }
+
+    int fd = -1;
+    uint32_t segment = 0;
+    uint64_t position = 0;
+    int err = segments_reserve(imgfs_file, segment_stream(&imgfs_file->header, resolution),
+                               size + alignment - 1, &fd, &segment);
+    if (err == ERR_NONE) err = fd_append(fd, data, size, alignment, &position);
+    if (err == ERR_NONE && offset != NULL) *offset = SEGMENT_OFFSET(segment, position);
+    return err;
+}
+
+/*******************************************************************
+ * Loads the v2 records, with the SHA and ID they point to, into
+ * the (zeroed) in-memory metadata.
+ */
+static int read_records(struct imgfs_file* imgfs_file)
+{
+    const uint32_t max_files = imgfs_file->header.max_files;
+    struct img_record* records = calloc(max_files, sizeof(struct img_record));
+    if (records == NULL) return ERR_OUT_OF_MEMORY;
+
+    int err = imgfs_pread(imgfs_file, records, max_files * sizeof(struct img_record),
+                          (uint64_t) metadata_position(&imgfs_file->header, 0));
+
+    for (uint32_t i = 0; i < max_files && err == ERR_NONE; ++i) {
+        const struct img_record* record = &records[i];
+        struct img_metadata* image = &imgfs_file->metadata[i];
+        if (record->is_valid == EMPTY) continue;
+
+        if (record->id_len == 0 || record->id_len > MAX_IMG_ID) {
+            err = ERR_IO;
+            break;
+        }
+        err = imgfs_pread(imgfs_file, image->SHA, SHA256_DIGEST_LENGTH, record->id_offset);
+        if (err == ERR_NONE) {
+            err = imgfs_pread(imgfs_file, image->img_id, record->id_len,
+                              record->id_offset + SHA256_DIGEST_LENGTH);
+        }
+        if (err != ERR_NONE) break;
+        image->img_id[record->id_len] = '\0';
+
+        memcpy(image->orig_res, record->orig_res, sizeof(image->orig_res));
+        memcpy(image->size, record->size, sizeof(image->size));
+        memcpy(image->offset, record->offset, sizeof(image->offset));
+        image->is_valid = record->is_valid;
+    }
+
+    free(records);
+    return err;
+}
+
+/*******************************************************************
+ * Header and metadata updates
+ */
+int imgfs_write_at(struct imgfs_file* imgfs_file, uint64_t offset, const void* data, size_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(data);
+
+    if (imgfs_file->journal != NULL) return journal_log(imgfs_file->journal, offset, data, size);
+
+    return imgfs_pwrite(imgfs_file, data, size, offset);
+}
+
+int imgfs_end_update(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    if (imgfs_file->journal != NULL && !imgfs_file->journal->autocommit) return ERR_NONE;
+
+    return journal_commit(imgfs_file);
+}
+
+/*******************************************************************
+ * Header writing
+ */
+int write_header(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    return imgfs_write_at(imgfs_file, 0, &imgfs_file->header, sizeof(struct imgfs_header));
+}
+
+/*******************************************************************
+ * Metadata writing, in the format of the file
+ */
+int write_metadata(struct imgfs_file* imgfs_file, uint32_t index, int new_image)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    if (index >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    metadata_view_update(imgfs_file, index);
+
+    const struct img_metadata* image = &imgfs_file->metadata[index];
+    const long position = metadata_position(&imgfs_file->header, index);
+
+    if (imgfs_format(&imgfs_file->header) == IMGFS_FORMAT_V1) {
+        return imgfs_write_at(imgfs_file, (uint64_t) position, image, sizeof(struct img_metadata));
+    }
+
+    struct img_record record;
+    if (!journal_lookup(imgfs_file->journal, (uint64_t) position, &record, sizeof(record))) {
+        const int err = imgfs_pread(imgfs_file, &record, sizeof(record), (uint64_t) position);
+        if (err != ERR_NONE) return err;
+    }
+
+    if (new_image) {
+        char id_entry[IMG_ID_ENTRY_SIZE] = {0};
+        memcpy(id_entry, image->SHA, SHA256_DIGEST_LENGTH);
+        memcpy(id_entry + SHA256_DIGEST_LENGTH, image->img_id, strlen(image->img_id));
+
+        // the entry of the former image of the slot is reused, unless the
+        // table grew over it; otherwise, it is appended like image content
+        const uint64_t table_end = (uint64_t) metadata_position(&imgfs_file->header,
+                                   imgfs_file->header.max_files);
+        const int err = record.id_offset >= table_end
+                        ? imgfs_pwrite(imgfs_file, id_entry, sizeof(id_entry), record.id_offset)
+                        : imgfs_append(imgfs_file, id_entry, sizeof(id_entry), &record.id_offset);
+        if (err != ERR_NONE) return err;
+    }
+
+    record.is_valid = image->is_valid;
+    record.id_len = (uint16_t) strlen(image->img_id);
+    memcpy(record.orig_res, image->orig_res, sizeof(record.orig_res));
+    memcpy(record.size, image->size, sizeof(record.size));
+    memcpy(record.offset, image->offset, sizeof(record.offset));
+    memcpy(record.sha_prefix, image->SHA, SHA_PREFIX_LENGTH);
+
+    return imgfs_write_at(imgfs_file, (uint64_t) position, &record, sizeof(record));
+}
+
 /*******************************************************************
  * File opening
  */
@@ -76,22 +633,50 @@ int do_open(const char* imgfs_filename, const char* open_mode, struct imgfs_file
     M_REQUIRE_NON_NULL(open_mode);
     M_REQUIRE_NON_NULL(imgfs_file);
 
-    if (strcmp(open_mode, "rb") == 0 || strcmp(open_mode, "rb+") == 0
-        || (strcmp(open_mode, "wb") == 0)) {
+    imgfs_file->metadata = NULL;
+    imgfs_file->journal = NULL;
+    imgfs_file->direct_fd = -1;
+    for (int res = 0; res < NB_RES; ++res) imgfs_file->extent_fd[res] = -1;
+    imgfs_file->segments = NULL;
+
+    if (strcmp(open_mode, "rb") == 0 || strcmp(open_mode, "rb+") == 0) {
+        // only a writer may replay a journal; it fails if another one is live
+        if (strcmp(open_mode, "rb+") == 0 && journal_recover(imgfs_filename) != ERR_NONE) {
+            return ERR_IO;
+        }
+        imgfs_file->file = fopen(imgfs_filename, open_mode);
+    } else if (strcmp(open_mode, "wb") == 0) {
         imgfs_file->file = fopen(imgfs_filename, open_mode);
     } else {
         return ERR_IO;
     }
 
     if (imgfs_file->file == NULL) return ERR_IO;
+    // all I/O is positional, on the descriptor
+    setvbuf(imgfs_file->file, NULL, _IONBF, 0);
 
-    if(fread(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
+    if (imgfs_pread(imgfs_file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE) {
         do_close(imgfs_file);
         return ERR_IO;
     }
 
     if(imgfs_file->header.nb_files > imgfs_file->header.max_files) return ERR_MAX_FILES;
 
+    if (imgfs_open_extents(imgfs_file, imgfs_filename, open_mode) != ERR_NONE) {
+        do_close(imgfs_file);
+        return ERR_IO;
+    }
+
+    // (originals in segments are read with posix_fadvise())
+    if ((imgfs_file->header.flags & (IMGFS_FLAG_DIRECT_ORIG | IMGFS_FLAG_SEGMENTS))
+        == IMGFS_FLAG_DIRECT_ORIG) {
+        // if this fails, originals are read through the page cache
+        char* orig_path = (imgfs_file->header.flags & IMGFS_FLAG_EXTENT_FILES)
+                          ? imgfs_extent_path(imgfs_filename, ORIG_RES) : NULL;
+        imgfs_file->direct_fd = open(orig_path != NULL ? orig_path : imgfs_filename,
+                                     O_RDONLY | O_DIRECT);
+        free(orig_path);
+    }
 
     imgfs_file->metadata = calloc(imgfs_file->header.max_files, sizeof(struct img_metadata));
 
@@ -100,14 +685,24 @@ int do_open(const char* imgfs_filename, const char* open_mode, struct imgfs_file
         return ERR_OUT_OF_MEMORY;
     }
 
-    if(fread(imgfs_file->metadata, sizeof(struct img_metadata),
-             imgfs_file->header.max_files, imgfs_file->file)
-       != imgfs_file->header.max_files) {
-        do_close(imgfs_file);
-        return ERR_IO;
+    int err = ERR_NONE;
+    if (imgfs_format(&imgfs_file->header) == IMGFS_FORMAT_V2) {
+        err = read_records(imgfs_file);
+    } else {
+        err = imgfs_pread(imgfs_file, imgfs_file->metadata,
+                          imgfs_file->header.max_files * sizeof(struct img_metadata),
+                          sizeof(struct imgfs_header));
     }
 
-    return ERR_NONE;
+    if (err == ERR_NONE) err = metadata_view_build(imgfs_file);
+    if (err == ERR_NONE) err = segments_open(imgfs_file, imgfs_filename, open_mode);
+
+    if (err == ERR_NONE && strcmp(open_mode, "rb+") == 0) {
+        err = journal_open(imgfs_file, imgfs_filename);
+    }
+
+    if (err != ERR_NONE) do_close(imgfs_file);
+    return err;
 }
 
 /*******************************************************************
@@ -118,17 +713,57 @@ void do_close(struct imgfs_file* imgfs_file)
     if (imgfs_file != NULL) {
 
         if (imgfs_file->file != NULL) {
+            journal_close(imgfs_file);
+            segments_close(imgfs_file);
             fclose(imgfs_file->file);
             imgfs_file->file = NULL;
+
+            if (imgfs_file->direct_fd >= 0) close(imgfs_file->direct_fd);
+            imgfs_file->direct_fd = -1;
+            for (int res = 0; res < NB_RES; ++res) {
+                if (imgfs_file->extent_fd[res] >= 0) close(imgfs_file->extent_fd[res]);
+                imgfs_file->extent_fd[res] = -1;
+            }
         }
 
         if (imgfs_file->metadata != NULL) {
             free(imgfs_file->metadata);
             imgfs_file->metadata = NULL;
         }
+
+        memset(&imgfs_file->view, 0, sizeof(imgfs_file->view));
     }
 }
 
+/*******************************************************************
+ * Image lookup by ID
+ */
+int find_image_index(const char* img_id, const struct imgfs_file* imgfs_file,
+                     uint32_t* index)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(index);
+
+    if (imgfs_file->header.nb_files == 0) return ERR_IMAGE_NOT_FOUND;
+
+    const uint32_t hash = img_id_hash(img_id);
+    const uint32_t max_files = imgfs_file->header.max_files;
+
+    for (uint32_t i = metadata_view_next_valid(imgfs_file, 0); i < max_files;
+         i = metadata_view_next_valid(imgfs_file, i + 1)) {
+        if (imgfs_file->view.id_hash[i] == hash
+            && imgfs_file->metadata[i].is_valid != EMPTY
+            && strcmp(img_id, imgfs_file->metadata[i].img_id) == 0) {
+            *index = i;
+            return ERR_NONE;
+        }
+    }
+
+    return ERR_IMAGE_NOT_FOUND;
+}
+
 int resolution_atoi (const char* str)
 {
     if (str == NULL) return -1;
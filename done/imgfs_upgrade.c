@@ -0,0 +1,72 @@
+#include "imgfs.h"
+#include "journal.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*******************************************************************
+ * Converts an imgFS from format v1 to format v2, in place.
+ */
+int do_upgrade(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    if (imgfs_format(&imgfs_file->header) == IMGFS_FORMAT_V2) return ERR_NONE;
+
+    // journaled updates are at v1 positions: have them all in place first
+    int err = journal_checkpoint(imgfs_file);
+    if (err != ERR_NONE) return err;
+
+    // the v2 table is smaller than the v1 one: it fits where the latter was
+    const uint32_t max_files = imgfs_file->header.max_files;
+    struct img_record* records = calloc(max_files, sizeof(struct img_record));
+    if (records == NULL) return ERR_OUT_OF_MEMORY;
+
+    // 1. SHA and ID of the valid images, at the end of the file
+    uint64_t end = 0;
+    err = imgfs_size(imgfs_file, &end);
+
+    for (uint32_t i = 0; i < max_files && err == ERR_NONE; ++i) {
+        const struct img_metadata* image = &imgfs_file->metadata[i];
+        struct img_record* record = &records[i];
+        if (image->is_valid == EMPTY) continue;
+
+        const uint64_t id_offset = end;
+        const size_t id_len = strlen(image->img_id);
+        char id_entry[IMG_ID_ENTRY_SIZE] = {0};
+        memcpy(id_entry, image->SHA, SHA256_DIGEST_LENGTH);
+        memcpy(id_entry + SHA256_DIGEST_LENGTH, image->img_id, id_len);
+        err = imgfs_pwrite(imgfs_file, id_entry, sizeof(id_entry), id_offset);
+        if (err != ERR_NONE) break;
+        end += sizeof(id_entry);
+
+        record->is_valid = image->is_valid;
+        record->id_len = (uint16_t) id_len;
+        record->id_offset = id_offset;
+        memcpy(record->orig_res, image->orig_res, sizeof(record->orig_res));
+        memcpy(record->size, image->size, sizeof(record->size));
+        memcpy(record->offset, image->offset, sizeof(record->offset));
+        memcpy(record->sha_prefix, image->SHA, SHA_PREFIX_LENGTH);
+    }
+
+    // 2. the records, over the v1 metadata, and 3. the header, which
+    // switches the format: logged, then committed as one batch, so that
+    // a crash leaves either the v1 table and header or the v2 ones
+    if (err == ERR_NONE) {
+        err = imgfs_write_at(imgfs_file, sizeof(struct imgfs_header), records,
+                             max_files * sizeof(struct img_record));
+    }
+    free(records);
+    if (err != ERR_NONE) return err;
+
+    memset(imgfs_file->header.name, 0, MAX_IMGFS_NAME);
+    strncpy(imgfs_file->header.name, CAT_TXT_V2, MAX_IMGFS_NAME - 1);
+    imgfs_file->header.version++;
+
+    err = write_header(imgfs_file);
+    if (err == ERR_NONE) err = journal_commit(imgfs_file);
+    return err;
+}
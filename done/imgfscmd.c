@@ -15,7 +15,7 @@
 #include <string.h>
 #include <vips/vips.h>
 
-#define MAPPINGS_NUMBER 6
+#define MAPPINGS_NUMBER 9
 
 typedef int (*command)(int argc, char* argv[]);
 
@@ -30,9 +30,13 @@ command_mapping create_cmd = {"create", do_create_cmd};
 command_mapping delete_cmd = {"delete", do_delete_cmd};
 command_mapping insert_cmd = {"insert", do_insert_cmd};
 command_mapping read_cmd = {"read", do_read_cmd};
+command_mapping upgrade_cmd = {"upgrade", do_upgrade_cmd};
+command_mapping grow_cmd = {"grow", do_grow_cmd};
+command_mapping compact_cmd = {"compact", do_compact_cmd};
 
 command_mapping* commands[MAPPINGS_NUMBER] =
-{&help_cmd, &list_cmd, &create_cmd, &delete_cmd, &insert_cmd, &read_cmd};
+{&help_cmd, &list_cmd, &create_cmd, &delete_cmd, &insert_cmd, &read_cmd, &upgrade_cmd,
+ &grow_cmd, &compact_cmd};
 
 
 /*******************************************************************************
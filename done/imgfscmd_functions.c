@@ -7,11 +7,13 @@
 
 #include "imgfs.h"
 #include "imgfscmd_functions.h"
+#include "segment.h" // for DEFAULT_SEGMENT_SIZE
 #include "util.h"   // for _unused
 
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <errno.h>
 
 // default values
 static const uint32_t default_max_files = 128;
@@ -26,6 +28,9 @@ static const uint16_t MAX_SMALL_RES = 512;
 static const uint16_t ARGS_NBR_MAX_FILES = 2;
 static const uint16_t ARGS_NBR_DO_DELETE = 2;
 static const uint16_t ARGS_NBR_THUMB_SMALL_RES = 3;
+static const uint16_t ARGS_NBR_SEGMENT_SIZE = 2;
+
+static const uint16_t default_max_live_percent = 50;
 
 static void create_name(const char* img_id, int resolution, char** new_name)
 {
@@ -137,11 +142,23 @@ int help(int useless _unused, char** useless_too _unused)
     "           -small_res <X_RES> <Y_RES>: resolution for small images.\n"
     "                                   default value is 256x256\n"
     "                                   maximum value is 512x512\n"
+    "           -direct_orig: align original images and read them around\n"
+    "                                   the page cache (O_DIRECT).\n"
+    "           -extent_files: store each resolution in its own file\n"
+    "                                   (<imgFS_filename>.thumb, .small, .orig).\n"
+    "           -segments [<SEGMENT_SIZE_MB>]: store the content in segment files\n"
+    "                                   (<imgFS_filename>.000000, ...).\n"
+    "                                   default size is 64 MB\n"
     "   read   <imgFS_filename> <imgID> [original|orig|thumbnail|thumb|small]:\n"
     "       read an image from the imgFS and save it to a file.\n"
     "       default resolution is \"original\".\n"
     "   insert <imgFS_filename> <imgID> <filename>: insert a new image in the imgFS.\n"
-    "   delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n");
+    "   delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n"
+    "   upgrade <imgFS_filename>: convert imgFS to the compact on-disk format v2.\n"
+    "   grow <imgFS_filename> <MAX_FILES>: raise the maximum number of files of imgFS.\n"
+    "   compact <imgFS_filename> [<MAX_LIVE_PERCENT>]: copy what is still used in the\n"
+    "       segments that are at most MAX_LIVE_PERCENT used, and remove them.\n"
+    "       default value is 50\n");
     return ERR_NONE;
 }
 
@@ -186,6 +203,8 @@ int do_create_cmd(int argc, char** argv)
     uint16_t thumb_resY = default_thumb_res;
     uint16_t small_resX = default_small_res;
     uint16_t small_resY = default_small_res;
+    uint32_t flags = 0;
+    uint64_t segment_size = 0;
 
     const char* imgfs_filename = argv[0];
     argc--; argv++;
@@ -225,6 +244,27 @@ int do_create_cmd(int argc, char** argv)
             }
             argc -= ARGS_NBR_THUMB_SMALL_RES;
             argv += ARGS_NBR_THUMB_SMALL_RES;
+        } else if (strcmp(argv[0], "-direct_orig") == 0) {
+            flags |= IMGFS_FLAG_DIRECT_ORIG;
+            argc--;
+            argv++;
+        } else if (strcmp(argv[0], "-extent_files") == 0) {
+            flags |= IMGFS_FLAG_EXTENT_FILES;
+            argc--;
+            argv++;
+        } else if (strcmp(argv[0], "-segments") == 0) {
+            flags |= IMGFS_FLAG_SEGMENTS;
+            segment_size = DEFAULT_SEGMENT_SIZE;
+            // the size is optional
+            const uint32_t size_mb = argc >= ARGS_NBR_SEGMENT_SIZE ? atouint32(argv[1]) : 0;
+            if (size_mb > 0) {
+                segment_size = (uint64_t) size_mb << 20;
+                argc -= ARGS_NBR_SEGMENT_SIZE;
+                argv += ARGS_NBR_SEGMENT_SIZE;
+            } else {
+                argc--;
+                argv++;
+            }
         } else {
             return ERR_INVALID_ARGUMENT;
         }
@@ -237,6 +277,8 @@ int do_create_cmd(int argc, char** argv)
     header.resized_res[1] = thumb_resY;
     header.resized_res[2] = small_resX;
     header.resized_res[3] = small_resY;
+    header.flags = flags;
+    header.segment_size = segment_size;
 
     struct imgfs_file imgfs_file = {0};
 
@@ -339,3 +381,95 @@ int do_insert_cmd(int argc, char **argv)
     do_close(&myfile);
     return error;
 }
+
+/**********************************************************************
+ * Converts the imgFS to on-disk format v2.
+ */
+int do_upgrade_cmd(int argc, char** argv)
+{
+    if (argv == NULL) return ERR_INVALID_ARGUMENT;
+
+    if (argc < 1) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    if (argc > 1) return ERR_INVALID_COMMAND;
+
+    struct imgfs_file imgfs_file = {0};
+
+    int err = do_open(argv[0], "rb+", &imgfs_file);
+
+    if (err != ERR_NONE) {
+        do_close(&imgfs_file);
+        return err;
+    }
+
+    err = do_upgrade(&imgfs_file);
+
+    do_close(&imgfs_file);
+
+    return err;
+}
+
+/**********************************************************************
+ * Raises the maximum number of files of the imgFS.
+ */
+int do_grow_cmd(int argc, char** argv)
+{
+    if (argv == NULL) return ERR_INVALID_ARGUMENT;
+
+    if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    if (argc > 2) return ERR_INVALID_COMMAND;
+
+    const uint32_t max_files = atouint32(argv[1]);
+    if (max_files == 0) return ERR_MAX_FILES;
+
+    struct imgfs_file imgfs_file = {0};
+
+    int err = do_open(argv[0], "rb+", &imgfs_file);
+
+    if (err != ERR_NONE) {
+        do_close(&imgfs_file);
+        return err;
+    }
+
+    err = do_grow(&imgfs_file, max_files);
+
+    do_close(&imgfs_file);
+
+    return err;
+}
+
+/**********************************************************************
+ * Compacts the segments of the imgFS.
+ */
+int do_compact_cmd(int argc, char** argv)
+{
+    if (argv == NULL) return ERR_INVALID_ARGUMENT;
+
+    if (argc < 1) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    if (argc > 2) return ERR_INVALID_COMMAND;
+
+    uint16_t max_live_percent = default_max_live_percent;
+    if (argc == 2) {
+        max_live_percent = atouint16(argv[1]);
+        if (errno == ERANGE || max_live_percent > 100) return ERR_INVALID_ARGUMENT;
+    }
+
+    struct imgfs_file imgfs_file = {0};
+
+    int err = do_open(argv[0], "rb+", &imgfs_file);
+
+    if (err != ERR_NONE) {
+        do_close(&imgfs_file);
+        return err;
+    }
+
+    uint32_t dropped = 0;
+    err = do_compact(&imgfs_file, max_live_percent, &dropped);
+    if (err == ERR_NONE) printf("%" PRIu32 " segment(s) removed\n", dropped);
+
+    do_close(&imgfs_file);
+
+    return err;
+}
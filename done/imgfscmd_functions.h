@@ -36,3 +36,18 @@ int do_insert_cmd(int argc, char* argv[]);
  * Reads an image from the imgFS.
  *******************************************************************/
 int do_read_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Converts the imgFS to on-disk format v2.
+ *******************************************************************/
+int do_upgrade_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Raises the maximum number of files of the imgFS.
+ *******************************************************************/
+int do_grow_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Compacts the segments of the imgFS.
+ *******************************************************************/
+int do_compact_cmd(int argc, char* argv[]);
@@ -0,0 +1,290 @@
+/* ** NOTE: undocumented in Doxygen
+ * @file io_engine.c
+ * @brief Asynchronous I/O engine (io_uring) for the imgFS content
+ */
+
+#include "io_engine.h"
+#include "error.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h> // for nanosleep
+
+#if defined(__linux__) && !defined(IMGFS_NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#define WITH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef WITH_IO_URING
+
+#define WAIT_RETRY_NS 1000000L // between waits the kernel refused
+
+static int ring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/*******************************************************************
+ * Setup
+ */
+int io_engine_init(struct io_engine* engine, unsigned depth)
+{
+    M_REQUIRE_NON_NULL(engine);
+    if (depth == 0) return ERR_INVALID_ARGUMENT;
+
+    memset(engine, 0, sizeof(*engine));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    engine->ring_fd = ring_setup(depth, &params);
+    if (engine->ring_fd < 0) return ERR_IO;
+    // at most sq_entries in flight: the completion ring (twice as large) cannot overflow
+    engine->depth = params.sq_entries;
+
+    engine->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    engine->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && engine->cq_ring_size > engine->sq_ring_size) {
+        engine->sq_ring_size = engine->cq_ring_size;
+    }
+
+    engine->sq_ring = mmap(NULL, engine->sq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_SQ_RING);
+    if (engine->sq_ring == MAP_FAILED) {
+        close(engine->ring_fd);
+        return ERR_IO;
+    }
+
+    if (single_mmap) {
+        engine->cq_ring = engine->sq_ring;
+    } else {
+        engine->cq_ring = mmap(NULL, engine->cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_CQ_RING);
+    }
+    engine->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    engine->sqes = engine->cq_ring == MAP_FAILED ? MAP_FAILED
+                   : mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_SQES);
+    if (engine->sqes == MAP_FAILED) {
+        if (engine->cq_ring != MAP_FAILED && !single_mmap) munmap(engine->cq_ring, engine->cq_ring_size);
+        munmap(engine->sq_ring, engine->sq_ring_size);
+        close(engine->ring_fd);
+        return ERR_IO;
+    }
+
+    char* const sq = engine->sq_ring;
+    char* const cq = engine->cq_ring;
+    engine->sq_head = (unsigned*) (void*) (sq + params.sq_off.head);
+    engine->sq_tail = (unsigned*) (void*) (sq + params.sq_off.tail);
+    engine->sq_mask = (unsigned*) (void*) (sq + params.sq_off.ring_mask);
+    engine->sq_array = (unsigned*) (void*) (sq + params.sq_off.array);
+    engine->cq_head = (unsigned*) (void*) (cq + params.cq_off.head);
+    engine->cq_tail = (unsigned*) (void*) (cq + params.cq_off.tail);
+    engine->cq_mask = (unsigned*) (void*) (cq + params.cq_off.ring_mask);
+    engine->cqes = cq + params.cq_off.cqes;
+
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->completed, NULL);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Release
+ */
+void io_engine_free(struct io_engine* engine)
+{
+    if (engine == NULL || engine->sq_ring == NULL) return;
+
+    munmap(engine->sqes, engine->sqes_size);
+    if (engine->cq_ring != engine->sq_ring) munmap(engine->cq_ring, engine->cq_ring_size);
+    munmap(engine->sq_ring, engine->sq_ring_size);
+    close(engine->ring_fd);
+    pthread_cond_destroy(&engine->completed);
+    pthread_mutex_destroy(&engine->lock);
+    memset(engine, 0, sizeof(*engine));
+}
+
+/*******************************************************************
+ * Queues a request in the submission ring, with lock held
+ */
+static void queue(struct io_engine* engine, struct io_request* request)
+{
+    const unsigned tail = *engine->sq_tail; // only written by us
+    const unsigned index = tail & *engine->sq_mask;
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*) engine->sqes + index;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->op == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = request->fd;
+    sqe->addr = (uint64_t) (uintptr_t) request->data;
+    sqe->len = (uint32_t) request->size;
+    sqe->off = request->offset;
+    sqe->user_data = (uint64_t) (uintptr_t) request;
+
+    engine->sq_array[index] = index;
+    __atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    request->done = 0;
+    ++engine->in_flight;
+    ++engine->queued;
+}
+
+/*******************************************************************
+ * Hands the completions to their requests, with lock held
+ */
+static void reap(struct io_engine* engine)
+{
+    unsigned head = *engine->cq_head;
+    const unsigned tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe* cqe = (const struct io_uring_cqe*) engine->cqes
+                                         + (head & *engine->cq_mask);
+        struct io_request* request = (struct io_request*) (uintptr_t) cqe->user_data;
+        request->result = cqe->res;
+        request->done = 1;
+        --engine->in_flight;
+    }
+    __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************
+ * Takes back the requests queued but not consumed by the kernel, after
+ * a refused submission, with lock held: they complete with -ECANCELED
+ * and nothing refers to them anymore
+ */
+static void cancel_queued(struct io_engine* engine)
+{
+    const unsigned head = __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE);
+    const unsigned tail = *engine->sq_tail;
+
+    for (unsigned at = head; at != tail; ++at) {
+        const struct io_uring_sqe* sqe = (const struct io_uring_sqe*) engine->sqes
+                                         + engine->sq_array[at & *engine->sq_mask];
+        struct io_request* request = (struct io_request*) (uintptr_t) sqe->user_data;
+        request->result = -ECANCELED;
+        request->done = 1;
+        --engine->in_flight;
+    }
+    __atomic_store_n(engine->sq_tail, head, __ATOMIC_RELEASE);
+    engine->queued = 0;
+}
+
+static int all_done(const struct io_request* requests, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (!requests[i].done) return 0;
+    }
+    return 1;
+}
+
+int io_engine_failed(const struct io_engine* engine)
+{
+    return engine == NULL || __atomic_load_n(&engine->failed, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************
+ * Submission and completion
+ */
+int io_engine_submit(struct io_engine* engine, struct io_request* requests, size_t n)
+{
+    M_REQUIRE_NON_NULL(engine);
+    M_REQUIRE_NON_NULL(requests);
+
+    pthread_mutex_lock(&engine->lock);
+
+    size_t next = 0; // first request not queued yet
+    while (next < n || !all_done(requests, n)) {
+        if (engine->failed && next < n) {
+            // never queued: they can be given up right away
+            for (; next < n; ++next) {
+                requests[next].result = -ECANCELED;
+                requests[next].done = 1;
+            }
+            continue;
+        }
+        while (next < n && engine->in_flight < engine->depth) {
+            queue(engine, &requests[next++]);
+        }
+
+        if (engine->in_kernel) {
+            // it submits our requests when back, or the next one of us does
+            pthread_cond_wait(&engine->completed, &engine->lock);
+            continue;
+        }
+
+        // submits everything queued so far and waits for some completion
+        engine->in_kernel = 1;
+        const unsigned to_submit = engine->queued;
+        pthread_mutex_unlock(&engine->lock);
+        const int ret = ring_enter(engine->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+        const int enter_errno = errno;
+        pthread_mutex_lock(&engine->lock);
+
+        int refused_wait = 0;
+        if (ret >= 0) {
+            engine->queued -= (unsigned) ret < to_submit ? (unsigned) ret : to_submit;
+        } else if (enter_errno != EINTR && enter_errno != EAGAIN && enter_errno != EBUSY) {
+            // the requests in the ring must not outlive their callers;
+            // those in the kernel are still waited for (with nothing to submit)
+            refused_wait = engine->failed && to_submit == 0;
+            cancel_queued(engine);
+            __atomic_store_n(&engine->failed, 1, __ATOMIC_RELAXED);
+        }
+        reap(engine);
+        engine->in_kernel = 0;
+        pthread_cond_broadcast(&engine->completed);
+        if (refused_wait) {
+            // not even waiting works: the kernel may still write to the
+            // buffers of our requests, so we cannot return before they
+            // complete; retry without spinning
+            const struct timespec pause = { 0, WAIT_RETRY_NS };
+            pthread_mutex_unlock(&engine->lock);
+            nanosleep(&pause, NULL);
+            pthread_mutex_lock(&engine->lock);
+        }
+    }
+
+    const int err = engine->failed ? ERR_IO : ERR_NONE;
+    pthread_mutex_unlock(&engine->lock);
+    return err;
+}
+
+#else // no io_uring
+
+int io_engine_init(struct io_engine* engine, unsigned depth)
+{
+    M_REQUIRE_NON_NULL(engine);
+    (void) depth;
+    memset(engine, 0, sizeof(*engine));
+    return ERR_IO;
+}
+
+void io_engine_free(struct io_engine* engine)
+{
+    (void) engine;
+}
+
+int io_engine_failed(const struct io_engine* engine)
+{
+    (void) engine;
+    return 1;
+}
+
+int io_engine_submit(struct io_engine* engine, struct io_request* requests, size_t n)
+{
+    (void) engine;
+    (void) requests;
+    (void) n;
+    return ERR_IO;
+}
+
+#endif
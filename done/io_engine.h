@@ -0,0 +1,115 @@
+/**
+ * @file io_engine.h
+ * @brief Asynchronous I/O engine (io_uring) for the imgFS content.
+ *
+ * An engine is one io_uring shared by all threads. Requests are queued
+ * in its submission ring; the thread that next enters the kernel submits
+ * all those queued so far (its own and the other threads') in the same
+ * system call, and reaps the completions of everybody. While a thread
+ * waits in the kernel, the others only queue.
+ *
+ * Batches come from io_engine_submit() calls with several requests (the
+ * content reads of a batch read), and from threads that do not share a
+ * lock: the server reads and appends one blob at a time under the lock
+ * of its shard, so those of one shard go one by one, and only those of
+ * different shards (or stores) can share a system call.
+ *
+ * If the kernel refuses a submission, the requests still in the ring are
+ * taken back (they complete with -ECANCELED) and the engine is marked
+ * failed for good: later submissions fail at once, and callers fall back
+ * to pread()/pwrite() (they can check io_engine_failed() first). Requests
+ * already in the kernel are still waited for.
+ *
+ * io_uring is used directly through its system calls (no liburing). It
+ * is compiled in on Linux unless IMGFS_NO_IO_URING is defined; where it
+ * is not, or when the kernel refuses it, io_engine_init() fails and the
+ * callers keep to pread()/pwrite().
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>    // for size_t
+#include <stdint.h>    // for uint64_t
+#include <sys/types.h> // for ssize_t
+
+#define IO_ENGINE_DEPTH 64 // requests in flight, at most
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum io_op {
+    IO_READ,
+    IO_WRITE
+};
+
+struct io_request {
+    enum io_op op;
+    int fd;
+    void* data;
+    size_t size;
+    uint64_t offset;
+    ssize_t result; // bytes transferred, or -errno
+    int done;
+};
+
+struct io_engine {
+    int ring_fd;
+    unsigned depth;
+
+    // submission ring
+    void* sq_ring;
+    size_t sq_ring_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    void* sqes;
+    size_t sqes_size;
+
+    // completion ring (may be sq_ring)
+    void* cq_ring;
+    size_t cq_ring_size;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    void* cqes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t completed;   // some requests are done
+    unsigned in_flight;         // queued or submitted, not completed
+    unsigned queued;            // not submitted yet
+    int in_kernel;              // a thread is submitting/waiting
+    int failed;                 // a submission was refused: not used anymore (atomic)
+};
+
+/**
+ * @brief Sets an engine up.
+ *
+ * @return Some error code: ERR_IO if io_uring is not available. 0 if no error.
+ */
+int io_engine_init(struct io_engine* engine, unsigned depth);
+
+/**
+ * @brief Releases an engine, with no request in flight.
+ */
+void io_engine_free(struct io_engine* engine);
+
+/**
+ * @brief Tells whether an engine was given up (see above), without lock.
+ */
+int io_engine_failed(const struct io_engine* engine);
+
+/**
+ * @brief Performs n requests, submitted together, and returns once all
+ *        of them are done. Each one gets its own result, which may be a
+ *        short transfer.
+ *
+ * @return Some error code (of the engine, not of the requests). 0 if no error.
+ */
+int io_engine_submit(struct io_engine* engine, struct io_request* requests, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
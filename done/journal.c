@@ -0,0 +1,371 @@
+/* ** NOTE: undocumented in Doxygen
+ * @file journal.c
+ * @brief Write-ahead (redo) journal for the imgFS metadata
+ */
+
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h> // for flock
+#include <unistd.h>   // for fdatasync, ftruncate, unlink
+#include <zlib.h>     // for crc32
+
+#define JOURNAL_MAGIC 0x4c4e4a49u   // "IJNL"
+#define MAX_BATCH_SIZE (1u << 30)   // sanity bound when recovering
+
+// on-disk batch: this header, then `count` entries, `bytes` bytes in total
+struct batch_header {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t bytes;
+    uint32_t crc;       // crc32 of the entries
+    uint32_t unused_32;
+};
+
+// on-disk entry: this header, then `size` bytes to write at `offset`
+struct entry_header {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t unused_32;
+};
+
+/*******************************************************************
+ * "<imgfs_filename>.journal", to be freed
+ */
+static char* journal_path(const char* imgfs_filename)
+{
+    const size_t len = strlen(imgfs_filename);
+    char* path = malloc(len + sizeof(JOURNAL_SUFFIX));
+    if (path == NULL) return NULL;
+
+    memcpy(path, imgfs_filename, len);
+    memcpy(path + len, JOURNAL_SUFFIX, sizeof(JOURNAL_SUFFIX));
+    return path;
+}
+
+/*******************************************************************
+ * Writes serialized entries in place
+ */
+static int apply_entries(const struct imgfs_file* imgfs_file, const char* entries, size_t len)
+{
+    size_t at = 0;
+    while (at + sizeof(struct entry_header) <= len) {
+        struct entry_header entry;
+        memcpy(&entry, entries + at, sizeof(entry));
+        at += sizeof(entry);
+        if (entry.size > len - at) return ERR_IO;
+
+        const int err = imgfs_pwrite(imgfs_file, entries + at, entry.size, entry.offset);
+        if (err != ERR_NONE) return err;
+        at += entry.size;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Syncs the data of a stream to disk
+ */
+static int sync_file(FILE* file)
+{
+    if (fflush(file) != 0 || fdatasync(fileno(file)) != 0) return ERR_IO;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Drops what was written of a batch that failed: the journal ends
+ * with the last committed batch again
+ */
+static void drop_partial_batch(struct imgfs_journal* journal)
+{
+    // what stdio still holds goes out first, so that it is cut as well
+    clearerr(journal->file);
+    (void) fflush(journal->file);
+    if (ftruncate(fileno(journal->file), (off_t) journal->size) != 0) {
+        perror("ftruncate() in drop_partial_batch()");
+    }
+}
+
+/*******************************************************************
+ * Crash recovery
+ */
+int journal_recover(const char* imgfs_filename)
+{
+    M_REQUIRE_NON_NULL(imgfs_filename);
+
+    char* path = journal_path(imgfs_filename);
+    if (path == NULL) return ERR_OUT_OF_MEMORY;
+
+    FILE* journal = fopen(path, "rb");
+    if (journal == NULL) {
+        // no journal: clean shutdown
+        free(path);
+        return ERR_NONE;
+    }
+    // a writer that has the imgFS open holds the lock: its journal is live
+    if (flock(fileno(journal), LOCK_EX | LOCK_NB) != 0) {
+        fclose(journal);
+        free(path);
+        return ERR_IO;
+    }
+
+    struct imgfs_file target;   // only its file is used
+    memset(&target, 0, sizeof(target));
+    int err = ERR_NONE;
+    struct batch_header batch;
+
+    // batches are replayed up to the first incomplete or corrupted one
+    while (err == ERR_NONE && fread(&batch, sizeof(batch), 1, journal) == 1
+           && batch.magic == JOURNAL_MAGIC && batch.bytes <= MAX_BATCH_SIZE) {
+        char* entries = malloc(batch.bytes);
+        if (entries == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+            break;
+        }
+        if (fread(entries, 1, batch.bytes, journal) != batch.bytes
+            || crc32(0L, (const Bytef*) entries, (uInt) batch.bytes) != batch.crc) {
+            free(entries);
+            break;
+        }
+
+        if (target.file == NULL && (target.file = fopen(imgfs_filename, "rb+")) == NULL) {
+            err = ERR_IO;
+        } else {
+            err = apply_entries(&target, entries, batch.bytes);
+        }
+        free(entries);
+    }
+
+    if (target.file != NULL) {
+        if (err == ERR_NONE) err = sync_file(target.file);
+        fclose(target.file);
+    }
+
+    // the journal is only dropped once its content is in place,
+    // and before its lock is released
+    if (err == ERR_NONE) unlink(path);
+    fclose(journal);
+    free(path);
+    return err;
+}
+
+/*******************************************************************
+ * Journal opening
+ */
+int journal_open(struct imgfs_file* imgfs_file, const char* imgfs_filename)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_filename);
+
+    struct imgfs_journal* journal = calloc(1, sizeof(struct imgfs_journal));
+    if (journal == NULL) return ERR_OUT_OF_MEMORY;
+
+    journal->path = journal_path(imgfs_filename);
+    if (journal->path == NULL) {
+        free(journal);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // not truncated before the lock is held: the journal may be live.
+    // Otherwise, any previous content has been recovered by now
+    journal->file = fopen(journal->path, "ab");
+    if (journal->file == NULL
+        || flock(fileno(journal->file), LOCK_EX | LOCK_NB) != 0
+        || ftruncate(fileno(journal->file), 0) != 0) {
+        if (journal->file != NULL) fclose(journal->file);
+        free(journal->path);
+        free(journal);
+        return ERR_IO;
+    }
+
+    journal->autocommit = 1;
+    imgfs_file->journal = journal;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Journal closing
+ */
+void journal_close(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file == NULL || imgfs_file->journal == NULL) return;
+
+    struct imgfs_journal* journal = imgfs_file->journal;
+
+    // an empty journal is not needed for recovery; keep it otherwise
+    const int err = journal_checkpoint(imgfs_file);
+    // unlinked before the lock is released, so never under a new writer
+    if (err == ERR_NONE) unlink(journal->path);
+    fclose(journal->file);
+
+    free(journal->path);
+    free(journal->pending);
+    free(journal);
+    imgfs_file->journal = NULL;
+}
+
+/*******************************************************************
+ * Update logging
+ */
+int journal_log(struct imgfs_journal* journal, uint64_t offset, const void* data, size_t size)
+{
+    M_REQUIRE_NON_NULL(journal);
+    M_REQUIRE_NON_NULL(data);
+    if (size > UINT32_MAX) return ERR_INVALID_ARGUMENT;
+
+    const size_t needed = journal->pending_len + sizeof(struct entry_header) + size;
+    if (needed > journal->pending_cap) {
+        size_t cap = journal->pending_cap == 0 ? 1024 : journal->pending_cap;
+        while (cap < needed) cap *= 2;
+        char* pending = realloc(journal->pending, cap);
+        if (pending == NULL) return ERR_OUT_OF_MEMORY;
+        journal->pending = pending;
+        journal->pending_cap = cap;
+    }
+
+    const struct entry_header entry = { offset, (uint32_t) size, 0 };
+    memcpy(journal->pending + journal->pending_len, &entry, sizeof(entry));
+    memcpy(journal->pending + journal->pending_len + sizeof(entry), data, size);
+    journal->pending_len = needed;
+    ++journal->pending_count;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Pending update lookup
+ */
+int journal_lookup(const struct imgfs_journal* journal, uint64_t offset, void* data, size_t size)
+{
+    if (journal == NULL || data == NULL) return 0;
+
+    int found = 0;
+    size_t at = 0;
+    while (at + sizeof(struct entry_header) <= journal->pending_len) {
+        struct entry_header entry;
+        memcpy(&entry, journal->pending + at, sizeof(entry));
+        at += sizeof(entry);
+        if (entry.offset == offset && entry.size == size) {
+            // later updates override earlier ones
+            memcpy(data, journal->pending + at, size);
+            found = 1;
+        }
+        at += entry.size;
+    }
+    return found;
+}
+
+/*******************************************************************
+ * Group commit, in steps
+ */
+void journal_group_begin(const struct imgfs_journal* journal, struct journal_group* group)
+{
+    if (group == NULL) return;
+
+    group->len = journal == NULL ? 0 : journal->pending_len;
+    group->count = journal == NULL ? 0 : journal->pending_count;
+}
+
+int journal_group_write(struct imgfs_journal* journal, const struct journal_group* group)
+{
+    M_REQUIRE_NON_NULL(journal);
+    M_REQUIRE_NON_NULL(group);
+    if (group->len > journal->pending_len) return ERR_INVALID_ARGUMENT;
+
+    const struct batch_header batch = {
+        JOURNAL_MAGIC, group->count, group->len,
+        (uint32_t) crc32(0L, (const Bytef*) journal->pending, (uInt) group->len), 0
+    };
+    if (fwrite(&batch, sizeof(batch), 1, journal->file) != 1
+        || fwrite(journal->pending, 1, group->len, journal->file) != group->len
+        || fflush(journal->file) != 0) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+int journal_group_sync(const struct imgfs_journal* journal)
+{
+    M_REQUIRE_NON_NULL(journal);
+
+    // (flushed by journal_group_write())
+    return fdatasync(fileno(journal->file)) == 0 ? ERR_NONE : ERR_IO;
+}
+
+int journal_group_end(struct imgfs_file* imgfs_file, const struct journal_group* group, int err)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(group);
+
+    struct imgfs_journal* journal = imgfs_file->journal;
+    if (journal == NULL) return err;
+    if (err != ERR_NONE) {
+        // the updates stay pending; a later commit writes them again
+        drop_partial_batch(journal);
+        return err;
+    }
+
+    if (group->len == 0) return ERR_NONE;
+
+    // in place; a crash from now on is repaired by journal_recover()
+    err = apply_entries(imgfs_file, journal->pending, group->len);
+
+    // the updates logged since the group began stay pending
+    journal->size += sizeof(struct batch_header) + group->len;
+    memmove(journal->pending, journal->pending + group->len, journal->pending_len - group->len);
+    journal->pending_len -= group->len;
+    journal->pending_count -= group->count;
+
+    // (rare, and done at once, lock held)
+    if (err == ERR_NONE && journal->size >= JOURNAL_CHECKPOINT_SIZE) {
+        err = journal_checkpoint(imgfs_file);
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Group commit
+ */
+int journal_commit(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    struct imgfs_journal* journal = imgfs_file->journal;
+    // without journal, updates were written in place
+    if (journal == NULL || journal->pending_count == 0) return ERR_NONE;
+
+    // 1. the content the updates refer to (also in the extent files)
+    int err = imgfs_sync(imgfs_file);
+    if (err != ERR_NONE) return err;
+
+    // 2. the updates, as one batch
+    struct journal_group group;
+    journal_group_begin(journal, &group);
+    err = journal_group_write(journal, &group);
+    if (err == ERR_NONE) err = journal_group_sync(journal);
+
+    // 3. in place
+    return journal_group_end(imgfs_file, &group, err);
+}
+
+/*******************************************************************
+ * Checkpoint
+ */
+int journal_checkpoint(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    int err = journal_commit(imgfs_file);
+    struct imgfs_journal* journal = imgfs_file->journal;
+    if (err != ERR_NONE || journal == NULL || journal->size == 0) return err;
+
+    err = sync_file(imgfs_file->file);
+    if (err != ERR_NONE) return err;
+
+    if (fflush(journal->file) != 0 || ftruncate(fileno(journal->file), 0) != 0) return ERR_IO;
+    rewind(journal->file);
+    journal->size = 0;
+    return ERR_NONE;
+}
@@ -0,0 +1,144 @@
+/**
+ * @file journal.h
+ * @brief Write-ahead (redo) journal for the imgFS metadata.
+ *
+ * Updates of the header and of the metadata table are not written in
+ * place right away: they are logged, then committed in groups. A commit
+ * makes the image content appended so far durable, appends all the
+ * logged updates to the journal file ("<imgFS>.journal") as one
+ * checksummed batch, syncs it, and only then applies the updates in
+ * place. Whatever the number of updates in the group, a commit costs
+ * two fdatasync()'s.
+ *
+ * When opening an imgFS, the committed batches left in its journal by
+ * a crash are replayed; a torn last batch is ignored.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_CHECKPOINT_SIZE (1 << 20) // journal bytes after which it is truncated
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct imgfs_journal {
+    FILE* file;
+    char* path;
+    char* pending;        // logged, uncommitted updates (serialized entries)
+    size_t pending_len;
+    size_t pending_cap;
+    uint32_t pending_count;
+    int autocommit;       // commit at the end of each update (default)
+    uint64_t size;        // bytes in the journal file
+};
+
+/**
+ * @brief Replays the committed updates left in the journal of an imgFS, if any,
+ *        and empties it. For writers only; fails if the journal is held
+ *        (locked) by a writer that has the imgFS open.
+ *
+ * @param imgfs_filename Path to the imgFS file.
+ * @return Some error code. 0 if no error.
+ */
+int journal_recover(const char* imgfs_filename);
+
+/**
+ * @brief Opens (creates) the journal of an imgFS opened for writing, and
+ *        locks it until journal_close(): one writer at a time.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int journal_open(struct imgfs_file* imgfs_file, const char* imgfs_filename);
+
+/**
+ * @brief Commits the pending updates, empties the journal and removes it.
+ */
+void journal_close(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Logs an update of size bytes at offset of the imgFS file.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int journal_log(struct imgfs_journal* journal, uint64_t offset, const void* data, size_t size);
+
+/**
+ * @brief Gets the last pending (not yet in place) update of exactly
+ *        [offset, offset + size), if any.
+ *
+ * @return 1 if found (and copied to data), 0 otherwise.
+ */
+int journal_lookup(const struct imgfs_journal* journal, uint64_t offset, void* data, size_t size);
+
+/**
+ * @brief Group commit: makes all the pending updates durable, then
+ *        applies them in place. Without a journal, does nothing.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int journal_commit(struct imgfs_file* imgfs_file);
+
+/**
+ * Group commit in steps, for callers that release the lock of the imgFS
+ * while syncing (journal_commit() takes all the steps at once):
+ *
+ *   journal_group_begin()          lock held
+ *   imgfs_sync_fds()               of imgfs_dup_sync_fds(), lock released
+ *   journal_group_write()          lock held
+ *   journal_group_sync()           lock released
+ *   journal_group_end()            lock held
+ *
+ * Only one group may be under way: the caller serializes its committers.
+ * Updates logged meanwhile stay pending, for the next group.
+ */
+struct journal_group {
+    size_t len;           // of the pending entries, from their start
+    uint32_t count;
+};
+
+/**
+ * @brief Starts a group with the updates pending now.
+ */
+void journal_group_begin(const struct imgfs_journal* journal, struct journal_group* group);
+
+/**
+ * @brief Writes the group to the journal as one batch, once the content
+ *        it refers to is durable. Not synced yet.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int journal_group_write(struct imgfs_journal* journal, const struct journal_group* group);
+
+/**
+ * @brief Makes the batch written by journal_group_write() durable.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int journal_group_sync(const struct imgfs_journal* journal);
+
+/**
+ * @brief Ends a group: if err (of the previous steps) is 0, applies its
+ *        updates in place; otherwise, drops what was written of its batch
+ *        and its updates stay pending.
+ *
+ * @return Some error code (err, else of applying). 0 if no error.
+ */
+int journal_group_end(struct imgfs_file* imgfs_file, const struct journal_group* group, int err);
+
+/**
+ * @brief Commits, makes the imgFS file durable and empties the journal.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int journal_checkpoint(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,260 @@
+/*
+ * @file json_writer.c
+ * @brief Streaming JSON emitter.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "json_writer.h"
+
+#define JSON_INITIAL_SIZE 256
+
+/*******************************************************************
+ * Initialization and clean-up
+ */
+void json_writer_init(struct json_writer* writer, json_sink sink, void* sink_arg)
+{
+    if (writer == NULL) return;
+
+    memset(writer, 0, sizeof(*writer));
+    writer->sink = sink;
+    writer->sink_arg = sink_arg;
+}
+
+void json_writer_free(struct json_writer* writer)
+{
+    if (writer == NULL) return;
+
+    free(writer->buf);
+    writer->buf = NULL;
+    writer->len = 0;
+    writer->cap = 0;
+}
+
+/*******************************************************************
+ * Raw output
+ */
+static int flush(struct json_writer* writer)
+{
+    if (writer->sink != NULL && writer->len > 0) {
+        const int err = writer->sink(writer->sink_arg, writer->buf, writer->len);
+        if (err != ERR_NONE) return writer->err = err;
+        writer->len = 0;
+    }
+    return ERR_NONE;
+}
+
+static int write_raw(struct json_writer* writer, const char* data, size_t len)
+{
+    if (writer->err != ERR_NONE) return writer->err;
+
+    // +1: room for the final '\0'
+    if (writer->len + len + 1 > writer->cap) {
+        size_t new_cap = writer->cap == 0 ? JSON_INITIAL_SIZE : writer->cap;
+        while (writer->len + len + 1 > new_cap) new_cap *= 2;
+        char* const grown = realloc(writer->buf, new_cap);
+        if (grown == NULL) return writer->err = ERR_OUT_OF_MEMORY;
+        writer->buf = grown;
+        writer->cap = new_cap;
+    }
+
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+
+    return writer->len >= JSON_FLUSH_SIZE && !writer->held ? flush(writer) : ERR_NONE;
+}
+
+int json_writer_hold(struct json_writer* writer, int hold)
+{
+    M_REQUIRE_NON_NULL(writer);
+
+    writer->held = hold;
+    if (writer->err == ERR_NONE && !hold && writer->len >= JSON_FLUSH_SIZE) flush(writer);
+    return writer->err;
+}
+
+#define write_lit(writer, lit) write_raw(writer, lit, sizeof(lit) - 1)
+
+/*******************************************************************
+ * Separators: ", " between the members of a container, "[ " / "{ "
+ * before the first one.
+ */
+static int begin_value(struct json_writer* writer)
+{
+    if (writer->depth == 0) return writer->err;
+
+    unsigned char* const has_members = &writer->has_members[writer->depth - 1];
+    if (*has_members == 2) {
+        // value of a key: the separator was written with the key
+        *has_members = 1;
+        return writer->err;
+    }
+    const int err = *has_members ? write_lit(writer, ", ") : write_lit(writer, " ");
+    *has_members = 1;
+    return err;
+}
+
+static int open_container(struct json_writer* writer, char open)
+{
+    if (writer->err == ERR_NONE && writer->depth == JSON_MAX_DEPTH) {
+        return writer->err = ERR_INVALID_ARGUMENT;
+    }
+    begin_value(writer);
+    write_raw(writer, &open, 1);
+    if (writer->err == ERR_NONE) writer->has_members[writer->depth++] = 0;
+    return writer->err;
+}
+
+static int close_container(struct json_writer* writer, char close)
+{
+    if (writer->err == ERR_NONE && writer->depth == 0) {
+        return writer->err = ERR_INVALID_ARGUMENT;
+    }
+    if (writer->err != ERR_NONE) return writer->err;
+
+    writer->depth--;
+    const char closing[] = { ' ', close };
+    return write_raw(writer, closing, sizeof(closing));
+}
+
+int json_begin_object(struct json_writer* writer)
+{
+    M_REQUIRE_NON_NULL(writer);
+    return open_container(writer, '{');
+}
+
+int json_end_object(struct json_writer* writer)
+{
+    M_REQUIRE_NON_NULL(writer);
+    return close_container(writer, '}');
+}
+
+int json_begin_array(struct json_writer* writer)
+{
+    M_REQUIRE_NON_NULL(writer);
+    return open_container(writer, '[');
+}
+
+int json_end_array(struct json_writer* writer)
+{
+    M_REQUIRE_NON_NULL(writer);
+    return close_container(writer, ']');
+}
+
+/*******************************************************************
+ * Values
+ */
+static int write_escaped(struct json_writer* writer, const char* str)
+{
+    write_lit(writer, "\"");
+    const char* run = str; // start of the pending run of plain characters
+    for (const char* c = str; *c != '\0'; ++c) {
+        const unsigned char uc = (unsigned char) *c;
+        // the same escapes as json-c, '/' included
+        if (uc >= 0x20 && uc != '"' && uc != '\\' && uc != '/') continue;
+
+        write_raw(writer, run, (size_t) (c - run));
+        run = c + 1;
+        switch (uc) {
+        case '"':
+            write_lit(writer, "\\\"");
+            break;
+        case '\\':
+            write_lit(writer, "\\\\");
+            break;
+        case '/':
+            write_lit(writer, "\\/");
+            break;
+        case '\b':
+            write_lit(writer, "\\b");
+            break;
+        case '\f':
+            write_lit(writer, "\\f");
+            break;
+        case '\n':
+            write_lit(writer, "\\n");
+            break;
+        case '\r':
+            write_lit(writer, "\\r");
+            break;
+        case '\t':
+            write_lit(writer, "\\t");
+            break;
+        default: {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", uc);
+            write_raw(writer, escaped, 6);
+        }
+        }
+    }
+    write_raw(writer, run, strlen(run));
+    return write_lit(writer, "\"");
+}
+
+int json_key(struct json_writer* writer, const char* key)
+{
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(key);
+
+    begin_value(writer);
+    write_escaped(writer, key);
+    const int err = write_lit(writer, ": ");
+    if (writer->depth > 0) writer->has_members[writer->depth - 1] = 2;
+    return err;
+}
+
+int json_string(struct json_writer* writer, const char* value)
+{
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(value);
+
+    begin_value(writer);
+    return write_escaped(writer, value);
+}
+
+int json_uint(struct json_writer* writer, uint64_t value)
+{
+    M_REQUIRE_NON_NULL(writer);
+
+    char digits[24];
+    const int len = snprintf(digits, sizeof(digits), "%" PRIu64, value);
+    begin_value(writer);
+    return write_raw(writer, digits, (size_t) len);
+}
+
+/*******************************************************************
+ * Completion
+ */
+int json_writer_finish(struct json_writer* writer, char** out, size_t* len)
+{
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(out);
+
+    *out = NULL;
+    if (writer->err == ERR_NONE && writer->depth != 0) writer->err = ERR_INVALID_ARGUMENT;
+
+    if (writer->err == ERR_NONE && writer->sink != NULL) flush(writer);
+
+    if (writer->err != ERR_NONE) {
+        json_writer_free(writer);
+        return writer->err;
+    }
+
+    if (writer->sink == NULL) {
+        // an empty document still needs its terminator
+        if (writer->buf == NULL && write_raw(writer, "", 0) != ERR_NONE) return writer->err;
+        writer->buf[writer->len] = '\0';
+        *out = writer->buf;
+        if (len != NULL) *len = writer->len;
+        writer->buf = NULL;
+        writer->len = 0;
+        writer->cap = 0;
+    } else {
+        json_writer_free(writer);
+    }
+    return ERR_NONE;
+}
@@ -0,0 +1,89 @@
+/**
+ * @file json_writer.h
+ * @brief Streaming JSON emitter.
+ *
+ * Writes JSON text directly into a growable output buffer, in the same
+ * spaced layout as json-c's default ("{ \"k\": [ 1, 2 ] }"). If a sink is
+ * given, the buffer is handed to it whenever it reaches JSON_FLUSH_SIZE,
+ * so the memory used stays bounded whatever the size of the document.
+ * The flushes can be held back for a while, e.g. not to call the sink
+ * with a lock held.
+ */
+
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+#define JSON_MAX_DEPTH  16
+#define JSON_FLUSH_SIZE 16384
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Consumer of the produced JSON text, e.g. a socket.
+ *        Returns some error code, 0 if no error.
+ */
+typedef int (*json_sink)(void* arg, const char* data, size_t len);
+
+struct json_writer {
+    char* buf;
+    size_t len;
+    size_t cap;
+    json_sink sink;   // NULL to keep the whole document in buf
+    void* sink_arg;
+    int held;         // no flush to the sink while set
+    int err;          // first error met; later calls are no-ops
+    unsigned depth;
+    unsigned char has_members[JSON_MAX_DEPTH]; // per open container
+};
+
+/**
+ * @brief Initializes a writer. With a NULL sink, the document is kept in
+ *        memory and retrieved with json_writer_finish().
+ */
+void json_writer_init(struct json_writer* writer, json_sink sink, void* sink_arg);
+
+/**
+ * @brief Holds back (hold != 0) the flushes to the sink, or lets them
+ *        through again, then flushing the buffer if it is full. While they
+ *        are held, the buffer grows with what is written.
+ *
+ * @return the first error met, 0 if none.
+ */
+int json_writer_hold(struct json_writer* writer, int hold);
+
+/**
+ * @brief Releases the buffer of a writer (not needed after a successful json_writer_finish()).
+ */
+void json_writer_free(struct json_writer* writer);
+
+int json_begin_object(struct json_writer* writer);
+int json_end_object(struct json_writer* writer);
+int json_begin_array(struct json_writer* writer);
+int json_end_array(struct json_writer* writer);
+
+/**
+ * @brief Writes the key of the next member of the current object.
+ */
+int json_key(struct json_writer* writer, const char* key);
+
+int json_string(struct json_writer* writer, const char* value);
+int json_uint(struct json_writer* writer, uint64_t value);
+
+/**
+ * @brief Completes the document.
+ *
+ * Without a sink, hands over the null-terminated text (and its length,
+ * if len is not NULL) to the caller, who must free() it; with a sink,
+ * flushes what remains and sets *out to NULL.
+ *
+ * @return the first error met while writing, 0 if none.
+ */
+int json_writer_finish(struct json_writer* writer, char** out, size_t* len);
+
+#ifdef __cplusplus
+}
+#endif
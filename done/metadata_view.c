@@ -0,0 +1,114 @@
+/* ** NOTE: undocumented in Doxygen
+ * @file metadata_view.c
+ * @brief Structure-of-arrays view of the imgFS metadata
+ */
+
+#include "imgfs.h"
+
+#include <stdint.h>
+#include <stdlib.h>   // for calloc, free
+#include <string.h>   // for memcpy, memset
+
+#define BITMAP_WORDS(n) (((size_t) (n) + 63) / 64)
+
+/*******************************************************************
+ * FNV-1a
+ */
+uint32_t img_id_hash(const char* img_id)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* c = (const unsigned char*) img_id; *c != '\0'; ++c) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*******************************************************************
+ * Slot refresh
+ */
+void metadata_view_update(struct imgfs_file* imgfs_file, uint32_t index)
+{
+    struct metadata_view* const view = &imgfs_file->view;
+    if (view->valid == NULL || index >= imgfs_file->header.max_files) return;
+
+    const struct img_metadata* image = &imgfs_file->metadata[index];
+    const uint64_t bit = UINT64_C(1) << (index % 64);
+
+    if (image->is_valid != EMPTY) {
+        view->valid[index / 64] |= bit;
+    } else {
+        view->valid[index / 64] &= ~bit;
+    }
+
+    uint64_t prefix = 0;
+    memcpy(&prefix, image->SHA, sizeof(prefix));
+    view->sha_prefix[index] = prefix;
+    view->id_hash[index] = image->is_valid != EMPTY ? img_id_hash(image->img_id) : 0;
+}
+
+/*******************************************************************
+ * View construction
+ */
+int metadata_view_build(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    const size_t n = imgfs_file->header.max_files;
+    struct metadata_view* const view = &imgfs_file->view;
+
+    // the arrays follow the metadata, in the same block (freed with it):
+    // the bitmap, then the 64-bit, then the 32-bit one
+    const size_t metadata_size = n * sizeof(struct img_metadata);
+    const size_t words = BITMAP_WORDS(n) + n;
+    const size_t view_size = (words + (n + 1) / 2) * sizeof(uint64_t);
+
+    char* block = realloc(imgfs_file->metadata, metadata_size + view_size);
+    if (block == NULL) return ERR_OUT_OF_MEMORY;
+    imgfs_file->metadata = (struct img_metadata*) block;
+    memset(block + metadata_size, 0, view_size);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-align"
+    view->valid = (uint64_t*) (block + metadata_size);
+#pragma GCC diagnostic pop
+    view->sha_prefix = view->valid + BITMAP_WORDS(n);
+    view->id_hash = (uint32_t*) (view->valid + words);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        metadata_view_update(imgfs_file, i);
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Bitmap scans: whole words are skipped at once
+ */
+static uint32_t next_bit(const struct imgfs_file* imgfs_file, uint32_t from, uint64_t flip)
+{
+    const uint32_t max_files = imgfs_file->header.max_files;
+    const uint64_t* const valid = imgfs_file->view.valid;
+    if (valid == NULL || from >= max_files) return max_files;
+
+    size_t word = from / 64;
+    uint64_t bits = (valid[word] ^ flip) & (~UINT64_C(0) << (from % 64));
+
+    while (bits == 0) {
+        if (++word >= BITMAP_WORDS(max_files)) return max_files;
+        bits = valid[word] ^ flip;
+    }
+
+    const size_t index = word * 64 + (size_t) __builtin_ctzll(bits);
+    return index < max_files ? (uint32_t) index : max_files;
+}
+
+uint32_t metadata_view_next_valid(const struct imgfs_file* imgfs_file, uint32_t from)
+{
+    return next_bit(imgfs_file, from, 0);
+}
+
+uint32_t metadata_view_next_free(const struct imgfs_file* imgfs_file, uint32_t from)
+{
+    return next_bit(imgfs_file, from, ~UINT64_C(0));
+}
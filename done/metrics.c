@@ -0,0 +1,285 @@
+/* ** NOTE: undocumented in Doxygen
+ * @file metrics.c
+ * @brief Counters of the imgFS server, exported in the Prometheus text format
+ */
+
+#define _GNU_SOURCE // for open_memstream
+#include "metrics.h"
+#include "error.h"
+
+#include <inttypes.h> // for PRIu64
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STATUS_LINE_SIZE 256
+#define LABELS_SIZE 64
+
+static const char* const endpoint_names[NB_METRICS_ENDPOINTS] = {
+    "/imgfs/read", "/imgfs/list", "/imgfs/insert", "/imgfs/delete",
+    "/imgfs/batch_read", "/imgfs/sprite", "/metrics", "other"
+};
+
+static const char* const lock_names[NB_METRICS_LOCKS] = {
+    "shard", "list", "sprite"
+};
+
+struct metrics_slot {
+    struct metrics_slot* next;   // all the slots, never freed
+    int in_use;                  // protected by slots_mutex
+
+    struct histogram request_us[NB_METRICS_ENDPOINTS];
+    struct histogram resize_us;
+    struct histogram lock_wait_us[NB_METRICS_LOCKS];
+    uint64_t bytes_sent;
+};
+
+static struct metrics_slot* slots;
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_slot shared; // when no slot can be allocated
+static __thread struct metrics_slot* own;
+
+static uint64_t connections_active;
+static uint64_t connections_total;
+
+/*******************************************************************
+ * Time
+ */
+uint64_t metrics_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000u + (uint64_t) now.tv_nsec / 1000u;
+}
+
+/*******************************************************************
+ * The slot of the calling thread
+ */
+static struct metrics_slot* own_slot(void)
+{
+    if (own != NULL) return own;
+
+    pthread_mutex_lock(&slots_mutex);
+    struct metrics_slot* slot = slots;
+    while (slot != NULL && slot->in_use) slot = slot->next;
+    if (slot == NULL) {
+        slot = calloc(1, sizeof(struct metrics_slot));
+        if (slot != NULL) {
+            slot->next = slots;
+            slots = slot;
+        }
+    }
+    if (slot != NULL) slot->in_use = 1;
+    pthread_mutex_unlock(&slots_mutex);
+
+    own = slot == NULL ? &shared : slot;
+    return own;
+}
+
+/*******************************************************************
+ * Same as histogram_add(), but for counters read by other threads
+ */
+static void add(struct histogram* histogram, uint64_t value)
+{
+    size_t bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && value >> bucket != 0) ++bucket;
+
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*******************************************************************
+ * Events
+ */
+void metrics_request(enum metrics_endpoint endpoint, uint64_t duration_us)
+{
+    if (endpoint >= NB_METRICS_ENDPOINTS) endpoint = METRICS_OTHER;
+    add(&own_slot()->request_us[endpoint], duration_us);
+}
+
+void metrics_bytes_sent(size_t bytes)
+{
+    __atomic_fetch_add(&own_slot()->bytes_sent, bytes, __ATOMIC_RELAXED);
+}
+
+void metrics_resize(uint64_t duration_us)
+{
+    add(&own_slot()->resize_us, duration_us);
+}
+
+void metrics_lock_wait(enum metrics_lock lock, uint64_t wait_us)
+{
+    if (lock >= NB_METRICS_LOCKS) return;
+    add(&own_slot()->lock_wait_us[lock], wait_us);
+}
+
+void metrics_connection_begin(void)
+{
+    __atomic_fetch_add(&connections_active, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&connections_total, 1, __ATOMIC_RELAXED);
+}
+
+void metrics_connection_end(void)
+{
+    __atomic_fetch_sub(&connections_active, 1, __ATOMIC_RELAXED);
+
+    // what was counted in the slot stays in it
+    if (own != NULL && own != &shared) {
+        pthread_mutex_lock(&slots_mutex);
+        own->in_use = 0;
+        pthread_mutex_unlock(&slots_mutex);
+    }
+    own = NULL;
+}
+
+/*******************************************************************
+ * Sums of the slots
+ */
+static void sum_histogram(struct histogram* total, const struct histogram* histogram)
+{
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        total->buckets[i] += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+    }
+    total->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    total->sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+    const uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    if (max > total->max) total->max = max;
+}
+
+static void sum_slot(struct metrics_slot* total, const struct metrics_slot* slot)
+{
+    for (size_t i = 0; i < NB_METRICS_ENDPOINTS; ++i) {
+        sum_histogram(&total->request_us[i], &slot->request_us[i]);
+    }
+    sum_histogram(&total->resize_us, &slot->resize_us);
+    for (size_t i = 0; i < NB_METRICS_LOCKS; ++i) {
+        sum_histogram(&total->lock_wait_us[i], &slot->lock_wait_us[i]);
+    }
+    total->bytes_sent += __atomic_load_n(&slot->bytes_sent, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************
+ * Number of threads of the process (-1 if unknown)
+ */
+static long process_threads(void)
+{
+    FILE* status = fopen("/proc/self/status", "r");
+    if (status == NULL) return -1;
+
+    char line[STATUS_LINE_SIZE];
+    long threads = -1;
+    while (threads < 0 && fgets(line, sizeof(line), status) != NULL) {
+        if (sscanf(line, "Threads: %ld", &threads) != 1) threads = -1;
+    }
+    fclose(status);
+    return threads;
+}
+
+/*******************************************************************
+ * Text format
+ */
+static void write_family(FILE* out, const char* name, const char* type, const char* help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void write_histogram(FILE* out, const char* name, const char* labels,
+                            const struct histogram* histogram)
+{
+    const char* separator = labels[0] == '\0' ? "" : ",";
+
+    // bucket i counts the values in [2^(i-1), 2^i): up to 2^i - 1, as they are integers
+    uint64_t cumulated = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS - 1; ++i) {
+        cumulated += histogram->buckets[i];
+        fprintf(out, "%s_bucket{%s%sle=\"%" PRIu64 "\"} %" PRIu64 "\n",
+                name, labels, separator, ((uint64_t) 1 << i) - 1, cumulated);
+    }
+    // (not histogram->count: the counters are not read at once, the buckets must add up)
+    cumulated += histogram->buckets[HISTOGRAM_BUCKETS - 1];
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, separator, cumulated);
+
+    if (labels[0] == '\0') {
+        fprintf(out, "%s_sum %" PRIu64 "\n%s_count %" PRIu64 "\n",
+                name, histogram->sum, name, cumulated);
+    } else {
+        fprintf(out, "%s_sum{%s} %" PRIu64 "\n%s_count{%s} %" PRIu64 "\n",
+                name, labels, histogram->sum, name, labels, cumulated);
+    }
+}
+
+int metrics_export(char** text, size_t* len)
+{
+    M_REQUIRE_NON_NULL(text);
+    M_REQUIRE_NON_NULL(len);
+
+    struct metrics_slot* total = calloc(1, sizeof(struct metrics_slot));
+    if (total == NULL) return ERR_OUT_OF_MEMORY;
+
+    pthread_mutex_lock(&slots_mutex);
+    for (const struct metrics_slot* slot = slots; slot != NULL; slot = slot->next) {
+        sum_slot(total, slot);
+    }
+    pthread_mutex_unlock(&slots_mutex);
+    sum_slot(total, &shared);
+
+    *text = NULL;
+    *len = 0;
+    FILE* out = open_memstream(text, len);
+    if (out == NULL) {
+        free(total);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    char labels[LABELS_SIZE];
+
+    write_family(out, "imgfs_request_duration_microseconds", "histogram",
+                 "Time to handle a request, by endpoint.");
+    for (size_t i = 0; i < NB_METRICS_ENDPOINTS; ++i) {
+        snprintf(labels, sizeof(labels), "endpoint=\"%s\"", endpoint_names[i]);
+        write_histogram(out, "imgfs_request_duration_microseconds", labels, &total->request_us[i]);
+    }
+
+    write_family(out, "imgfs_sent_bytes_total", "counter", "Bytes sent to clients.");
+    fprintf(out, "imgfs_sent_bytes_total %" PRIu64 "\n", total->bytes_sent);
+
+    write_family(out, "imgfs_resize_duration_microseconds", "histogram",
+                 "Time to resize an image on its first read at a resolution.");
+    write_histogram(out, "imgfs_resize_duration_microseconds", "", &total->resize_us);
+
+    write_family(out, "imgfs_lock_wait_microseconds", "histogram",
+                 "Time waited for the locks of the server, by lock.");
+    for (size_t i = 0; i < NB_METRICS_LOCKS; ++i) {
+        snprintf(labels, sizeof(labels), "lock=\"%s\"", lock_names[i]);
+        write_histogram(out, "imgfs_lock_wait_microseconds", labels, &total->lock_wait_us[i]);
+    }
+
+    write_family(out, "imgfs_connections_active", "gauge", "Connections being served.");
+    fprintf(out, "imgfs_connections_active %" PRIu64 "\n",
+            __atomic_load_n(&connections_active, __ATOMIC_RELAXED));
+    write_family(out, "imgfs_connections_total", "counter", "Connections accepted.");
+    fprintf(out, "imgfs_connections_total %" PRIu64 "\n",
+            __atomic_load_n(&connections_total, __ATOMIC_RELAXED));
+
+    const long threads = process_threads();
+    if (threads >= 0) {
+        write_family(out, "imgfs_threads", "gauge", "Threads of the server process.");
+        fprintf(out, "imgfs_threads %ld\n", threads);
+    }
+
+    free(total);
+    if (fclose(out) != 0) {
+        free(*text);
+        *text = NULL;
+        *len = 0;
+        return ERR_OUT_OF_MEMORY;
+    }
+    return ERR_NONE;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file metrics.h
+ * @brief Counters of the imgFS server, exported in the Prometheus text format.
+ *
+ * Each thread counts in its own slot, claimed on its first event and given
+ * back when its connection ends (for a later thread to go on counting in
+ * it): the hot path only does relaxed atomic additions to memory no other
+ * thread writes. Exporting sums the slots.
+ */
+
+#pragma once
+
+#include "durability.h" // for struct histogram
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum metrics_endpoint {
+    METRICS_READ,
+    METRICS_LIST,
+    METRICS_INSERT,
+    METRICS_DELETE,
+    METRICS_BATCH_READ,
+    METRICS_SPRITE,
+    METRICS_METRICS,
+    METRICS_OTHER,
+    NB_METRICS_ENDPOINTS
+};
+
+enum metrics_lock {
+    METRICS_LOCK_SHARD,
+    METRICS_LOCK_LIST,
+    METRICS_LOCK_SPRITE,
+    NB_METRICS_LOCKS
+};
+
+/**
+ * @brief Monotonic time, in microseconds.
+ */
+uint64_t metrics_now_us(void);
+
+/**
+ * @brief Counts a request to an endpoint and how long it took.
+ */
+void metrics_request(enum metrics_endpoint endpoint, uint64_t duration_us);
+
+/**
+ * @brief Counts bytes sent to clients.
+ */
+void metrics_bytes_sent(size_t bytes);
+
+/**
+ * @brief Counts a resized image (see lazily_resize) and how long it took.
+ */
+void metrics_resize(uint64_t duration_us);
+
+/**
+ * @brief Counts the time waited for a lock.
+ */
+void metrics_lock_wait(enum metrics_lock lock, uint64_t wait_us);
+
+/**
+ * @brief To be called by the thread of a connection when it starts.
+ */
+void metrics_connection_begin(void);
+
+/**
+ * @brief To be called by the thread of a connection when it ends:
+ *        gives its slot back.
+ */
+void metrics_connection_end(void);
+
+/**
+ * @brief Writes all the counters in the Prometheus text format
+ *        (into a buffer to be freed by the caller).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int metrics_export(char** text, size_t* len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,270 @@
+/* ** NOTE: undocumented in Doxygen
+ * @file segment.c
+ * @brief Segmented storage of the imgFS content
+ */
+
+#include "segment.h"
+
+#include <fcntl.h>    // for open
+#include <stdio.h>    // for snprintf
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h> // for fstat
+#include <unistd.h>   // for close, fdatasync, unlink
+
+#define SEGMENT_SUFFIX_LENGTH 8 // ".%06u", with room for larger numbers
+
+/*******************************************************************
+ * Series and file names
+ */
+int segment_stream(const struct imgfs_header* header, int resolution)
+{
+    return (header->flags & IMGFS_FLAG_EXTENT_FILES) ? resolution : 0;
+}
+
+char* segment_path(const struct imgfs_file* imgfs_file, int stream, uint32_t segment)
+{
+    const char* imgfs_filename = imgfs_file->segments->imgfs_filename;
+    char* base = (imgfs_file->header.flags & IMGFS_FLAG_EXTENT_FILES)
+                 ? imgfs_extent_path(imgfs_filename, stream) : strdup(imgfs_filename);
+    if (base == NULL) return NULL;
+
+    const size_t len = strlen(base) + SEGMENT_SUFFIX_LENGTH + 1;
+    char* path = malloc(len);
+    if (path != NULL) snprintf(path, len, "%s.%06u", base, segment);
+    free(base);
+    return path;
+}
+
+/*******************************************************************
+ * Opens a segment file; a new one first gets the header copy
+ */
+static int open_segment(const struct imgfs_file* imgfs_file, int stream, uint32_t segment,
+                        int flags, int* fd)
+{
+    char* path = segment_path(imgfs_file, stream, segment);
+    if (path == NULL) return ERR_OUT_OF_MEMORY;
+    *fd = open(path, flags, 0666);
+    free(path);
+    if (*fd < 0) return ERR_IO;
+
+    struct stat st;
+    int err = fstat(*fd, &st) == 0 ? ERR_NONE : ERR_IO;
+    if (err == ERR_NONE && st.st_size == 0 && (flags & (O_WRONLY | O_RDWR))) {
+        // position 0 means "not stored"
+        const ssize_t n = pwrite(*fd, &imgfs_file->header, sizeof(struct imgfs_header), 0);
+        if (n != (ssize_t) sizeof(struct imgfs_header)) err = ERR_IO;
+    }
+    if (err != ERR_NONE) {
+        close(*fd);
+        *fd = -1;
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Setup
+ */
+int segments_open(struct imgfs_file* imgfs_file, const char* imgfs_filename,
+                  const char* open_mode)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_filename);
+    M_REQUIRE_NON_NULL(open_mode);
+
+    imgfs_file->segments = NULL;
+    if (!(imgfs_file->header.flags & IMGFS_FLAG_SEGMENTS)) return ERR_NONE;
+    if (imgfs_file->header.segment_size == 0) return ERR_INVALID_ARGUMENT;
+
+    struct imgfs_segments* segments = calloc(1, sizeof(struct imgfs_segments));
+    if (segments == NULL) return ERR_OUT_OF_MEMORY;
+    segments->imgfs_filename = strdup(imgfs_filename);
+    if (segments->imgfs_filename == NULL) {
+        free(segments);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    const int create = strcmp(open_mode, "wb") == 0;
+    segments->writable = create || strcmp(open_mode, "rb+") == 0;
+    segments->nb_streams = (imgfs_file->header.flags & IMGFS_FLAG_EXTENT_FILES) ? NB_RES : 1;
+    for (int stream = 0; stream < NB_RES; ++stream) segments->active_fd[stream] = -1;
+    for (size_t i = 0; i < SEGMENT_FD_CACHE; ++i) segments->cache[i].fd = -1;
+    imgfs_file->segments = segments;
+
+    // nothing is appended past the last referenced segment (but what a crash lost)
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        const struct img_metadata* image = &imgfs_file->metadata[i];
+        if (image->is_valid == EMPTY) continue;
+
+        for (int res = 0; res < NB_RES; ++res) {
+            const int stream = segment_stream(&imgfs_file->header, res);
+            if (image->offset[res] != 0 && SEGMENT_OF(image->offset[res]) > segments->active[stream]) {
+                segments->active[stream] = SEGMENT_OF(image->offset[res]);
+            }
+        }
+    }
+
+    int err = ERR_NONE;
+    for (int stream = 0; create && stream < segments->nb_streams && err == ERR_NONE; ++stream) {
+        err = open_segment(imgfs_file, stream, 0, O_RDWR | O_CREAT | O_TRUNC,
+                           &segments->active_fd[stream]);
+    }
+    if (err != ERR_NONE) segments_close(imgfs_file);
+    return err;
+}
+
+/*******************************************************************
+ * Release
+ */
+void segments_close(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file == NULL || imgfs_file->segments == NULL) return;
+
+    struct imgfs_segments* segments = imgfs_file->segments;
+    for (int stream = 0; stream < NB_RES; ++stream) {
+        if (segments->active_fd[stream] >= 0) close(segments->active_fd[stream]);
+    }
+    for (size_t i = 0; i < SEGMENT_FD_CACHE; ++i) {
+        if (segments->cache[i].fd >= 0) close(segments->cache[i].fd);
+    }
+    free(segments->imgfs_filename);
+    free(segments);
+    imgfs_file->segments = NULL;
+}
+
+/*******************************************************************
+ * Descriptors for reading
+ */
+int segments_fd(struct imgfs_file* imgfs_file, int stream, uint32_t segment, int* fd)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->segments);
+    M_REQUIRE_NON_NULL(fd);
+
+    struct imgfs_segments* segments = imgfs_file->segments;
+    if (stream < 0 || stream >= segments->nb_streams) return ERR_INVALID_ARGUMENT;
+
+    // the active segment is read where it is written
+    if (segment == segments->active[stream] && segments->active_fd[stream] >= 0
+        && segments->writable) {
+        *fd = segments->active_fd[stream];
+        return ERR_NONE;
+    }
+
+    for (size_t i = 0; i < SEGMENT_FD_CACHE; ++i) {
+        if (segments->cache[i].fd >= 0 && segments->cache[i].stream == stream
+            && segments->cache[i].segment == segment) {
+            *fd = segments->cache[i].fd;
+            return ERR_NONE;
+        }
+    }
+
+    struct segment_fd* entry = &segments->cache[segments->next_victim];
+    segments->next_victim = (segments->next_victim + 1) % SEGMENT_FD_CACHE;
+    if (entry->fd >= 0) close(entry->fd);
+
+    entry->stream = stream;
+    entry->segment = segment;
+    const int err = open_segment(imgfs_file, stream, segment, O_RDONLY, &entry->fd);
+    if (err == ERR_NONE) *fd = entry->fd;
+    return err;
+}
+
+/*******************************************************************
+ * Forgets the cached descriptor of a segment, if any
+ */
+static void uncache(struct imgfs_segments* segments, int stream, uint32_t segment)
+{
+    for (size_t i = 0; i < SEGMENT_FD_CACHE; ++i) {
+        if (segments->cache[i].fd >= 0 && segments->cache[i].stream == stream
+            && segments->cache[i].segment == segment) {
+            close(segments->cache[i].fd);
+            segments->cache[i].fd = -1;
+        }
+    }
+}
+
+/*******************************************************************
+ * Descriptors for appending
+ */
+int segments_reserve(struct imgfs_file* imgfs_file, int stream, size_t size,
+                     int* fd, uint32_t* segment)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->segments);
+    M_REQUIRE_NON_NULL(fd);
+    M_REQUIRE_NON_NULL(segment);
+
+    struct imgfs_segments* segments = imgfs_file->segments;
+    if (stream < 0 || stream >= segments->nb_streams) return ERR_INVALID_ARGUMENT;
+    if (!segments->writable) return ERR_IO;
+
+    int err = ERR_NONE;
+    if (segments->active_fd[stream] < 0) {
+        err = open_segment(imgfs_file, stream, segments->active[stream], O_RDWR | O_CREAT,
+                           &segments->active_fd[stream]);
+        if (err != ERR_NONE) return err;
+    }
+
+    struct stat st;
+    if (fstat(segments->active_fd[stream], &st) != 0) return ERR_IO;
+
+    // a segment holds at least one image, whatever its size
+    if ((uint64_t) st.st_size > sizeof(struct imgfs_header)
+        && (uint64_t) st.st_size + size > imgfs_file->header.segment_size) {
+        // the full segment is never written again
+        if (fdatasync(segments->active_fd[stream]) != 0) return ERR_IO;
+        close(segments->active_fd[stream]);
+        segments->active_fd[stream] = -1;
+
+        const uint32_t next = segments->active[stream] + 1;
+        if (SEGMENT_OFFSET(next, 0) >> SEGMENT_SHIFT != next) return ERR_IMGFS_FULL;
+        uncache(segments, stream, next);
+
+        // left over by a crash, if it exists: nothing refers to it
+        err = open_segment(imgfs_file, stream, next, O_RDWR | O_CREAT | O_TRUNC,
+                           &segments->active_fd[stream]);
+        if (err != ERR_NONE) return err;
+        segments->active[stream] = next;
+    }
+
+    *fd = segments->active_fd[stream];
+    *segment = segments->active[stream];
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Durability
+ */
+int segments_sync(const struct imgfs_segments* segments)
+{
+    if (segments == NULL) return ERR_NONE;
+
+    for (int stream = 0; stream < segments->nb_streams; ++stream) {
+        if (segments->active_fd[stream] >= 0 && fdatasync(segments->active_fd[stream]) != 0) {
+            return ERR_IO;
+        }
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Dropping a whole segment
+ */
+int segments_drop(struct imgfs_file* imgfs_file, int stream, uint32_t segment)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->segments);
+
+    struct imgfs_segments* segments = imgfs_file->segments;
+    if (stream < 0 || stream >= segments->nb_streams) return ERR_INVALID_ARGUMENT;
+    if (segment >= segments->active[stream]) return ERR_INVALID_ARGUMENT;
+
+    uncache(segments, stream, segment);
+
+    char* path = segment_path(imgfs_file, stream, segment);
+    if (path == NULL) return ERR_OUT_OF_MEMORY;
+    const int err = unlink(path) == 0 ? ERR_NONE : ERR_IO;
+    free(path);
+    return err;
+}
@@ -0,0 +1,116 @@
+/**
+ * @file segment.h
+ * @brief Segmented storage of the imgFS content.
+ *
+ * With IMGFS_FLAG_SEGMENTS, image content is appended to segment files
+ * of at most header.segment_size bytes, "<imgFS>.000000", "<imgFS>.000001",
+ * ... (with IMGFS_FLAG_EXTENT_FILES, one series per resolution:
+ * "<imgFS>.thumb.000000", ...). Only the last segment of a series, the
+ * active one, is appended to; once full, the next one is started. The
+ * offsets of the metadata then hold the segment number in their high
+ * bits (see SEGMENT_OFFSET()). Like extent files, each segment starts
+ * with a copy of the header, so that no content is at position 0.
+ *
+ * Segments other than the active ones are never written again: do_compact()
+ * copies what is still referenced in them to the active segment, then
+ * drops the whole file at once.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+#define SEGMENT_SHIFT 40 // bits of the position in a segment
+#define SEGMENT_OFFSET(segment, position) (((uint64_t) (segment) << SEGMENT_SHIFT) | (position))
+#define SEGMENT_OF(offset) ((uint32_t) ((offset) >> SEGMENT_SHIFT))
+#define SEGMENT_POSITION(offset) ((offset) & (((uint64_t) 1 << SEGMENT_SHIFT) - 1))
+
+#define DEFAULT_SEGMENT_SIZE ((uint64_t) 64 << 20)
+#define SEGMENT_FD_CACHE 16 // segments kept open for reading
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct segment_fd {
+    int stream;
+    uint32_t segment;
+    int fd;                     // -1 if the entry is free
+};
+
+struct imgfs_segments {
+    char* imgfs_filename;
+    int writable;
+    int nb_streams;                      // NB_RES with extent files, 1 otherwise
+    uint32_t active[NB_RES];             // per stream
+    int active_fd[NB_RES];               // opened at the first append, -1 before
+    struct segment_fd cache[SEGMENT_FD_CACHE];
+    size_t next_victim;                  // round-robin eviction
+};
+
+/**
+ * @brief Series of segments the content of a resolution goes to.
+ */
+int segment_stream(const struct imgfs_header* header, int resolution);
+
+/**
+ * @brief Path of a segment file, to be freed by the caller.
+ *
+ * @return the path, NULL if out of memory.
+ */
+char* segment_path(const struct imgfs_file* imgfs_file, int stream, uint32_t segment);
+
+/**
+ * @brief Sets the segments of an imgFS up, once its metadata is loaded:
+ *        the active segment of each series is the last one referenced.
+ *        In "wb" mode, creates the first segment of each series. Does
+ *        nothing without IMGFS_FLAG_SEGMENTS.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int segments_open(struct imgfs_file* imgfs_file, const char* imgfs_filename,
+                  const char* open_mode);
+
+/**
+ * @brief Closes the segment files and releases imgfs_file->segments.
+ */
+void segments_close(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Gets a descriptor (owned by the segments) to read a segment.
+ *
+ * @return Some error code: ERR_IO if the segment does not exist. 0 if no error.
+ */
+int segments_fd(struct imgfs_file* imgfs_file, int stream, uint32_t segment, int* fd);
+
+/**
+ * @brief Gets where to append size bytes to a series: the active segment,
+ *        or the next one if they do not fit (then made active).
+ *
+ * @param fd Where to store the descriptor of the segment.
+ * @param segment Where to store its number.
+ * @return Some error code. 0 if no error.
+ */
+int segments_reserve(struct imgfs_file* imgfs_file, int stream, size_t size,
+                     int* fd, uint32_t* segment);
+
+/**
+ * @brief Makes the active segments durable (fdatasync()).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int segments_sync(const struct imgfs_segments* segments);
+
+/**
+ * @brief Removes a segment that is not active (and no longer referenced).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int segments_drop(struct imgfs_file* imgfs_file, int stream, uint32_t segment);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,104 @@
+/* ** NOTE: undocumented in Doxygen
+ * @file shard_ring.c
+ * @brief Consistent hashing of image IDs onto the shards of a server
+ */
+
+#include "shard_ring.h"
+#include "error.h"
+#include "imgfs.h" // for img_id_hash
+
+#include <limits.h> // for NAME_MAX
+#include <stdio.h>  // for snprintf
+#include <stdlib.h> // for calloc, qsort
+#include <string.h>
+
+#define VNODE_NAME_SIZE (NAME_MAX + 16) // "<vnode>-<name>"
+
+/*******************************************************************
+ * Spreads FNV-1a hashes over the ring (MurmurHash3 finalizer)
+ */
+static uint32_t mix(uint32_t hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int compare_points(const void* a, const void* b)
+{
+    const struct shard_ring_point* p = a;
+    const struct shard_ring_point* q = b;
+    if (p->hash != q->hash) return p->hash < q->hash ? -1 : 1;
+    // ties are broken the same way whatever the order of insertion
+    return p->shard < q->shard ? -1 : p->shard > q->shard;
+}
+
+/*******************************************************************
+ * Setup
+ */
+int shard_ring_init(struct shard_ring* ring, const char* const* names, uint32_t nb_shards)
+{
+    M_REQUIRE_NON_NULL(ring);
+    M_REQUIRE_NON_NULL(names);
+    if (nb_shards == 0 || nb_shards > MAX_SHARDS) return ERR_INVALID_ARGUMENT;
+
+    // shards of the same name would have the same points
+    for (uint32_t shard = 0; shard < nb_shards; ++shard) {
+        M_REQUIRE_NON_NULL(names[shard]);
+        for (uint32_t other = 0; other < shard; ++other) {
+            if (strcmp(names[shard], names[other]) == 0) return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->points = calloc((size_t) nb_shards * SHARD_RING_VNODES, sizeof(struct shard_ring_point));
+    if (ring->points == NULL) return ERR_OUT_OF_MEMORY;
+
+    // the points of a shard only depend on its name
+    for (uint32_t shard = 0; shard < nb_shards; ++shard) {
+        for (uint32_t vnode = 0; vnode < SHARD_RING_VNODES; ++vnode) {
+            char name[VNODE_NAME_SIZE];
+            snprintf(name, sizeof(name), "%u-%s", vnode, names[shard]);
+            struct shard_ring_point* point = &ring->points[ring->nb_points++];
+            point->hash = mix(img_id_hash(name));
+            point->shard = shard;
+        }
+    }
+    qsort(ring->points, ring->nb_points, sizeof(struct shard_ring_point), compare_points);
+    ring->nb_shards = nb_shards;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Release
+ */
+void shard_ring_free(struct shard_ring* ring)
+{
+    if (ring == NULL) return;
+    free(ring->points);
+    memset(ring, 0, sizeof(*ring));
+}
+
+/*******************************************************************
+ * Lookup: first point at or after the hash of the ID
+ */
+uint32_t shard_ring_lookup(const struct shard_ring* ring, const char* img_id)
+{
+    if (ring == NULL || img_id == NULL || ring->nb_points == 0) return 0;
+
+    const uint32_t hash = mix(img_id_hash(img_id));
+    size_t low = 0;
+    size_t high = ring->nb_points;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (ring->points[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return ring->points[low == ring->nb_points ? 0 : low].shard;
+}
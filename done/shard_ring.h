@@ -0,0 +1,61 @@
+/**
+ * @file shard_ring.h
+ * @brief Consistent hashing of image IDs onto the shards of a server.
+ *
+ * Each shard is given SHARD_RING_VNODES points on a 32-bit ring; an image
+ * ID goes to the shard of the first point at or after its hash (wrapping
+ * around). Adding or removing a shard thus only moves the IDs of the ring
+ * arcs that change hands, about 1/N of them, and the many points per shard
+ * keep the shards evenly loaded.
+ *
+ * The points of a shard are derived from its name (the server uses the
+ * base name of the shard file), not from its position in the list: the
+ * same names give the same routing whatever their order.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#define SHARD_RING_VNODES 64 // points per shard
+#define MAX_SHARDS 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shard_ring_point {
+    uint32_t hash;
+    uint32_t shard;
+};
+
+struct shard_ring {
+    struct shard_ring_point* points; // sorted by hash
+    size_t nb_points;
+    uint32_t nb_shards;
+};
+
+/**
+ * @brief Builds the ring of nb_shards shards, numbered after their
+ *        position in names.
+ *
+ * @param names The distinct names of the shards.
+ * @return Some error code: ERR_INVALID_ARGUMENT if two names are the same.
+ *         0 if no error.
+ */
+int shard_ring_init(struct shard_ring* ring, const char* const* names, uint32_t nb_shards);
+
+/**
+ * @brief Releases the ring.
+ */
+void shard_ring_free(struct shard_ring* ring);
+
+/**
+ * @brief Shard an image ID goes to.
+ */
+uint32_t shard_ring_lookup(const struct shard_ring* ring, const char* img_id);
+
+#ifdef __cplusplus
+}
+#endif
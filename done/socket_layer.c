@@ -4,6 +4,8 @@
 #include <stdint.h> // uint16_t
 #include <sys/types.h> // ssize_t
 #include <sys/socket.h>
+#include <sys/uio.h> // struct iovec
+#include <string.h> // memset
 #include <arpa/inet.h>
 #include <unistd.h>
 
@@ -51,6 +53,29 @@ int tcp_accept(int passive_socket)
     else return accept(passive_socket, NULL, NULL);
 }
 
+int tcp_connect(uint16_t port)
+{
+    int new_socket = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (new_socket == -1) {
+        perror("Error creating socket");
+        return ERR_IO;
+    }
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(new_socket, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        perror("Error during the connection");
+        close(new_socket);
+        return ERR_IO;
+    }
+
+    return new_socket;
+}
+
 ssize_t tcp_read(int active_socket, char* buffer, size_t buffer_len)
 {
     M_REQUIRE_NON_NULL(buffer);
@@ -66,3 +91,15 @@ ssize_t tcp_send(int active_socket, const char* response, size_t response_len)
 
     return send(active_socket, response, response_len, 0);
 }
+
+ssize_t tcp_sendv(int active_socket, const struct iovec* iov, size_t iovcnt)
+{
+    M_REQUIRE_NON_NULL(iov);
+    if (iovcnt == 0) return ERR_INVALID_ARGUMENT;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = (struct iovec*) (uintptr_t) iov;
+    message.msg_iovlen = iovcnt;
+    return sendmsg(active_socket, &message, 0);
+}
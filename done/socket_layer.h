@@ -10,6 +10,7 @@
 #include <stddef.h> // size_t
 #include <stdint.h> // uint16_t
 #include <sys/types.h> // ssize_t
+#include <sys/uio.h> // struct iovec
 
 int tcp_server_init(uint16_t port);
 
@@ -18,9 +19,21 @@ int tcp_server_init(uint16_t port);
  */
 int tcp_accept(int passive_socket);
 
+/**
+ * @brief Blocking call that connects to a TCP server on the local host
+ * (where tcp_server_init() listens); returns the socket
+ */
+int tcp_connect(uint16_t port);
+
 /**
  * @brief Blocking call that reads the active socket once and stores the output in buf
  */
 ssize_t tcp_read(int active_socket, char* buf, size_t buflen);
 
 ssize_t tcp_send(int active_socket, const char* response, size_t response_len);
+
+/**
+ * @brief Sends several buffers at once (gather write); returns the number of bytes sent,
+ * which may be less than their total
+ */
+ssize_t tcp_sendv(int active_socket, const struct iovec* iov, size_t iovcnt);
@@ -0,0 +1,105 @@
+/* ** NOTE: undocumented in Doxygen
+ * @file bench.c
+ * @brief Latency samples of the imgFS micro-benchmarks and their report
+ */
+
+#include "bench.h"
+#include "error.h"
+
+#include <inttypes.h> // for PRIu64
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*******************************************************************
+ * Time
+ */
+uint64_t bench_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/*******************************************************************
+ * Samples
+ */
+int bench_samples_init(struct bench_samples* samples, size_t capacity)
+{
+    M_REQUIRE_NON_NULL(samples);
+
+    samples->ns = calloc(capacity, sizeof(uint64_t));
+    if (samples->ns == NULL) return ERR_OUT_OF_MEMORY;
+    samples->count = 0;
+    samples->capacity = capacity;
+    return ERR_NONE;
+}
+
+void bench_samples_free(struct bench_samples* samples)
+{
+    if (samples == NULL) return;
+    free(samples->ns);
+    samples->ns = NULL;
+    samples->count = 0;
+    samples->capacity = 0;
+}
+
+void bench_record(struct bench_samples* samples, uint64_t start)
+{
+    const uint64_t end = bench_now_ns();
+    if (samples->count < samples->capacity) samples->ns[samples->count++] = end - start;
+}
+
+/*******************************************************************
+ * Report
+ */
+static int compare_ns(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*) a;
+    const uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank, in microseconds
+static double percentile_us(const struct bench_samples* samples, unsigned percent)
+{
+    size_t rank = (samples->count * percent + 99) / 100;
+    if (rank > 0) --rank;
+    return (double) samples->ns[rank] / 1000.0;
+}
+
+void bench_report_header(void)
+{
+    printf("%-32s %8s %12s %10s %10s %10s %10s\n",
+           "benchmark", "ops", "ops/s", "p50 us", "p90 us", "p99 us", "max us");
+}
+
+static void report(const char* name, struct bench_samples* samples, uint64_t wall_ns)
+{
+    if (samples->count == 0) {
+        printf("%-32s %8s\n", name, "-");
+        return;
+    }
+
+    qsort(samples->ns, samples->count, sizeof(uint64_t), compare_ns);
+
+    if (wall_ns == 0) {
+        // one after the other
+        for (size_t i = 0; i < samples->count; ++i) wall_ns += samples->ns[i];
+    }
+    const double ops_per_s = wall_ns == 0 ? 0.0 : (double) samples->count * 1e9 / (double) wall_ns;
+
+    printf("%-32s %8zu %12.0f %10.2f %10.2f %10.2f %10.2f\n", name, samples->count, ops_per_s,
+           percentile_us(samples, 50), percentile_us(samples, 90), percentile_us(samples, 99),
+           (double) samples->ns[samples->count - 1] / 1000.0);
+}
+
+void bench_report(const char* name, struct bench_samples* samples)
+{
+    report(name, samples, 0);
+}
+
+void bench_report_wall(const char* name, struct bench_samples* samples, uint64_t wall_ns)
+{
+    report(name, samples, wall_ns == 0 ? 1 : wall_ns);
+}
@@ -0,0 +1,55 @@
+/**
+ * @file bench.h
+ * @brief Latency samples of the imgFS micro-benchmarks and their report.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+struct bench_samples {
+    uint64_t* ns;    // latency of each operation
+    size_t count;
+    size_t capacity;
+};
+
+/**
+ * @brief Monotonic time, in nanoseconds.
+ */
+uint64_t bench_now_ns(void);
+
+/**
+ * @brief Prepares room for capacity samples.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int bench_samples_init(struct bench_samples* samples, size_t capacity);
+
+/**
+ * @brief Releases the samples.
+ */
+void bench_samples_free(struct bench_samples* samples);
+
+/**
+ * @brief Records the latency of one operation started at start (from
+ *        bench_now_ns()); ignored past the capacity.
+ */
+void bench_record(struct bench_samples* samples, uint64_t start);
+
+/**
+ * @brief Prints the header of the report table.
+ */
+void bench_report_header(void);
+
+/**
+ * @brief Prints the throughput and the latency percentiles of a benchmark
+ *        (sorts the samples).
+ */
+void bench_report(const char* name, struct bench_samples* samples);
+
+/**
+ * @brief Same as bench_report(), the throughput being that of operations
+ *        run concurrently over wall_ns nanoseconds.
+ */
+void bench_report_wall(const char* name, struct bench_samples* samples, uint64_t wall_ns);
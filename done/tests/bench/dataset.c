@@ -0,0 +1,60 @@
+/* ** NOTE: undocumented in Doxygen
+ * @file dataset.c
+ * @brief Reproducible synthetic images for the imgFS benchmarks and generator
+ */
+
+#include "dataset.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <vips/vips.h>
+
+/*******************************************************************
+ * Pseudo-random numbers
+ */
+uint32_t dataset_random(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/*******************************************************************
+ * Images: neither trivial nor pure noise, so that JPEG sizes are realistic
+ */
+int dataset_jpeg(uint32_t seed, uint32_t width, uint32_t height, char** jpeg, size_t* size)
+{
+    M_REQUIRE_NON_NULL(jpeg);
+    M_REQUIRE_NON_NULL(size);
+    if (width == 0 || height == 0) return ERR_INVALID_ARGUMENT;
+
+    uint32_t state = seed == 0 ? 1 : seed;
+    const size_t pixels_size = (size_t) width * height * 3;
+    unsigned char* pixels = malloc(pixels_size);
+    if (pixels == NULL) return ERR_OUT_OF_MEMORY;
+
+    const uint32_t tint = dataset_random(&state);
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            unsigned char* pixel = &pixels[(y * width + x) * 3];
+            const uint32_t noise = dataset_random(&state) & 0x1f;
+            pixel[0] = (unsigned char) ((x + (tint & 0xff) + noise) & 0xff);
+            pixel[1] = (unsigned char) ((y + ((tint >> 8) & 0xff) + noise) & 0xff);
+            pixel[2] = (unsigned char) ((x + y + ((tint >> 16) & 0xff)) & 0xff);
+        }
+    }
+
+    VipsImage* image = vips_image_new_from_memory(pixels, pixels_size, (int) width, (int) height,
+                                                  3, VIPS_FORMAT_UCHAR);
+    int err = image == NULL ? ERR_IMGLIB : ERR_NONE;
+    void* buffer = NULL;
+    if (err == ERR_NONE && vips_jpegsave_buffer(image, &buffer, size, NULL) != 0) err = ERR_IMGLIB;
+    if (image != NULL) g_object_unref(image);
+    free(pixels);
+
+    *jpeg = buffer;
+    return err;
+}
@@ -0,0 +1,23 @@
+/**
+ * @file dataset.h
+ * @brief Reproducible synthetic images for the imgFS benchmarks and generator.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+/**
+ * @brief Next number of a xorshift32 sequence (the same on every platform).
+ *        The state must not be 0.
+ */
+uint32_t dataset_random(uint32_t* state);
+
+/**
+ * @brief Encodes a width x height JPEG of smooth gradients plus noise, the
+ *        same for the same seed (into a buffer to be released with g_free()).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int dataset_jpeg(uint32_t seed, uint32_t width, uint32_t height, char** jpeg, size_t* size);
@@ -0,0 +1,423 @@
+/**
+ * @file imgfs-bench.c
+ * @brief Micro-benchmarks of the imgFS library.
+ *
+ * Usage: imgfs-bench [-n <count>] [-files <N>] [-seed <S>] [-dir <path>] [benchmark...]
+ *
+ * The images are generated (JPEG from pseudo-random pixels) from the seed:
+ * the same seed gives the same datasets. The stores are created in dir and
+ * removed at the end. Updates are not committed one by one (as in the
+ * server with the periodic durability): the journal is committed once per
+ * benchmark, outside of the measures.
+ */
+
+#include "bench.h"
+#include "dataset.h"
+#include "error.h"
+#include "http_prot.h"
+#include "image_content.h"
+#include "imgfs.h"
+#include "journal.h"
+#include "util.h"      // for atouint32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>   // for unlink
+#include <vips/vips.h>
+
+#define DEFAULT_COUNT 1000
+#define DEFAULT_FILES 20000
+#define DEFAULT_SEED 202
+#define IMAGE_WIDTH 320
+#define IMAGE_HEIGHT 240
+#define READ_IMAGES 100   // images read at random by the read benchmark
+#define LIST_PAGE 100
+#define HTTP_POST_BODY 4096
+#define PATH_SIZE 4096
+
+struct options {
+    unsigned count;    // operations per benchmark
+    unsigned files;    // images of the store opened and listed
+    uint32_t seed;
+    const char* dir;
+};
+
+/*******************************************************************
+ * Datasets
+ */
+static void make_id(char* img_id, unsigned i)
+{
+    snprintf(img_id, MAX_IMG_ID + 1, "img%06u", i);
+}
+
+static void store_path(const struct options* options, const char* name, char* path)
+{
+    snprintf(path, PATH_SIZE, "%s/bench-%s.imgfs", options->dir, name);
+}
+
+static int create_store(const char* path, uint32_t max_files, struct imgfs_file* imgfs_file)
+{
+    memset(imgfs_file, 0, sizeof(*imgfs_file));
+    imgfs_file->header.max_files = max_files;
+    imgfs_file->header.resized_res[0] = 64;
+    imgfs_file->header.resized_res[1] = 64;
+    imgfs_file->header.resized_res[2] = 256;
+    imgfs_file->header.resized_res[3] = 256;
+
+    int err = do_create(path, imgfs_file);
+    if (err != ERR_NONE) return err;
+    do_close(imgfs_file);
+
+    err = do_open(path, "rb+", imgfs_file);
+    if (err != ERR_NONE) return err;
+    if (imgfs_file->journal != NULL) imgfs_file->journal->autocommit = 0;
+    return ERR_NONE;
+}
+
+static int close_store(struct imgfs_file* imgfs_file)
+{
+    const int err = imgfs_file->journal != NULL ? journal_commit(imgfs_file) : ERR_NONE;
+    do_close(imgfs_file);
+    return err;
+}
+
+// count images; unique ones are generated from the seed, the others share the first content
+static int fill_store(const struct options* options, struct imgfs_file* imgfs_file,
+                      unsigned count, unsigned unique)
+{
+    char* shared = NULL;
+    size_t shared_size = 0;
+    int err = dataset_jpeg(options->seed, IMAGE_WIDTH, IMAGE_HEIGHT, &shared, &shared_size);
+
+    for (unsigned i = 0; i < count && err == ERR_NONE; ++i) {
+        char img_id[MAX_IMG_ID + 1];
+        make_id(img_id, i);
+        if (i < unique && i > 0) {
+            char* jpeg = NULL;
+            size_t size = 0;
+            err = dataset_jpeg(options->seed + i, IMAGE_WIDTH, IMAGE_HEIGHT, &jpeg, &size);
+            if (err == ERR_NONE) err = do_insert(jpeg, size, img_id, imgfs_file);
+            g_free(jpeg);
+        } else {
+            err = do_insert(shared, shared_size, img_id, imgfs_file);
+        }
+    }
+    g_free(shared);
+    return err;
+}
+
+/*******************************************************************
+ * do_open of a large store
+ */
+static int bench_open(const struct options* options)
+{
+    char path[PATH_SIZE];
+    store_path(options, "open", path);
+
+    struct imgfs_file imgfs_file;
+    int err = create_store(path, options->files, &imgfs_file);
+    if (err == ERR_NONE) err = fill_store(options, &imgfs_file, options->files, 1);
+    if (err == ERR_NONE) err = close_store(&imgfs_file);
+
+    struct bench_samples samples;
+    if (err == ERR_NONE) err = bench_samples_init(&samples, options->count);
+    if (err != ERR_NONE) {
+        unlink(path);
+        return err;
+    }
+
+    for (unsigned i = 0; i < options->count && err == ERR_NONE; ++i) {
+        const uint64_t start = bench_now_ns();
+        err = do_open(path, "rb", &imgfs_file);
+        bench_record(&samples, start);
+        if (err == ERR_NONE) do_close(&imgfs_file);
+    }
+
+    char name[PATH_SIZE];
+    snprintf(name, sizeof(name), "do_open (%u images)", options->files);
+    bench_report(name, &samples);
+    bench_samples_free(&samples);
+    unlink(path);
+    return err;
+}
+
+/*******************************************************************
+ * do_read of stored images, original and resized
+ */
+static int bench_read(const struct options* options)
+{
+    char path[PATH_SIZE];
+    store_path(options, "read", path);
+
+    struct imgfs_file imgfs_file;
+    int err = create_store(path, READ_IMAGES, &imgfs_file);
+    if (err == ERR_NONE) err = fill_store(options, &imgfs_file, READ_IMAGES, READ_IMAGES);
+    // the resized variants exist: only hits are measured
+    for (uint32_t i = 0; i < READ_IMAGES && err == ERR_NONE; ++i) {
+        err = lazily_resize(THUMB_RES, &imgfs_file, i);
+    }
+
+    static const int resolutions[] = { ORIG_RES, THUMB_RES };
+    static const char* const names[] = { "do_read (orig, hit)", "do_read (thumb, hit)" };
+    for (size_t r = 0; r < 2 && err == ERR_NONE; ++r) {
+        struct bench_samples samples;
+        err = bench_samples_init(&samples, options->count);
+        if (err != ERR_NONE) break;
+
+        uint32_t state = options->seed == 0 ? 1 : options->seed;
+        for (unsigned i = 0; i < options->count && err == ERR_NONE; ++i) {
+            char img_id[MAX_IMG_ID + 1];
+            make_id(img_id, dataset_random(&state) % READ_IMAGES);
+            char* buffer = NULL;
+            uint32_t size = 0;
+
+            const uint64_t start = bench_now_ns();
+            err = do_read(img_id, resolutions[r], &buffer, &size, &imgfs_file);
+            bench_record(&samples, start);
+            free(buffer);
+        }
+        bench_report(names[r], &samples);
+        bench_samples_free(&samples);
+    }
+
+    const int close_err = close_store(&imgfs_file);
+    unlink(path);
+    return err != ERR_NONE ? err : close_err;
+}
+
+/*******************************************************************
+ * do_insert of new content and of duplicates
+ */
+static int bench_insert(const struct options* options)
+{
+    // generated beforehand: only the insertions are measured
+    char** jpegs = calloc(options->count, sizeof(char*));
+    size_t* sizes = calloc(options->count, sizeof(size_t));
+    int err = jpegs == NULL || sizes == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    for (unsigned i = 0; i < options->count && err == ERR_NONE; ++i) {
+        err = dataset_jpeg(options->seed + i, IMAGE_WIDTH, IMAGE_HEIGHT, &jpegs[i], &sizes[i]);
+    }
+
+    static const char* const names[] = { "do_insert (new content)", "do_insert (dedup hit)" };
+    for (int dedup = 0; dedup < 2 && err == ERR_NONE; ++dedup) {
+        char path[PATH_SIZE];
+        store_path(options, "insert", path);
+
+        struct imgfs_file imgfs_file;
+        struct bench_samples samples;
+        err = create_store(path, options->count, &imgfs_file);
+        if (err != ERR_NONE) break;
+        err = bench_samples_init(&samples, options->count);
+
+        for (unsigned i = 0; i < options->count && err == ERR_NONE; ++i) {
+            char img_id[MAX_IMG_ID + 1];
+            make_id(img_id, i);
+            const unsigned content = dedup ? 0 : i;
+
+            const uint64_t start = bench_now_ns();
+            err = do_insert(jpegs[content], sizes[content], img_id, &imgfs_file);
+            bench_record(&samples, start);
+        }
+        if (err == ERR_NONE) bench_report(names[dedup], &samples);
+        bench_samples_free(&samples);
+
+        const int close_err = close_store(&imgfs_file);
+        if (err == ERR_NONE) err = close_err;
+        unlink(path);
+    }
+
+    for (unsigned i = 0; jpegs != NULL && i < options->count; ++i) g_free(jpegs[i]);
+    free(jpegs);
+    free(sizes);
+    return err;
+}
+
+/*******************************************************************
+ * lazily_resize, for each resolution
+ */
+static int bench_resize(const struct options* options)
+{
+    char path[PATH_SIZE];
+    store_path(options, "resize", path);
+
+    struct imgfs_file imgfs_file;
+    int err = create_store(path, options->count, &imgfs_file);
+    if (err == ERR_NONE) err = fill_store(options, &imgfs_file, options->count, options->count);
+
+    static const int resolutions[] = { THUMB_RES, SMALL_RES };
+    static const char* const names[] = { "lazily_resize (thumb)", "lazily_resize (small)" };
+    for (size_t r = 0; r < 2 && err == ERR_NONE; ++r) {
+        struct bench_samples samples;
+        err = bench_samples_init(&samples, options->count);
+
+        for (uint32_t i = 0; i < options->count && err == ERR_NONE; ++i) {
+            const uint64_t start = bench_now_ns();
+            err = lazily_resize(resolutions[r], &imgfs_file, i);
+            bench_record(&samples, start);
+        }
+        if (err == ERR_NONE) bench_report(names[r], &samples);
+        bench_samples_free(&samples);
+    }
+
+    const int close_err = close_store(&imgfs_file);
+    unlink(path);
+    return err != ERR_NONE ? err : close_err;
+}
+
+/*******************************************************************
+ * do_list in JSON: the whole store, and a page
+ */
+static int bench_list(const struct options* options)
+{
+    char path[PATH_SIZE];
+    store_path(options, "list", path);
+
+    struct imgfs_file imgfs_file;
+    int err = create_store(path, options->files, &imgfs_file);
+    if (err == ERR_NONE) err = fill_store(options, &imgfs_file, options->files, 1);
+
+    for (int page = 0; page < 2 && err == ERR_NONE; ++page) {
+        struct bench_samples samples;
+        err = bench_samples_init(&samples, options->count);
+
+        const struct list_query query = { 0, LIST_PAGE, NULL, LIST_FIELD_SIZE };
+        for (unsigned i = 0; i < options->count && err == ERR_NONE; ++i) {
+            char* json = NULL;
+            const uint64_t start = bench_now_ns();
+            err = page ? do_list_query(&imgfs_file, &query, &json)
+                  : do_list(&imgfs_file, JSON, &json);
+            bench_record(&samples, start);
+            free(json);
+        }
+
+        char name[PATH_SIZE];
+        if (page) {
+            snprintf(name, sizeof(name), "do_list_query (page of %d)", LIST_PAGE);
+        } else {
+            snprintf(name, sizeof(name), "do_list JSON (%u images)", options->files);
+        }
+        if (err == ERR_NONE) bench_report(name, &samples);
+        bench_samples_free(&samples);
+    }
+
+    const int close_err = close_store(&imgfs_file);
+    unlink(path);
+    return err != ERR_NONE ? err : close_err;
+}
+
+/*******************************************************************
+ * http_parse_message of typical requests
+ */
+static int bench_http(const struct options* options)
+{
+    static const char get[] =
+        "GET /imgfs/read?res=thumb&img_id=img000042 HTTP/1.1\r\n"
+        "Host: localhost:8000\r\n"
+        "User-Agent: imgfs-bench\r\n"
+        "Accept: image/avif,image/webp,*/*\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "If-None-Match: \"0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef-thumb\"\r\n"
+        "Connection: keep-alive\r\n\r\n";
+
+    char post[sizeof(get) + HTTP_POST_BODY + 256];
+    const int header_len = snprintf(post, sizeof(post),
+                                    "POST /imgfs/insert?name=img000042 HTTP/1.1\r\n"
+                                    "Host: localhost:8000\r\n"
+                                    "Content-Type: application/octet-stream\r\n"
+                                    "Content-Length: %d\r\n\r\n", HTTP_POST_BODY);
+    if (header_len < 0) return ERR_IO;
+    uint32_t state = options->seed == 0 ? 1 : options->seed;
+    for (int i = 0; i < HTTP_POST_BODY; ++i) post[header_len + i] = (char) ('a' + dataset_random(&state) % 26);
+    post[header_len + HTTP_POST_BODY] = '\0';
+
+    const char* const messages[] = { get, post };
+    const size_t lengths[] = { sizeof(get) - 1, (size_t) header_len + HTTP_POST_BODY };
+    static const char* const names[] = { "http_parse_message (GET)", "http_parse_message (POST 4k)" };
+
+    int err = ERR_NONE;
+    for (size_t m = 0; m < 2 && err == ERR_NONE; ++m) {
+        struct bench_samples samples;
+        err = bench_samples_init(&samples, options->count);
+
+        for (unsigned i = 0; i < options->count && err == ERR_NONE; ++i) {
+            struct http_message message;
+            int content_len = 0;
+            const uint64_t start = bench_now_ns();
+            const int parsed = http_parse_message(messages[m], lengths[m], &message, &content_len);
+            bench_record(&samples, start);
+            if (parsed <= 0) err = ERR_INVALID_ARGUMENT;
+        }
+        if (err == ERR_NONE) bench_report(names[m], &samples);
+        bench_samples_free(&samples);
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Benchmarks
+ */
+struct benchmark {
+    const char* name;
+    int (*run)(const struct options* options);
+};
+
+static const struct benchmark benchmarks[] = {
+    { "open", bench_open },
+    { "read", bench_read },
+    { "insert", bench_insert },
+    { "resize", bench_resize },
+    { "list", bench_list },
+    { "http", bench_http }
+};
+
+#define NB_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static int usage(void)
+{
+    fprintf(stderr, "imgfs-bench [-n <count>] [-files <N>] [-seed <S>] [-dir <path>] [benchmark...]\n"
+            "  -n: operations per benchmark (default %d)\n"
+            "  -files: images of the stores opened and listed (default %d)\n"
+            "  -seed: seed of the generated images (default %d)\n"
+            "  -dir: where to create the stores (default .)\n"
+            "  benchmarks (default all):", DEFAULT_COUNT, DEFAULT_FILES, DEFAULT_SEED);
+    for (size_t i = 0; i < NB_BENCHMARKS; ++i) fprintf(stderr, " %s", benchmarks[i].name);
+    fprintf(stderr, "\n");
+    return ERR_INVALID_ARGUMENT;
+}
+
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0])) return ERR_IMGLIB;
+
+    struct options options = { DEFAULT_COUNT, DEFAULT_FILES, DEFAULT_SEED, "." };
+    int first = 1;
+    for (; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+        if (strcmp(argv[first], "-n") == 0) {
+            options.count = atouint32(argv[first + 1]);
+        } else if (strcmp(argv[first], "-files") == 0) {
+            options.files = atouint32(argv[first + 1]);
+        } else if (strcmp(argv[first], "-seed") == 0) {
+            options.seed = atouint32(argv[first + 1]);
+        } else if (strcmp(argv[first], "-dir") == 0) {
+            options.dir = argv[first + 1];
+        } else {
+            return usage();
+        }
+    }
+    if (options.count == 0 || options.files == 0) return usage();
+
+    bench_report_header();
+    int err = ERR_NONE;
+    for (size_t i = 0; i < NB_BENCHMARKS && err == ERR_NONE; ++i) {
+        int selected = first == argc;
+        for (int j = first; j < argc; ++j) selected |= strcmp(argv[j], benchmarks[i].name) == 0;
+        if (!selected) continue;
+
+        err = benchmarks[i].run(&options);
+        if (err != ERR_NONE) fprintf(stderr, "%s: %s\n", benchmarks[i].name, ERR_MSG(err));
+    }
+
+    vips_shutdown();
+    return err;
+}
@@ -0,0 +1,316 @@
+/**
+ * @file imgfs-gen.c
+ * @brief Generator of synthetic imgFS stores, for scale testing.
+ *
+ * Usage: imgfs-gen <imgFS_filename> [-max_files <N>] [-fill <ratio>] [-dup <ratio>]
+ *                  [-deleted <ratio>] [-sizes <WxH:weight,...>] [-seed <S>] [create options...]
+ *
+ * The store is created as by "imgfscmd create" (the other options, such as
+ * -thumb_res or -segments, are passed to it), then filled with JPEGs
+ * generated from the seed: the same arguments give the same store.
+ *   - fill: valid images, as a fraction of max_files;
+ *   - deleted: slots that held an image since deleted (their content stays
+ *     in the file, as after do_delete()), as a fraction of max_files;
+ *   - dup: valid images whose content is the one of an earlier valid image,
+ *     shared as do_insert() would, as a fraction of the valid images
+ *     (deleted slots keep content of their own: do_insert() does not
+ *     share with them);
+ *   - sizes: the resolutions of the unique images, drawn with these weights.
+ * Deleted slots are spread among the valid ones; the last slots are left
+ * empty.
+ *
+ * The images are written like do_insert() would, but the generator knows
+ * which contents are duplicates: no deduplication scan, which would make
+ * the generation quadratic in the number of slots. The journal is
+ * committed every GEN_COMMIT_EVERY images.
+ */
+
+#include "dataset.h"
+#include "error.h"
+#include "imgfs.h"
+#include "imgfscmd_functions.h" // for do_create_cmd
+#include "journal.h"
+#include "util.h"               // for atouint32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define DEFAULT_MAX_FILES 100000
+#define DEFAULT_FILL 0.9
+#define DEFAULT_DUP 0.2
+#define DEFAULT_DELETED 0.05
+#define DEFAULT_SIZES "320x240:70,640x480:25,1600x1200:5"
+#define DEFAULT_SEED 202
+#define MAX_SIZES 16
+#define MAX_CREATE_ARGS 32
+#define GEN_COMMIT_EVERY 4096
+#define GEN_PROGRESS_EVERY 65536
+
+struct image_size {
+    uint32_t width;
+    uint32_t height;
+    uint32_t weight;
+};
+
+struct options {
+    uint32_t max_files;
+    double fill;
+    double dup;
+    double deleted;
+    struct image_size sizes[MAX_SIZES];
+    size_t nb_sizes;
+    uint32_t total_weight;
+    uint32_t seed;
+};
+
+// what a duplicate shares with the image it copies
+struct content {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t res[2];
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+};
+
+/*******************************************************************
+ * Options
+ */
+static int parse_ratio(const char* str, double* ratio)
+{
+    char* end = NULL;
+    const double value = strtod(str, &end);
+    if (end == str || *end != '\0' || !(value >= 0.0 && value <= 1.0)) return ERR_INVALID_ARGUMENT;
+    *ratio = value;
+    return ERR_NONE;
+}
+
+// "320x240:70,1600x1200:5": the weight defaults to 1
+static int parse_sizes(const char* str, struct options* options)
+{
+    options->nb_sizes = 0;
+    options->total_weight = 0;
+
+    const char* cursor = str;
+    while (*cursor != '\0') {
+        if (options->nb_sizes == MAX_SIZES) return ERR_INVALID_ARGUMENT;
+        struct image_size* size = &options->sizes[options->nb_sizes];
+
+        char* end = NULL;
+        size->width = (uint32_t) strtoul(cursor, &end, 10);
+        if (*end != 'x') return ERR_INVALID_ARGUMENT;
+        cursor = end + 1;
+        size->height = (uint32_t) strtoul(cursor, &end, 10);
+        cursor = end;
+        size->weight = 1;
+        if (*cursor == ':') {
+            size->weight = (uint32_t) strtoul(cursor + 1, &end, 10);
+            cursor = end;
+        }
+        if (*cursor == ',') ++cursor;
+        else if (*cursor != '\0') return ERR_INVALID_ARGUMENT;
+
+        if (size->width == 0 || size->height == 0 || size->weight == 0) return ERR_INVALID_ARGUMENT;
+        options->total_weight += size->weight;
+        ++options->nb_sizes;
+    }
+    return options->nb_sizes == 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+}
+
+static const struct image_size* pick_size(const struct options* options, uint32_t* state)
+{
+    uint32_t draw = dataset_random(state) % options->total_weight;
+    size_t i = 0;
+    while (draw >= options->sizes[i].weight) {
+        draw -= options->sizes[i].weight;
+        ++i;
+    }
+    return &options->sizes[i];
+}
+
+// true for exactly *wanted of the *left next draws
+static int pick(uint32_t* state, uint32_t* wanted, uint32_t left)
+{
+    if (*wanted == 0 || dataset_random(state) % left >= *wanted) return 0;
+    --*wanted;
+    return 1;
+}
+
+/*******************************************************************
+ * Generation
+ */
+static int new_content(const struct options* options, uint32_t index, uint32_t* state,
+                       struct imgfs_file* imgfs_file, struct content* content)
+{
+    const struct image_size* size = pick_size(options, state);
+    char* jpeg = NULL;
+    size_t jpeg_size = 0;
+    int err = dataset_jpeg(options->seed * 2654435761u + index, size->width, size->height,
+                           &jpeg, &jpeg_size);
+    if (err != ERR_NONE) return err;
+
+    content->size = (uint32_t) jpeg_size;
+    content->res[0] = size->width;
+    content->res[1] = size->height;
+    SHA256((const unsigned char*) jpeg, jpeg_size, content->SHA);
+    err = imgfs_content_append(imgfs_file, ORIG_RES, jpeg, jpeg_size, &content->offset);
+    g_free(jpeg);
+    return err;
+}
+
+static int commit(struct imgfs_file* imgfs_file)
+{
+    const int err = write_header(imgfs_file);
+    if (err != ERR_NONE) return err;
+    return imgfs_file->journal != NULL ? journal_commit(imgfs_file) : ERR_NONE;
+}
+
+static int generate(const struct options* options, struct imgfs_file* imgfs_file)
+{
+    const uint32_t valid = (uint32_t) (options->fill * options->max_files + 0.5);
+    uint32_t deleted = (uint32_t) (options->deleted * options->max_files + 0.5);
+    if ((uint64_t) valid + deleted > options->max_files) return ERR_INVALID_ARGUMENT;
+    const uint32_t used = valid + deleted;
+    uint32_t dups = (uint32_t) (options->dup * valid + 0.5);
+    if (dups >= valid) dups = valid > 0 ? valid - 1 : 0; // the first image has new content
+
+    // the contents of valid images, the only ones duplicates may share
+    struct content* contents = calloc(valid > 0 ? valid : 1, sizeof(struct content));
+    if (contents == NULL) return ERR_OUT_OF_MEMORY;
+    uint32_t nb_contents = 0;
+    uint32_t nb_unique = 0;
+    uint64_t content_bytes = 0;
+
+    uint32_t state = options->seed == 0 ? 1 : options->seed;
+    int err = ERR_NONE;
+    for (uint32_t i = 0; i < used && err == ERR_NONE; ++i) {
+        const int is_deleted = pick(&state, &deleted, used - i);
+        // (used - i - deleted: valid slots left, this one included)
+        const int is_dup = !is_deleted && nb_contents > 0
+                           && pick(&state, &dups, used - i - deleted);
+
+        struct content own;
+        const struct content* content = &own;
+        if (is_dup) {
+            content = &contents[dataset_random(&state) % nb_contents];
+        } else {
+            err = new_content(options, i, &state, imgfs_file, &own);
+            if (err != ERR_NONE) break;
+            if (!is_deleted) contents[nb_contents++] = own;
+            ++nb_unique;
+            content_bytes += own.size;
+        }
+
+        struct img_metadata* image = &imgfs_file->metadata[i];
+        memset(image, 0, sizeof(*image));
+        snprintf(image->img_id, sizeof(image->img_id), "gen%08u", i);
+        memcpy(image->SHA, content->SHA, SHA256_DIGEST_LENGTH);
+        image->orig_res[0] = content->res[0];
+        image->orig_res[1] = content->res[1];
+        image->size[ORIG_RES] = content->size;
+        image->offset[ORIG_RES] = content->offset;
+        image->is_valid = NON_EMPTY;
+
+        imgfs_file->header.nb_files++;
+        imgfs_file->header.version++;
+        err = write_metadata(imgfs_file, i, 1);
+
+        if (err == ERR_NONE && is_deleted) {
+            // as do_delete()
+            image->is_valid = EMPTY;
+            imgfs_file->header.nb_files--;
+            imgfs_file->header.version++;
+            err = write_metadata(imgfs_file, i, 0);
+        }
+
+        if (err == ERR_NONE && (i + 1) % GEN_COMMIT_EVERY == 0) err = commit(imgfs_file);
+        if ((i + 1) % GEN_PROGRESS_EVERY == 0) fprintf(stderr, "%u/%u images\n", i + 1, used);
+    }
+    if (err == ERR_NONE) err = commit(imgfs_file);
+
+    if (err == ERR_NONE) {
+        printf("%u slots: %u valid, %u deleted, %u empty; %u unique contents (%llu bytes)\n",
+               options->max_files, imgfs_file->header.nb_files, used - imgfs_file->header.nb_files,
+               options->max_files - used, nb_unique, (unsigned long long) content_bytes);
+    }
+    free(contents);
+    return err;
+}
+
+/*******************************************************************
+ * Main
+ */
+static int usage(void)
+{
+    fprintf(stderr, "imgfs-gen <imgFS_filename> [-max_files <N>] [-fill <ratio>] [-dup <ratio>]\n"
+            "          [-deleted <ratio>] [-sizes <WxH:weight,...>] [-seed <S>] [create options...]\n"
+            "  -max_files: slots of the store (default %d)\n"
+            "  -fill: valid images, as a fraction of the slots (default %.2f)\n"
+            "  -dup: valid images duplicating the content of an earlier one (default %.2f)\n"
+            "  -deleted: deleted images, as a fraction of the slots (default %.2f)\n"
+            "  -sizes: resolutions of the images and their weights (default %s)\n"
+            "  -seed: seed of the generated images (default %d)\n"
+            "  other options: as for \"imgfscmd create\"\n",
+            DEFAULT_MAX_FILES, DEFAULT_FILL, DEFAULT_DUP, DEFAULT_DELETED, DEFAULT_SIZES, DEFAULT_SEED);
+    return ERR_INVALID_ARGUMENT;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) return usage();
+    if (VIPS_INIT(argv[0])) return ERR_IMGLIB;
+
+    struct options options = { DEFAULT_MAX_FILES, DEFAULT_FILL, DEFAULT_DUP, DEFAULT_DELETED,
+                               {{0}}, 0, 0, DEFAULT_SEED };
+    int err = parse_sizes(DEFAULT_SIZES, &options);
+
+    // the create command gets the file name, -max_files and the unknown options
+    char* create_argv[MAX_CREATE_ARGS];
+    char max_files_option[] = "-max_files";
+    char max_files[16];
+    int create_argc = 3;
+    create_argv[0] = argv[1];
+    create_argv[1] = max_files_option;
+    create_argv[2] = max_files;
+
+    for (int i = 2; i < argc && err == ERR_NONE; ++i) {
+        const int has_value = i + 1 < argc;
+        if (strcmp(argv[i], "-max_files") == 0 && has_value) {
+            options.max_files = atouint32(argv[++i]);
+            if (options.max_files == 0) err = ERR_MAX_FILES;
+        } else if (strcmp(argv[i], "-fill") == 0 && has_value) {
+            err = parse_ratio(argv[++i], &options.fill);
+        } else if (strcmp(argv[i], "-dup") == 0 && has_value) {
+            err = parse_ratio(argv[++i], &options.dup);
+        } else if (strcmp(argv[i], "-deleted") == 0 && has_value) {
+            err = parse_ratio(argv[++i], &options.deleted);
+        } else if (strcmp(argv[i], "-sizes") == 0 && has_value) {
+            err = parse_sizes(argv[++i], &options);
+        } else if (strcmp(argv[i], "-seed") == 0 && has_value) {
+            options.seed = atouint32(argv[++i]);
+        } else if (create_argc < MAX_CREATE_ARGS) {
+            create_argv[create_argc++] = argv[i];
+        } else {
+            err = ERR_INVALID_COMMAND;
+        }
+    }
+    if (err == ERR_NONE && options.fill + options.deleted > 1.0) err = ERR_INVALID_ARGUMENT;
+    snprintf(max_files, sizeof(max_files), "%u", options.max_files);
+
+    struct imgfs_file imgfs_file;
+    memset(&imgfs_file, 0, sizeof(imgfs_file));
+    if (err == ERR_NONE) err = do_create_cmd(create_argc, create_argv);
+    if (err == ERR_NONE) err = do_open(argv[1], "rb+", &imgfs_file);
+    if (err == ERR_NONE) {
+        if (imgfs_file.journal != NULL) imgfs_file.journal->autocommit = 0;
+        err = generate(&options, &imgfs_file);
+        do_close(&imgfs_file);
+    }
+
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(err));
+        if (err == ERR_INVALID_ARGUMENT || err == ERR_INVALID_COMMAND) usage();
+    }
+    vips_shutdown();
+    return err;
+}
@@ -0,0 +1,562 @@
+/**
+ * @file imgfs-load.c
+ * @brief HTTP load generator for the imgFS server.
+ *
+ * Usage: imgfs-load [-port <P>] [-threads <T>] [-n <requests>] [-images <N>]
+ *                   [-mix <op:weight,...>] [-store <name>] [-seed <S>]
+ *
+ * Each thread keeps one connection to the server (keep-alive) and sends
+ * requests one after the other, drawn with the weights of the mix among
+ * list, read_thumb, read_small, read_orig, insert and delete. Before the
+ * measures, images (generated from the seed) are inserted for the reads to
+ * hit; each thread deletes the images it inserted itself, oldest first (an
+ * insert when it has none). Everything inserted is deleted at the end.
+ *
+ * Each insert sends content of its own, so that none of them is a
+ * deduplication hit: one of NB_PAYLOADS generated images, with its ID in a
+ * comment (COM segment) right after the start of image.
+ */
+
+#define _GNU_SOURCE // for memmem
+
+#include "bench.h"
+#include "dataset.h"
+#include "error.h"
+#include "socket_layer.h"
+#include "util.h"      // for atouint16, atouint32
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>   // for strncasecmp
+#include <unistd.h>    // for close
+#include <vips/vips.h>
+
+#define DEFAULT_PORT 8000
+#define DEFAULT_THREADS 8
+#define DEFAULT_REQUESTS 10000
+#define DEFAULT_IMAGES 100
+#define DEFAULT_MIX "list:2,read_thumb:40,read_small:20,read_orig:20,insert:9,delete:9"
+#define DEFAULT_SEED 202
+#define IMAGE_WIDTH 320
+#define IMAGE_HEIGHT 240
+#define NB_PAYLOADS 16   // images the insert requests tag with their ID
+#define JPEG_COM_SIZE 4  // marker and length of a comment segment
+#define RESPONSE_BUFFER 65536
+#define REQUEST_SIZE 512
+#define ID_SIZE 32
+#define MAX_STORE_NAME 64
+
+enum op { OP_LIST, OP_READ_THUMB, OP_READ_SMALL, OP_READ_ORIG, OP_INSERT, OP_DELETE, NB_OPS };
+
+static const char* const op_names[NB_OPS] = {
+    "list", "read_thumb", "read_small", "read_orig", "insert", "delete"
+};
+
+struct options {
+    uint16_t port;
+    unsigned threads;
+    unsigned requests;   // per thread
+    unsigned images;     // inserted beforehand, for the reads
+    unsigned weights[NB_OPS];
+    unsigned total_weight;
+    char root[MAX_STORE_NAME + 8]; // "/imgfs" or "/imgfs/<store>"
+    uint32_t seed;
+};
+
+struct payload {
+    char* jpeg;
+    size_t size;
+};
+
+static struct payload payloads[NB_PAYLOADS];
+static size_t max_payload_size;
+
+// a keep-alive connection, with what was received and not used yet
+struct connection {
+    int socket;
+    char* buf;
+    size_t start;
+    size_t end;
+};
+
+struct worker {
+    const struct options* options;
+    unsigned index;
+    pthread_t thread;
+    struct bench_samples samples[NB_OPS];
+    unsigned errors[NB_OPS];
+    char (*owned)[ID_SIZE];  // inserted and not deleted yet, oldest first
+    char* tagged;            // max_payload_size + JPEG_COM_SIZE + ID_SIZE bytes
+    size_t owned_first;
+    size_t owned_count;
+    int err;
+};
+
+/*******************************************************************
+ * Connection
+ */
+static int connection_open(struct connection* connection, uint16_t port)
+{
+    connection->start = 0;
+    connection->end = 0;
+    connection->socket = tcp_connect(port);
+    return connection->socket < 0 ? ERR_IO : ERR_NONE;
+}
+
+static void connection_close(struct connection* connection)
+{
+    if (connection->socket >= 0) close(connection->socket);
+    connection->socket = -1;
+}
+
+static int connection_fill(struct connection* connection)
+{
+    if (connection->start > 0) {
+        memmove(connection->buf, connection->buf + connection->start,
+                connection->end - connection->start);
+        connection->end -= connection->start;
+        connection->start = 0;
+    }
+    if (connection->end == RESPONSE_BUFFER) return ERR_IO; // headers too long
+
+    const ssize_t read = tcp_read(connection->socket, connection->buf + connection->end,
+                                  RESPONSE_BUFFER - connection->end);
+    if (read <= 0) return ERR_IO;
+    connection->end += (size_t) read;
+    return ERR_NONE;
+}
+
+static int connection_skip(struct connection* connection, size_t size)
+{
+    while (size > 0) {
+        if (connection->start == connection->end) {
+            const int err = connection_fill(connection);
+            if (err != ERR_NONE) return err;
+        }
+        const size_t available = connection->end - connection->start;
+        const size_t skipped = available < size ? available : size;
+        connection->start += skipped;
+        size -= skipped;
+    }
+    return ERR_NONE;
+}
+
+// the next line, without its "\r\n"
+static int connection_line(struct connection* connection, const char** line, size_t* len)
+{
+    const char* end = NULL;
+    while ((end = memmem(connection->buf + connection->start, connection->end - connection->start,
+                         "\r\n", 2)) == NULL) {
+        const int err = connection_fill(connection);
+        if (err != ERR_NONE) return err;
+    }
+    *line = connection->buf + connection->start;
+    *len = (size_t) (end - *line);
+    connection->start += *len + 2;
+    return ERR_NONE;
+}
+
+static int header_is(const char* line, size_t len, const char* name, const char** value)
+{
+    const size_t name_len = strlen(name);
+    if (len <= name_len || strncasecmp(line, name, name_len) != 0 || line[name_len] != ':') return 0;
+    *value = line + name_len + 1;
+    while (**value == ' ') ++*value;
+    return 1;
+}
+
+/*
+ * Receives a response (its body is dropped); gives its status code.
+ */
+static int read_response(struct connection* connection, int* status)
+{
+    const char* line = NULL;
+    size_t len = 0;
+    int err = connection_line(connection, &line, &len);
+    if (err != ERR_NONE) return err;
+    if (len < 12 || strncmp(line, "HTTP/1.", 7) != 0) return ERR_IO;
+    *status = atoi(line + 9);
+
+    size_t content_length = 0;
+    int chunked = 0;
+    while ((err = connection_line(connection, &line, &len)) == ERR_NONE && len > 0) {
+        const char* value = NULL;
+        if (header_is(line, len, "Content-Length", &value)) {
+            content_length = strtoul(value, NULL, 10);
+        } else if (header_is(line, len, "Transfer-Encoding", &value)) {
+            chunked = strncasecmp(value, "chunked", strlen("chunked")) == 0;
+        }
+    }
+    if (err != ERR_NONE) return err;
+
+    if (!chunked) return connection_skip(connection, content_length);
+
+    for (;;) {
+        err = connection_line(connection, &line, &len);
+        if (err != ERR_NONE) return err;
+        const size_t chunk = strtoul(line, NULL, 16);
+        if (chunk == 0) break;
+        err = connection_skip(connection, chunk + 2);
+        if (err != ERR_NONE) return err;
+    }
+    // no trailers: the empty line
+    return connection_line(connection, &line, &len);
+}
+
+/*
+ * Sends a request and receives its response, which failed if its status
+ * is 400 or more; ERR_IO if the connection failed.
+ */
+static int request(struct connection* connection, const struct options* options,
+                   const char* method, const char* uri, const struct payload* body, int* failed)
+{
+    char head[REQUEST_SIZE];
+    const int len = snprintf(head, sizeof(head),
+                             "%s %s%s HTTP/1.1\r\nHost: localhost:%u\r\nUser-Agent: imgfs-load\r\n"
+                             "Content-Length: %zu\r\n\r\n",
+                             method, options->root, uri, options->port, body != NULL ? body->size : 0);
+    if (len < 0 || (size_t) len >= sizeof(head)) return ERR_INVALID_ARGUMENT;
+
+    struct iovec iov[2] = { { head, (size_t) len }, { NULL, 0 } };
+    size_t iovcnt = 1;
+    if (body != NULL) {
+        iov[1].iov_base = body->jpeg;
+        iov[1].iov_len = body->size;
+        iovcnt = 2;
+    }
+
+    // partial sends
+    size_t index = 0;
+    while (index < iovcnt) {
+        const ssize_t sent = tcp_sendv(connection->socket, iov + index, iovcnt - index);
+        if (sent <= 0) return ERR_IO;
+        size_t left = (size_t) sent;
+        while (index < iovcnt && left >= iov[index].iov_len) left -= iov[index++].iov_len;
+        if (index < iovcnt) {
+            iov[index].iov_base = (char*) iov[index].iov_base + left;
+            iov[index].iov_len -= left;
+        }
+    }
+
+    int status = 0;
+    const int err = read_response(connection, &status);
+    *failed = err != ERR_NONE || status >= 400;
+    return err;
+}
+
+/*
+ * A copy of the payload with a comment holding id, after the SOI marker.
+ */
+static void tag_payload(const struct payload* payload, const char* id, char* buffer,
+                        struct payload* tagged)
+{
+    const size_t len = strlen(id);
+    memcpy(buffer, payload->jpeg, 2);
+    buffer[2] = (char) 0xFF;
+    buffer[3] = (char) 0xFE;
+    // (the length counts itself)
+    buffer[4] = (char) ((len + 2) >> 8);
+    buffer[5] = (char) ((len + 2) & 0xFF);
+    memcpy(buffer + 2 + JPEG_COM_SIZE, id, len);
+    memcpy(buffer + 2 + JPEG_COM_SIZE + len, payload->jpeg + 2, payload->size - 2);
+
+    tagged->jpeg = buffer;
+    tagged->size = payload->size + JPEG_COM_SIZE + len;
+}
+
+/*******************************************************************
+ * Setup and cleanup
+ */
+static void image_id(char* id, unsigned i)
+{
+    snprintf(id, ID_SIZE, "load%06u", i);
+}
+
+// inserts (insert != 0) or deletes the images the reads go to
+static int populate(const struct options* options, int insert)
+{
+    struct connection connection = { -1, malloc(RESPONSE_BUFFER), 0, 0 };
+    if (connection.buf == NULL) return ERR_OUT_OF_MEMORY;
+    int err = connection_open(&connection, options->port);
+
+    unsigned failures = 0;
+    for (unsigned i = 0; i < options->images && err == ERR_NONE; ++i) {
+        char uri[REQUEST_SIZE];
+        char id[ID_SIZE];
+        image_id(id, i);
+        int failed = 0;
+        if (insert) {
+            struct payload image = { NULL, 0 };
+            err = dataset_jpeg(options->seed + i, IMAGE_WIDTH, IMAGE_HEIGHT, &image.jpeg, &image.size);
+            snprintf(uri, sizeof(uri), "/insert?name=%s", id);
+            if (err == ERR_NONE) err = request(&connection, options, "POST", uri, &image, &failed);
+            g_free(image.jpeg);
+        } else {
+            snprintf(uri, sizeof(uri), "/delete?img_id=%s", id);
+            err = request(&connection, options, "GET", uri, NULL, &failed);
+        }
+        failures += (unsigned) failed;
+    }
+    // e.g. left by an interrupted run
+    if (failures > 0) fprintf(stderr, "%u image(s) could not be %s\n", failures, insert ? "inserted" : "deleted");
+
+    connection_close(&connection);
+    free(connection.buf);
+    return err;
+}
+
+/*******************************************************************
+ * Workers
+ */
+static enum op pick_op(const struct options* options, uint32_t* state)
+{
+    unsigned draw = dataset_random(state) % options->total_weight;
+    int op = 0;
+    while (draw >= options->weights[op]) draw -= options->weights[op++];
+    return (enum op) op;
+}
+
+static void* work(void* arg)
+{
+    struct worker* worker = arg;
+    const struct options* options = worker->options;
+    uint32_t state = (options->seed ^ (worker->index + 1) * 2654435761u) | 1;
+    unsigned inserted = 0;
+
+    struct connection connection = { -1, malloc(RESPONSE_BUFFER), 0, 0 };
+    worker->err = connection.buf == NULL ? ERR_OUT_OF_MEMORY : connection_open(&connection, options->port);
+
+    for (unsigned r = 0; r < options->requests && worker->err == ERR_NONE; ++r) {
+        enum op op = pick_op(options, &state);
+        if (op == OP_DELETE && worker->owned_count == 0) op = OP_INSERT;
+
+        char uri[REQUEST_SIZE];
+        struct payload tagged;
+        const struct payload* body = NULL;
+        const char* method = "GET";
+        char id[ID_SIZE];
+        switch (op) {
+        case OP_LIST:
+            snprintf(uri, sizeof(uri), "/list");
+            break;
+        case OP_READ_THUMB:
+        case OP_READ_SMALL:
+        case OP_READ_ORIG:
+            image_id(id, dataset_random(&state) % options->images);
+            snprintf(uri, sizeof(uri), "/read?res=%s&img_id=%s",
+                     op == OP_READ_THUMB ? "thumb" : op == OP_READ_SMALL ? "small" : "orig", id);
+            break;
+        case OP_INSERT: {
+            char* owned = worker->owned[(worker->owned_first + worker->owned_count) % options->requests];
+            snprintf(owned, ID_SIZE, "load-t%02u-%06u", worker->index, inserted++);
+            ++worker->owned_count;
+            snprintf(uri, sizeof(uri), "/insert?name=%s", owned);
+            tag_payload(&payloads[dataset_random(&state) % NB_PAYLOADS], owned, worker->tagged,
+                        &tagged);
+            body = &tagged;
+            method = "POST";
+            break;
+        }
+        default:
+            snprintf(uri, sizeof(uri), "/delete?img_id=%s", worker->owned[worker->owned_first]);
+            worker->owned_first = (worker->owned_first + 1) % options->requests;
+            --worker->owned_count;
+            break;
+        }
+
+        int failed = 0;
+        const uint64_t start = bench_now_ns();
+        int err = request(&connection, options, method, uri, body, &failed);
+        bench_record(&worker->samples[op], start);
+        worker->errors[op] += (unsigned) failed;
+        if (op == OP_INSERT && failed) --worker->owned_count;
+
+        if (err == ERR_IO) {
+            // the server closed the connection (e.g. after an error)
+            connection_close(&connection);
+            err = connection_open(&connection, options->port);
+        }
+        worker->err = err;
+    }
+
+    // leaves the store as it was
+    while (worker->err == ERR_NONE && worker->owned_count > 0) {
+        char uri[REQUEST_SIZE];
+        int failed = 0;
+        snprintf(uri, sizeof(uri), "/delete?img_id=%s", worker->owned[worker->owned_first]);
+        worker->owned_first = (worker->owned_first + 1) % options->requests;
+        --worker->owned_count;
+        worker->err = request(&connection, options, "GET", uri, NULL, &failed);
+    }
+
+    connection_close(&connection);
+    free(connection.buf);
+    return NULL;
+}
+
+/*******************************************************************
+ * Options
+ */
+static int parse_mix(const char* str, struct options* options)
+{
+    memset(options->weights, 0, sizeof(options->weights));
+    options->total_weight = 0;
+
+    const char* cursor = str;
+    while (*cursor != '\0') {
+        const char* colon = strchr(cursor, ':');
+        if (colon == NULL) return ERR_INVALID_ARGUMENT;
+
+        int op = 0;
+        while (op < NB_OPS && (strlen(op_names[op]) != (size_t) (colon - cursor)
+                               || strncmp(op_names[op], cursor, (size_t) (colon - cursor)) != 0)) {
+            ++op;
+        }
+        if (op == NB_OPS) return ERR_INVALID_ARGUMENT;
+
+        char* end = NULL;
+        options->weights[op] = (unsigned) strtoul(colon + 1, &end, 10);
+        options->total_weight += options->weights[op];
+        if (*end == ',') ++end;
+        else if (*end != '\0') return ERR_INVALID_ARGUMENT;
+        cursor = end;
+    }
+    return options->total_weight == 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+}
+
+static int usage(void)
+{
+    fprintf(stderr, "imgfs-load [-port <P>] [-threads <T>] [-n <requests>] [-images <N>]\n"
+            "           [-mix <op:weight,...>] [-store <name>] [-seed <S>]\n"
+            "  -port: of the server, on this host (default %d)\n"
+            "  -threads: connections, one request at a time each (default %d)\n"
+            "  -n: requests per connection (default %d)\n"
+            "  -images: inserted beforehand, for the reads (default %d)\n"
+            "  -mix: weights of list, read_thumb, read_small, read_orig, insert, delete\n"
+            "        (default %s)\n"
+            "  -store: named store of the server (default: the first one)\n"
+            "  -seed: seed of the generated images and of the requests (default %d)\n",
+            DEFAULT_PORT, DEFAULT_THREADS, DEFAULT_REQUESTS, DEFAULT_IMAGES, DEFAULT_MIX, DEFAULT_SEED);
+    return ERR_INVALID_ARGUMENT;
+}
+
+/*******************************************************************
+ * Main
+ */
+int main(int argc, char* argv[])
+{
+    struct options options = { DEFAULT_PORT, DEFAULT_THREADS, DEFAULT_REQUESTS, DEFAULT_IMAGES,
+                               {0}, 0, "/imgfs", DEFAULT_SEED };
+    int err = parse_mix(DEFAULT_MIX, &options);
+
+    for (int i = 1; i < argc && err == ERR_NONE; i += 2) {
+        if (i + 1 == argc) return usage();
+        if (strcmp(argv[i], "-port") == 0) {
+            options.port = atouint16(argv[i + 1]);
+        } else if (strcmp(argv[i], "-threads") == 0) {
+            options.threads = atouint32(argv[i + 1]);
+        } else if (strcmp(argv[i], "-n") == 0) {
+            options.requests = atouint32(argv[i + 1]);
+        } else if (strcmp(argv[i], "-images") == 0) {
+            options.images = atouint32(argv[i + 1]);
+        } else if (strcmp(argv[i], "-mix") == 0) {
+            err = parse_mix(argv[i + 1], &options);
+        } else if (strcmp(argv[i], "-store") == 0) {
+            if (strlen(argv[i + 1]) > MAX_STORE_NAME) return usage();
+            snprintf(options.root, sizeof(options.root), "/imgfs/%s", argv[i + 1]);
+        } else if (strcmp(argv[i], "-seed") == 0) {
+            options.seed = atouint32(argv[i + 1]);
+        } else {
+            return usage();
+        }
+    }
+    if (err != ERR_NONE || options.port == 0 || options.threads == 0 || options.requests == 0
+        || options.images == 0) {
+        return usage();
+    }
+
+    if (VIPS_INIT(argv[0])) return ERR_IMGLIB;
+    for (uint32_t i = 0; i < NB_PAYLOADS && err == ERR_NONE; ++i) {
+        err = dataset_jpeg(options.seed + options.images + i, IMAGE_WIDTH, IMAGE_HEIGHT,
+                           &payloads[i].jpeg, &payloads[i].size);
+        if (err == ERR_NONE && payloads[i].size > max_payload_size) max_payload_size = payloads[i].size;
+    }
+    const int populated = err == ERR_NONE;
+    if (populated) err = populate(&options, 1);
+
+    struct worker* workers = err == ERR_NONE ? calloc(options.threads, sizeof(struct worker)) : NULL;
+    if (err == ERR_NONE && workers == NULL) err = ERR_OUT_OF_MEMORY;
+
+    unsigned started = 0;
+    uint64_t wall_ns = 0;
+    if (err == ERR_NONE) {
+        const uint64_t start = bench_now_ns();
+        for (; started < options.threads && err == ERR_NONE; ++started) {
+            struct worker* worker = &workers[started];
+            worker->options = &options;
+            worker->index = started;
+            worker->owned = calloc(options.requests, ID_SIZE);
+            worker->tagged = malloc(max_payload_size + JPEG_COM_SIZE + ID_SIZE);
+            if (worker->owned == NULL || worker->tagged == NULL) err = ERR_OUT_OF_MEMORY;
+            for (int op = 0; op < NB_OPS && err == ERR_NONE; ++op) {
+                err = bench_samples_init(&worker->samples[op], options.requests);
+            }
+            if (err == ERR_NONE && pthread_create(&worker->thread, NULL, work, worker) != 0) {
+                err = ERR_THREADING;
+            }
+            if (err != ERR_NONE) break;
+        }
+        for (unsigned i = 0; i < started; ++i) {
+            pthread_join(workers[i].thread, NULL);
+            if (err == ERR_NONE) err = workers[i].err;
+        }
+        wall_ns = bench_now_ns() - start;
+    }
+
+    if (err == ERR_NONE) {
+        // all the connections together
+        printf("%u connection(s), %u request(s) each, %.3f s\n",
+               options.threads, options.requests, (double) wall_ns / 1e9);
+        bench_report_header();
+        struct bench_samples all;
+        err = bench_samples_init(&all, (size_t) options.threads * options.requests);
+        unsigned errors = 0;
+        for (int op = 0; op < NB_OPS && err == ERR_NONE; ++op) {
+            struct bench_samples merged;
+            err = bench_samples_init(&merged, (size_t) options.threads * options.requests);
+            unsigned op_errors = 0;
+            for (unsigned i = 0; i < options.threads && err == ERR_NONE; ++i) {
+                const struct bench_samples* samples = &workers[i].samples[op];
+                memcpy(merged.ns + merged.count, samples->ns, samples->count * sizeof(uint64_t));
+                merged.count += samples->count;
+                memcpy(all.ns + all.count, samples->ns, samples->count * sizeof(uint64_t));
+                all.count += samples->count;
+                op_errors += workers[i].errors[op];
+            }
+            if (merged.count > 0) bench_report_wall(op_names[op], &merged, wall_ns);
+            if (op_errors > 0) printf("  %s: %u error(s)\n", op_names[op], op_errors);
+            errors += op_errors;
+            bench_samples_free(&merged);
+        }
+        if (err == ERR_NONE) bench_report_wall("total", &all, wall_ns);
+        if (errors > 0) printf("%u error(s)\n", errors);
+        bench_samples_free(&all);
+    }
+
+    // best effort, even after an error
+    if (populated) populate(&options, 0);
+
+    for (unsigned i = 0; workers != NULL && i < options.threads; ++i) {
+        for (int op = 0; op < NB_OPS; ++op) bench_samples_free(&workers[i].samples[op]);
+        free(workers[i].owned);
+        free(workers[i].tagged);
+    }
+    free(workers);
+    for (size_t i = 0; i < NB_PAYLOADS; ++i) g_free(payloads[i].jpeg);
+
+    if (err != ERR_NONE) fprintf(stderr, "ERROR: %s\n", ERR_MSG(err));
+    vips_shutdown();
+    return err;
+}
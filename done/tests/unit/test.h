@@ -220,6 +220,12 @@ static const char *const ERR_NAMES[] = {"ERR_FIRST",
         system(command);                                                                                               \
     } while (0)
 
+// the journal of an imgFS (JOURNAL_SUFFIX is in journal.h)
+#define DECLARE_JOURNAL(name, imgfs)                                                                                   \
+    char name[4096] = {0};                                                                                             \
+    strcat(name, imgfs);                                                                                               \
+    strcat(name, JOURNAL_SUFFIX)
+
 #define NON_NULL ((void *) 1)
 
 static void read_file(void *buffer, const char *filename, size_t size)
@@ -232,6 +238,14 @@ static void read_file(void *buffer, const char *filename, size_t size)
     fclose(file);
 }
 
+// what is in place, whatever the journal holds
+static uint32_t nb_files_on_disk(const char *filename)
+{
+    struct imgfs_header header;
+    read_file(&header, filename, sizeof(header));
+    return header.nb_files;
+}
+
 static void read_file_and_size(void **buffer, const char *filename, size_t* size)
 {
     FILE *file = fopen(filename, "r");
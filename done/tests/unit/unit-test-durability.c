@@ -0,0 +1,217 @@
+#include "imgfs.h"
+#include "durability.h"
+#include "journal.h"
+#include "test.h"
+#include <check.h>
+#include <unistd.h>
+
+// ======================================================================
+START_TEST(histogram_buckets)
+{
+    start_test_print;
+
+    struct histogram histogram;
+    memset(&histogram, 0, sizeof(histogram));
+    histogram_add(&histogram, 0);
+    histogram_add(&histogram, 1);
+    histogram_add(&histogram, 3);
+    histogram_add(&histogram, 1 << 20);
+    histogram_add(&histogram, UINT64_MAX);
+
+    ck_assert_uint_eq(histogram.buckets[0], 1);
+    ck_assert_uint_eq(histogram.buckets[1], 1);
+    ck_assert_uint_eq(histogram.buckets[2], 1);
+    ck_assert_uint_eq(histogram.buckets[21], 1);
+    ck_assert_uint_eq(histogram.buckets[HISTOGRAM_BUCKETS - 1], 1);
+    ck_assert_uint_eq(histogram.count, 5);
+    ck_assert_uint_eq(histogram.max, UINT64_MAX);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(durability_modes)
+{
+    start_test_print;
+
+    for (int mode = 0; mode < NB_DURABILITY_MODES; ++mode) {
+        ck_assert_int_eq(durability_parse(durability_name((enum durability_mode) mode)), mode);
+    }
+    ck_assert_int_eq(durability_parse("always"), -1);
+    ck_assert_int_eq(durability_parse(NULL), -1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(durability_none)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct durability durability;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    ck_assert_err_none(durability_start(&durability, DURABILITY_NONE, 0, &file, &mutex));
+    ck_assert_ptr_null(file.journal);
+
+    durability_update_begin(&durability);
+    pthread_mutex_lock(&mutex);
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_err_none(durability_update_done(&durability));
+    pthread_mutex_unlock(&mutex);
+    ck_assert_uint_eq(nb_files_on_disk(dump), 1);
+
+    durability_stop(&durability);
+    ck_assert_uint_eq(durability.batch.count, 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(durability_request)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct durability durability;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    // a lone update does not wait for others to join
+    ck_assert_err_none(durability_start(&durability, DURABILITY_REQUEST, 60000, &file, &mutex));
+
+    durability_update_begin(&durability);
+    pthread_mutex_lock(&mutex);
+    ck_assert_err_none(do_delete("pic1", &file));
+    // logged only
+    ck_assert_uint_eq(nb_files_on_disk(dump), 2);
+    ck_assert_err_none(durability_update_done(&durability));
+    pthread_mutex_unlock(&mutex);
+
+    // durable once done
+    ck_assert_uint_eq(nb_files_on_disk(dump), 1);
+    ck_assert_uint_eq(durability.batch.count, 1);
+    ck_assert_uint_eq(durability.wait_us.count, 1);
+
+    // a failed update is not waited for: the next one is alone again
+    durability_update_begin(&durability);
+    pthread_mutex_lock(&mutex);
+    ck_assert_err(do_delete("pic1", &file), ERR_IMAGE_NOT_FOUND);
+    durability_update_cancel(&durability);
+    pthread_mutex_unlock(&mutex);
+    ck_assert_int_eq(durability.arriving, 0);
+    ck_assert_uint_eq(durability.logged, 1);
+
+    durability_update_begin(&durability);
+    pthread_mutex_lock(&mutex);
+    ck_assert_err_none(do_delete("pic2", &file));
+    ck_assert_err_none(durability_update_done(&durability));
+    pthread_mutex_unlock(&mutex);
+    ck_assert_uint_eq(nb_files_on_disk(dump), 0);
+    ck_assert_uint_eq(durability.batch.count, 2);
+
+    durability_stop(&durability);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(durability_failed_commit)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_JOURNAL(journal, dump);
+
+    struct imgfs_file file;
+    struct durability durability;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(durability_start(&durability, DURABILITY_REQUEST, 0, &file, &mutex));
+
+    // a journal that cannot be written
+    fclose(file.journal->file);
+    file.journal->file = fopen("/dev/full", "w");
+    ck_assert_ptr_nonnull(file.journal->file);
+
+    durability_update_begin(&durability);
+    pthread_mutex_lock(&mutex);
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_err(durability_update_done(&durability), ERR_IO);
+    pthread_mutex_unlock(&mutex);
+    ck_assert_uint_eq(durability.durable, 0);
+
+    // neither is any later update
+    durability_update_begin(&durability);
+    pthread_mutex_lock(&mutex);
+    ck_assert_err_none(do_delete("pic2", &file));
+    ck_assert_err(durability_update_done(&durability), ERR_IO);
+    pthread_mutex_unlock(&mutex);
+    ck_assert_uint_eq(durability.durable, 0);
+    ck_assert_uint_eq(nb_files_on_disk(dump), 2);
+
+    durability_stop(&durability);
+    do_close(&file);
+    unlink(journal);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(durability_periodic)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct durability durability;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(durability_start(&durability, DURABILITY_PERIODIC, 1000, &file, &mutex));
+
+    durability_update_begin(&durability);
+    pthread_mutex_lock(&mutex);
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_err_none(do_delete("pic2", &file));
+    ck_assert_err_none(durability_update_done(&durability));
+    pthread_mutex_unlock(&mutex);
+    ck_assert_uint_eq(nb_files_on_disk(dump), 2);
+
+    // stopping commits what is pending
+    durability_stop(&durability);
+    ck_assert_uint_eq(nb_files_on_disk(dump), 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *durability_test_suite()
+{
+    Suite *s = suite_create("Tests for the server durability modes");
+
+    Add_Test(s, histogram_buckets);
+    Add_Test(s, durability_modes);
+    Add_Test(s, durability_none);
+    Add_Test(s, durability_request);
+    Add_Test(s, durability_failed_commit);
+    Add_Test(s, durability_periodic);
+
+    return s;
+}
+
+TEST_SUITE(durability_test_suite)
@@ -1,3 +1,4 @@
+#include "http_compress.h"
 #include "http_prot.h"
 #include "test.h"
 #include <check.h>
@@ -279,6 +280,243 @@ START_TEST(http_parse_message_full_headers_full_content)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_parse_message_binary_content_pipelined)
+{
+    start_test_print;
+
+    // a body with '\0', then the start of the next message (keep-alive)
+    const char str[] = "POST /imgfs/insert?name=a HTTP/1.1" HTTP_LINE_DELIM "Content-Length: 5" HTTP_HDR_END_DELIM
+                       "ab\0cdGET /imgfs/list HTTP/1.1" HTTP_HDR_END_DELIM;
+    struct http_message msg;
+    int content_len;
+
+    ck_assert_int_eq(http_parse_message(str, sizeof(str) - 1, &msg, &content_len), 1);
+    ck_assert_int_eq(content_len, 5);
+    ck_assert_uint_eq(msg.body.len, 5);
+    ck_assert_mem_eq(msg.body.val, "ab\0cd", 5);
+
+    // only the headers and the start of the body received
+    ck_assert_int_eq(http_parse_message(str, sizeof(str) - 1 - strlen("cdGET /imgfs/list HTTP/1.1")
+                                        - strlen(HTTP_HDR_END_DELIM), &msg, &content_len), 0);
+    ck_assert_uint_eq(msg.body.len, 3);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_get_header_valid)
+{
+    start_test_print;
+
+    const char *str = "GET /imgfs/read?res=orig&img_id=pic1 HTTP/1.1" HTTP_LINE_DELIM "Host: localhost:8000" HTTP_LINE_DELIM
+                      "if-none-match: \"abc-orig\"" HTTP_HDR_END_DELIM;
+    struct http_message msg;
+    struct http_string value;
+    int content_len;
+
+    ck_assert_int_eq(http_parse_message(str, strlen(str), &msg, &content_len), 1);
+
+    ck_assert_invalid_arg(http_get_header(NULL, "Host", &value));
+    ck_assert_invalid_arg(http_get_header(&msg, NULL, &value));
+    ck_assert_invalid_arg(http_get_header(&msg, "Host", NULL));
+
+    ck_assert_int_eq(http_get_header(&msg, "If-None-Match", &value), 1);
+    ck_assert_http_str_eq(value, "\"abc-orig\"");
+    ck_assert_int_eq(http_get_header(&msg, "Hos", &value), 0);
+    ck_assert_int_eq(http_get_header(&msg, "Range", &value), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_match_etag_valid)
+{
+    start_test_print;
+
+    const char *str = "\"other\", W/\"abc-orig\" ,\"last\"";
+    struct http_string value = {.val = str, .len = strlen(str)};
+    struct http_string any = {.val = "*", .len = 1};
+
+    ck_assert_invalid_arg(http_match_etag(NULL, "\"abc-orig\""));
+    ck_assert_invalid_arg(http_match_etag(&value, NULL));
+
+    ck_assert_int_eq(http_match_etag(&value, "\"abc-orig\""), 1);
+    ck_assert_int_eq(http_match_etag(&value, "\"last\""), 1);
+    ck_assert_int_eq(http_match_etag(&value, "\"abc-thumb\""), 0);
+    ck_assert_int_eq(http_match_etag(&value, "\"abc\""), 0);
+    ck_assert_int_eq(http_match_etag(&any, "\"abc-thumb\""), 1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_range_valid)
+{
+    start_test_print;
+
+#define parse_range(str) \
+    http_parse_range(&(struct http_string) {.val = str, .len = strlen(str)}, 1000, &first, &last)
+
+    uint64_t first = 0;
+    uint64_t last = 0;
+
+    ck_assert_invalid_arg(http_parse_range(NULL, 1000, &first, &last));
+
+    ck_assert_int_eq(parse_range("bytes=0-99"), HTTP_RANGE_SATISFIABLE);
+    ck_assert_uint_eq(first, 0);
+    ck_assert_uint_eq(last, 99);
+
+    ck_assert_int_eq(parse_range("bytes=100-"), HTTP_RANGE_SATISFIABLE);
+    ck_assert_uint_eq(first, 100);
+    ck_assert_uint_eq(last, 999);
+
+    ck_assert_int_eq(parse_range("bytes=-10"), HTTP_RANGE_SATISFIABLE);
+    ck_assert_uint_eq(first, 990);
+    ck_assert_uint_eq(last, 999);
+
+    ck_assert_int_eq(parse_range("bytes=500-5000"), HTTP_RANGE_SATISFIABLE);
+    ck_assert_uint_eq(last, 999);
+
+    ck_assert_int_eq(parse_range("bytes=1000-"), HTTP_RANGE_UNSATISFIABLE);
+    ck_assert_int_eq(parse_range("bytes=-0"), HTTP_RANGE_UNSATISFIABLE);
+
+    ck_assert_int_eq(parse_range("bytes=5-1"), HTTP_RANGE_IGNORED);
+    ck_assert_int_eq(parse_range("bytes=0-1,5-6"), HTTP_RANGE_IGNORED);
+    ck_assert_int_eq(parse_range("items=0-1"), HTTP_RANGE_IGNORED);
+    ck_assert_int_eq(parse_range("bytes=-"), HTTP_RANGE_IGNORED);
+
+#undef parse_range
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_negotiate_encoding_valid)
+{
+    start_test_print;
+
+#define negotiate(accept)                                                                                              \
+    do {                                                                                                               \
+        const char *str = "GET /imgfs/list HTTP/1.1" HTTP_LINE_DELIM "Accept-Encoding: " accept HTTP_HDR_END_DELIM;    \
+        ck_assert_int_eq(http_parse_message(str, strlen(str), &msg, &content_len), 1);                               \
+    } while (0)
+
+    struct http_message msg;
+    int content_len;
+
+    ck_assert_invalid_arg(http_negotiate_encoding(NULL));
+
+    negotiate("gzip, deflate, br");
+    ck_assert_int_eq(http_negotiate_encoding(&msg), HTTP_ENCODING_GZIP);
+
+    negotiate("gzip;q=0, deflate");
+    ck_assert_int_eq(http_negotiate_encoding(&msg), HTTP_ENCODING_DEFLATE);
+
+    negotiate("gzip;q=0.5, deflate;q=0.8");
+    ck_assert_int_eq(http_negotiate_encoding(&msg), HTTP_ENCODING_DEFLATE);
+
+    negotiate("br");
+    ck_assert_int_eq(http_negotiate_encoding(&msg), HTTP_ENCODING_IDENTITY);
+
+    // "*" does not override a coding that is named
+    negotiate("gzip;q=0, *");
+    ck_assert_int_eq(http_negotiate_encoding(&msg), HTTP_ENCODING_DEFLATE);
+
+    negotiate("*;q=0.5, deflate;q=0");
+    ck_assert_int_eq(http_negotiate_encoding(&msg), HTTP_ENCODING_GZIP);
+
+    const char *str = "GET /imgfs/list HTTP/1.1" HTTP_HDR_END_DELIM;
+    ck_assert_int_eq(http_parse_message(str, strlen(str), &msg, &content_len), 1);
+    ck_assert_int_eq(http_negotiate_encoding(&msg), HTTP_ENCODING_IDENTITY);
+
+#undef negotiate
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+struct collected {
+    char* data;
+    size_t len;
+    unsigned calls;
+};
+
+static int collect(void* arg, const char* data, size_t len)
+{
+    struct collected* collected = arg;
+    ck_assert_uint_le(len, COMPRESS_CHUNK);
+    collected->data = realloc(collected->data, collected->len + len);
+    ck_assert_ptr_nonnull(collected->data);
+    memcpy(collected->data + collected->len, data, len);
+    collected->len += len;
+    ++collected->calls;
+    return ERR_NONE;
+}
+
+START_TEST(http_compressor_round_trip)
+{
+    start_test_print;
+
+#define PLAIN_SIZE (1 << 20)
+    // not too compressible: several chunks of output
+    char* plain = malloc(PLAIN_SIZE);
+    ck_assert_ptr_nonnull(plain);
+    uint32_t state = 202;
+    for (size_t i = 0; i < PLAIN_SIZE; ++i) {
+        state = state * 1103515245u + 12345u;
+        plain[i] = (char) ('a' + (state >> 16) % 16);
+    }
+
+    struct http_compressor compressor;
+    ck_assert_invalid_arg(http_compressor_init(&compressor, HTTP_ENCODING_IDENTITY, collect, NULL));
+
+    // fed in small pieces, handed out a chunk at a time
+    struct collected collected = { NULL, 0, 0 };
+    ck_assert_err_none(http_compressor_init(&compressor, HTTP_ENCODING_GZIP, collect, &collected));
+    for (size_t i = 0; i < PLAIN_SIZE; i += 1000) {
+        ck_assert_err_none(http_compressor_write(&compressor, plain + i,
+                                                 PLAIN_SIZE - i < 1000 ? PLAIN_SIZE - i : 1000));
+    }
+    ck_assert_err_none(http_compressor_finish(&compressor));
+    ck_assert_uint_gt(collected.calls, 1);
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    ck_assert_int_eq(inflateInit2(&stream, MAX_WBITS + 16), Z_OK);
+    char* inflated = malloc(PLAIN_SIZE + 1);
+    ck_assert_ptr_nonnull(inflated);
+    stream.next_in = (const Bytef*) collected.data;
+    stream.avail_in = (uInt) collected.len;
+    stream.next_out = (Bytef*) inflated;
+    stream.avail_out = PLAIN_SIZE + 1;
+    ck_assert_int_eq(inflate(&stream, Z_FINISH), Z_STREAM_END);
+    ck_assert_uint_eq(stream.total_out, PLAIN_SIZE);
+    ck_assert_mem_eq(inflated, plain, PLAIN_SIZE);
+    inflateEnd(&stream);
+
+    // the same as in one go
+    char* out = NULL;
+    size_t out_len = 0;
+    ck_assert_err_none(http_compress(HTTP_ENCODING_GZIP, plain, PLAIN_SIZE, &out, &out_len));
+    ck_assert_uint_eq(out_len, collected.len);
+    ck_assert_mem_eq(out, collected.data, out_len);
+
+    free(out);
+    free(inflated);
+    free(collected.data);
+    free(plain);
+#undef PLAIN_SIZE
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *http_test_suite()
 {
@@ -300,6 +538,13 @@ Suite *http_test_suite()
     Add_Test(s, http_parse_message_full_headers_no_content);
     Add_Test(s, http_parse_message_full_headers_partial_content);
     Add_Test(s, http_parse_message_full_headers_full_content);
+    Add_Test(s, http_parse_message_binary_content_pipelined);
+
+    Add_Test(s, http_get_header_valid);
+    Add_Test(s, http_match_etag_valid);
+    Add_Test(s, http_parse_range_valid);
+    Add_Test(s, http_negotiate_encoding_valid);
+    Add_Test(s, http_compressor_round_trip);
 
     return s;
 }
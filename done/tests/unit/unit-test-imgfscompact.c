@@ -0,0 +1,182 @@
+#include "imgfs.h"
+#include "imgfscmd_functions.h"
+#include "segment.h"
+#include "test.h"
+#include <check.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+#define IMAGE_SIZE 82234
+
+#define DECLARE_SEGMENT(name, imgfs, segment) \
+    char name[4096] = {0};                    \
+    snprintf(name, sizeof(name), "%s.%06u", imgfs, segment)
+
+// one image per segment
+static void create_segmented(const char* dump, uint32_t flags, char* image)
+{
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 64, 64, 256, 256 },
+                               .header.flags = IMGFS_FLAG_SEGMENTS | flags,
+                               .header.segment_size = IMAGE_SIZE + 1024 };
+
+    ck_assert_err_none(do_create(dump, &file));
+    do_close(&file);
+
+    read_file(image, DATA_DIR "/brouillard.jpg", IMAGE_SIZE);
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    for (char i = 0; i < 3; ++i) {
+        char img_id[] = { 'p', (char) ('0' + i), '\0' };
+        image[40000] = i; // not duplicates
+        ck_assert_err_none(do_insert(image, IMAGE_SIZE, img_id, &file));
+    }
+    do_close(&file);
+}
+
+// ======================================================================
+START_TEST(do_compact_null_params)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    ck_assert_invalid_arg(do_compact(NULL, 50, NULL));
+    ck_assert_invalid_arg(do_compact_cmd(0, NULL));
+    ck_assert_err(do_compact_cmd(0, (char*[]) { NULL }), ERR_NOT_ENOUGH_ARGUMENTS);
+
+    // no segments to compact
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_ptr_null(file.segments);
+    ck_assert_invalid_arg(do_compact(&file, 50, NULL));
+    do_close(&file);
+
+    // segments are not read with O_DIRECT
+    struct imgfs_file direct = { .header.max_files = 10,
+                                 .header.resized_res = { 64, 64, 256, 256 },
+                                 .header.flags = IMGFS_FLAG_SEGMENTS | IMGFS_FLAG_DIRECT_ORIG,
+                                 .header.segment_size = IMAGE_SIZE + 1024 };
+    ck_assert_invalid_arg(do_create(dump, &direct));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(segments_roll_over)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    char image[IMAGE_SIZE];
+
+    create_segmented(dump, 0, image);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_ptr_nonnull(file.segments);
+    for (uint32_t i = 0; i < 3; ++i) {
+        ck_assert_uint_eq(SEGMENT_OF(file.metadata[i].offset[ORIG_RES]), i);
+        ck_assert_uint_eq(SEGMENT_POSITION(file.metadata[i].offset[ORIG_RES]),
+                          sizeof(struct imgfs_header));
+    }
+    ck_assert_uint_eq(file.segments->active[0], 2);
+
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_read("p1", ORIG_RES, &read, &read_size, &file));
+    image[40000] = 1;
+    ck_assert_uint_eq(read_size, IMAGE_SIZE);
+    ck_assert_mem_eq(read, image, IMAGE_SIZE);
+    free(read);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_compact_drops_segments)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_SEGMENT(segment0, dump, 0);
+    DECLARE_SEGMENT(segment1, dump, 1);
+    char image[IMAGE_SIZE];
+
+    create_segmented(dump, 0, image);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_delete("p0", &file));
+
+    // only the segment with nothing referenced in it
+    uint32_t dropped = 0;
+    ck_assert_err_none(do_compact(&file, 0, &dropped));
+    ck_assert_uint_eq(dropped, 1);
+    ck_assert_int_ne(access(segment0, F_OK), 0);
+    ck_assert_int_eq(access(segment1, F_OK), 0);
+
+    // p1 moves to the active segment
+    ck_assert_err_none(do_compact(&file, 100, &dropped));
+    ck_assert_uint_eq(dropped, 1);
+    ck_assert_int_ne(access(segment1, F_OK), 0);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_read("p1", ORIG_RES, &read, &read_size, &file));
+    image[40000] = 1;
+    ck_assert_uint_eq(read_size, IMAGE_SIZE);
+    ck_assert_mem_eq(read, image, IMAGE_SIZE);
+    free(read);
+    ck_assert_uint_ge(SEGMENT_OF(file.metadata[1].offset[ORIG_RES]), 2);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(segments_per_resolution)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    char thumbs[4096] = {0};
+    snprintf(thumbs, sizeof(thumbs), "%s.thumb.%06u", dump, 0);
+    char image[IMAGE_SIZE];
+
+    create_segmented(dump, IMGFS_FLAG_EXTENT_FILES, image);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_read("p2", THUMB_RES, &read, &read_size, &file));
+    free(read);
+
+    // thumbnails do not follow the originals
+    ck_assert_uint_eq(file.metadata[2].offset[THUMB_RES],
+                      SEGMENT_OFFSET(0, sizeof(struct imgfs_header)));
+    ck_assert_uint_eq(SEGMENT_OF(file.metadata[2].offset[ORIG_RES]), 2);
+    ck_assert_int_eq(access(thumbs, F_OK), 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_compact_test_suite()
+{
+    Suite *s = suite_create("Tests for the segments and do_compact");
+
+    Add_Test(s, do_compact_null_params);
+    Add_Test(s, segments_roll_over);
+    Add_Test(s, do_compact_drops_segments);
+    Add_Test(s, segments_per_resolution);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_compact_test_suite)
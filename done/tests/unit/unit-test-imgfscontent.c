@@ -262,6 +262,79 @@ START_TEST(lazily_resize_valid_fallible)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(make_sprite_sheet_null_params)
+{
+    start_test_print;
+
+    const char* images[1] = { "" };
+    size_t sizes[1] = { 0 };
+    char* sheet = NULL;
+    size_t sheet_size = 0;
+    struct sprite_cell cells[1];
+
+    ck_assert_invalid_arg(make_sprite_sheet(NULL, sizes, 1, 1, 64, 64, &sheet, &sheet_size, cells));
+    ck_assert_invalid_arg(make_sprite_sheet(images, NULL, 1, 1, 64, 64, &sheet, &sheet_size, cells));
+    ck_assert_invalid_arg(make_sprite_sheet(images, sizes, 1, 1, 64, 64, NULL, &sheet_size, cells));
+    ck_assert_invalid_arg(make_sprite_sheet(images, sizes, 1, 1, 64, 64, &sheet, &sheet_size, NULL));
+    ck_assert_invalid_arg(make_sprite_sheet(images, sizes, 0, 1, 64, 64, &sheet, &sheet_size, cells));
+    ck_assert_invalid_arg(make_sprite_sheet(images, sizes, 1, 0, 64, 64, &sheet, &sheet_size, cells));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(make_sprite_sheet_valid)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    char* thumbs[2] = { NULL, NULL };
+    uint32_t thumb_sizes[2] = { 0, 0 };
+    ck_assert_err_none(do_read("pic1", THUMB_RES, &thumbs[0], &thumb_sizes[0], &file));
+    ck_assert_err_none(do_read("pic2", THUMB_RES, &thumbs[1], &thumb_sizes[1], &file));
+    do_close(&file);
+
+    // three cells, two per row
+    const char* images[3] = { thumbs[0], thumbs[1], thumbs[0] };
+    size_t sizes[3] = { thumb_sizes[0], thumb_sizes[1], thumb_sizes[0] };
+    char* sheet = NULL;
+    size_t sheet_size = 0;
+    struct sprite_cell cells[3];
+    ck_assert_err_none(make_sprite_sheet(images, sizes, 3, 2, 64, 64, &sheet, &sheet_size, cells));
+
+    ck_assert_ptr_nonnull(sheet);
+    ck_assert_uint_gt(sheet_size, 2);
+    ck_assert_uint_eq((unsigned char) sheet[0], 0xFF);
+    ck_assert_uint_eq((unsigned char) sheet[1], 0xD8);
+    ck_assert_uint_eq(cells[1].x, 64);
+    ck_assert_uint_eq(cells[1].y, 0);
+    ck_assert_uint_eq(cells[2].x, 0);
+    ck_assert_uint_eq(cells[2].y, 64);
+    for (int i = 0; i < 3; ++i) {
+        ck_assert_uint_le(cells[i].width, 64);
+        ck_assert_uint_le(cells[i].height, 64);
+    }
+
+    // the cells must hold the images
+    char* small = NULL;
+    size_t small_size = 0;
+    ck_assert_invalid_arg(make_sprite_sheet(images, sizes, 1, 1, 1, 1, &small, &small_size, cells));
+    ck_assert_ptr_null(small);
+
+    free(sheet);
+    free(thumbs[0]);
+    free(thumbs[1]);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -275,6 +348,8 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, lazily_resize_already_exists);
     Add_Test(s, lazily_resize_valid);
     Add_Test(s, lazily_resize_valid_fallible);
+    Add_Test(s, make_sprite_sheet_null_params);
+    Add_Test(s, make_sprite_sheet_valid);
 
     return s;
 }
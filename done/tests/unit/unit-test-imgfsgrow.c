@@ -0,0 +1,121 @@
+#include "imgfs.h"
+#include "imgfscmd_functions.h"
+#include "test.h"
+#include <check.h>
+
+// ======================================================================
+START_TEST(do_grow_null_params)
+{
+    start_test_print;
+
+    ck_assert_invalid_arg(do_grow(NULL, 10));
+    ck_assert_invalid_arg(do_grow_cmd(0, NULL));
+    ck_assert_err(do_grow_cmd(1, (char*[]) { "file" }), ERR_NOT_ENOUGH_ARGUMENTS);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_grow_not_larger)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    ck_assert_err(do_grow(&file, file.header.max_files), ERR_MAX_FILES);
+    ck_assert_err(do_grow(&file, 1), ERR_MAX_FILES);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+static void check_grown(const char* dump)
+{
+    struct imgfs_file original;
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &original));
+    ck_assert_err_none(do_open(dump, "rb", &file));
+
+    ck_assert_int_eq(file.header.max_files, 1000);
+    ck_assert_int_eq(file.header.nb_files, original.header.nb_files);
+
+    for (uint32_t i = 0; i < original.header.max_files; ++i) {
+        ck_assert_int_eq(file.metadata[i].is_valid, original.metadata[i].is_valid);
+        if (file.metadata[i].is_valid == EMPTY) continue;
+
+        char *expected = NULL, *actual = NULL;
+        uint32_t expected_size = 0, actual_size = 0;
+        ck_assert_str_eq(file.metadata[i].img_id, original.metadata[i].img_id);
+        ck_assert_err_none(do_read(original.metadata[i].img_id, ORIG_RES,
+                                   &expected, &expected_size, &original));
+        ck_assert_err_none(do_read(file.metadata[i].img_id, ORIG_RES,
+                                   &actual, &actual_size, &file));
+        ck_assert_uint_eq(actual_size, expected_size);
+        ck_assert_mem_eq(actual, expected, expected_size);
+        free(expected);
+        free(actual);
+    }
+    for (uint32_t i = original.header.max_files; i < file.header.max_files; ++i) {
+        ck_assert_int_eq(file.metadata[i].is_valid, EMPTY);
+    }
+
+    do_close(&file);
+    do_close(&original);
+}
+
+START_TEST(do_grow_moves_content)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    char *argv[] = {dump, "1000"};
+    ck_assert_err_none(do_grow_cmd(2, argv));
+
+    check_grown(dump);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_grow_v2)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_upgrade(&file));
+    ck_assert_err_none(do_grow(&file, 1000));
+    do_close(&file);
+
+    check_grown(dump);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_do_grow_test_suite()
+{
+    Suite *s = suite_create("Tests for do_grow implementation");
+
+    Add_Test(s, do_grow_null_params);
+    Add_Test(s, do_grow_not_larger);
+    Add_Test(s, do_grow_moves_content);
+    Add_Test(s, do_grow_v2);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_do_grow_test_suite)
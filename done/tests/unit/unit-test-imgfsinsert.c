@@ -2,6 +2,8 @@
 #include "test.h"
 #include <check.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vips/vips.h>
 
 // ======================================================================
@@ -338,6 +340,105 @@ START_TEST(do_insert_write_initializes_metadata)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_insert_direct_orig)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[82234];
+    char* read = NULL;
+    uint32_t read_size = 0;
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 64, 64, 256, 256 },
+                               .header.flags = IMGFS_FLAG_DIRECT_ORIG };
+
+    ck_assert_err_none(do_create(dump, &file));
+    do_close(&file);
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_uint_eq(file.header.flags, IMGFS_FLAG_DIRECT_ORIG);
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+
+    ck_assert_err_none(do_insert(image, 82234, "pic1", &file));
+    ck_assert_err_none(do_read("pic1", THUMB_RES, &read, &read_size, &file));
+    free(read);
+    image[40000] ^= 1; // not a duplicate
+    ck_assert_err_none(do_insert(image, 82234, "pic2", &file));
+    image[40000] ^= 1;
+
+    ck_assert_uint_eq(file.metadata[0].offset[ORIG_RES] % DIRECT_ALIGNMENT, 0);
+    ck_assert_uint_eq(file.metadata[1].offset[ORIG_RES] % DIRECT_ALIGNMENT, 0);
+
+    ck_assert_err_none(do_read("pic1", ORIG_RES, &read, &read_size, &file));
+    ck_assert_uint_eq(read_size, 82234);
+    ck_assert_mem_eq(read, image, 82234);
+    free(read);
+
+    ck_assert_err_none(do_read_range("pic1", ORIG_RES, 5000, 100, &read, &read_size, &file));
+    ck_assert_uint_eq(read_size, 100);
+    ck_assert_mem_eq(read, image + 5000, 100);
+    free(read);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_extent_files)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char thumbs[4096] = {0};
+    strcat(thumbs, dump);
+    strcat(thumbs, ".thumb");
+    char image[82234];
+    char* read = NULL;
+    uint32_t read_size = 0;
+    struct stat st;
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 64, 64, 256, 256 },
+                               .header.flags = IMGFS_FLAG_EXTENT_FILES };
+
+    ck_assert_err_none(do_create(dump, &file));
+    do_close(&file);
+    ck_assert_int_eq(stat(thumbs, &st), 0);
+    ck_assert_uint_eq(st.st_size, sizeof(struct imgfs_header));
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+    ck_assert_err_none(do_insert(image, 82234, "pic1", &file));
+    ck_assert_err_none(do_read("pic1", THUMB_RES, &read, &read_size, &file));
+    free(read);
+
+    // each resolution starts its own file, right after the header copy
+    ck_assert_uint_eq(file.metadata[0].offset[ORIG_RES], sizeof(struct imgfs_header));
+    ck_assert_uint_eq(file.metadata[0].offset[THUMB_RES], sizeof(struct imgfs_header));
+    ck_assert_int_eq(stat(thumbs, &st), 0);
+    ck_assert_uint_eq(st.st_size, sizeof(struct imgfs_header) + file.metadata[0].size[THUMB_RES]);
+
+    // no content in the imgFS file
+    ck_assert_int_eq(stat(dump, &st), 0);
+    ck_assert_uint_eq(st.st_size, sizeof(struct imgfs_header) + 10 * sizeof(struct img_metadata));
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err_none(do_read("pic1", ORIG_RES, &read, &read_size, &file));
+    ck_assert_uint_eq(read_size, 82234);
+    ck_assert_mem_eq(read, image, 82234);
+    free(read);
+    do_close(&file);
+
+    // an extent file is missing
+    unlink(thumbs);
+    ck_assert_err(do_open(dump, "rb", &file), ERR_IO);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -352,6 +453,8 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, do_insert_valid);
     Add_Test(s, do_insert_write_correct_metadata);
     Add_Test(s, do_insert_write_initializes_metadata);
+    Add_Test(s, do_insert_direct_orig);
+    Add_Test(s, do_insert_extent_files);
 
     return s;
 }
@@ -0,0 +1,237 @@
+#include "imgfs.h"
+#include "journal.h"
+#include "test.h"
+#include <check.h>
+#include <unistd.h>
+
+// ======================================================================
+START_TEST(journal_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_invalid_arg(journal_recover(NULL));
+    ck_assert_invalid_arg(journal_open(NULL, "file"));
+    ck_assert_invalid_arg(journal_open(&file, NULL));
+    ck_assert_invalid_arg(journal_log(NULL, 0, "data", 4));
+    ck_assert_invalid_arg(journal_commit(NULL));
+    ck_assert_invalid_arg(journal_checkpoint(NULL));
+    ck_assert_int_eq(journal_lookup(NULL, 0, NON_NULL, 4), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_removed_on_close)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_JOURNAL(journal, dump);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_ptr_null(file.journal);
+    ck_assert_int_ne(access(journal, F_OK), 0);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_ptr_nonnull(file.journal);
+    ck_assert_int_eq(access(journal, F_OK), 0);
+    ck_assert_err_none(do_delete("pic1", &file));
+    do_close(&file);
+    ck_assert_int_ne(access(journal, F_OK), 0);
+
+    ck_assert_uint_eq(nb_files_on_disk(dump), 1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_group_commit)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    file.journal->autocommit = 0;
+
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_err_none(do_delete("pic2", &file));
+
+    // logged, not yet in place
+    ck_assert_uint_eq(file.journal->pending_count, 4);
+    ck_assert_uint_eq(nb_files_on_disk(dump), 2);
+
+    ck_assert_err_none(journal_commit(&file));
+    ck_assert_uint_eq(file.journal->pending_count, 0);
+    ck_assert_uint_eq(nb_files_on_disk(dump), 0);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_group_steps)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct journal_group group;
+    int fds[IMGFS_MAX_SYNC_FDS];
+    size_t nb_fds = 0;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    file.journal->autocommit = 0;
+
+    ck_assert_err_none(do_delete("pic1", &file));
+    journal_group_begin(file.journal, &group);
+    ck_assert_uint_eq(group.count, 2);
+
+    ck_assert_err_none(imgfs_dup_sync_fds(&file, fds, &nb_fds));
+    ck_assert_uint_eq(nb_fds, 1);
+    // as if logged by another update while the group syncs
+    ck_assert_err_none(do_delete("pic2", &file));
+    ck_assert_err_none(imgfs_sync_fds(fds, nb_fds));
+
+    ck_assert_err_none(journal_group_write(file.journal, &group));
+    ck_assert_err_none(journal_group_sync(file.journal));
+    ck_assert_err_none(journal_group_end(&file, &group, ERR_NONE));
+
+    // only the group is in place, the later update is still pending
+    ck_assert_uint_eq(nb_files_on_disk(dump), 1);
+    ck_assert_uint_eq(file.journal->pending_count, 2);
+    ck_assert_uint_eq(file.header.nb_files, 0);
+
+    // a failed group stays pending too
+    journal_group_begin(file.journal, &group);
+    ck_assert_err(journal_group_end(&file, &group, ERR_IO), ERR_IO);
+    ck_assert_uint_eq(file.journal->pending_count, 2);
+
+    ck_assert_err_none(journal_commit(&file));
+    ck_assert_uint_eq(file.journal->pending_count, 0);
+    ck_assert_uint_eq(nb_files_on_disk(dump), 0);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_recovery)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_saved);
+    DECLARE_JOURNAL(journal, dump);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_delete("pic1", &file));
+    // as if we crashed right after the commit: the journal holds the update
+    DUPLICATE_FILE(dump_saved, journal);
+    do_close(&file);
+
+    // the update did not make it in place
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    DUPLICATE_FILE(journal, dump_saved);
+
+    // only writers replay the journal
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(access(journal, F_OK), 0);
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_uint_eq(file.header.nb_files, 1);
+    char* buffer = NULL;
+    uint32_t size = 0;
+    ck_assert_err(do_read("pic1", ORIG_RES, &buffer, &size, &file), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &buffer, &size, &file));
+    free(buffer);
+    do_close(&file);
+    ck_assert_int_ne(access(journal, F_OK), 0);
+
+    unlink(dump_saved);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_single_writer)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_JOURNAL(journal, dump);
+
+    struct imgfs_file file;
+    struct imgfs_file other;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    // the journal of a live writer is neither replayed nor taken over
+    ck_assert_err(do_open(dump, "rb+", &other), ERR_IO);
+    ck_assert_int_eq(access(journal, F_OK), 0);
+    ck_assert_err_none(do_open(dump, "rb", &other));
+    do_close(&other);
+
+    ck_assert_err_none(do_delete("pic1", &file));
+    do_close(&file);
+    ck_assert_int_ne(access(journal, F_OK), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_torn_batch)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_JOURNAL(journal, dump);
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    // a batch header with no entries after it: ignored
+    FILE* out = fopen(journal, "wb");
+    ck_assert_ptr_nonnull(out);
+    const uint32_t torn[6] = { 0x4c4e4a49u, 1, 64, 0, 0, 0 };
+    ck_assert_uint_eq(fwrite(torn, sizeof(torn), 1, out), 1);
+    fclose(out);
+
+    ck_assert_err_none(journal_recover(dump));
+    ck_assert_int_ne(access(journal, F_OK), 0);
+    ck_assert_uint_eq(nb_files_on_disk(dump), 2);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_journal_test_suite()
+{
+    Suite *s = suite_create("Tests for the imgFS journal");
+
+    Add_Test(s, journal_null_params);
+    Add_Test(s, journal_removed_on_close);
+    Add_Test(s, journal_group_commit);
+    Add_Test(s, journal_group_steps);
+    Add_Test(s, journal_recovery);
+    Add_Test(s, journal_single_writer);
+    Add_Test(s, journal_torn_batch);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_journal_test_suite)
@@ -1,5 +1,6 @@
 #include "imgfs.h"
 #include "imgfscmd_functions.h"
+#include "json_writer.h"
 #include "test.h"
 #include "util.h"
 #include <check.h>
@@ -93,6 +94,196 @@ START_TEST(do_list_json_non_emtpy)
 END_TEST
 
 // ======================================================================
+START_TEST(do_list_query_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct list_query query = {0};
+    char *str = NULL;
+
+    ck_assert_invalid_arg(do_list_query(NULL, &query, &str));
+    ck_assert_invalid_arg(do_list_query(&file, NULL, &str));
+    ck_assert_invalid_arg(do_list_query(&file, &query, NULL));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_list_query_pages)
+{
+    start_test_print;
+
+    char *out = NULL;
+    struct imgfs_file file;
+    struct list_query query = {0};
+
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    query.limit = 1;
+    ck_assert_err_none(do_list_query(&file, &query, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic1\" ], \"next\": 0 }");
+    free(out);
+
+    query.start = 1;
+    ck_assert_err_none(do_list_query(&file, &query, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic2\" ] }");
+    free(out);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_list_query_filters)
+{
+    start_test_print;
+
+    char *out = NULL;
+    struct imgfs_file file;
+    struct list_query query = {0};
+
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    query.prefix = "pic2";
+    ck_assert_err_none(do_list_query(&file, &query, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic2\" ] }");
+    free(out);
+
+    query.prefix = "pic1";
+    query.fields = LIST_FIELD_SIZE | LIST_FIELD_RESOLUTION;
+    ck_assert_err_none(do_list_query(&file, &query, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ { \"img_id\": \"pic1\", \"size\": [ 0, 0, 72876 ], "
+                     "\"resolution\": [ 1200, 800 ] } ] }");
+    free(out);
+
+    query.prefix = "nope";
+    ck_assert_err_none(do_list_query(&file, &query, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ ] }");
+    free(out);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(json_writer_escapes)
+{
+    start_test_print;
+
+    char *out = NULL;
+    size_t len = 0;
+    struct json_writer writer;
+    json_writer_init(&writer, NULL, NULL);
+
+    ck_assert_err_none(json_begin_object(&writer));
+    ck_assert_err_none(json_key(&writer, "a\"b"));
+    ck_assert_err_none(json_string(&writer, "c\\d\n\x01/"));
+    ck_assert_err_none(json_key(&writer, "e"));
+    ck_assert_err_none(json_begin_object(&writer));
+    ck_assert_err_none(json_end_object(&writer));
+    ck_assert_err_none(json_end_object(&writer));
+    ck_assert_err_none(json_writer_finish(&writer, &out, &len));
+    // json-c escapes '/' too
+    ck_assert_str_eq(out, "{ \"a\\\"b\": \"c\\\\d\\n\\u0001\\/\", \"e\": { } }");
+    ck_assert_uint_eq(len, strlen(out));
+    free(out);
+
+    json_writer_init(&writer, NULL, NULL);
+    ck_assert_err(json_end_array(&writer), ERR_INVALID_ARGUMENT);
+    json_writer_free(&writer);
+
+    end_test_print;
+}
+END_TEST
+
+static int count_sink(void* arg, const char* data, size_t len)
+{
+    (void) data;
+    *(size_t*) arg += len;
+    return ERR_NONE;
+}
+
+START_TEST(do_list_json_sink)
+{
+    start_test_print;
+
+    char *out = NULL;
+    size_t sent = 0;
+    struct imgfs_file file;
+    struct list_query query = {0};
+    struct json_writer writer;
+
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    json_writer_init(&writer, count_sink, &sent);
+    ck_assert_err_none(do_list_json(&file, &query, &writer));
+    ck_assert_err_none(json_writer_finish(&writer, &out, NULL));
+    ck_assert_ptr_eq(out, NULL);
+    ck_assert_uint_eq(sent, strlen("{ \"Images\": [ \"pic1\", \"pic2\" ] }"));
+
+    // held back flushes wait for the release
+    sent = 0;
+    json_writer_init(&writer, count_sink, &sent);
+    ck_assert_err_none(json_writer_hold(&writer, 1));
+    json_begin_array(&writer);
+    for (int i = 0; i < JSON_FLUSH_SIZE / 8; ++i) json_string(&writer, "pic1");
+    ck_assert_uint_eq(sent, 0);
+    ck_assert_uint_ge(writer.len, JSON_FLUSH_SIZE);
+    ck_assert_err_none(json_writer_hold(&writer, 0));
+    ck_assert_uint_gt(sent, 0);
+    ck_assert_uint_eq(writer.len, 0);
+    json_writer_free(&writer);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_list_images_count_only)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct list_query query = {0};
+    struct list_page page;
+
+    ck_assert_invalid_arg(do_list_images(NULL, &query, NULL, NULL, &page));
+    ck_assert_invalid_arg(do_list_images(&file, &query, NULL, NULL, NULL));
+
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    ck_assert_err_none(do_list_images(&file, &query, NULL, NULL, &page));
+    ck_assert_uint_eq(page.listed, 2);
+    ck_assert_uint_eq(page.last, 1);
+    ck_assert_int_eq(page.has_next, 0);
+
+    query.limit = 1;
+    ck_assert_err_none(do_list_images(&file, &query, NULL, NULL, &page));
+    ck_assert_uint_eq(page.listed, 1);
+    ck_assert_uint_eq(page.last, 0);
+    ck_assert_int_eq(page.has_next, 1);
+
+    uint32_t slots[2] = { 0 };
+    query.limit = 2;
+    ck_assert_err_none(do_list_images(&file, &query, NULL, slots, &page));
+    ck_assert_uint_eq(page.listed, 2);
+    ck_assert_uint_eq(slots[0], 0);
+    ck_assert_uint_eq(slots[1], 1);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 Suite *imgfs_structures_test_suite()
 {
     Suite *s = suite_create("Tests for do_list and do_list_cmd implementation");
@@ -105,6 +296,14 @@ Suite *imgfs_structures_test_suite()
 
     Add_Test(s, do_list_json_emtpy);
     Add_Test(s, do_list_json_non_emtpy);
+
+    Add_Test(s, do_list_query_null_params);
+    Add_Test(s, do_list_query_pages);
+    Add_Test(s, do_list_query_filters);
+
+    Add_Test(s, json_writer_escapes);
+    Add_Test(s, do_list_json_sink);
+    Add_Test(s, do_list_images_count_only);
     return s;
 }
 
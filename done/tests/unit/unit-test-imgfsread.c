@@ -1,5 +1,6 @@
 #include "image_content.h"
 #include "imgfs.h"
+#include "io_engine.h"
 #include "test.h"
 #include <check.h>
 #include <vips/vips.h>
@@ -74,6 +75,81 @@ START_TEST(do_read_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_read_range_valid)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    char expected_buffer[72876];
+    char *buffer;
+    uint32_t size;
+
+    read_file(expected_buffer, DATA_DIR "/papillon.jpg", 72876);
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    ck_assert_err_none(do_read_range("pic1", ORIG_RES, 1000, 100, &buffer, &size, &file));
+    ck_assert_int_eq(size, 100);
+    ck_assert_mem_eq(expected_buffer + 1000, buffer, 100);
+    free(buffer);
+
+    // slices are cut at the end of the image
+    ck_assert_err_none(do_read_range("pic1", ORIG_RES, 72800, 1000, &buffer, &size, &file));
+    ck_assert_int_eq(size, 76);
+    ck_assert_mem_eq(expected_buffer + 72800, buffer, 76);
+    free(buffer);
+
+    ck_assert_invalid_arg(do_read_range("pic1", ORIG_RES, 72876, 1, &buffer, &size, &file));
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_read_batch_valid)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    char expected_buffer[72876];
+    struct batch_image images[3] = { { .img_id = "pic1" }, { .img_id = "none" },
+        { .img_id = "pic1" }
+    };
+
+    ck_assert_invalid_arg(do_read_batch(images, 3, ORIG_RES, NULL));
+    ck_assert_invalid_arg(do_read_batch(NULL, 3, ORIG_RES, &file));
+
+    read_file(expected_buffer, DATA_DIR "/papillon.jpg", 72876);
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+    ck_assert_err(do_read_batch(images, 3, NB_RES, &file), ERR_RESOLUTIONS);
+
+    // through the I/O engine, if there is one here, then without
+    struct io_engine engine;
+    const int with_engine = io_engine_init(&engine, IO_ENGINE_DEPTH) == ERR_NONE;
+    for (int pass = with_engine ? 0 : 1; pass < 2; ++pass) {
+        imgfs_set_io_engine(pass == 0 ? &engine : NULL);
+        ck_assert_err_none(do_read_batch(images, 3, ORIG_RES, &file));
+
+        // a missing image does not fail the others
+        ck_assert_err(images[1].err, ERR_IMAGE_NOT_FOUND);
+        ck_assert_ptr_null(images[1].data);
+        for (int i = 0; i < 3; i += 2) {
+            ck_assert_err_none(images[i].err);
+            ck_assert_int_eq(images[i].size, 72876);
+            ck_assert_mem_eq(expected_buffer, images[i].data, 72876);
+            free(images[i].data);
+        }
+    }
+    if (with_engine) io_engine_free(&engine);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(do_read_resize)
 {
@@ -142,6 +218,8 @@ Suite *imgfs_read_test_suite()
     Add_Test(s, do_read_null_params);
     Add_Test(s, do_read_not_found);
     Add_Test(s, do_read_valid);
+    Add_Test(s, do_read_range_valid);
+    Add_Test(s, do_read_batch_valid);
     Add_Test(s, do_read_resize);
     Add_Test(s, do_read_resize_invalid_mode);
 
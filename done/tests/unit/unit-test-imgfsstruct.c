@@ -4,7 +4,7 @@
 // ======================================================================
 #define SIZE_imgfs_header 64
 #define SIZE_img_metadata 216
-#define SIZE_imgfs_file   80
+#define SIZE_imgfs_file   136
 
 #define OFFSET_imgfs_header_name        0
 #define OFFSET_imgfs_header_version     32
@@ -22,6 +22,11 @@
 #define OFFSET_imgfs_file_file     0
 #define OFFSET_imgfs_file_header   8
 #define OFFSET_imgfs_file_metadata 72
+#define OFFSET_imgfs_file_view     80
+#define OFFSET_imgfs_file_journal  104
+#define OFFSET_imgfs_file_direct_fd 112
+#define OFFSET_imgfs_file_extent_fd 116
+#define OFFSET_imgfs_file_segments  128
 
 // ======================================================================
 #define test_member(T, M)                                                                                              \
@@ -90,6 +95,11 @@ START_TEST(imgfs_file)
     test_member(imgfs_file, file);
     test_member(imgfs_file, header);
     test_member(imgfs_file, metadata);
+    test_member(imgfs_file, view);
+    test_member(imgfs_file, journal);
+    test_member(imgfs_file, direct_fd);
+    test_member(imgfs_file, extent_fd);
+    test_member(imgfs_file, segments);
 
     end_test_print;
 }
@@ -137,6 +137,73 @@ START_TEST(do_close_null_file)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_open_metadata_view)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    uint32_t index = 0;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    ck_assert_int_eq(metadata_view_valid(&file.view, 0), 1);
+    ck_assert_int_eq(metadata_view_valid(&file.view, 1), 1);
+    ck_assert_int_eq(metadata_view_next_valid(&file, 0), 0);
+    ck_assert_int_eq(metadata_view_next_valid(&file, 2), file.header.max_files);
+    ck_assert_int_eq(metadata_view_next_free(&file, 0), 2);
+    ck_assert_int_eq(file.view.id_hash[1], img_id_hash("pic2"));
+
+    ck_assert_err_none(find_image_index("pic2", &file, &index));
+    ck_assert_int_eq(index, 1);
+
+    // kept in sync when the metadata is written
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_int_eq(metadata_view_valid(&file.view, 0), 0);
+    ck_assert_int_eq(metadata_view_next_free(&file, 0), 0);
+    ck_assert_int_eq(metadata_view_next_valid(&file, 0), 1);
+    ck_assert_err(find_image_index("pic1", &file, &index), ERR_IMAGE_NOT_FOUND);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_positional_io)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct imgfs_header header;
+    uint64_t size = 0;
+    uint64_t offset = 0;
+    char buffer[4] = {0};
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    ck_assert_err_none(imgfs_pread(&file, &header, sizeof(header), 0));
+    ck_assert_mem_eq(&header, &file.header, sizeof(header));
+
+    ck_assert_err_none(imgfs_size(&file, &size));
+    ck_assert_err_none(imgfs_append(&file, "abcd", 4, &offset));
+    ck_assert_uint_eq(offset, size);
+    ck_assert_err_none(imgfs_pwrite(&file, "x", 1, size + 1));
+    ck_assert_err_none(imgfs_pread(&file, buffer, 4, size));
+    ck_assert_mem_eq(buffer, "axcd", 4);
+
+    // past the end
+    ck_assert_err(imgfs_pread(&file, buffer, 4, size + 2), ERR_IO);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_tools_suite_RES()
 {
@@ -147,6 +214,8 @@ Suite *imgfs_tools_suite_RES()
     Add_Test(s, do_open_invalid_mode);
     Add_Test(s, do_open_correct_header);
     Add_Test(s, do_open_correct_metadata);
+    Add_Test(s, do_open_metadata_view);
+    Add_Test(s, imgfs_positional_io);
 
     Add_Test(s, do_close_null_param);
     Add_Test(s, do_close_null_file);
@@ -0,0 +1,130 @@
+#include "imgfs.h"
+#include "imgfscmd_functions.h"
+#include "test.h"
+#include <check.h>
+
+// ======================================================================
+START_TEST(do_upgrade_null_params)
+{
+    start_test_print;
+
+    ck_assert_invalid_arg(do_upgrade(NULL));
+    ck_assert_invalid_arg(do_upgrade_cmd(0, NULL));
+    ck_assert_err(do_upgrade_cmd(0, (char*[]) { NULL }), ERR_NOT_ENOUGH_ARGUMENTS);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_upgrade_keeps_content)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file original;
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &original));
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_int_eq(imgfs_format(&file.header), IMGFS_FORMAT_V1);
+    ck_assert_err_none(do_upgrade(&file));
+    // a second upgrade is a no-op
+    ck_assert_err_none(do_upgrade(&file));
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(imgfs_format(&file.header), IMGFS_FORMAT_V2);
+    ck_assert_str_eq(file.header.name, CAT_TXT_V2);
+    ck_assert_int_eq(file.header.nb_files, original.header.nb_files);
+    ck_assert_int_eq(file.header.max_files, original.header.max_files);
+    ck_assert_mem_eq(file.metadata, original.metadata,
+                     original.header.max_files * sizeof(struct img_metadata));
+
+    do_close(&file);
+    do_close(&original);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_upgrade_then_delete)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char *out = NULL;
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    char *argv[] = {dump};
+    ck_assert_err_none(do_upgrade_cmd(1, argv));
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_delete("pic1", &file));
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 1);
+    ck_assert_err_none(do_list(&file, JSON, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic2\" ] }");
+    free(out);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_upgrade_reinsert_reuses_id_entry)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char *buffer = NULL;
+    uint32_t size = 0;
+    uint64_t before = 0;
+    uint64_t after = 0;
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_upgrade(&file));
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &buffer, &size, &file));
+    ck_assert_err_none(imgfs_size(&file, &before));
+
+    // the content is shared with pic2, and the slot of pic1 keeps its entry
+    for (int i = 0; i < 3; ++i) {
+        ck_assert_err_none(do_delete(i == 0 ? "pic1" : "pic3", &file));
+        ck_assert_err_none(do_insert(buffer, size, "pic3", &file));
+    }
+    ck_assert_err_none(imgfs_size(&file, &after));
+    ck_assert_uint_eq(after, before);
+    do_close(&file);
+    free(buffer);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 2);
+    ck_assert_str_eq(file.metadata[0].img_id, "pic3");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_do_upgrade_test_suite()
+{
+    Suite *s = suite_create("Tests for do_upgrade implementation");
+
+    Add_Test(s, do_upgrade_null_params);
+    Add_Test(s, do_upgrade_keeps_content);
+    Add_Test(s, do_upgrade_then_delete);
+    Add_Test(s, do_upgrade_reinsert_reuses_id_entry);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_do_upgrade_test_suite)
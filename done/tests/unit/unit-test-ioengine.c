@@ -0,0 +1,165 @@
+#include "imgfs.h"
+#include "io_engine.h"
+#include "test.h"
+#include <check.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define NB_REQUESTS (2 * IO_ENGINE_DEPTH + 1)
+#define REQUEST_SIZE 16
+
+// ======================================================================
+START_TEST(io_engine_null_params)
+{
+    start_test_print;
+
+    struct io_request request;
+    ck_assert_invalid_arg(io_engine_init(NULL, IO_ENGINE_DEPTH));
+    ck_assert_invalid_arg(io_engine_submit(NULL, &request, 1));
+    ck_assert_int_eq(io_engine_failed(NULL), 1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(io_engine_batch)
+{
+    start_test_print;
+
+    struct io_engine engine;
+    if (io_engine_init(&engine, IO_ENGINE_DEPTH) != ERR_NONE) {
+        // no io_uring here: callers use pread()/pwrite()
+        end_test_print;
+        return;
+    }
+
+    FILE* file = fopen(IMGFS("test02"), "rb");
+    ck_assert_ptr_nonnull(file);
+    const int fd = fileno(file);
+
+    // more than fit in flight at once
+    static char buffers[NB_REQUESTS][REQUEST_SIZE];
+    struct io_request requests[NB_REQUESTS];
+    for (size_t i = 0; i < NB_REQUESTS; ++i) {
+        requests[i] = (struct io_request) {
+            IO_READ, fd, buffers[i], REQUEST_SIZE, i * 7, 0, 0
+        };
+    }
+    ck_assert_err_none(io_engine_submit(&engine, requests, NB_REQUESTS));
+    ck_assert_int_eq(io_engine_failed(&engine), 0);
+
+    for (size_t i = 0; i < NB_REQUESTS; ++i) {
+        char expected[REQUEST_SIZE];
+        ck_assert_int_eq(requests[i].done, 1);
+        ck_assert_int_eq(requests[i].result, REQUEST_SIZE);
+        ck_assert_int_eq(pread(fd, expected, REQUEST_SIZE, (off_t) (i * 7)), REQUEST_SIZE);
+        ck_assert_mem_eq(buffers[i], expected, REQUEST_SIZE);
+    }
+
+    fclose(file);
+    io_engine_free(&engine);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(io_engine_refused)
+{
+    start_test_print;
+
+    struct io_engine engine;
+    if (io_engine_init(&engine, IO_ENGINE_DEPTH) != ERR_NONE) {
+        end_test_print;
+        return;
+    }
+
+    // a ring the kernel no longer knows: every submission is refused
+    const int ring_fd = engine.ring_fd;
+    engine.ring_fd = -1;
+
+    char buffers[2][REQUEST_SIZE];
+    struct io_request requests[2] = {
+        { IO_READ, 0, buffers[0], REQUEST_SIZE, 0, 0, 0 },
+        { IO_READ, 0, buffers[1], REQUEST_SIZE, 0, 0, 0 }
+    };
+    ck_assert_err(io_engine_submit(&engine, requests, 2), ERR_IO);
+    // nothing is left in the ring
+    for (size_t i = 0; i < 2; ++i) {
+        ck_assert_int_eq(requests[i].done, 1);
+        ck_assert_int_eq(requests[i].result, -ECANCELED);
+    }
+    ck_assert_uint_eq(engine.in_flight, 0);
+    ck_assert_uint_eq(engine.queued, 0);
+    ck_assert_uint_eq(*engine.sq_head, *engine.sq_tail);
+
+    // and it is not used anymore
+    ck_assert_int_eq(io_engine_failed(&engine), 1);
+    ck_assert_err(io_engine_submit(&engine, requests, 1), ERR_IO);
+    ck_assert_uint_eq(engine.in_flight, 0);
+
+    engine.ring_fd = ring_fd;
+    io_engine_free(&engine);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(io_engine_imgfs)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct io_engine engine;
+    if (io_engine_init(&engine, IO_ENGINE_DEPTH) != ERR_NONE) {
+        end_test_print;
+        return;
+    }
+
+    struct imgfs_file file;
+    char* expected = NULL;
+    char* image = NULL;
+    uint32_t expected_size = 0;
+    uint32_t image_size = 0;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &expected, &expected_size, &file));
+
+    imgfs_set_io_engine(&engine);
+
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &image, &image_size, &file));
+    ck_assert_uint_eq(image_size, expected_size);
+    ck_assert_mem_eq(image, expected, expected_size);
+
+    uint64_t offset = 0;
+    char buffer[5] = {0};
+    ck_assert_err_none(imgfs_append(&file, "hello", 5, &offset));
+    ck_assert_err_none(imgfs_pread(&file, buffer, 5, offset));
+    ck_assert_mem_eq(buffer, "hello", 5);
+
+    do_close(&file);
+    imgfs_set_io_engine(NULL);
+    io_engine_free(&engine);
+    free(expected);
+    free(image);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *io_engine_test_suite()
+{
+    Suite *s = suite_create("Tests for the io_uring engine");
+
+    Add_Test(s, io_engine_null_params);
+    Add_Test(s, io_engine_batch);
+    Add_Test(s, io_engine_refused);
+    Add_Test(s, io_engine_imgfs);
+
+    return s;
+}
+
+TEST_SUITE(io_engine_test_suite)
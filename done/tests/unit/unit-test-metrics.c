@@ -0,0 +1,87 @@
+#include "metrics.h"
+#include "util.h" // for _unused
+#include "test.h"
+#include <check.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NB_THREADS 8
+#define NB_EVENTS 1000
+
+static void* count_reads(void* arg _unused)
+{
+    metrics_connection_begin();
+    for (int i = 0; i < NB_EVENTS; ++i) {
+        metrics_request(METRICS_READ, 3);
+        metrics_bytes_sent(10);
+    }
+    metrics_connection_end();
+    return NULL;
+}
+
+// ======================================================================
+START_TEST(metrics_export_null_params)
+{
+    start_test_print;
+
+    char* text = NULL;
+    size_t len = 0;
+    ck_assert_invalid_arg(metrics_export(NULL, &len));
+    ck_assert_invalid_arg(metrics_export(&text, NULL));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(metrics_export_sums_threads)
+{
+    start_test_print;
+
+    pthread_t threads[NB_THREADS];
+    for (int i = 0; i < NB_THREADS; ++i) {
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, count_reads, NULL), 0);
+    }
+    for (int i = 0; i < NB_THREADS; ++i) pthread_join(threads[i], NULL);
+
+    metrics_resize(1500);
+    metrics_lock_wait(METRICS_LOCK_SHARD, 0);
+
+    char* text = NULL;
+    size_t len = 0;
+    ck_assert_err_none(metrics_export(&text, &len));
+    ck_assert_ptr_nonnull(text);
+    ck_assert_uint_eq(strlen(text), len);
+
+    // 3 goes to the bucket of [2, 4)
+    ck_assert_ptr_nonnull(strstr(text,
+                                 "imgfs_request_duration_microseconds_bucket{endpoint=\"/imgfs/read\",le=\"1\"} 0\n"));
+    ck_assert_ptr_nonnull(strstr(text,
+                                 "imgfs_request_duration_microseconds_bucket{endpoint=\"/imgfs/read\",le=\"3\"} 8000\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_request_duration_microseconds_sum{endpoint=\"/imgfs/read\"} 24000\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_request_duration_microseconds_count{endpoint=\"/imgfs/list\"} 0\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_sent_bytes_total 80000\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_resize_duration_microseconds_bucket{le=\"1023\"} 0\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_resize_duration_microseconds_bucket{le=\"2047\"} 1\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_lock_wait_microseconds_bucket{lock=\"shard\",le=\"0\"} 1\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_connections_active 0\n"));
+    ck_assert_ptr_nonnull(strstr(text, "imgfs_connections_total 8\n"));
+    free(text);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *metrics_test_suite()
+{
+    Suite *s = suite_create("Tests for the server metrics");
+
+    Add_Test(s, metrics_export_null_params);
+    Add_Test(s, metrics_export_sums_threads);
+
+    return s;
+}
+
+TEST_SUITE(metrics_test_suite)
@@ -0,0 +1,130 @@
+#include "imgfs.h"
+#include "shard_ring.h"
+#include "test.h"
+#include <check.h>
+
+#define NB_IDS 10000
+
+static const char* const names[] = { "s0.imgfs", "s1.imgfs", "s2.imgfs", "s3.imgfs", "s4.imgfs" };
+
+// ======================================================================
+START_TEST(shard_ring_null_params)
+{
+    start_test_print;
+
+    struct shard_ring ring;
+    ck_assert_invalid_arg(shard_ring_init(NULL, names, 1));
+    ck_assert_invalid_arg(shard_ring_init(&ring, NULL, 1));
+    ck_assert_invalid_arg(shard_ring_init(&ring, names, 0));
+    ck_assert_invalid_arg(shard_ring_init(&ring, names, MAX_SHARDS + 1));
+    ck_assert_invalid_arg(shard_ring_init(&ring, (const char* []) { "a", "b", "a" }, 3));
+
+    ck_assert_err_none(shard_ring_init(&ring, names, 1));
+    ck_assert_uint_eq(shard_ring_lookup(&ring, "pic1"), 0);
+    ck_assert_uint_eq(shard_ring_lookup(&ring, NULL), 0);
+    shard_ring_free(&ring);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(shard_ring_balance)
+{
+    start_test_print;
+
+    struct shard_ring ring;
+    uint32_t counts[4] = {0};
+    ck_assert_err_none(shard_ring_init(&ring, names, 4));
+
+    for (int i = 0; i < NB_IDS; ++i) {
+        char img_id[MAX_IMG_ID + 1];
+        snprintf(img_id, sizeof(img_id), "img%d", i);
+        const uint32_t shard = shard_ring_lookup(&ring, img_id);
+        ck_assert_uint_lt(shard, 4);
+        ++counts[shard];
+    }
+    // within 40% of an even split
+    for (int shard = 0; shard < 4; ++shard) {
+        ck_assert_uint_gt(counts[shard], NB_IDS / 4 * 6 / 10);
+        ck_assert_uint_lt(counts[shard], NB_IDS / 4 * 14 / 10);
+    }
+    shard_ring_free(&ring);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(shard_ring_adding_a_shard)
+{
+    start_test_print;
+
+    struct shard_ring before;
+    struct shard_ring after;
+    ck_assert_err_none(shard_ring_init(&before, names, 4));
+    ck_assert_err_none(shard_ring_init(&after, names, 5));
+
+    // IDs only move to the new shard, about 1/5 of them
+    int moved = 0;
+    for (int i = 0; i < NB_IDS; ++i) {
+        char img_id[MAX_IMG_ID + 1];
+        snprintf(img_id, sizeof(img_id), "img%d", i);
+        const uint32_t from = shard_ring_lookup(&before, img_id);
+        const uint32_t to = shard_ring_lookup(&after, img_id);
+        if (from != to) {
+            ck_assert_uint_eq(to, 4);
+            ++moved;
+        }
+    }
+    ck_assert_int_gt(moved, NB_IDS / 10);
+    ck_assert_int_lt(moved, NB_IDS * 3 / 10);
+
+    shard_ring_free(&before);
+    shard_ring_free(&after);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(shard_ring_order_of_names)
+{
+    start_test_print;
+
+    struct shard_ring ring;
+    struct shard_ring reversed;
+    ck_assert_err_none(shard_ring_init(&ring, names, 4));
+    ck_assert_err_none(shard_ring_init(&reversed,
+                                       (const char* []) { names[3], names[2], names[1], names[0] },
+                                       4));
+
+    // the IDs go to the shard of the same name
+    for (int i = 0; i < NB_IDS; ++i) {
+        char img_id[MAX_IMG_ID + 1];
+        snprintf(img_id, sizeof(img_id), "img%d", i);
+        ck_assert_uint_eq(shard_ring_lookup(&reversed, img_id),
+                          3 - shard_ring_lookup(&ring, img_id));
+    }
+
+    shard_ring_free(&ring);
+    shard_ring_free(&reversed);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *shard_ring_test_suite()
+{
+    Suite *s = suite_create("Tests for the consistent hashing of image IDs to shards");
+
+    Add_Test(s, shard_ring_null_params);
+    Add_Test(s, shard_ring_balance);
+    Add_Test(s, shard_ring_adding_a_shard);
+    Add_Test(s, shard_ring_order_of_names);
+
+    return s;
+}
+
+TEST_SUITE(shard_ring_test_suite)
@@ -0,0 +1,402 @@
+// the stores are private to the service: test them from within
+#include "imgfs_server_service.c"
+#include "test.h"
+#include <check.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define STORE_SPEC_SIZE 8300
+
+static void set_uri(struct http_message* msg, const char* uri)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->method.val = "GET";
+    msg->method.len = strlen("GET");
+    msg->uri.val = uri;
+    msg->uri.len = strlen(uri);
+}
+
+// handles a request, returns what was replied to it
+static void serve(const char* uri, char* reply, size_t size)
+{
+    int fds[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    struct http_message msg;
+    set_uri(&msg, uri);
+    ck_assert_err_none(handle_http_message(&msg, fds[0]));
+    close(fds[0]);
+
+    memset(reply, 0, size);
+    size_t len = 0;
+    ssize_t got = 0;
+    while (len < size - 1 && (got = read(fds[1], reply + len, size - 1 - len)) > 0) {
+        len += (size_t) got;
+    }
+    close(fds[1]);
+}
+
+// ======================================================================
+START_TEST(parse_store_name_valid)
+{
+    start_test_print;
+
+    struct store store;
+    memset(&store, 0, sizeof(store));
+
+    char plain[] = "photos";
+    ck_assert_err_none(parse_store_name(&store, plain));
+    ck_assert_str_eq(store.name, "photos");
+    ck_assert_uint_eq(store.max_requests, 0);
+
+    char limited[] = "avatars_2-b@8";
+    ck_assert_err_none(parse_store_name(&store, limited));
+    ck_assert_str_eq(store.name, "avatars_2-b");
+    ck_assert_uint_eq(store.max_requests, 8);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(parse_store_name_invalid)
+{
+    start_test_print;
+
+    struct store store;
+    memset(&store, 0, sizeof(store));
+
+    char empty[] = "";
+    ck_assert_invalid_arg(parse_store_name(&store, empty));
+    char only_limit[] = "@8";
+    ck_assert_invalid_arg(parse_store_name(&store, only_limit));
+    char zero_limit[] = "photos@0";
+    ck_assert_invalid_arg(parse_store_name(&store, zero_limit));
+    char bad_limit[] = "photos@many";
+    ck_assert_invalid_arg(parse_store_name(&store, bad_limit));
+    char slash[] = "pho/tos";
+    ck_assert_invalid_arg(parse_store_name(&store, slash));
+    char query[] = "photos?";
+    ck_assert_invalid_arg(parse_store_name(&store, query));
+
+    char too_long[MAX_STORE_NAME + 2];
+    memset(too_long, 'a', MAX_STORE_NAME + 1);
+    too_long[MAX_STORE_NAME + 1] = '\0';
+    ck_assert_invalid_arg(parse_store_name(&store, too_long));
+    too_long[MAX_STORE_NAME] = '\0';
+    ck_assert_err_none(parse_store_name(&store, too_long));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(open_stores_unnamed)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(open_stores(dump));
+    ck_assert_uint_eq(nb_stores, 1);
+    ck_assert_str_eq(stores[0].name, "");
+    ck_assert_uint_eq(stores[0].nb_shards, 1);
+    ck_assert_uint_eq(stores[0].max_requests, 0);
+    close_stores();
+    ck_assert_ptr_null(stores);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(open_stores_named)
+{
+    start_test_print;
+    DECLARE_DUMP_PREFIXED(1);
+    DECLARE_DUMP_PREFIXED(2);
+
+    DUPLICATE_FILE(dump1, IMGFS("test02"));
+    DUPLICATE_FILE(dump2, IMGFS("empty"));
+
+    char spec[STORE_SPEC_SIZE];
+    snprintf(spec, sizeof(spec), "photos@4=%s;avatars=%s", dump1, dump2);
+    ck_assert_err_none(open_stores(spec));
+    ck_assert_uint_eq(nb_stores, 2);
+    ck_assert_str_eq(stores[0].name, "photos");
+    ck_assert_uint_eq(stores[0].max_requests, 4);
+    ck_assert_uint_eq(stores[0].shards[0].fs_file.header.nb_files, 2);
+    ck_assert_str_eq(stores[1].name, "avatars");
+    ck_assert_uint_eq(stores[1].max_requests, 0);
+    ck_assert_uint_eq(stores[1].shards[0].fs_file.header.nb_files, 0);
+    close_stores();
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(open_stores_invalid)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    char spec[STORE_SPEC_SIZE];
+    // duplicate name
+    snprintf(spec, sizeof(spec), "photos=%s;photos=%s", dump, dump);
+    ck_assert_invalid_arg(open_stores(spec));
+    ck_assert_uint_eq(nb_stores, 0);
+    ck_assert_ptr_null(stores);
+
+    // store without shards
+    snprintf(spec, sizeof(spec), "photos=%s;avatars", dump);
+    ck_assert_invalid_arg(open_stores(spec));
+    ck_assert_uint_eq(nb_stores, 0);
+
+    // empty store
+    snprintf(spec, sizeof(spec), "photos=%s;;", dump);
+    ck_assert_invalid_arg(open_stores(spec));
+    ck_assert_uint_eq(nb_stores, 0);
+
+    snprintf(spec, sizeof(spec), "pho tos=%s", dump);
+    ck_assert_invalid_arg(open_stores(spec));
+
+    snprintf(spec, sizeof(spec), "photos=%s", "not a file");
+    ck_assert_err(open_stores(spec), ERR_IO);
+    ck_assert_uint_eq(nb_stores, 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(find_store_routes)
+{
+    start_test_print;
+    DECLARE_DUMP_PREFIXED(1);
+    DECLARE_DUMP_PREFIXED(2);
+
+    DUPLICATE_FILE(dump1, IMGFS("test02"));
+    DUPLICATE_FILE(dump2, IMGFS("empty"));
+
+    char spec[STORE_SPEC_SIZE];
+    snprintf(spec, sizeof(spec), "photos=%s;avatars=%s", dump1, dump2);
+    ck_assert_err_none(open_stores(spec));
+
+    struct http_message msg;
+    struct http_string op;
+
+    set_uri(&msg, "/imgfs/avatars/read?img_id=pic1&res=orig");
+    ck_assert_ptr_eq(find_store(&msg, &op), &stores[1]);
+    ck_assert_int_eq(http_match_verb(&op, "/read?img_id=pic1&res=orig"), 1);
+    ck_assert_uint_eq(op.len, strlen("/read?img_id=pic1&res=orig"));
+
+    set_uri(&msg, "/imgfs/photos/list");
+    ck_assert_ptr_eq(find_store(&msg, &op), &stores[0]);
+    ck_assert_uint_eq(op.len, strlen("/list"));
+
+    // the first store is also right under the root
+    set_uri(&msg, "/imgfs/list?limit=1");
+    ck_assert_ptr_eq(find_store(&msg, &op), &stores[0]);
+    ck_assert_uint_eq(op.len, strlen("/list?limit=1"));
+
+    // an unknown store is an unknown operation of the first one
+    set_uri(&msg, "/imgfs/videos/list");
+    ck_assert_ptr_eq(find_store(&msg, &op), &stores[0]);
+    ck_assert_uint_eq(op.len, strlen("/videos/list"));
+    ck_assert_int_eq(match_op(&op, "/list"), 0);
+
+    // names are matched whole
+    set_uri(&msg, "/imgfs/photo/list");
+    find_store(&msg, &op);
+    ck_assert_uint_eq(op.len, strlen("/photo/list"));
+    set_uri(&msg, "/imgfs/photosX/list");
+    find_store(&msg, &op);
+    ck_assert_uint_eq(op.len, strlen("/photosX/list"));
+
+    set_uri(&msg, "/imgfs");
+    ck_assert_ptr_null(find_store(&msg, &op));
+    set_uri(&msg, "/imgfsphotos/list");
+    ck_assert_ptr_null(find_store(&msg, &op));
+    set_uri(&msg, "/other/photos/list");
+    ck_assert_ptr_null(find_store(&msg, &op));
+
+    close_stores();
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(match_op_whole_names)
+{
+    start_test_print;
+
+    struct http_string op;
+
+    op.val = "/read";
+    op.len = strlen(op.val);
+    ck_assert_int_eq(match_op(&op, "/read"), 1);
+
+    op.val = "/read?img_id=pic1";
+    op.len = strlen(op.val);
+    ck_assert_int_eq(match_op(&op, "/read"), 1);
+
+    op.val = "/readXYZ";
+    op.len = strlen(op.val);
+    ck_assert_int_eq(match_op(&op, "/read"), 0);
+
+    op.val = "/listfoo?limit=1";
+    op.len = strlen(op.val);
+    ck_assert_int_eq(match_op(&op, "/list"), 0);
+
+    op.val = "/sprite.json?limit=1";
+    op.len = strlen(op.val);
+    ck_assert_int_eq(match_op(&op, "/sprite"), 0);
+    ck_assert_int_eq(match_op(&op, "/sprite.json"), 1);
+
+    // (not null-terminated)
+    op.val = "/readXYZ";
+    op.len = strlen("/rea");
+    ck_assert_int_eq(match_op(&op, "/read"), 0);
+    op.len = strlen("/read");
+    ck_assert_int_eq(match_op(&op, "/read"), 1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(store_enter_limit)
+{
+    start_test_print;
+
+    struct store store;
+    memset(&store, 0, sizeof(store));
+
+    // no limit
+    for (int i = 0; i < 100; ++i) ck_assert_int_eq(store_enter(&store), 1);
+    for (int i = 0; i < 100; ++i) store_leave(&store);
+    ck_assert_uint_eq(store.requests, 0);
+
+    store.max_requests = 2;
+    ck_assert_int_eq(store_enter(&store), 1);
+    ck_assert_int_eq(store_enter(&store), 1);
+    ck_assert_int_eq(store_enter(&store), 0);
+    // refusals are not counted
+    ck_assert_uint_eq(store.requests, 2);
+    store_leave(&store);
+    ck_assert_int_eq(store_enter(&store), 1);
+    ck_assert_int_eq(store_enter(&store), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(handle_named_stores)
+{
+    start_test_print;
+    DECLARE_DUMP_PREFIXED(1);
+    DECLARE_DUMP_PREFIXED(2);
+
+    DUPLICATE_FILE(dump1, IMGFS("test02"));
+    DUPLICATE_FILE(dump2, IMGFS("empty"));
+
+    char spec[STORE_SPEC_SIZE];
+    snprintf(spec, sizeof(spec), "photos=%s;avatars=%s", dump1, dump2);
+    ck_assert_err_none(open_stores(spec));
+
+    char reply[4096];
+    serve("/imgfs/photos/list", reply, sizeof(reply));
+    ck_assert_ptr_nonnull(strstr(reply, HTTP_OK));
+    ck_assert_ptr_nonnull(strstr(reply, "\"pic1\""));
+
+    serve("/imgfs/avatars/list", reply, sizeof(reply));
+    ck_assert_ptr_nonnull(strstr(reply, HTTP_OK));
+    ck_assert_ptr_null(strstr(reply, "\"pic1\""));
+
+    serve("/imgfs/list", reply, sizeof(reply));
+    ck_assert_ptr_nonnull(strstr(reply, "\"pic1\""));
+
+    serve("/imgfs/videos/list", reply, sizeof(reply));
+    ck_assert_ptr_nonnull(strstr(reply, "500 Internal Server Error"));
+    ck_assert_ptr_nonnull(strstr(reply, ERR_MSG(ERR_INVALID_COMMAND)));
+
+    serve("/imgfs/photos/listfoo", reply, sizeof(reply));
+    ck_assert_ptr_nonnull(strstr(reply, ERR_MSG(ERR_INVALID_COMMAND)));
+
+    serve("/imgfs/readXYZ?img_id=pic1&res=orig", reply, sizeof(reply));
+    ck_assert_ptr_nonnull(strstr(reply, ERR_MSG(ERR_INVALID_COMMAND)));
+
+    close_stores();
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(handle_store_busy)
+{
+    start_test_print;
+    DECLARE_DUMP_PREFIXED(1);
+    DECLARE_DUMP_PREFIXED(2);
+
+    DUPLICATE_FILE(dump1, IMGFS("test02"));
+    DUPLICATE_FILE(dump2, IMGFS("empty"));
+
+    char spec[STORE_SPEC_SIZE];
+    snprintf(spec, sizeof(spec), "photos@1=%s;avatars@1=%s", dump1, dump2);
+    ck_assert_err_none(open_stores(spec));
+
+    // a request of photos is being served
+    ck_assert_int_eq(store_enter(&stores[0]), 1);
+
+    char reply[4096];
+    serve("/imgfs/photos/list", reply, sizeof(reply));
+    ck_assert_ptr_eq(strstr(reply, HTTP_PROTOCOL_ID HTTP_SERVICE_UNAVAILABLE HTTP_LINE_DELIM), reply);
+    ck_assert_ptr_nonnull(strstr(reply, HTTP_LINE_DELIM "Retry-After: 1" HTTP_LINE_DELIM));
+    ck_assert_ptr_null(strstr(reply, "\"pic1\""));
+
+    // the other stores are not held back
+    serve("/imgfs/avatars/list", reply, sizeof(reply));
+    ck_assert_ptr_nonnull(strstr(reply, HTTP_OK));
+
+    store_leave(&stores[0]);
+    serve("/imgfs/photos/list", reply, sizeof(reply));
+    ck_assert_ptr_nonnull(strstr(reply, HTTP_OK));
+    ck_assert_ptr_nonnull(strstr(reply, "\"pic1\""));
+    // served requests leave
+    ck_assert_uint_eq(stores[0].requests, 0);
+    ck_assert_uint_eq(stores[1].requests, 0);
+
+    close_stores();
+
+    end_test_print;
+}
+END_TEST
+
+Suite *stores_test_suite()
+{
+    Suite *s = suite_create("Tests for the stores of the server");
+
+    Add_Test(s, parse_store_name_valid);
+    Add_Test(s, parse_store_name_invalid);
+
+    Add_Test(s, open_stores_unnamed);
+    Add_Test(s, open_stores_named);
+    Add_Test(s, open_stores_invalid);
+
+    Add_Test(s, find_store_routes);
+    Add_Test(s, match_op_whole_names);
+
+    Add_Test(s, store_enter_limit);
+    Add_Test(s, handle_named_stores);
+    Add_Test(s, handle_store_busy);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(stores_test_suite)
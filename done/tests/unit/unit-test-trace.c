@@ -0,0 +1,81 @@
+#include "trace.h"
+#include "test.h"
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ======================================================================
+START_TEST(trace_export_null_params)
+{
+    start_test_print;
+
+    char* json = NULL;
+    size_t len = 0;
+    ck_assert_invalid_arg(trace_export(NULL, &len));
+    ck_assert_invalid_arg(trace_export(&json, NULL));
+
+    // not tracing: nothing recorded
+    ck_assert_err_none(trace_init(0));
+    ck_assert_uint_eq(trace_request_begin(), 0);
+    ck_assert_uint_eq(trace_begin(), 0);
+    ck_assert_err_none(trace_export(&json, &len));
+    ck_assert_str_eq(json, "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [ ] }");
+    free(json);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(trace_sampled_requests)
+{
+    start_test_print;
+
+    ck_assert_err_none(trace_init(2));
+    for (int i = 0; i < 4; ++i) {
+        const uint64_t request = trace_request_begin();
+        // one in two
+        ck_assert_int_eq(request != 0, i % 2 == 1);
+
+        const uint64_t span = trace_begin();
+        ck_assert_int_eq(span != 0, request != 0);
+        trace_end("lookup", span);
+        trace_request_end(request);
+    }
+
+    char* json = NULL;
+    size_t len = 0;
+    ck_assert_err_none(trace_export(&json, &len));
+    ck_assert_uint_eq(strlen(json), len);
+
+    // spans of requests 2 and 4, each ending before its request
+    const char* lookup = strstr(json, "\"name\": \"lookup\"");
+    ck_assert_ptr_nonnull(lookup);
+    const char* request = strstr(lookup, "\"name\": \"request\"");
+    ck_assert_ptr_nonnull(request);
+    ck_assert_ptr_nonnull(strstr(request, "\"args\": { \"request\": 2 }"));
+    lookup = strstr(request, "\"name\": \"lookup\"");
+    ck_assert_ptr_nonnull(lookup);
+    ck_assert_ptr_nonnull(strstr(lookup, "\"args\": { \"request\": 4 }"));
+    ck_assert_ptr_nonnull(strstr(json, "\"ph\": \"X\""));
+    ck_assert_ptr_null(strstr(json, "\"request\": 1 "));
+    free(json);
+
+    trace_free();
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *trace_test_suite()
+{
+    Suite *s = suite_create("Tests for the tracing of the requests");
+
+    Add_Test(s, trace_export_null_params);
+    Add_Test(s, trace_sampled_requests);
+
+    return s;
+}
+
+TEST_SUITE(trace_test_suite)
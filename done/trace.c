@@ -0,0 +1,164 @@
+/* ** NOTE: undocumented in Doxygen
+ * @file trace.c
+ * @brief Sampled tracing of the stages of the requests of the imgFS server
+ */
+
+#include "trace.h"
+#include "error.h"
+#include "json_writer.h"
+#include "metrics.h" // for metrics_now_us
+
+#include <stdlib.h>
+
+/*
+ * A span is published like a seqlock: seq is 0 while it is written,
+ * then the number it was claimed with (plus one). A reader keeps it if
+ * seq is the same before and after copying it.
+ */
+struct trace_event {
+    uint64_t seq;
+    const char* name;
+    uint64_t request;
+    uint64_t start;
+    uint64_t duration;
+    uint64_t tid;
+};
+
+static struct trace_event* events;
+static unsigned sample_every;
+static uint64_t requests;  // atomic
+static uint64_t claimed;   // atomic
+static uint64_t threads;   // atomic
+
+static __thread uint64_t tracing; // request being traced, 0 if none
+static __thread uint64_t tid;
+
+/*******************************************************************
+ * Setup
+ */
+int trace_init(unsigned every)
+{
+    if (every == 0) return ERR_NONE;
+
+    events = calloc(TRACE_EVENTS, sizeof(struct trace_event));
+    if (events == NULL) return ERR_OUT_OF_MEMORY;
+    sample_every = every;
+    return ERR_NONE;
+}
+
+void trace_free(void)
+{
+    sample_every = 0;
+    free(events);
+    events = NULL;
+}
+
+/*******************************************************************
+ * Requests
+ */
+uint64_t trace_request_begin(void)
+{
+    if (sample_every == 0) return 0;
+
+    const uint64_t request = __atomic_add_fetch(&requests, 1, __ATOMIC_RELAXED);
+    if (request % sample_every != 0) return 0;
+
+    if (tid == 0) tid = __atomic_add_fetch(&threads, 1, __ATOMIC_RELAXED);
+    tracing = request;
+    return metrics_now_us();
+}
+
+void trace_request_end(uint64_t start)
+{
+    trace_end("request", start);
+    tracing = 0;
+}
+
+/*******************************************************************
+ * Spans
+ */
+uint64_t trace_begin(void)
+{
+    return tracing == 0 ? 0 : metrics_now_us();
+}
+
+void trace_end(const char* name, uint64_t start)
+{
+    struct trace_event* const ring = events;
+    if (tracing == 0 || start == 0 || ring == NULL) return;
+
+    const uint64_t end = metrics_now_us();
+    const uint64_t seq = __atomic_fetch_add(&claimed, 1, __ATOMIC_RELAXED);
+    struct trace_event* event = &ring[seq % TRACE_EVENTS];
+
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&event->name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->request, tracing, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->duration, end - start, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->tid, tid, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************
+ * Export
+ */
+static int read_event(const struct trace_event* event, struct trace_event* copy)
+{
+    copy->seq = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE);
+    copy->name = __atomic_load_n(&event->name, __ATOMIC_RELAXED);
+    copy->request = __atomic_load_n(&event->request, __ATOMIC_RELAXED);
+    copy->start = __atomic_load_n(&event->start, __ATOMIC_RELAXED);
+    copy->duration = __atomic_load_n(&event->duration, __ATOMIC_RELAXED);
+    copy->tid = __atomic_load_n(&event->tid, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return copy->seq != 0 && __atomic_load_n(&event->seq, __ATOMIC_RELAXED) == copy->seq;
+}
+
+int trace_export(char** json, size_t* len)
+{
+    M_REQUIRE_NON_NULL(json);
+    M_REQUIRE_NON_NULL(len);
+
+    struct json_writer writer;
+    json_writer_init(&writer, NULL, NULL);
+    json_begin_object(&writer);
+    json_key(&writer, "displayTimeUnit");
+    json_string(&writer, "ms");
+    json_key(&writer, "traceEvents");
+    json_begin_array(&writer);
+
+    // oldest first
+    const uint64_t last = __atomic_load_n(&claimed, __ATOMIC_ACQUIRE);
+    const uint64_t first = last > TRACE_EVENTS ? last - TRACE_EVENTS : 0;
+    for (uint64_t seq = first; events != NULL && seq < last; ++seq) {
+        struct trace_event event;
+        // still being written, or already overwritten
+        if (!read_event(&events[seq % TRACE_EVENTS], &event) || event.seq != seq + 1) continue;
+
+        json_begin_object(&writer);
+        json_key(&writer, "name");
+        json_string(&writer, event.name);
+        json_key(&writer, "ph");
+        json_string(&writer, "X");
+        json_key(&writer, "ts");
+        json_uint(&writer, event.start);
+        json_key(&writer, "dur");
+        json_uint(&writer, event.duration);
+        json_key(&writer, "pid");
+        json_uint(&writer, 1);
+        json_key(&writer, "tid");
+        json_uint(&writer, event.tid);
+        json_key(&writer, "args");
+        json_begin_object(&writer);
+        json_key(&writer, "request");
+        json_uint(&writer, event.request);
+        json_end_object(&writer);
+        json_end_object(&writer);
+    }
+
+    json_end_array(&writer);
+    json_end_object(&writer);
+    return json_writer_finish(&writer, json, len);
+}
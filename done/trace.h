@@ -0,0 +1,70 @@
+/**
+ * @file trace.h
+ * @brief Sampled tracing of the stages of the requests of the imgFS server.
+ *
+ * One request in sample_every is traced: the stages it goes through
+ * (lookup, file I/O, resizing, socket writes...) are recorded as spans
+ * with monotonic timestamps, into a ring of the last TRACE_EVENTS spans.
+ * The ring is exported in the Chrome trace format (chrome://tracing,
+ * Perfetto, speedscope...). When the calling thread is not tracing a
+ * request, a span costs a thread-local check.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#define TRACE_EVENTS 16384 // spans kept
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Starts tracing one request in sample_every (0: none).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int trace_init(unsigned sample_every);
+
+/**
+ * @brief Stops tracing and releases the spans.
+ */
+void trace_free(void);
+
+/**
+ * @brief Tells whether the request the calling thread starts is traced.
+ *
+ * @return the start of the request span (0 if not traced).
+ */
+uint64_t trace_request_begin(void);
+
+/**
+ * @brief Ends the request of the calling thread.
+ */
+void trace_request_end(uint64_t start);
+
+/**
+ * @brief Starts a span.
+ *
+ * @return its start (0 if the calling thread is not tracing).
+ */
+uint64_t trace_begin(void);
+
+/**
+ * @brief Ends a span (name must live as long as the program: a literal).
+ */
+void trace_end(const char* name, uint64_t start);
+
+/**
+ * @brief Writes the spans in the Chrome trace JSON format (into a buffer
+ *        to be freed by the caller).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int trace_export(char** json, size_t* len);
+
+#ifdef __cplusplus
+}
+#endif